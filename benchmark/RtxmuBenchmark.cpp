@@ -0,0 +1,556 @@
+/*
+* Copyright (c) 2024 NVIDIA CORPORATION. All rights reserved
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+// Drives the suballocators and the compaction pipeline of the manager without a GPU. Builtin traces model
+// streaming, level loads and floods of tiny acceleration structures, traces recorded by an application can
+// be replayed by passing their paths. Binary traces captured with BeginAllocationTrace are replayed with their
+// recorded block size, their builds, compactions and releases turned into result and compaction allocations.
+// Anything else is read as a text trace with one operation per line:
+//     a <handle> <size>    allocate size bytes and remember the suballocation as handle
+//     f <handle>           free the suballocation of handle
+//     n                    advance a frame
+// Lines starting with # are ignored
+
+#include "rtxmu/AccelStructManager.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <stdio.h>
+#include <unordered_map>
+
+namespace
+{
+    using namespace rtxmu;
+
+    struct MockAllocator
+    {
+        Logger* logger = nullptr;
+    };
+
+    // Block without any memory behind it, only counts how much would be resident
+    class MockBlock
+    {
+    public:
+
+        void setAllocator(MockAllocator*)
+        {
+        }
+
+        bool allocate(uint64_t size, std::string)
+        {
+            m_size = size;
+            s_residentSize += size;
+            return true;
+        }
+
+        void free()
+        {
+            s_residentSize -= m_size;
+            m_size = 0;
+        }
+
+        bool evict()
+        {
+            return false;
+        }
+
+        void makeResident()
+        {
+        }
+
+        uint64_t getAlignment()
+        {
+            return 65536;
+        }
+
+        static uint64_t s_residentSize;
+
+    private:
+
+        uint64_t m_size = 0;
+    };
+
+    uint64_t MockBlock::s_residentSize = 0;
+
+    enum class OpType
+    {
+        Allocate,
+        Free,
+        NextFrame
+    };
+
+    struct Op
+    {
+        OpType   type;
+        uint64_t handle;
+        uint64_t size;
+    };
+
+    constexpr uint64_t BlockSize           = 8 * 1024 * 1024;
+    constexpr uint64_t AllocationAlignment = 256;
+
+    struct Trace
+    {
+        std::string     name;
+        std::vector<Op> ops;
+        uint64_t        blockSize = BlockSize;
+    };
+
+    // Acceleration structure sizes spread over orders of magnitude, so pick them log uniformly
+    uint64_t RandomSize(std::mt19937_64& rng, uint64_t minSize, uint64_t maxSize)
+    {
+        std::uniform_real_distribution<double> distribution(std::log(static_cast<double>(minSize)),
+                                                            std::log(static_cast<double>(maxSize)));
+        return static_cast<uint64_t>(std::exp(distribution(rng)));
+    }
+
+    // Meshes stream in every frame and stay for a random number of frames
+    Trace MakeStreamingTrace(std::mt19937_64& rng)
+    {
+        Trace trace = { "streaming", {} };
+
+        std::multimap<uint64_t, uint64_t> expirations;
+        uint64_t nextHandle = 0;
+        for (uint64_t frame = 0; frame < 600; frame++)
+        {
+            for (uint32_t meshIndex = 0; meshIndex < 64; meshIndex++)
+            {
+                const uint64_t handle = nextHandle++;
+                trace.ops.push_back({ OpType::Allocate, handle, RandomSize(rng, 4096, 4 * 1024 * 1024) });
+                expirations.emplace(frame + 30 + rng() % 90, handle);
+            }
+
+            while ((expirations.empty() == false) && (expirations.begin()->first <= frame))
+            {
+                trace.ops.push_back({ OpType::Free, expirations.begin()->second, 0 });
+                expirations.erase(expirations.begin());
+            }
+            trace.ops.push_back({ OpType::NextFrame, 0, 0 });
+        }
+
+        for (const auto& expiration : expirations)
+        {
+            trace.ops.push_back({ OpType::Free, expiration.second, 0 });
+        }
+        return trace;
+    }
+
+    // Every level load allocates a burst of acceleration structures and keeps a tenth of them around
+    Trace MakeLevelLoadTrace(std::mt19937_64& rng)
+    {
+        Trace trace = { "level load", {} };
+
+        std::vector<uint64_t> live;
+        uint64_t nextHandle = 0;
+        for (uint32_t levelIndex = 0; levelIndex < 8; levelIndex++)
+        {
+            for (uint32_t meshIndex = 0; meshIndex < 20000; meshIndex++)
+            {
+                trace.ops.push_back({ OpType::Allocate, nextHandle, RandomSize(rng, 1024, 16 * 1024 * 1024) });
+                live.push_back(nextHandle++);
+            }
+            trace.ops.push_back({ OpType::NextFrame, 0, 0 });
+
+            std::shuffle(live.begin(), live.end(), rng);
+            const size_t keptCount = live.size() / 10;
+            for (size_t liveIndex = keptCount; liveIndex < live.size(); liveIndex++)
+            {
+                trace.ops.push_back({ OpType::Free, live[liveIndex], 0 });
+            }
+            live.resize(keptCount);
+            trace.ops.push_back({ OpType::NextFrame, 0, 0 });
+        }
+
+        for (const uint64_t& handle : live)
+        {
+            trace.ops.push_back({ OpType::Free, handle, 0 });
+        }
+        return trace;
+    }
+
+    // Foliage and debris, hundreds of thousands of acceleration structures of a few KB each
+    Trace MakeTinyFloodTrace(std::mt19937_64& rng)
+    {
+        Trace trace = { "tiny flood", {} };
+
+        std::vector<uint64_t> live;
+        for (uint64_t handle = 0; handle < 200000; handle++)
+        {
+            trace.ops.push_back({ OpType::Allocate, handle, RandomSize(rng, 512, 16384) });
+            live.push_back(handle);
+        }
+
+        std::shuffle(live.begin(), live.end(), rng);
+        for (const uint64_t& handle : live)
+        {
+            trace.ops.push_back({ OpType::Free, handle, 0 });
+        }
+        return trace;
+    }
+
+    // Result and compaction memory of an acceleration structure get a handle each
+    void ConvertAllocationTrace(const std::vector<AllocationTraceRecord>& records, Trace& trace)
+    {
+        std::vector<bool> isCompacted;
+        for (const AllocationTraceRecord& record : records)
+        {
+            const uint64_t resultHandle     = record.accelStructId * 2;
+            const uint64_t compactionHandle = record.accelStructId * 2 + 1;
+            if (record.accelStructId >= isCompacted.size())
+            {
+                isCompacted.resize(record.accelStructId + 1, false);
+            }
+
+            switch (record.type)
+            {
+            case AllocationTraceRecordType::Build:
+                trace.ops.push_back({ OpType::Free, resultHandle, 0 });
+                trace.ops.push_back({ OpType::Free, compactionHandle, 0 });
+                trace.ops.push_back({ OpType::Allocate, resultHandle, record.size });
+                isCompacted[record.accelStructId] = false;
+                break;
+            case AllocationTraceRecordType::Update:
+                // The manager keeps the outgrown result around, the replay swaps it so handles stay unique
+                if (record.flags & AllocationTraceReallocated)
+                {
+                    trace.ops.push_back({ OpType::Free, resultHandle, 0 });
+                    trace.ops.push_back({ OpType::Allocate, resultHandle, record.size });
+                }
+                break;
+            case AllocationTraceRecordType::Compaction:
+            case AllocationTraceRecordType::Deserialize:
+                trace.ops.push_back({ OpType::Allocate, compactionHandle, record.size });
+                isCompacted[record.accelStructId] = true;
+                break;
+            case AllocationTraceRecordType::GarbageCollection:
+                if (isCompacted[record.accelStructId])
+                {
+                    trace.ops.push_back({ OpType::Free, resultHandle, 0 });
+                }
+                break;
+            case AllocationTraceRecordType::Remove:
+                trace.ops.push_back({ OpType::Free, resultHandle, 0 });
+                trace.ops.push_back({ OpType::Free, compactionHandle, 0 });
+                isCompacted[record.accelStructId] = false;
+                break;
+            case AllocationTraceRecordType::Frame:
+                trace.ops.push_back({ OpType::NextFrame, 0, 0 });
+                break;
+            }
+        }
+    }
+
+    bool LoadTrace(const char* path, Trace& trace)
+    {
+        trace.name = path;
+
+        AllocationTraceHeader              header;
+        std::vector<AllocationTraceRecord> records;
+        if (ReadAllocationTrace(path, header, records))
+        {
+            if (header.blockSize != 0)
+            {
+                trace.blockSize = header.blockSize;
+            }
+            ConvertAllocationTrace(records, trace);
+            return true;
+        }
+
+        std::ifstream file(path);
+        if (file.is_open() == false)
+        {
+            fprintf(stderr, "Failed to open trace %s\n", path);
+            return false;
+        }
+
+        std::string line;
+        while (std::getline(file, line))
+        {
+            std::istringstream stream(line);
+            std::string        type;
+            Op                 op = { OpType::NextFrame, 0, 0 };
+            if (!(stream >> type) || (type[0] == '#'))
+            {
+                continue;
+            }
+
+            if (type == "a")
+            {
+                op.type = OpType::Allocate;
+                stream >> op.handle >> op.size;
+            }
+            else if (type == "f")
+            {
+                op.type = OpType::Free;
+                stream >> op.handle;
+            }
+            else if (type != "n")
+            {
+                fprintf(stderr, "Unknown operation %s in trace %s\n", type.c_str(), path);
+                return false;
+            }
+            trace.ops.push_back(op);
+        }
+        return true;
+    }
+
+    struct Latencies
+    {
+        std::vector<uint64_t> nanoseconds;
+
+        uint64_t percentile(double fraction) const
+        {
+            if (nanoseconds.empty())
+            {
+                return 0;
+            }
+            return nanoseconds[static_cast<size_t>(fraction * static_cast<double>(nanoseconds.size() - 1))];
+        }
+    };
+
+    void PrintLatencies(const char* name, Latencies& latencies)
+    {
+        std::sort(latencies.nanoseconds.begin(), latencies.nanoseconds.end());
+
+        printf("    %-8s %9zu ops  p50 %6" PRIu64 " ns  p90 %6" PRIu64 " ns  p99 %7" PRIu64 " ns  p99.9 %8" PRIu64 " ns  max %9" PRIu64 " ns\n",
+               name,
+               latencies.nanoseconds.size(),
+               latencies.percentile(0.5),
+               latencies.percentile(0.9),
+               latencies.percentile(0.99),
+               latencies.percentile(0.999),
+               latencies.percentile(1.0));
+    }
+
+    template<typename Pool>
+    void RunTrace(const char* poolName, Pool& pool, const Trace& trace)
+    {
+        using Clock = std::chrono::steady_clock;
+
+        std::unordered_map<uint64_t, typename Pool::SubAllocation> live;
+        Latencies allocateLatencies;
+        Latencies freeLatencies;
+        uint64_t  peakResidentSize    = 0;
+        uint64_t  peakUsedSize        = 0;
+        uint64_t  usedSize            = 0;
+        double    peakFragmentation   = 0.0;
+        uint64_t  failedAllocations   = 0;
+
+        for (const Op& op : trace.ops)
+        {
+            if (op.type == OpType::Allocate)
+            {
+                const auto start = Clock::now();
+                auto subAllocation = pool.allocate(op.size);
+                const auto end = Clock::now();
+
+                allocateLatencies.nanoseconds.push_back(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()));
+                if (subAllocation.subBlock == nullptr)
+                {
+                    failedAllocations++;
+                    continue;
+                }
+
+                usedSize        += subAllocation.subBlock->getSize();
+                peakUsedSize     = std::max(peakUsedSize, usedSize);
+                peakResidentSize = std::max(peakResidentSize, MockBlock::s_residentSize);
+                live[op.handle]  = subAllocation;
+            }
+            else if (op.type == OpType::Free)
+            {
+                auto liveIter = live.find(op.handle);
+                if (liveIter == live.end())
+                {
+                    continue;
+                }
+                usedSize -= liveIter->second.subBlock->getSize();
+
+                const auto start = Clock::now();
+                pool.free(liveIter->second.subBlock);
+                const auto end = Clock::now();
+
+                freeLatencies.nanoseconds.push_back(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()));
+                live.erase(liveIter);
+            }
+            else
+            {
+                // Fragmentation walks every free range so only sample it once per frame
+                peakFragmentation = std::max(peakFragmentation, pool.getStats().fragmentation);
+                pool.nextFrame();
+            }
+        }
+
+        const Stats stats = pool.getStats();
+
+        printf("  %s\n", poolName);
+        PrintLatencies("allocate", allocateLatencies);
+        PrintLatencies("free", freeLatencies);
+        printf("    peak used %.1f MB  peak resident %.1f MB  peak fragmentation %.1f %%  final fragmentation %.1f %%  failed %" PRIu64 "\n",
+               peakUsedSize / 1000000.0,
+               peakResidentSize / 1000000.0,
+               peakFragmentation,
+               stats.fragmentation,
+               failedAllocations);
+
+        for (auto& liveEntry : live)
+        {
+            pool.free(liveEntry.second.subBlock);
+        }
+    }
+
+    void RunSuballocators(const Trace& trace)
+    {
+        Logger        logger;
+        MockAllocator allocator;
+        allocator.logger = &logger;
+
+        printf("%s trace, %zu operations, %" PRIu64 " byte blocks\n", trace.name.c_str(), trace.ops.size(), trace.blockSize);
+        {
+            Suballocator<MockAllocator, MockBlock> pool(trace.blockSize, AllocationAlignment, &allocator, AllocationPolicy::BestFit);
+            RunTrace("best fit", pool, trace);
+        }
+        {
+            Suballocator<MockAllocator, MockBlock> pool(trace.blockSize, AllocationAlignment, &allocator, AllocationPolicy::Linear);
+            RunTrace("linear", pool, trace);
+        }
+        {
+            SizeClassSuballocator<MockAllocator, MockBlock> pool(GetDefaultSizeClasses(trace.blockSize), AllocationAlignment, &allocator);
+            RunTrace("size classes", pool, trace);
+        }
+    }
+
+    // Exposes the fence tracked pipeline of the manager, standing in for the backend that would record the
+    // size copies and compactions
+    class MockAccelStructManager : public AccelStructManager<AccelerationStructure>
+    {
+    public:
+
+        MockAccelStructManager() :
+            AccelStructManager(Level::DISABLED)
+        {
+        }
+
+        std::vector<uint64_t> Build(uint32_t count)
+        {
+            std::vector<uint64_t> accelStructIds;
+            for (uint32_t buildIndex = 0; buildIndex < count; buildIndex++)
+            {
+                const uint64_t accelStructId = GetAccelStructId();
+                m_asBufferBuildQueue[accelStructId]->requestedCompaction = true;
+                accelStructIds.push_back(accelStructId);
+            }
+            return accelStructIds;
+        }
+
+        // Each stage completes the frame after it got recorded, compacted builds get released
+        void Tick(const uint64_t completedFenceValue,
+                  const uint64_t submitFenceValue)
+        {
+            PipelineWork work;
+            BeginPipelineTick(completedFenceValue, work);
+
+            for (const uint64_t& accelStructId : work.sizeCopyIds)
+            {
+                m_asBufferBuildQueue[accelStructId]->compactionSizeCopied = true;
+            }
+            for (const uint64_t& accelStructId : work.compactionIds)
+            {
+                m_asBufferBuildQueue[accelStructId]->isCompacted = true;
+            }
+            EndPipelineTick(submitFenceValue, work);
+
+            for (const uint64_t& accelStructId : work.garbageCollectionIds)
+            {
+                ReleaseAccelStructId(accelStructId);
+            }
+        }
+    };
+
+    void RunPipeline()
+    {
+        using Clock = std::chrono::steady_clock;
+
+        MockAccelStructManager manager;
+        Latencies              tickLatencies;
+
+        // Frames in flight before a fence completes, like a renderer buffering a few frames
+        constexpr uint64_t FrameLatency = 3;
+
+        printf("compaction pipeline, 2000 frames of 500 builds\n");
+        for (uint64_t frame = 1; frame <= 2000 + 4 * FrameLatency; frame++)
+        {
+            if (frame <= 2000)
+            {
+                manager.TrackBuilds(manager.Build(500), frame);
+            }
+
+            const auto start = Clock::now();
+            manager.Tick((frame > FrameLatency) ? frame - FrameLatency : 0, frame);
+            const auto end = Clock::now();
+
+            tickLatencies.nanoseconds.push_back(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()));
+        }
+
+        PrintLatencies("tick", tickLatencies);
+        printf("    pipeline depth %" PRIu64 " after draining\n", manager.GetPipelineDepth());
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<Trace> traces;
+
+    if (argc > 1)
+    {
+        for (int argIndex = 1; argIndex < argc; argIndex++)
+        {
+            Trace trace;
+            if (LoadTrace(argv[argIndex], trace) == false)
+            {
+                return 1;
+            }
+            traces.push_back(std::move(trace));
+        }
+    }
+    else
+    {
+        // Fixed seed so runs before and after an allocator change replay the same operations
+        std::mt19937_64 rng(1);
+        traces.push_back(MakeStreamingTrace(rng));
+        traces.push_back(MakeLevelLoadTrace(rng));
+        traces.push_back(MakeTinyFloodTrace(rng));
+    }
+
+    for (const Trace& trace : traces)
+    {
+        RunSuballocators(trace);
+    }
+
+    if (argc <= 1)
+    {
+        RunPipeline();
+    }
+    return 0;
+}
@@ -20,12 +20,25 @@
 * SOFTWARE.
 */
 
+
 #pragma once
 
+#include <algorithm>
 #include <queue>
+#include <deque>
+#include <vector>
+#include <string>
+#include <unordered_map>
 #include <mutex>
+#include <atomic>
+#include <memory>
 #include <cinttypes>
+#include <cstring>
+#include "AllocationTrace.h"
 #include "Logger.h"
+#include "NodePool.h"
+#include "SizeClassSuballocator.h"
+#include "TopLevelInstances.h"
 
 namespace rtxmu
 {
@@ -35,43 +48,363 @@ namespace rtxmu
     constexpr uint64_t CompactionSizeSuballocationBlockSize = 65536;
     constexpr uint64_t DefaultSuballocatorBlockSize         = 8388608;
     constexpr uint64_t ReservedId                           = 0;
+    constexpr double   DefaultDefragmentationOccupancy      = 0.5;
+    constexpr uint64_t DefaultHeapArenaSize                 = 67108864;
+    constexpr uint32_t DefaultMaxBuildsPerChunk             = 256;
+    constexpr uint32_t SerializedAccelStructMagic           = 0x4d585452;
+    constexpr uint32_t SerializedAccelStructVersion         = 1;
+    constexpr uint32_t GpuTimingQueryCount                  = 512;
+    constexpr size_t   MaxCollectedGpuTimings               = 4096;
+
+    // Folds value into seed, used to key caches on build input shapes
+    inline uint64_t HashCombine(uint64_t seed,
+                                uint64_t value)
+    {
+        return seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+    }
+
+    // Hashes geometry data on the CPU into the key identifying serialized acceleration structures
+    inline uint64_t HashBytes(const void* data,
+                              size_t      size,
+                              uint64_t    seed = 0)
+    {
+        // FNV-1a folded into the seed
+        uint64_t             hash  = 0xcbf29ce484222325ull;
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t byteIndex = 0; byteIndex < size; byteIndex++)
+        {
+            hash = (hash ^ bytes[byteIndex]) * 0x100000001b3ull;
+        }
+        return HashCombine(seed, hash);
+    }
+
+    // Leads every serialized acceleration structure blob, followed by driverBlobSize bytes of driver data
+    // starting with the driver compatibility identifier
+    struct SerializedAccelStructHeader
+    {
+        uint32_t magic          = SerializedAccelStructMagic;
+        uint32_t version        = SerializedAccelStructVersion;
+        uint64_t geometryKey    = 0;
+        uint64_t driverBlobSize = 0;
+    };
+
+    // Serialized acceleration structure blob handed back for deserialization, a non zero geometry key
+    // has to match the key the blob was serialized with
+    struct SerializedAccelStruct
+    {
+        const void* data        = nullptr;
+        uint64_t    size        = 0;
+        uint64_t    geometryKey = 0;
+    };
+
+    enum class SerializationState : uint8_t
+    {
+        None,
+        // Serialized size query recorded, waiting on the GPU
+        SizeRequested,
+        // Serialize copy recorded, waiting on the GPU
+        Serializing
+    };
+
+    // Work recorded by the manager that GPU timing tells apart
+    enum class GpuTimingPhase : uint32_t
+    {
+        Build,
+        Update,
+        CompactionSizeCopy,
+        Compaction,
+        Count
+    };
+
+    // GPU duration of the commands recorded by one Populate*CommandList call
+    struct GpuTiming
+    {
+        GpuTimingPhase phase            = GpuTimingPhase::Build;
+        // Fence value of the submission the batch got attributed to
+        uint64_t       fenceValue       = 0;
+        double         milliseconds     = 0.0;
+        uint64_t       accelStructCount = 0;
+        // Result bytes for builds and updates, compaction size bytes for size copies and compacted bytes for compactions
+        uint64_t       bytes            = 0;
+    };
+
+    // Sum of all batches of a phase collected since GPU timing got enabled
+    struct GpuPhaseTiming
+    {
+        uint64_t batchCount       = 0;
+        double   milliseconds     = 0.0;
+        uint64_t accelStructCount = 0;
+        uint64_t bytes            = 0;
+    };
+
+    // Fixed size digest of a sequence of values, two independent 64 bit hashes and the value count stand in for
+    // the values themselves so keys are built and compared without allocating
+    struct InputDigest
+    {
+        uint64_t hash  = 0;
+        uint64_t check = 0xcbf29ce484222325ull;
+        uint64_t count = 0;
+
+        void add(const uint64_t value)
+        {
+            // splitmix64 finalizer, so neighboring addresses and counts spread over all bits
+            uint64_t mixed = value + 0x9e3779b97f4a7c15ull * (count + 1);
+            mixed = (mixed ^ (mixed >> 30)) * 0xbf58476d1ce4e5b9ull;
+            mixed = (mixed ^ (mixed >> 27)) * 0x94d049bb133111ebull;
+            mixed = mixed ^ (mixed >> 31);
+
+            hash  = HashCombine(hash, mixed);
+            check = (check ^ mixed) * 0x100000001b3ull;
+            count++;
+        }
+
+        bool operator==(const InputDigest& digest) const
+        {
+            return (hash == digest.hash) && (check == digest.check) && (count == digest.count);
+        }
+    };
+
+    // Build inputs including their GPU addresses, bottom level builds with equal keys build equal acceleration structures
+    struct BuildInputKey
+    {
+        InputDigest inputs;
+
+        bool operator==(const BuildInputKey& key) const { return inputs == key.inputs; }
+    };
+
+    struct BuildInputKeyHash
+    {
+        size_t operator()(const BuildInputKey& key) const
+        {
+            return static_cast<size_t>(key.inputs.hash);
+        }
+    };
 
     struct AccelerationStructure
     {
-        uint64_t compactionSize  = 0;
-        uint64_t resultSize      = 0;
-        uint64_t scratchSize     = 0;
-        bool isCompacted         = false;
-        bool requestedCompaction = false;
-        bool readyToFree         = false;
+        uint64_t compactionSize   = 0;
+        uint64_t resultSize       = 0;
+        uint64_t scratchSize      = 0;
+        uint64_t initialSize      = 0;
+        uint64_t updateScratchSize = 0;
+        // Ties pipeline entries to this instance so recycled ids are never advanced by stale entries
+        uint64_t pipelineSerial   = 0;
+        bool isCompacted          = false;
+        bool requestedCompaction  = false;
+        bool readyToFree          = false;
+        // Set once the compaction size has been copied over or queried for readback
+        bool compactionSizeCopied = false;
+        // Held back by the compaction budget, waiting in the compaction backlog
+        bool isCompactionDeferred = false;
+        SerializationState serializationState = SerializationState::None;
+        // Ids handed out for this acceleration structure by build deduplication
+        uint32_t referenceCount = 1;
+        // Entry in the deduplication table while later identical builds may share this acceleration structure
+        const BuildInputKey* deduplicationKey = nullptr;
+        // Refits since the last full build, BVH quality decays with each one
+        uint32_t refitCount = 0;
+        bool rebuildRequested = false;
     };
 
+    // Id to acceleration structure lookup table stored in fixed size pages that never move,
+    // so lookups from recording threads don't need a lock while other threads add new ids.
+    // Every page of pointers comes with a page of current GPU addresses, so bulk address lookups
+    // stream through dense arrays instead of chasing acceleration structures
+    template<typename T>
+    class AccelStructTable
+    {
+    public:
+        static constexpr uint64_t PageSize = 4096;
+        static constexpr uint64_t MaxPages = 4096;
+        static constexpr uint64_t MaxSize  = PageSize * MaxPages;
+
+        AccelStructTable()
+        {
+            for (uint64_t pageIndex = 0; pageIndex < MaxPages; pageIndex++)
+            {
+                m_pages[pageIndex].store(nullptr, std::memory_order_relaxed);
+                m_addressPages[pageIndex].store(nullptr, std::memory_order_relaxed);
+            }
+        }
+
+        ~AccelStructTable()
+        {
+            for (uint64_t pageIndex = 0; pageIndex < MaxPages; pageIndex++)
+            {
+                delete[] m_pages[pageIndex].load(std::memory_order_relaxed);
+                delete[] m_addressPages[pageIndex].load(std::memory_order_relaxed);
+            }
+        }
+
+        T*& operator[](uint64_t accelStructId)
+        {
+            T** page = m_pages[accelStructId / PageSize].load(std::memory_order_acquire);
+            return page[accelStructId % PageSize];
+        }
+
+        // GPU address of the acceleration structure, 0 while it has none
+        uint64_t& address(uint64_t accelStructId)
+        {
+            uint64_t* page = m_addressPages[accelStructId / PageSize].load(std::memory_order_acquire);
+            return page[accelStructId % PageSize];
+        }
+
+        // Number of ids ever handed out including the reserved id
+        uint64_t size() const
+        {
+            return m_size.load(std::memory_order_acquire);
+        }
+
+        // Appends a new empty entry and returns its id, or MaxSize once the table is full. Safe to call from
+        // multiple threads, the pages of every id below size exist before size covers them
+        uint64_t add()
+        {
+            const uint64_t accelStructId = m_nextId.fetch_add(1, std::memory_order_relaxed);
+            if (accelStructId >= MaxSize)
+            {
+                return MaxSize;
+            }
+
+            // Threads adding ids help each other create the pages in order
+            const uint64_t pageIndex = accelStructId / PageSize;
+            uint64_t       pageCount = m_pageCount.load(std::memory_order_acquire);
+            while (pageCount <= pageIndex)
+            {
+                createPage(pageCount);
+                m_pageCount.compare_exchange_weak(pageCount, pageCount + 1, std::memory_order_acq_rel);
+                pageCount = m_pageCount.load(std::memory_order_acquire);
+            }
+
+            uint64_t entryCount = m_size.load(std::memory_order_relaxed);
+            while ((entryCount <= accelStructId) &&
+                   (m_size.compare_exchange_weak(entryCount, accelStructId + 1, std::memory_order_acq_rel) == false))
+            {
+            }
+            return accelStructId;
+        }
+
+        // Drops every entry but keeps the pages around for reuse, must not overlap with add
+        void clear()
+        {
+            const uint64_t entryCount = size();
+            for (uint64_t accelStructId = 0; accelStructId < entryCount; accelStructId++)
+            {
+                (*this)[accelStructId] = nullptr;
+                address(accelStructId) = 0;
+            }
+            m_size.store(0, std::memory_order_release);
+            m_nextId.store(0, std::memory_order_release);
+        }
+
+    private:
+        void createPage(const uint64_t pageIndex)
+        {
+            uint64_t* addressPage = nullptr;
+            uint64_t* newAddressPage = new uint64_t[PageSize]();
+            if (m_addressPages[pageIndex].compare_exchange_strong(addressPage, newAddressPage,
+                                                                  std::memory_order_acq_rel) == false)
+            {
+                delete[] newAddressPage;
+            }
+
+            T** page = nullptr;
+            T** newPage = new T*[PageSize]();
+            if (m_pages[pageIndex].compare_exchange_strong(page, newPage, std::memory_order_acq_rel) == false)
+            {
+                delete[] newPage;
+            }
+        }
+
+        std::atomic<T**>       m_pages[MaxPages];
+        std::atomic<uint64_t*> m_addressPages[MaxPages];
+        std::atomic<uint64_t>  m_size{ 0 };
+        // Ids handed out so far, runs ahead of size while adding threads create pages
+        std::atomic<uint64_t>  m_nextId{ 0 };
+        // Pages below this are known to exist
+        std::atomic<uint64_t>  m_pageCount{ 0 };
+    };
+
+    // Hands out scratch ranges from one fixed size buffer in recording order. Ranges handed out between
+    // two barriers never alias, acquire reports when a barrier has to be placed before its range is used.
+    // Not thread safe, callers serialize whole recordings so every wrap barrier lands in the right command list
+    class ScratchRing
+    {
+    public:
+
+        void reset(uint64_t size)
+        {
+            m_size           = size;
+            m_offset         = 0;
+            m_used           = false;
+            m_barrierPending = false;
+        }
+
+        uint64_t getSize() const
+        {
+            return m_size;
+        }
+
+        // Earlier recordings might still be using the ring so the first range of a recording needs a barrier
+        void beginRecording()
+        {
+            m_barrierPending = m_used;
+        }
+
+        // Returns false when the range can't fit in the ring at all
+        bool acquire(uint64_t  size,
+                     uint64_t& offset,
+                     bool&     needsBarrier)
+        {
+            const uint64_t alignedSize = ((size + AccelStructAlignment - 1) / AccelStructAlignment) * AccelStructAlignment;
+            if (alignedSize > m_size)
+            {
+                return false;
+            }
+
+            // Wrap around once the end is reached, overwriting ranges of builds before the barrier
+            if (m_offset + alignedSize > m_size)
+            {
+                m_offset         = 0;
+                m_barrierPending = true;
+            }
+
+            offset           = m_offset;
+            needsBarrier     = m_barrierPending;
+            m_offset        += alignedSize;
+            m_barrierPending = false;
+            m_used           = true;
+            return true;
+        }
+
+    private:
+        uint64_t m_size           = 0;
+        uint64_t m_offset         = 0;
+        bool     m_used           = false;
+        bool     m_barrierPending = false;
+    };
+
+    // Build, update, compaction and garbage collection entry points may be recorded concurrently from
+    // multiple threads into separate command lists as long as a given acceleration structure id is only
+    // used by one thread at a time.  Initialize and Reset must not overlap with any other call.
     template<typename T>
     class AccelStructManager
     {
     public:
 
         AccelStructManager(Level logVerbosity) :
+        m_logger(logVerbosity),
         m_buildLogger(""),
         m_suballocationBlockSize(0),
         m_totalUncompactedMemory(0),
         m_totalCompactedMemory(0)
         {
             // Reserve acceleration structure index 0 to not be used
-            m_asBufferBuildQueue.resize(1, nullptr);
-
-            Logger::setLoggerSettings(logVerbosity);
+            m_asBufferBuildQueue.add();
         }
 
         ~AccelStructManager()
         {
-            for (T* accelStruct : m_asBufferBuildQueue)
-            {
-                if (accelStruct != nullptr)
-                {
-                    delete accelStruct;
-                }
-            }
+            ReleaseAllAccelStructs();
         }
 
         // Resets all queues and frees all memory in suballocators
@@ -80,57 +413,871 @@ namespace rtxmu
             m_totalUncompactedMemory = 0;
             m_totalCompactedMemory = 0;
 
-            for (T* accelStruct : m_asBufferBuildQueue)
+            ReleaseAllAccelStructs();
+
+            m_asBufferBuildQueue.clear();
+            m_asBufferBuildQueue.add();
+            for (IdShard& shard : m_idShards)
             {
-                if (accelStruct != nullptr)
+                std::lock_guard<std::mutex> guard(shard.lock);
+                shard.freeIds     = std::queue<uint64_t>();
+                shard.freeIdCount = 0;
+            }
+
+            std::lock_guard<std::mutex> pipelineGuard(m_pipelineLock);
+            m_pipelineBuilds.clear();
+            m_pipelineSizeCopies.clear();
+            m_pipelineCompactions.clear();
+            m_compactionBacklog.clear();
+
+            std::lock_guard<std::mutex> deduplicationGuard(m_deduplicationLock);
+            m_deduplicationTable.clear();
+
+            // Batches of command lists that were never submitted would block the ones after them
+            std::lock_guard<std::mutex> gpuTimingGuard(m_gpuTimingLock);
+            m_gpuTimingBatches.clear();
+        }
+
+        // Hands freshly built acceleration structures over to the fence tracked pipeline.
+        // The build commands must be part of a submission that signals fenceValue once complete,
+        // after which Tick takes care of the size copies, compaction and garbage collection.
+        void TrackBuilds(const std::vector<uint64_t>& accelStructIds,
+                         const uint64_t               fenceValue)
+        {
+            // Builds that failed to allocate their memory have no id, deduplicated ones share theirs
+            std::vector<uint64_t> liveIds;
+            GetLiveIds(accelStructIds, liveIds);
+
+            std::lock_guard<std::mutex> guard(m_pipelineLock);
+
+            for (const uint64_t& accelStructId : liveIds)
+            {
+                T* accelStruct = m_asBufferBuildQueue[accelStructId];
+                accelStruct->pipelineSerial = ++m_pipelineSerial;
+                m_pipelineBuilds.push_back({ accelStructId, accelStruct->pipelineSerial, fenceValue });
+            }
+
+            SubmitGpuTimings(fenceValue);
+        }
+
+        // Overrides the size classes of the result, transient result and compaction pools, which default to
+        // GetDefaultSizeClasses of the suballocator block size. Takes effect on the next Initialize or Reset
+        void SetSizeClasses(const std::vector<SizeClass>& sizeClasses)
+        {
+            m_sizeClasses = sizeClasses;
+        }
+
+        // Returns the number of acceleration structures still moving through the fence tracked pipeline
+        uint64_t GetPipelineDepth()
+        {
+            std::lock_guard<std::mutex> guard(m_pipelineLock);
+            return m_pipelineBuilds.size() + m_pipelineSizeCopies.size() + m_pipelineCompactions.size() + m_compactionBacklog.size();
+        }
+
+        // Caps the compactions recorded per PopulateCompactionCommandList call, and so per Tick, by compacted bytes
+        // and count. 0 lifts a cap and at least one compaction is always recorded. Compactions saving the most
+        // memory go first, the rest wait in a backlog that every later call works through before the ids passed in
+        void SetCompactionBudget(const uint64_t maxCompactedBytes,
+                                 const uint64_t maxCompactionCount = 0)
+        {
+            m_compactionByteBudget  = maxCompactedBytes;
+            m_compactionCountBudget = maxCompactionCount;
+        }
+
+        // Returns the number of compactions held back by the compaction budget
+        uint64_t GetDeferredCompactionCount()
+        {
+            std::lock_guard<std::mutex> guard(m_pipelineLock);
+            return m_compactionBacklog.size();
+        }
+
+        // Writes the current GPU address of each id to addresses, advancing strideInBytes per id so the addresses
+        // can go straight into mapped instance descs. Reads from a dense table that compaction and defragmentation
+        // keep up to date, ids that are ReservedId or removed get 0. Must not overlap with calls moving those ids
+        void GetAccelStructAddresses(const uint64_t* accelStructIds,
+                                     const size_t    count,
+                                     void*           addresses,
+                                     const size_t    strideInBytes = sizeof(uint64_t))
+        {
+            unsigned char* destination = static_cast<unsigned char*>(addresses);
+            for (size_t index = 0; index < count; index++)
+            {
+                // Instance desc fields aren't necessarily 8 byte aligned in the caller's layout
+                const uint64_t address = (accelStructIds[index] < m_asBufferBuildQueue.size()) ?
+                                             m_asBufferBuildQueue.address(accelStructIds[index]) : 0;
+                memcpy(destination + index * strideInBytes, &address, sizeof(address));
+            }
+        }
+
+        // Bottom level builds whose inputs, GPU addresses included, match a live acceleration structure get its id
+        // back with an extra reference instead of being built again. Only builds that don't allow updates are shared
+        // and the geometry behind the addresses must stay the same while shared. RemoveAccelerationStructures
+        // drops one reference per id passed in, the memory goes with the last one
+        void SetBuildDeduplication(const bool enable)
+        {
+            std::lock_guard<std::mutex> guard(m_deduplicationLock);
+            m_buildDeduplication = enable;
+
+            // Acceleration structures built so far stay shared, they just stop being handed out again
+            if (enable == false)
+            {
+                for (auto& entry : m_deduplicationTable)
                 {
-                    delete accelStruct;
+                    m_asBufferBuildQueue[entry.second]->deduplicationKey = nullptr;
                 }
+                m_deduplicationTable.clear();
             }
         }
 
+        // Turns refits into full rebuilds once an acceleration structure has been refit maxRefitsBeforeRebuild
+        // times in a row, 0 keeps refitting forever. Rebuilds reuse the memory of the acceleration structure
+        void SetRefitPolicy(const uint32_t maxRefitsBeforeRebuild)
+        {
+            m_maxRefitsBeforeRebuild = maxRefitsBeforeRebuild;
+        }
+
+        // Turns the next refit of each acceleration structure into a full rebuild, for when the application
+        // sees the refit quality suffer, like bounds growing far beyond those of the last build
+        void RequestRebuild(const std::vector<uint64_t>& accelStructIds)
+        {
+            for (const uint64_t& accelStructId : accelStructIds)
+            {
+                if (IsLiveId(accelStructId))
+                {
+                    m_asBufferBuildQueue[accelStructId]->rebuildRequested = true;
+                }
+            }
+        }
+
+        // Returns the number of refits since the last full build
+        uint32_t GetRefitCount(const uint64_t accelStructId)
+        {
+            return IsLiveId(accelStructId) ? m_asBufferBuildQueue[accelStructId]->refitCount : 0;
+        }
+
+        // Managed top level acceleration structures rebuild instead of refitting once more than rebuildRatio of
+        // their instances changed since the last build, 1.0 refits whenever the instance count stays the same
+        void SetTopLevelRebuildRatio(const double rebuildRatio)
+        {
+            m_topLevelRebuildRatio = rebuildRatio;
+        }
+
+        // Sends the log messages of this manager to loggerCallback instead of the platform debug output,
+        // null drops them
+        void SetLoggerCallback(void (*loggerCallback)(const char*))
+        {
+            m_logger.setLoggerCallback(loggerCallback);
+        }
+
+        void SetLogVerbosity(const Level verbosity)
+        {
+            m_logger.setLoggerSettings(verbosity);
+        }
+
+        // Queues log messages in a lock free ring of capacity messages instead of calling the callback from the
+        // thread that logged them, so builds on many threads don't serialize on the callback. AdvanceFrame and
+        // FlushLog deliver them, messages that don't fit get dropped and counted. 0 goes back to immediate
+        // delivery. Must not overlap other calls
+        void EnableAsyncLogging(const uint32_t capacity)
+        {
+            m_logger.enableAsyncDelivery(capacity);
+        }
+
+        // Delivers the queued log messages from the calling thread
+        void FlushLog()
+        {
+            m_logger.flush();
+        }
+
+        // Reports allocations, frees, block creation and destruction of every pool as well as recorded
+        // compactions to callback, see TelemetryCallback. Null stops the reporting. Must not overlap other calls
+        void SetTelemetryCallback(TelemetryCallback callback,
+                                  void*             callbackUserData = nullptr)
+        {
+            m_telemetrySink.callback         = callback;
+            m_telemetrySink.callbackUserData = callbackUserData;
+        }
+
+        // Streams every build, update, compaction, garbage collection and removal along with frame markers to a
+        // binary trace at path until EndAllocationTrace, for replaying production workloads against other allocator
+        // settings offline. See AllocationTrace.h for the format. Returns false if the file couldn't be created
+        bool BeginAllocationTrace(const char* path)
+        {
+            if (m_allocationTrace.open(path, m_suballocationBlockSize) == false)
+            {
+                if (m_logger.isEnabled(Level::ERR))
+                {
+                    char buf[128];
+                    snprintf(buf, sizeof buf, "RTXMU Allocation Trace %.64s couldn't be created\n", path);
+                    m_logger.log(Level::ERR, buf);
+                }
+                return false;
+            }
+            return true;
+        }
+
+        void EndAllocationTrace()
+        {
+            m_allocationTrace.close();
+        }
+
+        // Moves the GPU timings collected so far to the end of timings. Every batch recorded with GPU timing enabled
+        // is measured by two timestamps, attributed to the fence value of the next TrackBuilds or Tick call and read
+        // back by the Tick that sees the fence completed. Attribution assumes all of them go through one queue.
+        // At most MaxCollectedGpuTimings are held between calls, the phase totals count the dropped ones too
+        void GetGpuTimings(std::vector<GpuTiming>& timings)
+        {
+            std::lock_guard<std::mutex> guard(m_gpuTimingLock);
+            timings.insert(timings.end(), m_gpuTimings.begin(), m_gpuTimings.end());
+            m_gpuTimings.clear();
+        }
+
+        GpuPhaseTiming GetGpuPhaseTiming(const GpuTimingPhase phase)
+        {
+            std::lock_guard<std::mutex> guard(m_gpuTimingLock);
+            return m_gpuPhaseTimings[static_cast<uint32_t>(phase)];
+        }
+
+        // Stops timing new batches, the ones in flight are still collected
+        void DisableGpuTiming()
+        {
+            std::lock_guard<std::mutex> guard(m_gpuTimingLock);
+            m_gpuTiming = false;
+        }
+
+        // Returns the number of ids sharing the acceleration structure
+        uint32_t GetReferenceCount(const uint64_t accelStructId)
+        {
+            std::lock_guard<std::mutex> guard(m_deduplicationLock);
+            return IsLiveId(accelStructId) ? m_asBufferBuildQueue[accelStructId]->referenceCount : 0;
+        }
+
     protected:
+
+        // Builds that failed hand back ReservedId, every entry point taking ids checks them with this first
+        bool IsLiveId(const uint64_t accelStructId)
+        {
+            return (accelStructId > ReservedId) &&
+                   (accelStructId < m_asBufferBuildQueue.size()) &&
+                   (m_asBufferBuildQueue[accelStructId] != nullptr);
+        }
+
+        // Copies the live ids to liveIds sorted and without duplicates, so the id lists builds hand back with
+        // ReservedId for failed builds and repeated ids for deduplicated builds can be passed to the batched entry
+        // points as they are. Removal must not go through this, it drops one reference per id
+        void GetLiveIds(const std::vector<uint64_t>& accelStructIds,
+                        std::vector<uint64_t>&       liveIds)
+        {
+            liveIds.clear();
+            liveIds.reserve(accelStructIds.size());
+            for (const uint64_t& accelStructId : accelStructIds)
+            {
+                if (IsLiveId(accelStructId))
+                {
+                    liveIds.push_back(accelStructId);
+                }
+            }
+            std::sort(liveIds.begin(), liveIds.end());
+            liveIds.erase(std::unique(liveIds.begin(), liveIds.end()), liveIds.end());
+        }
+
+        void RecordTrace(const AllocationTraceRecordType type,
+                         const uint64_t                  accelStructId = ReservedId,
+                         const uint64_t                  size          = 0,
+                         const uint64_t                  secondarySize = 0,
+                         const uint32_t                  flags         = 0)
+        {
+            if (m_allocationTrace.isOpen())
+            {
+                AllocationTraceRecord record;
+                record.type          = type;
+                record.flags         = flags;
+                record.accelStructId = accelStructId;
+                record.size          = size;
+                record.secondarySize = secondarySize;
+                m_allocationTrace.write(record);
+            }
+        }
+
+        void ReportCompaction(const uint64_t accelStructId,
+                              const uint64_t sizeBefore,
+                              const uint64_t sizeAfter,
+                              const PoolType pool = PoolType::Compaction)
+        {
+            if (m_telemetrySink.callback != nullptr)
+            {
+                TelemetryEvent event;
+                event.type          = TelemetryEventType::Compaction;
+                event.pool          = pool;
+                event.size          = sizeAfter;
+                event.sizeBefore    = sizeBefore;
+                event.accelStructId = accelStructId;
+                m_telemetrySink.report(event);
+            }
+        }
+
+        struct GpuTimingBatch
+        {
+            GpuTimingPhase phase;
+            // First of the two timestamp queries of the batch
+            uint32_t       queryIndex;
+            uint64_t       accelStructCount;
+            uint64_t       bytes;
+            uint64_t       fenceValue;
+            bool           recorded;
+            bool           submitted;
+        };
+
+        // Called by the backends once their timestamp resources exist, timestampPeriod is in nanoseconds per tick
+        void StartGpuTiming(const double timestampPeriod)
+        {
+            std::lock_guard<std::mutex> guard(m_gpuTimingLock);
+            m_gpuTimestampPeriod = timestampPeriod;
+            m_gpuTiming          = true;
+            for (GpuPhaseTiming& phaseTiming : m_gpuPhaseTimings)
+            {
+                phaseTiming = GpuPhaseTiming();
+            }
+        }
+
+        // Hands out the pair of queries the batch about to be recorded writes its timestamps to. Returns false
+        // when GPU timing is off or every query is still in flight, the batch just goes unmeasured then
+        bool AcquireGpuTimingQueries(const GpuTimingPhase phase,
+                                     uint32_t&            queryIndex)
+        {
+            std::lock_guard<std::mutex> guard(m_gpuTimingLock);
+
+            // Batches are handed queries in ring order and retired in the same order
+            if ((m_gpuTiming == false) ||
+                ((m_gpuTimingBatches.size() + 1) * 2 > GpuTimingQueryCount))
+            {
+                return false;
+            }
+
+            queryIndex           = m_nextGpuTimingQuery;
+            m_nextGpuTimingQuery = (m_nextGpuTimingQuery + 2) % GpuTimingQueryCount;
+            m_gpuTimingBatches.push_back({ phase, queryIndex, 0, 0, 0, false, false });
+            return true;
+        }
+
+        // Fills in what the batch did once its end timestamp is recorded
+        void FinishGpuTimingBatch(const uint32_t queryIndex,
+                                  const uint64_t accelStructCount,
+                                  const uint64_t bytes)
+        {
+            std::lock_guard<std::mutex> guard(m_gpuTimingLock);
+
+            for (auto batch = m_gpuTimingBatches.rbegin(); batch != m_gpuTimingBatches.rend(); batch++)
+            {
+                if ((batch->queryIndex == queryIndex) && (batch->recorded == false))
+                {
+                    batch->accelStructCount = accelStructCount;
+                    batch->bytes            = bytes;
+                    batch->recorded         = true;
+                    break;
+                }
+            }
+        }
+
+        // Attributes every batch recorded since the last submission to fenceValue
+        void SubmitGpuTimings(const uint64_t fenceValue)
+        {
+            std::lock_guard<std::mutex> guard(m_gpuTimingLock);
+
+            for (GpuTimingBatch& batch : m_gpuTimingBatches)
+            {
+                if (batch.recorded && (batch.submitted == false))
+                {
+                    batch.fenceValue = fenceValue;
+                    batch.submitted  = true;
+                }
+            }
+        }
+
+        // Reads back the timestamps of every batch whose submission has completed on the GPU, readTimestamps
+        // fills in the begin and end tick of the batch at a query index and returns false if they're unavailable
+        template<typename ReadTimestamps>
+        void CollectGpuTimings(const uint64_t completedFenceValue,
+                               ReadTimestamps readTimestamps)
+        {
+            std::lock_guard<std::mutex> guard(m_gpuTimingLock);
+
+            while ((m_gpuTimingBatches.empty() == false) &&
+                   m_gpuTimingBatches.front().submitted &&
+                   (m_gpuTimingBatches.front().fenceValue <= completedFenceValue))
+            {
+                const GpuTimingBatch batch = m_gpuTimingBatches.front();
+                m_gpuTimingBatches.pop_front();
+
+                uint64_t beginTick = 0;
+                uint64_t endTick   = 0;
+                if ((readTimestamps(batch.queryIndex, beginTick, endTick) == false) || (endTick < beginTick))
+                {
+                    continue;
+                }
+
+                GpuTiming timing;
+                timing.phase            = batch.phase;
+                timing.fenceValue       = batch.fenceValue;
+                timing.milliseconds     = static_cast<double>(endTick - beginTick) * m_gpuTimestampPeriod / 1000000.0;
+                timing.accelStructCount = batch.accelStructCount;
+                timing.bytes            = batch.bytes;
+
+                GpuPhaseTiming& phaseTiming = m_gpuPhaseTimings[static_cast<uint32_t>(batch.phase)];
+                phaseTiming.batchCount++;
+                phaseTiming.milliseconds     += timing.milliseconds;
+                phaseTiming.accelStructCount += timing.accelStructCount;
+                phaseTiming.bytes            += timing.bytes;
+
+                if (m_gpuTimings.size() < MaxCollectedGpuTimings)
+                {
+                    m_gpuTimings.push_back(timing);
+                }
+            }
+        }
+
+        // Compacted acceleration structures have no result memory left to rebuild into
+        bool IsRebuildDue(const T* accelStruct)
+        {
+            return (accelStruct->isCompacted == false) &&
+                   (accelStruct->rebuildRequested ||
+                    ((m_maxRefitsBeforeRebuild > 0) && (accelStruct->refitCount >= m_maxRefitsBeforeRebuild)));
+        }
+
+        bool IsBuildDeduplicationEnabled()
+        {
+            std::lock_guard<std::mutex> guard(m_deduplicationLock);
+            return m_buildDeduplication;
+        }
+
+        // Returns the id of a live acceleration structure built from equal inputs with a reference taken on it,
+        // ReservedId when the inputs are built for the first time
+        uint64_t AcquireDeduplicatedBuild(const BuildInputKey& key)
+        {
+            std::lock_guard<std::mutex> guard(m_deduplicationLock);
+
+            auto entry = m_deduplicationTable.find(key);
+            if (entry == m_deduplicationTable.end())
+            {
+                return ReservedId;
+            }
+
+            m_asBufferBuildQueue[entry->second]->referenceCount++;
+
+            if (m_logger.isEnabled(Level::DBG))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU Deduplicated Build %" PRIu64 "\n", entry->second);
+                m_logger.log(Level::DBG, buf);
+            }
+            return entry->second;
+        }
+
+        // Lets later builds from equal inputs share a recorded build
+        void RegisterDeduplicatedBuild(const uint64_t       accelStructId,
+                                       const BuildInputKey& key)
+        {
+            std::lock_guard<std::mutex> guard(m_deduplicationLock);
+
+            auto entry = m_deduplicationTable.emplace(key, accelStructId);
+            if (entry.second)
+            {
+                m_asBufferBuildQueue[accelStructId]->deduplicationKey = &entry.first->first;
+            }
+        }
+
+        // Stops handing out the acceleration structure, needed once its inputs change with a rebuild
+        void UnregisterDeduplicatedBuild(const uint64_t accelStructId)
+        {
+            std::lock_guard<std::mutex> guard(m_deduplicationLock);
+            EraseDeduplicationEntry(m_asBufferBuildQueue[accelStructId]);
+        }
+
+        // Drops a reference, returns true once the last one is gone and the acceleration structure can be released
+        bool ReleaseReference(const uint64_t accelStructId)
+        {
+            std::lock_guard<std::mutex> guard(m_deduplicationLock);
+
+            T* accelStruct = m_asBufferBuildQueue[accelStructId];
+            if (--accelStruct->referenceCount > 0)
+            {
+                return false;
+            }
+
+            EraseDeduplicationEntry(accelStruct);
+            return true;
+        }
+
+        // Checks the RTXMU header of a serialized blob, the driver compatibility is checked by the backends
+        static const SerializedAccelStructHeader* GetSerializedAccelStructHeader(const SerializedAccelStruct& serialized,
+                                                                                 const uint64_t              minDriverBlobSize)
+        {
+            const SerializedAccelStructHeader* header = static_cast<const SerializedAccelStructHeader*>(serialized.data);
+            if ((serialized.data == nullptr) ||
+                (serialized.size < sizeof(SerializedAccelStructHeader) + minDriverBlobSize) ||
+                (header->magic   != SerializedAccelStructMagic) ||
+                (header->version != SerializedAccelStructVersion) ||
+                (header->driverBlobSize != serialized.size - sizeof(SerializedAccelStructHeader)) ||
+                ((serialized.geometryKey != 0) && (header->geometryKey != serialized.geometryKey)))
+            {
+                return nullptr;
+            }
+            return header;
+        }
+
+        struct PipelineEntry
+        {
+            uint64_t accelStructId;
+            uint64_t serial;
+            uint64_t fenceValue;
+        };
+
+        // Work due this tick, gathered from every stage whose fence has completed
+        struct PipelineWork
+        {
+            std::vector<uint64_t> sizeCopyIds;
+            std::vector<uint64_t> compactionIds;
+            std::vector<uint64_t> garbageCollectionIds;
+        };
+
+        // Pops every pipeline entry whose submission has completed on the GPU
+        void BeginPipelineTick(const uint64_t completedFenceValue,
+                               PipelineWork&  work)
+        {
+            std::lock_guard<std::mutex> guard(m_pipelineLock);
+
+            PopCompletedEntries(m_pipelineBuilds, completedFenceValue, [&](uint64_t accelStructId)
+            {
+                T* accelStruct = m_asBufferBuildQueue[accelStructId];
+                if (accelStruct->requestedCompaction == false)
+                {
+                    // Nothing to compact so the build is simply done
+                    return;
+                }
+                if (accelStruct->compactionSizeCopied)
+                {
+                    work.compactionIds.push_back(accelStructId);
+                }
+                else
+                {
+                    work.sizeCopyIds.push_back(accelStructId);
+                }
+            });
+
+            PopCompletedEntries(m_pipelineSizeCopies, completedFenceValue, [&](uint64_t accelStructId)
+            {
+                work.compactionIds.push_back(accelStructId);
+            });
+
+            PopCompletedEntries(m_pipelineCompactions, completedFenceValue, [&](uint64_t accelStructId)
+            {
+                work.garbageCollectionIds.push_back(accelStructId);
+            });
+        }
+
+        // Queues the work recorded this tick behind the fence value that the tick submission signals
+        void EndPipelineTick(const uint64_t      submitFenceValue,
+                             const PipelineWork& work)
+        {
+            std::lock_guard<std::mutex> guard(m_pipelineLock);
+
+            for (const uint64_t& accelStructId : work.sizeCopyIds)
+            {
+                m_pipelineSizeCopies.push_back({ accelStructId, m_asBufferBuildQueue[accelStructId]->pipelineSerial, submitFenceValue });
+            }
+
+            for (const uint64_t& accelStructId : work.compactionIds)
+            {
+                T* accelStruct = m_asBufferBuildQueue[accelStructId];
+
+                // Compaction sizes that weren't available yet go around again, deferred compactions wait in the backlog
+                if (accelStruct->isCompacted)
+                {
+                    m_pipelineCompactions.push_back({ accelStructId, accelStruct->pipelineSerial, submitFenceValue });
+                }
+                else if (accelStruct->isCompactionDeferred == false)
+                {
+                    m_pipelineSizeCopies.push_back({ accelStructId, accelStruct->pipelineSerial, submitFenceValue });
+                }
+            }
+
+            SubmitGpuTimings(submitFenceValue);
+        }
+
+        // Appends the compactions waiting in the backlog to accelStructIds and drops duplicates
+        void TakeDeferredCompactions(std::vector<uint64_t>& accelStructIds)
+        {
+            {
+                std::lock_guard<std::mutex> guard(m_pipelineLock);
+
+                for (const uint64_t& accelStructId : m_compactionBacklog)
+                {
+                    // Removed acceleration structures leave stale backlog entries behind
+                    T* accelStruct = m_asBufferBuildQueue[accelStructId];
+                    if ((accelStruct != nullptr) && accelStruct->isCompactionDeferred)
+                    {
+                        accelStruct->isCompactionDeferred = false;
+                        accelStructIds.push_back(accelStructId);
+                    }
+                }
+                m_compactionBacklog.clear();
+            }
+
+            std::sort(accelStructIds.begin(), accelStructIds.end());
+            accelStructIds.erase(std::unique(accelStructIds.begin(), accelStructIds.end()), accelStructIds.end());
+        }
+
+        // Keeps the compactions that fit the compaction budget, largest savings first, and moves the rest
+        // into the backlog. Both vectors stay paired up
+        void ApplyCompactionBudget(std::vector<uint64_t>& accelStructIds,
+                                   std::vector<uint64_t>& compactionSizes)
+        {
+            if ((m_compactionByteBudget == 0) && (m_compactionCountBudget == 0))
+            {
+                return;
+            }
+
+            std::vector<size_t> order(accelStructIds.size());
+            for (size_t index = 0; index < order.size(); index++)
+            {
+                order[index] = index;
+            }
+
+            auto savings = [&](size_t index)
+            {
+                const uint64_t resultSize = m_asBufferBuildQueue[accelStructIds[index]]->resultSize;
+                return (resultSize > compactionSizes[index]) ? resultSize - compactionSizes[index] : 0;
+            };
+            std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+            {
+                return savings(a) > savings(b);
+            });
+
+            std::vector<uint64_t> keptIds;
+            std::vector<uint64_t> keptSizes;
+            uint64_t              compactedBytes = 0;
+
+            std::lock_guard<std::mutex> guard(m_pipelineLock);
+
+            for (const size_t& index : order)
+            {
+                const bool fitsBudget = keptIds.empty() ||
+                                        (((m_compactionByteBudget  == 0) || (compactedBytes + compactionSizes[index] <= m_compactionByteBudget)) &&
+                                         ((m_compactionCountBudget == 0) || (keptIds.size() < m_compactionCountBudget)));
+                if (fitsBudget)
+                {
+                    keptIds.push_back(accelStructIds[index]);
+                    keptSizes.push_back(compactionSizes[index]);
+                    compactedBytes += compactionSizes[index];
+                }
+                else
+                {
+                    m_asBufferBuildQueue[accelStructIds[index]]->isCompactionDeferred = true;
+                    m_compactionBacklog.push_back(accelStructIds[index]);
+                }
+            }
+
+            if ((m_compactionBacklog.empty() == false) && m_logger.isEnabled(Level::DBG))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU Compactions Deferred By Budget %" PRIu64 "\n", static_cast<uint64_t>(m_compactionBacklog.size()));
+                m_logger.log(Level::DBG, buf);
+            }
+
+            accelStructIds.swap(keptIds);
+            compactionSizes.swap(keptSizes);
+        }
+
+        void EraseDeduplicationEntry(T* accelStruct)
+        {
+            if (accelStruct->deduplicationKey != nullptr)
+            {
+                // The key lives in the table entry that is about to go away
+                const BuildInputKey key = *accelStruct->deduplicationKey;
+                m_deduplicationTable.erase(key);
+                accelStruct->deduplicationKey = nullptr;
+            }
+        }
+
+        template<typename Callback>
+        void PopCompletedEntries(std::deque<PipelineEntry>& entries,
+                                 const uint64_t             completedFenceValue,
+                                 Callback                   callback)
+        {
+            while ((entries.empty() == false) &&
+                   (entries.front().fenceValue <= completedFenceValue))
+            {
+                const PipelineEntry entry = entries.front();
+                entries.pop_front();
+
+                // Skip entries for acceleration structures that were removed in the meantime
+                if ((entry.accelStructId < m_asBufferBuildQueue.size()) &&
+                    (m_asBufferBuildQueue[entry.accelStructId] != nullptr) &&
+                    (m_asBufferBuildQueue[entry.accelStructId]->pipelineSerial == entry.serial))
+                {
+                    callback(entry.accelStructId);
+                }
+            }
+        }
+
+        // Id allocation is the only shared state touched when recording builds from multiple threads, so it is
+        // sharded. Threads start looking for a recycled id in a shard of their own and only mint a new one once
+        // every shard ran dry. Returns ReservedId once every id the table can hold is in use
         uint64_t GetAccelStructId()
         {
-            uint64_t asId = 0;
-            if (m_asIdFreeList.size() > 0)
+            const uint32_t homeShard = GetIdShardIndex();
+            for (uint32_t shardOffset = 0; shardOffset < IdShardCount; shardOffset++)
             {
-                asId = m_asIdFreeList.front();
-                m_asBufferBuildQueue[asId] = new T();
-                m_asIdFreeList.pop();
+                IdShard& shard = m_idShards[(homeShard + shardOffset) % IdShardCount];
+                if (shard.freeIdCount.load(std::memory_order_relaxed) == 0)
+                {
+                    continue;
+                }
+
+                std::lock_guard<std::mutex> guard(shard.lock);
+                if (shard.freeIds.empty() == false)
+                {
+                    const uint64_t asId = shard.freeIds.front();
+                    shard.freeIds.pop();
+                    shard.freeIdCount.store(shard.freeIds.size(), std::memory_order_relaxed);
+
+                    m_asBufferBuildQueue[asId] = shard.accelStructPool.allocate();
+                    m_asBufferBuildQueue.address(asId) = 0;
+                    return asId;
+                }
             }
-            else
+
+            const uint64_t asId = m_asBufferBuildQueue.add();
+            if (asId == AccelStructTable<T>::MaxSize)
             {
-                m_asBufferBuildQueue.push_back(new T());
-                asId = m_asId++;
+                if (m_logger.isEnabled(Level::ERR))
+                {
+                    m_logger.log(Level::ERR, "RTXMU Out of acceleration structure ids\n");
+                }
+                return ReservedId;
             }
+
+            IdShard& shard = m_idShards[asId % IdShardCount];
+            std::lock_guard<std::mutex> guard(shard.lock);
+            m_asBufferBuildQueue[asId] = shard.accelStructPool.allocate();
             return asId;
         }
 
+        // Ids go back to the shard owning them, the one their acceleration structure was allocated from
         void ReleaseAccelStructId(uint64_t accelStructId)
         {
-            m_asIdFreeList.push(accelStructId);
-            delete m_asBufferBuildQueue[accelStructId];
+            IdShard& shard = m_idShards[accelStructId % IdShardCount];
+            std::lock_guard<std::mutex> guard(shard.lock);
+
+            shard.freeIds.push(accelStructId);
+            shard.freeIdCount.store(shard.freeIds.size(), std::memory_order_relaxed);
+            shard.accelStructPool.release(m_asBufferBuildQueue[accelStructId]);
             m_asBufferBuildQueue[accelStructId] = nullptr;
+            m_asBufferBuildQueue.address(accelStructId) = 0;
+        }
+
+        // Spreads threads over the id shards round robin, a thread keeps its shard for its lifetime
+        static uint32_t GetIdShardIndex()
+        {
+            static std::atomic<uint32_t> nextShardIndex{ 0 };
+            thread_local const uint32_t  shardIndex = nextShardIndex.fetch_add(1, std::memory_order_relaxed) % IdShardCount;
+            return shardIndex;
+        }
+
+        // Records where the acceleration structure lives from now on, must follow every build, compaction and move
+        void PublishAddress(const uint64_t accelStructId,
+                            const uint64_t address)
+        {
+            m_asBufferBuildQueue.address(accelStructId) = address;
+        }
+
+        void ReleaseAllAccelStructs()
+        {
+            const uint64_t entryCount = m_asBufferBuildQueue.size();
+            for (uint64_t accelStructId = 0; accelStructId < entryCount; accelStructId++)
+            {
+                T*& accelStruct = m_asBufferBuildQueue[accelStructId];
+                if (accelStruct != nullptr)
+                {
+                    m_idShards[accelStructId % IdShardCount].accelStructPool.release(accelStruct);
+                    accelStruct = nullptr;
+                }
+            }
         }
         
         // Logger
+        Logger      m_logger;
         std::string m_buildLogger;
 
         // Every suballocator block gets allocated with a configurable size
         uint32_t m_suballocationBlockSize = 0;
 
+        // Acceleration structure pools split allocations into these size classes, empty uses the defaults
+        std::vector<SizeClass> m_sizeClasses;
+
+        // Retention and growth policy applied to the video memory pools
+        BlockRetention m_blockRetention;
+
         // Limits the amount of transient compaction buffer memory
-        uint64_t m_totalUncompactedMemory = 0;
-        uint64_t m_totalCompactedMemory = 0;
+        std::atomic<uint64_t> m_totalUncompactedMemory;
+        std::atomic<uint64_t> m_totalCompactedMemory;
+
+        // Free ids and the acceleration structure nodes, which are recycled instead of going through new/delete
+        // per build, of the ids with accelStructId % IdShardCount equal to the shard index
+        static constexpr uint32_t IdShardCount = 8;
+        struct alignas(64) IdShard
+        {
+            std::mutex            lock;
+            std::queue<uint64_t>  freeIds;
+            std::atomic<uint64_t> freeIdCount{ 0 };
+            NodePool<T, 256>      accelStructPool;
+        };
+
+        AccelStructTable<T>  m_asBufferBuildQueue;
+        IdShard              m_idShards[IdShardCount];
+
+        // Fixed scratch budget shared by all builds and refits, 0 keeps one scratch suballocation per acceleration structure
+        uint64_t             m_scratchBudget = 0;
+        ScratchRing          m_scratchRing;
+        std::mutex           m_scratchRingLock;
+
+        // Fence tracked pipeline stages, each in submission order
+        std::deque<PipelineEntry> m_pipelineBuilds;
+        std::deque<PipelineEntry> m_pipelineSizeCopies;
+        std::deque<PipelineEntry> m_pipelineCompactions;
+        uint64_t                  m_pipelineSerial = 0;
+        std::mutex                m_pipelineLock;
+
+        // Compactions per recording are capped by these, 0 is unlimited. Held back ids wait in the backlog
+        uint64_t                  m_compactionByteBudget  = 0;
+        uint64_t                  m_compactionCountBudget = 0;
+        std::vector<uint64_t>     m_compactionBacklog;
+
+        // Live bottom level acceleration structures by build inputs, only filled while build deduplication is enabled
+        bool                      m_buildDeduplication = false;
+        std::unordered_map<BuildInputKey,
+                           uint64_t,
+                           BuildInputKeyHash> m_deduplicationTable;
+        std::mutex                m_deduplicationLock;
+
+        // Refits in a row before the next one turns into a rebuild, 0 is unlimited
+        uint32_t                  m_maxRefitsBeforeRebuild = 0;
+        double                    m_topLevelRebuildRatio   = DefaultTopLevelRebuildRatio;
+
+        // Handed to every pool, outlives them since the pools belong to the derived manager
+        TelemetrySink             m_telemetrySink;
 
-        std::vector<T*> m_asBufferBuildQueue;
-        std::queue<uint64_t> m_asIdFreeList;
-        // Increment by 1 the asId by the reserved id that can't be used
-        uint64_t m_asId = ReservedId + 1;
+        AllocationTraceWriter     m_allocationTrace;
 
-        std::mutex m_threadSafeLock;
+        // Timestamp query pairs in flight in recording order, results wait in m_gpuTimings until they're taken
+        bool                       m_gpuTiming          = false;
+        double                     m_gpuTimestampPeriod = 0.0;
+        uint32_t                   m_nextGpuTimingQuery = 0;
+        std::deque<GpuTimingBatch> m_gpuTimingBatches;
+        std::vector<GpuTiming>     m_gpuTimings;
+        GpuPhaseTiming             m_gpuPhaseTimings[static_cast<uint32_t>(GpuTimingPhase::Count)];
+        std::mutex                 m_gpuTimingLock;
 
         Level m_logVerbosity;
     };
-}
\ No newline at end of file
+}
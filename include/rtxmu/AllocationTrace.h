@@ -0,0 +1,202 @@
+/*
+* Copyright (c) 2024 NVIDIA CORPORATION. All rights reserved
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cinttypes>
+#include <cstring>
+#include <mutex>
+#include <stdio.h>
+#include <vector>
+
+namespace rtxmu
+{
+    // An allocation trace is an AllocationTraceHeader followed by AllocationTraceRecords up to the end of the
+    // file, in the order the manager saw the calls. Records are only ever appended so a trace cut short by a
+    // crash is still readable up to the last complete record
+    constexpr char     AllocationTraceMagic[8] = { 'R', 'T', 'X', 'M', 'U', 'T', 'R', 'C' };
+    constexpr uint32_t AllocationTraceVersion  = 1;
+
+    struct AllocationTraceHeader
+    {
+        char     magic[8]   = {};
+        uint32_t version    = 0;
+        uint32_t recordSize = 0;
+        // Suballocator block size the trace was recorded with
+        uint64_t blockSize  = 0;
+    };
+
+    enum class AllocationTraceRecordType : uint32_t
+    {
+        // size and secondarySize are the result and scratch size from the prebuild info
+        Build,
+        // Refits carry the update scratch size in size, rebuilds are flagged and carry the same sizes as builds
+        Update,
+        // size is the compacted size and secondarySize the size of the result it was compacted from
+        Compaction,
+        // Build memory got released, along with the result of compacted acceleration structures
+        GarbageCollection,
+        // All memory of the acceleration structure got released
+        Remove,
+        // size is the size of the compacted acceleration structure deserialized into
+        Deserialize,
+        // The manager advanced a frame
+        Frame
+    };
+
+    constexpr uint32_t AllocationTraceAllowCompaction = 0x1;
+    constexpr uint32_t AllocationTraceAllowUpdate     = 0x2;
+    constexpr uint32_t AllocationTraceRebuild         = 0x4;
+    // The rebuild outgrew its result memory and got a new result allocation
+    constexpr uint32_t AllocationTraceReallocated     = 0x8;
+
+    struct AllocationTraceRecord
+    {
+        AllocationTraceRecordType type          = AllocationTraceRecordType::Frame;
+        uint32_t                  flags         = 0;
+        uint64_t                  accelStructId = 0;
+        uint64_t                  size          = 0;
+        uint64_t                  secondarySize = 0;
+    };
+
+    // Buffers records and appends them to the trace file in large writes so recording stays cheap.
+    // The buffer is also written out with every frame so a crash loses at most the current frame
+    class AllocationTraceWriter
+    {
+    public:
+
+        ~AllocationTraceWriter()
+        {
+            close();
+        }
+
+        // Returns false if the trace file couldn't be created
+        bool open(const char* path, uint64_t blockSize)
+        {
+            close();
+
+            std::lock_guard<std::mutex> guard(m_lock);
+
+            m_file = fopen(path, "wb");
+            if (m_file == nullptr)
+            {
+                return false;
+            }
+
+            AllocationTraceHeader header;
+            memcpy(header.magic, AllocationTraceMagic, sizeof(header.magic));
+            header.version    = AllocationTraceVersion;
+            header.recordSize = sizeof(AllocationTraceRecord);
+            header.blockSize  = blockSize;
+            fwrite(&header, sizeof(header), 1, m_file);
+
+            m_buffer.reserve(BufferedRecordCount);
+            m_isOpen = true;
+            return true;
+        }
+
+        void close()
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+
+            if (m_file != nullptr)
+            {
+                flush();
+                fclose(m_file);
+                m_file = nullptr;
+            }
+            m_isOpen = false;
+        }
+
+        // Checked before building a record so a manager without a trace only pays for this load
+        bool isOpen() const
+        {
+            return m_isOpen.load(std::memory_order_relaxed);
+        }
+
+        void write(const AllocationTraceRecord& record)
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+
+            // Closed by another thread after the isOpen check
+            if (m_file == nullptr)
+            {
+                return;
+            }
+
+            m_buffer.push_back(record);
+            if ((m_buffer.size() == BufferedRecordCount) ||
+                (record.type == AllocationTraceRecordType::Frame))
+            {
+                flush();
+            }
+        }
+
+    private:
+
+        static constexpr size_t BufferedRecordCount = 4096;
+
+        void flush()
+        {
+            if (m_buffer.empty() == false)
+            {
+                fwrite(m_buffer.data(), sizeof(AllocationTraceRecord), m_buffer.size(), m_file);
+                fflush(m_file);
+                m_buffer.clear();
+            }
+        }
+
+        FILE*                              m_file = nullptr;
+        std::vector<AllocationTraceRecord> m_buffer;
+        std::atomic<bool>                  m_isOpen = { false };
+        std::mutex                         m_lock;
+    };
+
+    // Reads a whole trace for offline replay, returns false if the file isn't a trace of this version
+    inline bool ReadAllocationTrace(const char*                         path,
+                                    AllocationTraceHeader&              header,
+                                    std::vector<AllocationTraceRecord>& records)
+    {
+        FILE* file = fopen(path, "rb");
+        if (file == nullptr)
+        {
+            return false;
+        }
+
+        const bool isTrace = (fread(&header, sizeof(header), 1, file) == 1) &&
+                             (memcmp(header.magic, AllocationTraceMagic, sizeof(header.magic)) == 0) &&
+                             (header.version    == AllocationTraceVersion) &&
+                             (header.recordSize == sizeof(AllocationTraceRecord));
+        if (isTrace)
+        {
+            AllocationTraceRecord record;
+            while (fread(&record, sizeof(record), 1, file) == 1)
+            {
+                records.push_back(record);
+            }
+        }
+
+        fclose(file);
+        return isTrace;
+    }
+}
@@ -24,17 +24,60 @@
 
 #include "AccelStructManager.h"
 #include "D3D12Suballocator.h"
+#include "PrebuildInfoCache.h"
+#include <unordered_map>
 
 namespace rtxmu
 {
+    // Memory a top level acceleration structure moved away from, released once the GPU passed fenceValue
+    struct DxRetiredTopLevelMemory
+    {
+        uint64_t fenceValue = 0;
+        Suballocator<Allocator, D3D12AccelStructBlock>::SubAllocation resultGpuMemory;
+        Suballocator<Allocator, D3D12ScratchBlock>::SubAllocation scratchGpuMemory;
+        Suballocator<Allocator, D3D12ScratchBlock>::SubAllocation updateGpuMemory;
+        std::vector<Suballocator<Allocator, D3D12UploadBlock>::SubAllocation> instanceMemory;
+    };
+
+    // Top level acceleration structure created by CreateTopLevel, built from instances the manager uploads
+    struct DxTopLevel
+    {
+        explicit DxTopLevel(const uint32_t instanceCapacity) : instances(instanceCapacity) {}
+
+        TopLevelInstances<D3D12_RAYTRACING_INSTANCE_DESC,
+                          Suballocator<Allocator, D3D12UploadBlock>::SubAllocation> instances;
+        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_NONE;
+        // Signaled once the last recorded build completed
+        uint64_t lastFenceValue = 0;
+        std::vector<DxRetiredTopLevelMemory> retiredMemory;
+    };
+
     struct DxAccelerationStructure : AccelerationStructure
     {
         Suballocator<Allocator, D3D12ScratchBlock>::SubAllocation updateGpuMemory;
         Suballocator<Allocator, D3D12ScratchBlock>::SubAllocation scratchGpuMemory;
         Suballocator<Allocator, D3D12AccelStructBlock>::SubAllocation resultGpuMemory;
         Suballocator<Allocator, D3D12CompactedAccelStructBlock>::SubAllocation compactionGpuMemory;
+        // Previous compacted location after a defragmentation move, released by garbage collection
+        Suballocator<Allocator, D3D12CompactedAccelStructBlock>::SubAllocation defragSourceMemory;
+        // Result and scratch a rebuild outgrew, released by garbage collection once the GPU is done with them
+        std::vector<Suballocator<Allocator, D3D12AccelStructBlock>::SubAllocation> retiredResultMemory;
+        std::vector<Suballocator<Allocator, D3D12ScratchBlock>::SubAllocation> retiredScratchMemory;
         Suballocator<Allocator, D3D12ReadBackBlock>::SubAllocation compactionSizeCpuMemory;
         Suballocator<Allocator, D3D12CompactionWriteBlock>::SubAllocation compactionSizeGpuMemory;
+        // Serialized size and serialized copy while serializing, uploaded blob until garbage collection after deserializing
+        Suballocator<Allocator, D3D12CompactionWriteBlock>::SubAllocation serializedSizeGpuMemory;
+        Suballocator<Allocator, D3D12ReadBackBlock>::SubAllocation serializedSizeCpuMemory;
+        Suballocator<Allocator, D3D12ScratchBlock>::SubAllocation serializedGpuMemory;
+        Suballocator<Allocator, D3D12ReadBackBlock>::SubAllocation serializedCpuMemory;
+        Suballocator<Allocator, D3D12UploadBlock>::SubAllocation deserializedUploadMemory;
+        uint64_t serializedSize = 0;
+        // Signaled once the serialized size query completed on the GPU
+        uint64_t serializedSizeFenceValue = 0;
+        // Signaled once the serialize copy completed on the GPU
+        uint64_t serializeFenceValue = 0;
+        // Only set for top level acceleration structures created by CreateTopLevel
+        std::unique_ptr<DxTopLevel> topLevel;
     };
 
     class DxAccelStructManager : public AccelStructManager<DxAccelerationStructure>
@@ -44,25 +87,80 @@ namespace rtxmu
         DxAccelStructManager(ID3D12Device5* device,
                              Level          verbosity = Level::DISABLED);
 
-        // Initializes suballocator block size
-        void Initialize(uint32_t suballocatorBlockSize = DefaultSuballocatorBlockSize);
+        ~DxAccelStructManager();
+
+        // Initializes suballocator block size. A non zero scratch budget caps build scratch memory by sharing one
+        // scratch buffer of that size between all builds, separated by UAV barriers whenever it wraps around.
+        // Refits draw their update scratch from it as well instead of holding on to it between refits.
+        // Recording builds with a scratch budget is serialized and must stay on a single queue
+        void Initialize(uint32_t suballocatorBlockSize = DefaultSuballocatorBlockSize,
+                        uint64_t scratchBudget         = 0);
 
         // Resets all queues and frees all memory in suballocators
         void Reset();
 
-        // Receives acceleration structure inputs and returns a command list with build commands
-        void PopulateUpdateCommandList(ID3D12GraphicsCommandList4*                                 commandList,
+        // Receives acceleration structure inputs and returns a command list with build commands.
+        // Returns false if a rebuild ran out of memory, the previous build is kept for those. Rebuilds of
+        // acceleration structures shared by build deduplication are skipped and make it return false as well.
+        // Refits turn into rebuilds when due by the refit policy, see SetRefitPolicy and RequestRebuild.
+        // Rebuilds that outgrow their memory move to new memory, pass their ids to GarbageCollection once the
+        // GPU is done with the previous build to release the old memory, otherwise it goes on removal
+        bool PopulateUpdateCommandList(ID3D12GraphicsCommandList4*                                 commandList,
                                        const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS* asInputs,
                                        const uint32_t                                              buildCount,
                                        const std::vector<uint64_t>&                                accelStructIds);
 
-        // Receives acceleration structure inputs and returns a command list with build commands
-        void PopulateBuildCommandList(ID3D12GraphicsCommandList4*                                 commandList,
+        // Receives acceleration structure inputs and returns a command list with build commands.
+        // Returns false if a build ran out of memory or ids, its id is then ReservedId and nothing was recorded.
+        // With build deduplication enabled builds matching a live acceleration structure get its id instead, so an
+        // id can show up more than once. The id lists can still be passed on as they are, every other entry point
+        // handles each acceleration structure once and RemoveAccelerationStructures drops one reference per id.
+        // Opacity micromap arrays build through here as well and share the pools and compaction of the rest
+        bool PopulateBuildCommandList(ID3D12GraphicsCommandList4*                                 commandList,
                                       const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS* asInputs,
                                       const uint64_t                                              buildCount,
                                       std::vector<uint64_t>&                                      accelStructIds);
 
-        // Returns a command list with compaction copies if the acceleration structures are ready to be compacted
+        // Creates a top level acceleration structure whose instances are kept and uploaded by the manager. It gets an
+        // id like any other and memory sized for instanceCapacity instances, 0 picks a small default, which follows
+        // the instance count with some hysteresis from there on. Compaction isn't supported and gets dropped from
+        // flags. Returns ReservedId once every id is in use
+        uint64_t CreateTopLevel(const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags,
+                                const uint32_t                                            instanceCapacity = 0);
+
+        // Sets the number of instances, instances added are zeroed until written
+        void SetTopLevelInstanceCount(const uint64_t topLevelId,
+                                      const uint32_t instanceCount);
+
+        // Writes instanceCount instance descs starting at firstInstance, within the instance count. Instance buffers
+        // only get the instances written since they were last used uploaded to them
+        void SetTopLevelInstances(const uint64_t                        topLevelId,
+                                  const uint32_t                        firstInstance,
+                                  const D3D12_RAYTRACING_INSTANCE_DESC* instanceDescs,
+                                  const uint32_t                        instanceCount);
+
+        // Records the build of a top level acceleration structure followed by a UAV barrier on it. Refits when it
+        // allows updates and few instances changed, see SetTopLevelRebuildRatio, rebuilds when the instance count
+        // changed and records nothing when no instance did. Instance buffers and memory replaced by capacity changes
+        // are reused and released once completedFenceValue shows the GPU is done with them, the commands must be
+        // submitted so that they signal submitFenceValue. The address changes along with the capacity so fetch it
+        // after each call. Returns false if it ran out of memory. The previous build is kept if that happened before
+        // the memory got replaced, otherwise the acceleration structure stays unbuilt until a later call rebuilds it,
+        // so don't trace against it after a false return
+        bool PopulateTopLevelBuildCommandList(ID3D12GraphicsCommandList4* commandList,
+                                              const uint64_t              topLevelId,
+                                              const uint64_t              completedFenceValue,
+                                              const uint64_t              submitFenceValue);
+
+        // Returns a command list with compaction copies if the acceleration structures are ready to be compacted.
+        // Ids over the compaction budget are deferred to later calls, see SetCompactionBudget. The ids compacted by
+        // this call, which includes deferred ones from earlier calls, are appended to compactedAccelStructIds. Only
+        // pass those to GarbageCollection once the copies finished, deferred ids still need their transient memory
+        void PopulateCompactionCommandList(ID3D12GraphicsCommandList4*  commandList,
+                                           const std::vector<uint64_t>& accelStructIds,
+                                           std::vector<uint64_t>&       compactedAccelStructIds);
+
+        // Same as above for callers that don't track the compacted ids
         void PopulateCompactionCommandList(ID3D12GraphicsCommandList4*  commandList,
                                            const std::vector<uint64_t>& accelStructIds);
 
@@ -70,11 +168,122 @@ namespace rtxmu
         void PopulateUAVBarriersCommandList(ID3D12GraphicsCommandList4*  commandList,
                                             const std::vector<uint64_t>& accelStructIds);
 
-        // Performs copies to bring over any compaction size data
+        // Performs copies to bring over any compaction size data. May be recorded on a copy command list, which skips
+        // the state transitions, as long as it's submitted separately from the builds it copies the sizes of
         void PopulateCompactionSizeCopiesCommandList(ID3D12GraphicsCommandList4* commandList,
                                                      const std::vector<uint64_t>& accelStructIds);
 
-        // Remove all memory that an Acceleration Structure might use
+        // Drives compaction without any manual bookkeeping. Builds handed over with TrackBuilds get their
+        // compaction size copied, get compacted and finally get their transient memory released, each
+        // step as soon as completedFenceValue shows the previous one finished. The recorded commands must
+        // be submitted so that they signal submitFenceValue
+        void Tick(ID3D12GraphicsCommandList4* commandList,
+                  const uint64_t              completedFenceValue,
+                  const uint64_t              submitFenceValue);
+
+        // Same as above with the compaction size copies recorded on copyCommandList, so they can run on a copy queue
+        // while commandList with the compactions runs on a compute queue. Builds work on compute queues as well.
+        // Both queues signal the one fence the values are compared against, submitFenceValue only once both
+        // command lists completed, e.g. by making the queue that signals it wait on the other one first
+        void Tick(ID3D12GraphicsCommandList4* commandList,
+                  ID3D12GraphicsCommandList4* copyCommandList,
+                  const uint64_t              completedFenceValue,
+                  const uint64_t              submitFenceValue);
+
+        // Moves compacted acceleration structures out of the emptiest compaction blocks with clone copies,
+        // copying at most byteBudget bytes per call so the work can be spread over frames. Moved ids are
+        // appended to movedAccelStructIds, their new address is returned right away so instance descs
+        // referencing them need patching. Pass the moved ids to GarbageCollection once the copies finished
+        // on the GPU to release their old copy, blocks get released as soon as they are emptied out.
+        // Must not overlap other calls on the manager
+        void PopulateDefragmentationCommandList(ID3D12GraphicsCommandList4* commandList,
+                                                const uint64_t              byteBudget,
+                                                std::vector<uint64_t>&      movedAccelStructIds,
+                                                const double                maxBlockOccupancy = DefaultDefragmentationOccupancy);
+
+        // Caps the video memory held by the suballocator blocks, 0 lifts the cap. Blocks that would exceed it
+        // fail to allocate unless the callback lets them through. The callback must not call back into the
+        // manager, see MemoryBudgetCallback
+        void SetMemoryBudget(const uint64_t       memoryBudget,
+                             MemoryBudgetCallback callback         = nullptr,
+                             void*                callbackUserData = nullptr);
+
+        // Returns the video memory currently held by the suballocator blocks
+        uint64_t GetAllocatedDeviceMemory();
+
+        // Queries the local video memory budget and usage the OS grants this process, returns false if unavailable
+        bool QueryVideoMemoryBudget(uint64_t& budget,
+                                    uint64_t& usage);
+
+        // Evicts blocks that hold no acceleration structures, they are made resident again once reused.
+        // Returns the number of bytes evicted
+        uint64_t EvictIdleBlocks();
+
+        // Places blocks allocated from here on as placed resources in shared heaps of heapSize bytes instead of
+        // committing a resource per block, so block creation no longer goes to the OS and the pools recycle
+        // each other's memory. The arena lives as long as the manager and keeps its heap size once enabled.
+        // Its heaps count against the memory budget in full, the blocks placed in them don't count on their own
+        void EnableHeapArena(const uint64_t heapSize = DefaultHeapArenaSize);
+
+        // Keeps emptied blocks allocated for a while and grows new blocks of pools that keep running out, so
+        // content streaming in and out doesn't allocate and free blocks every frame. See BlockRetention
+        void SetBlockRetention(const BlockRetention& retention);
+
+        // Ages retained blocks, releases the expired ones, starts the per frame telemetry counters over and
+        // delivers log messages queued by async logging. Tick calls it once per call
+        void AdvanceFrame();
+
+        // Releases every retained block right away, returns the number of bytes released
+        uint64_t TrimRetainedBlocks();
+
+        // Caps the number of input shapes whose prebuild info is cached, the cache starts over once it is full.
+        // Defaults to DefaultPrebuildInfoCacheCapacity, 0 always asks the driver
+        void SetPrebuildInfoCacheCapacity(const size_t capacity);
+
+        // Places blocks allocated from here on in heaps of an external allocator, which has to outlive them.
+        // Null goes back to committed resources
+        void SetHeapAllocator(D3D12HeapAllocator* heapAllocator);
+
+        // Creates blocks allocated from here on, and the GPU timing queries, on the node of a multi adapter device in
+        // creationNodeMask and makes the blocks visible to the creation node and the nodes in visibleNodeMask. Call
+        // before Initialize to cover every block, and before EnableHeapArena as well since placed blocks share the
+        // node masks of their heap
+        void SetNodeMask(const uint32_t creationNodeMask,
+                         const uint32_t visibleNodeMask);
+
+        // Measures every build, update, compaction size copy and compaction batch recorded from here on with a pair
+        // of timestamp queries, see GetGpuTimings. timestampFrequency is ID3D12CommandQueue::GetTimestampFrequency of
+        // the queue the batches get submitted to. Returns false if the queries couldn't be created
+        bool EnableGpuTiming(const uint64_t timestampFrequency);
+
+        // Serializes bottom level acceleration structures whose build and compaction completed on the GPU, in
+        // two steps. The first call records the serialized size queries, later calls record the serialize copies
+        // once completedFenceValue shows the size queries finished. Acceleration structures still waiting on
+        // compaction are skipped. The commands must be submitted so that they signal submitFenceValue
+        void PopulateSerializeCommandList(ID3D12GraphicsCommandList4*  commandList,
+                                          const std::vector<uint64_t>& accelStructIds,
+                                          const uint64_t               completedFenceValue,
+                                          const uint64_t               submitFenceValue);
+
+        // Fills blob with the RTXMU header and the serialized data once completedFenceValue shows the serialize copy
+        // completed on the GPU, tagged with geometryKey. Returns false while the acceleration structure isn't serialized yet
+        bool GetSerializedAccelStruct(const uint64_t        accelStructId,
+                                      const uint64_t        geometryKey,
+                                      const uint64_t        completedFenceValue,
+                                      std::vector<uint8_t>& blob);
+
+        // Returns whether a serialized blob was written by this RTXMU version for a compatible driver and device
+        bool IsSerializedAccelStructCompatible(const SerializedAccelStruct& serializedAccelStruct);
+
+        // Deserializes blobs straight into the compaction pool, skipping the build and compaction. Blobs that are
+        // incompatible or out of memory get ReservedId and make it return false. Pass the ids to GarbageCollection
+        // once the copies finished on the GPU to release the uploaded blobs. Deserialized acceleration structures
+        // are final and can't be updated or rebuilt
+        bool PopulateDeserializeCommandList(ID3D12GraphicsCommandList4*               commandList,
+                                            const std::vector<SerializedAccelStruct>& serializedAccelStructs,
+                                            std::vector<uint64_t>&                    accelStructIds);
+
+        // Remove all memory that an Acceleration Structure might use, once the last id sharing it is removed
         void RemoveAccelerationStructures(const std::vector<uint64_t>& accelStructIds);
 
         // Remove all memory used in build process, while only leaving the acceleration structure buffer itself in memory
@@ -110,12 +319,79 @@ namespace rtxmu
 
         Stats GetCompactionPoolMemoryStats();
 
+        // Returns the counters of a pool without walking its blocks, pools this backend doesn't own read all zero
+        PoolTelemetry GetPoolTelemetry(const PoolType pool);
+
         static void logCallbackFunction(const char* msg);
 
     private:
 
+        // Build inputs reduced to everything the prebuild info depends on, GPU addresses excluded
+        struct PrebuildInfoKey
+        {
+            InputDigest shape;
+
+            bool operator==(const PrebuildInfoKey& key) const { return shape == key.shape; }
+        };
+
+        struct PrebuildInfoKeyHash
+        {
+            size_t operator()(const PrebuildInfoKey& key) const;
+        };
+
+        // Fills the deduplication key of bottom level inputs, returns false for inputs that can't be shared
+        bool GetBuildInputKey(const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& asInputs,
+                              BuildInputKey&                                              key);
+
+        // Returns the prebuild info for the inputs, only asking the driver for input shapes not seen before
+        void GetPrebuildInfo(const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& asInputs,
+                             D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO&       prebuildInfo);
+
+        // Applies the block retention policy to the video memory pools
+        void ApplyBlockRetention();
+
+        // Returns the scratch address for a build, taken from the scratch budget whenever the build fits in it
+        D3D12_GPU_VIRTUAL_ADDRESS AcquireScratch(ID3D12GraphicsCommandList4* commandList,
+                                                 DxAccelerationStructure*   accelStruct,
+                                                 const uint64_t              scratchSize);
+
+        // Returns the scratch address for a refit, from the scratch budget unless the acceleration structure holds its own
+        D3D12_GPU_VIRTUAL_ADDRESS AcquireUpdateScratch(ID3D12GraphicsCommandList4* commandList,
+                                                       DxAccelerationStructure*    accelStruct);
+
+        // Writes the begin timestamp of a batch, returns false if the batch goes unmeasured
+        bool BeginGpuTiming(ID3D12GraphicsCommandList4* commandList,
+                            const GpuTimingPhase        phase,
+                            uint32_t&                   queryIndex);
+
+        // Writes the end timestamp of a batch and resolves both into the readback memory
+        void EndGpuTiming(ID3D12GraphicsCommandList4* commandList,
+                          const uint32_t              queryIndex,
+                          const uint64_t              accelStructCount,
+                          const uint64_t              bytes);
+
         void CopyCompaction(ID3D12GraphicsCommandList4* commandList,
-                            const uint64_t              accelStructId);
+                            const uint64_t              accelStructId,
+                            const uint64_t              compactionSize);
+
+        // Transitions every distinct resource once
+        void TransitionResources(ID3D12GraphicsCommandList4*   commandList,
+                                 std::vector<ID3D12Resource*>& resources,
+                                 const D3D12_RESOURCE_STATES   stateBefore,
+                                 const D3D12_RESOURCE_STATES   stateAfter);
+
+        // Moves a top level acceleration structure to memory sized for instanceCapacity instances, retiring the previous memory
+        bool AllocateTopLevelMemory(const uint64_t topLevelId,
+                                    const uint32_t instanceCapacity);
+
+        // Releases retired top level memory the GPU is done with
+        void ReleaseRetiredTopLevelMemory(DxTopLevel*    topLevel,
+                                          const uint64_t completedFenceValue);
+
+        void ReleaseSerializedMemory(DxAccelerationStructure* accelStruct);
+
+        // Releases the memory rebuilds moved away from
+        void ReleaseRetiredRebuildMemory(DxAccelerationStructure* accelStruct);
 
         void PostBuildRelease(const uint64_t accelStructId);
 
@@ -123,13 +399,33 @@ namespace rtxmu
 
         Allocator m_allocator;
 
+        // Declared ahead of the pools so it outlives the blocks placed in it
+        std::unique_ptr<D3D12HeapArena>                                                   m_heapArena;
+
         // Suballocation buffers
-        std::unique_ptr<Suballocator<Allocator, D3D12ScratchBlock>>              m_scratchPool;
-        std::unique_ptr<Suballocator<Allocator, D3D12AccelStructBlock>>          m_resultPool;
-        std::unique_ptr<Suballocator<Allocator, D3D12AccelStructBlock>>          m_transientResultPool;
-        std::unique_ptr<Suballocator<Allocator, D3D12ScratchBlock>>              m_updatePool;
-        std::unique_ptr<Suballocator<Allocator, D3D12CompactedAccelStructBlock>> m_compactionPool;
-        std::unique_ptr<Suballocator<Allocator, D3D12CompactionWriteBlock>>      m_compactionSizeGpuPool;
-        std::unique_ptr<Suballocator<Allocator, D3D12ReadBackBlock>>             m_compactionSizeCpuPool;
+        std::unique_ptr<Suballocator<Allocator, D3D12ScratchBlock>>                       m_scratchPool;
+        std::unique_ptr<SizeClassSuballocator<Allocator, D3D12AccelStructBlock>>          m_resultPool;
+        std::unique_ptr<SizeClassSuballocator<Allocator, D3D12AccelStructBlock>>          m_transientResultPool;
+        std::unique_ptr<Suballocator<Allocator, D3D12ScratchBlock>>                       m_updatePool;
+        std::unique_ptr<SizeClassSuballocator<Allocator, D3D12CompactedAccelStructBlock>> m_compactionPool;
+        std::unique_ptr<Suballocator<Allocator, D3D12CompactionWriteBlock>>               m_compactionSizeGpuPool;
+        std::unique_ptr<Suballocator<Allocator, D3D12ReadBackBlock>>                      m_compactionSizeCpuPool;
+        std::unique_ptr<Suballocator<Allocator, D3D12ScratchBlock>>                       m_serializedGpuPool;
+        std::unique_ptr<Suballocator<Allocator, D3D12ReadBackBlock>>                      m_serializedCpuPool;
+        std::unique_ptr<Suballocator<Allocator, D3D12UploadBlock>>                        m_uploadPool;
+        std::unique_ptr<Suballocator<Allocator, D3D12UploadBlock>>                        m_instancePool;
+
+        // Backing memory of the scratch budget
+        Suballocator<Allocator, D3D12ScratchBlock>::SubAllocation                         m_scratchRingMemory = {};
+
+        // Timestamp queries of GPU timing and the readback memory they resolve to, created by EnableGpuTiming
+        ID3D12QueryHeap*                                                                  m_gpuTimingQueryHeap = nullptr;
+        std::unique_ptr<Suballocator<Allocator, D3D12ReadBackBlock>>                      m_gpuTimingReadbackPool;
+        Suballocator<Allocator, D3D12ReadBackBlock>::SubAllocation                        m_gpuTimingReadbackMemory = {};
+
+        // Instanced meshes share input shapes so cache what the driver reported for them
+        PrebuildInfoCache<PrebuildInfoKey,
+                          D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO,
+                          PrebuildInfoKeyHash>                                            m_prebuildInfoCache;
     };
 }
\ No newline at end of file
@@ -23,6 +23,7 @@
 #pragma once
 
 #include "Suballocator.h"
+#include "HeapArena.h"
 #include <d3d12.h>
 #include <assert.h>
 #include <string>
@@ -31,37 +32,134 @@
 
 namespace rtxmu
 {
+    // Lets suballocator blocks be placed in heaps owned by an external allocator such as D3D12MA instead of
+    // being committed resources. allocate returns a heap range of at least size bytes and a handle that is
+    // passed back to free once the block placed in it is released
+    class D3D12HeapAllocator
+    {
+    public:
+        virtual ~D3D12HeapAllocator() = default;
+
+        virtual bool allocate(uint64_t        size,
+                              uint64_t        alignment,
+                              D3D12_HEAP_TYPE heapType,
+                              ID3D12Heap*&    heap,
+                              uint64_t&       heapOffset,
+                              void*&          handle) = 0;
+
+        virtual void free(void* handle) = 0;
+
+        // Whether the heaps are accounted against the memory budget themselves, blocks placed in them aren't then
+        virtual bool isBudgeted() const { return false; }
+    };
+
     struct Allocator
     {
-        ID3D12Device5* device;
+        ID3D12Device5*      device;
+        MemoryBudget        memoryBudget;
+        // Null commits a resource per block
+        D3D12HeapAllocator* heapAllocator = nullptr;
+        // Node of a multi adapter device the blocks get created on and the nodes they are visible to
+        uint32_t            creationNodeMask = 1;
+        uint32_t            visibleNodeMask  = 1;
+        // Sink of the manager owning the pools
+        Logger*             logger = nullptr;
     };
 
     class D3D12Block
     {
     public:
 
-        static D3D12_GPU_VIRTUAL_ADDRESS getGPUVA(D3D12Block block,
-                                                  uint64_t   offset);
+        // Served from the address cached at allocation, no call into the resource
+        static D3D12_GPU_VIRTUAL_ADDRESS getGPUVA(const D3D12Block& block,
+                                                  uint64_t          offset);
 
-        void allocate(uint64_t              size,
+        // Returns false when the memory is out of budget or couldn't be allocated
+        bool allocate(uint64_t              size,
                       D3D12_HEAP_TYPE       heapType,
                       D3D12_RESOURCE_STATES state,
                       uint32_t              alignment);
 
         void free();
 
+        // Pages the block out of video memory, only to be used while nothing references it.
+        // Residency of placed blocks is managed per heap so they always stay resident
+        bool evict();
+
+        void makeResident();
+
         uint64_t getVMA();
 
         ID3D12Resource* getResource();
 
-        static void setAllocator(Allocator* allocator);
+        void setAllocator(Allocator* allocator);
 
     protected:
-        static Allocator* m_allocator;
+        Allocator* m_allocator = nullptr;
+
+    private:
+
+        ID3D12Resource*           m_resource      = nullptr;
+        D3D12_GPU_VIRTUAL_ADDRESS m_gpuVA         = 0;
+        uint64_t                  m_budgetedSize  = 0;
+        // Heap range the resource is placed in, null for committed resources
+        D3D12HeapAllocator*       m_heapAllocator = nullptr;
+        void*                     m_heapHandle    = nullptr;
+    };
+
+    // Heap of the built in heap arena, heapKind is the D3D12_HEAP_TYPE
+    class D3D12Heap
+    {
+    public:
+
+        bool allocate(uint64_t size,
+                      uint32_t heapKind);
+
+        void free();
+
+        bool evict();
+
+        void makeResident();
+
+        ID3D12Heap* getHeap();
+
+        void setAllocator(Allocator* allocator);
+
+    private:
+        Allocator*  m_allocator    = nullptr;
+        ID3D12Heap* m_heap         = nullptr;
+        uint64_t    m_budgetedSize = 0;
+    };
+
+    // Built in heap allocator, the blocks of every pool are placed in a few large heaps per heap type
+    // which get recycled between the pools as blocks come and go
+    class D3D12HeapArena : public D3D12HeapAllocator
+    {
+    public:
+
+        D3D12HeapArena(Allocator* allocator,
+                       uint64_t   heapSize);
+
+        bool allocate(uint64_t        size,
+                      uint64_t        alignment,
+                      D3D12_HEAP_TYPE heapType,
+                      ID3D12Heap*&    heap,
+                      uint64_t&       heapOffset,
+                      void*&          handle) override;
+
+        void free(void* handle) override;
+
+        // Heaps of the default heap type reserve their whole size against the memory budget
+        bool isBudgeted() const override { return true; }
+
+        // Evicts heaps without any blocks placed in them, returns the number of bytes evicted
+        uint64_t evictIdleHeaps();
+
+        uint64_t getSize();
 
     private:
 
-        ID3D12Resource* m_resource = nullptr;
+        HeapArena<Allocator, D3D12Heap> m_arena;
     };
 
     class D3D12ScratchBlock : public D3D12Block
@@ -73,27 +171,32 @@ namespace rtxmu
 
         uint32_t getAlignment() { return alignment; }
 
-        void allocate(uint64_t size, std::string name)
+        bool allocate(uint64_t size, std::string name)
         {
-            D3D12Block::allocate(size, heapType, state, alignment);
+            if (D3D12Block::allocate(size, heapType, state, alignment) == false)
+            {
+                return false;
+            }
 
             name = std::string("RTXMU Scratch Suballocator Block #").append(name);
             std::wstring wideString(name.begin(), name.end());
             getResource()->SetName(wideString.c_str());
 
-            if (Logger::isEnabled(Level::DBG))
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
                 char buf[128];
                 snprintf(buf, sizeof buf, "RTXMU Scratch Suballocator Block Allocation of size %" PRIu64 "\n", size);
-                Logger::log(Level::DBG, buf);
+                m_allocator->logger->log(Level::DBG, buf);
             }
+
+            return true;
         }
 
         void free()
         {
-            if (Logger::isEnabled(Level::DBG))
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
-                Logger::log(Level::DBG, "RTXMU Scratch Suballocator Block Release\n");
+                m_allocator->logger->log(Level::DBG, "RTXMU Scratch Suballocator Block Release\n");
             }
             D3D12Block::free();
         }
@@ -108,27 +211,32 @@ namespace rtxmu
 
         uint32_t getAlignment() { return alignment; }
 
-        void allocate(uint64_t size, std::string name)
+        bool allocate(uint64_t size, std::string name)
         {
-            D3D12Block::allocate(size, heapType, state, alignment);
+            if (D3D12Block::allocate(size, heapType, state, alignment) == false)
+            {
+                return false;
+            }
 
             name = std::string("RTXMU Result BLAS Suballocator Block #").append(name);
             std::wstring wideString(name.begin(), name.end());
             getResource()->SetName(wideString.c_str());
 
-            if (Logger::isEnabled(Level::DBG))
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
                 char buf[128];
                 snprintf(buf, sizeof buf, "RTXMU Result BLAS Suballocator Block Allocation of size %" PRIu64 "\n", size);
-                Logger::log(Level::DBG, buf);
+                m_allocator->logger->log(Level::DBG, buf);
             }
+
+            return true;
         }
 
         void free()
         {
-            if (Logger::isEnabled(Level::DBG))
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
-                Logger::log(Level::DBG, "RTXMU Result BLAS Suballocator Block Release\n");
+                m_allocator->logger->log(Level::DBG, "RTXMU Result BLAS Suballocator Block Release\n");
             }
             D3D12Block::free();
         }
@@ -143,27 +251,32 @@ namespace rtxmu
 
         uint32_t getAlignment() { return alignment; }
 
-        void allocate(uint64_t size, std::string name)
+        bool allocate(uint64_t size, std::string name)
         {
-            D3D12Block::allocate(size, heapType, state, alignment);
+            if (D3D12Block::allocate(size, heapType, state, alignment) == false)
+            {
+                return false;
+            }
 
             name = std::string("RTXMU Compacted BLAS Suballocator Block #").append(name);
             std::wstring wideString(name.begin(), name.end());
             getResource()->SetName(wideString.c_str());
 
-            if (Logger::isEnabled(Level::DBG))
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
                 char buf[128];
                 snprintf(buf, sizeof buf, "RTXMU Compacted BLAS Suballocator Block Allocation of size %" PRIu64 "\n", size);
-                Logger::log(Level::DBG, buf);
+                m_allocator->logger->log(Level::DBG, buf);
             }
+
+            return true;
         }
 
         void free()
         {
-            if (Logger::isEnabled(Level::DBG))
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
-                Logger::log(Level::DBG, "RTXMU Compacted BLAS Suballocator Block Release\n");
+                m_allocator->logger->log(Level::DBG, "RTXMU Compacted BLAS Suballocator Block Release\n");
             }
             D3D12Block::free();
         }
@@ -178,30 +291,116 @@ namespace rtxmu
 
         uint32_t getAlignment() { return alignment; }
 
-        void allocate(uint64_t size, std::string name)
+        bool allocate(uint64_t size, std::string name)
         {
-            D3D12Block::allocate(size, heapType, state, alignment);
+            if (D3D12Block::allocate(size, heapType, state, alignment) == false)
+            {
+                return false;
+            }
 
             name = std::string("RTXMU Readback CPU Suballocator Block #").append(name);
             std::wstring wideString(name.begin(), name.end());
             getResource()->SetName(wideString.c_str());
 
-            if (Logger::isEnabled(Level::DBG))
+            // Readback heaps may stay mapped, so the block gets mapped once instead of on every read
+            if (FAILED(getResource()->Map(0, nullptr, reinterpret_cast<void**>(&m_mappedData))))
+            {
+                m_mappedData = nullptr;
+                D3D12Block::free();
+                return false;
+            }
+
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
                 char buf[128];
                 snprintf(buf, sizeof buf, "RTXMU Readback CPU Suballocator Block Allocation of size %" PRIu64 "\n", size);
-                Logger::log(Level::DBG, buf);
+                m_allocator->logger->log(Level::DBG, buf);
+            }
+
+            return true;
+        }
+
+        void free()
+        {
+            if (m_allocator->logger->isEnabled(Level::DBG))
+            {
+                m_allocator->logger->log(Level::DBG, "RTXMU Readback CPU Suballocator Block Release\n");
+            }
+
+            // Nothing got written by the CPU
+            D3D12_RANGE writtenRange{ 0, 0 };
+            getResource()->Unmap(0, &writtenRange);
+            m_mappedData = nullptr;
+
+            D3D12Block::free();
+        }
+
+        // CPU pointer to the start of the block, only valid to read from once the GPU copies into it completed
+        const unsigned char* getMappedData() { return m_mappedData; }
+
+    private:
+
+        unsigned char* m_mappedData = nullptr;
+    };
+
+    class D3D12UploadBlock : public D3D12Block
+    {
+    public:
+        static constexpr D3D12_RESOURCE_STATES state = D3D12_RESOURCE_STATE_GENERIC_READ;
+        static constexpr D3D12_HEAP_TYPE heapType = D3D12_HEAP_TYPE_UPLOAD;
+        static constexpr uint32_t alignment = D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT;
+
+        uint32_t getAlignment() { return alignment; }
+
+        bool allocate(uint64_t size, std::string name)
+        {
+            if (D3D12Block::allocate(size, heapType, state, alignment) == false)
+            {
+                return false;
+            }
+
+            name = std::string("RTXMU Upload CPU Suballocator Block #").append(name);
+            std::wstring wideString(name.begin(), name.end());
+            getResource()->SetName(wideString.c_str());
+
+            // Upload heaps may stay mapped, nothing gets read back through the mapping
+            D3D12_RANGE readRange{ 0, 0 };
+            if (FAILED(getResource()->Map(0, &readRange, reinterpret_cast<void**>(&m_mappedData))))
+            {
+                m_mappedData = nullptr;
+                D3D12Block::free();
+                return false;
             }
+
+            if (m_allocator->logger->isEnabled(Level::DBG))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU Upload CPU Suballocator Block Allocation of size %" PRIu64 "\n", size);
+                m_allocator->logger->log(Level::DBG, buf);
+            }
+
+            return true;
         }
 
         void free()
         {
-            if (Logger::isEnabled(Level::DBG))
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
-                Logger::log(Level::DBG, "RTXMU Readback CPU Suballocator Block Release\n");
+                m_allocator->logger->log(Level::DBG, "RTXMU Upload CPU Suballocator Block Release\n");
             }
+
+            getResource()->Unmap(0, nullptr);
+            m_mappedData = nullptr;
+
             D3D12Block::free();
         }
+
+        // CPU pointer to the start of the block, written data is visible to GPU work submitted afterwards
+        unsigned char* getMappedData() { return m_mappedData; }
+
+    private:
+
+        unsigned char* m_mappedData = nullptr;
     };
 
     class D3D12CompactionWriteBlock : public D3D12Block
@@ -213,27 +412,32 @@ namespace rtxmu
 
         uint32_t getAlignment() { return alignment; }
 
-        void allocate(uint64_t size, std::string name)
+        bool allocate(uint64_t size, std::string name)
         {
-            D3D12Block::allocate(size, heapType, state, alignment);
+            if (D3D12Block::allocate(size, heapType, state, alignment) == false)
+            {
+                return false;
+            }
 
             name = std::string("RTXMU Compaction Size GPU Suballocator Block #").append(name);
             std::wstring wideString(name.begin(), name.end());
             getResource()->SetName(wideString.c_str());
 
-            if (Logger::isEnabled(Level::DBG))
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
                 char buf[128];
                 snprintf(buf, sizeof buf, "RTXMU Compaction Size GPU Suballocator Block Allocation of size %" PRIu64 "\n", size);
-                Logger::log(Level::DBG, buf);
+                m_allocator->logger->log(Level::DBG, buf);
             }
+
+            return true;
         }
 
         void free()
         {
-            if (Logger::isEnabled(Level::DBG))
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
-                Logger::log(Level::DBG, "RTXMU Compaction Size GPU Suballocator Block Release\n");
+                m_allocator->logger->log(Level::DBG, "RTXMU Compaction Size GPU Suballocator Block Release\n");
             }
             D3D12Block::free();
         }
@@ -248,27 +452,32 @@ namespace rtxmu
 
         uint32_t getAlignment() { return alignment; }
 
-        void allocate(uint64_t size, std::string name)
+        bool allocate(uint64_t size, std::string name)
         {
-            D3D12Block::allocate(size, heapType, state, alignment);
+            if (D3D12Block::allocate(size, heapType, state, alignment) == false)
+            {
+                return false;
+            }
 
             name = std::string("RTXMU Upload to CPU Suballocator Block #").append(name);
             std::wstring wideString(name.begin(), name.end());
             getResource()->SetName(wideString.c_str());
 
-            if (Logger::isEnabled(Level::DBG))
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
                 char buf[128];
                 snprintf(buf, sizeof buf, "RTXMU Upload CPU Suballocator Block Allocation of size %" PRIu64 "\n", size);
-                Logger::log(Level::DBG, buf);
+                m_allocator->logger->log(Level::DBG, buf);
             }
+
+            return true;
         }
 
         void free()
         {
-            if (Logger::isEnabled(Level::DBG))
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
-                Logger::log(Level::DBG, "RTXMU Upload to CPU Suballocator Block Release\n");
+                m_allocator->logger->log(Level::DBG, "RTXMU Upload to CPU Suballocator Block Release\n");
             }
             D3D12Block::free();
         }
@@ -283,27 +492,32 @@ namespace rtxmu
 
         uint32_t getAlignment() { return alignment; }
 
-        void allocate(uint64_t size, std::string name)
+        bool allocate(uint64_t size, std::string name)
         {
-            D3D12Block::allocate(size, heapType, state, alignment);
+            if (D3D12Block::allocate(size, heapType, state, alignment) == false)
+            {
+                return false;
+            }
 
             name = std::string("RTXMU Upload to GPU Suballocator Block #").append(name);
             std::wstring wideString(name.begin(), name.end());
             getResource()->SetName(wideString.c_str());
 
-            if (Logger::isEnabled(Level::DBG))
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
                 char buf[128];
                 snprintf(buf, sizeof buf, "RTXMU Upload GPU Suballocator Block Allocation of size %" PRIu64 "\n", size);
-                Logger::log(Level::DBG, buf);
+                m_allocator->logger->log(Level::DBG, buf);
             }
+
+            return true;
         }
 
         void free()
         {
-            if (Logger::isEnabled(Level::DBG))
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
-                Logger::log(Level::DBG, "RTXMU Upload to GPU Suballocator Block Release\n");
+                m_allocator->logger->log(Level::DBG, "RTXMU Upload to GPU Suballocator Block Release\n");
             }
             D3D12Block::free();
         }
@@ -0,0 +1,306 @@
+/*
+* Copyright (c) 2024 NVIDIA CORPORATION. All rights reserved
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "Logger.h"
+#include "NodePool.h"
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <stdio.h>
+
+namespace rtxmu
+{
+    // Carves large backend heaps into placements for suballocator blocks, turning block creation into a cheap
+    // placement and letting all pools recycle the same memory. The Heap type has to implement
+    // bool allocate(uint64_t size, uint32_t heapKind), free(), bool evict() and makeResident(). heapKind tells
+    // apart heaps that can't be shared, like D3D12 heap types or Vulkan memory types
+    template<typename AllocatorType, typename Heap>
+    class HeapArena
+    {
+    public:
+
+        struct HeapDesc
+        {
+            Heap     heap;
+            uint32_t heapKind  = 0;
+            uint64_t size      = 0;
+            uint64_t usedSize  = 0;
+            bool     isEvicted = false;
+
+            // Free ranges keyed by offset so released placements coalesce with their neighbors
+            std::map<uint64_t, uint64_t> freeRanges;
+        };
+
+        // Heap range backing a single suballocator block
+        struct Placement
+        {
+            Heap*     heap;
+            uint64_t  offset;
+            uint64_t  size;
+            HeapDesc* heapDesc;
+        };
+
+        HeapArena(uint64_t       heapSize,
+                  uint64_t       placementAlignment,
+                  AllocatorType* allocator)
+        {
+            m_heapSize           = heapSize;
+            m_placementAlignment = placementAlignment;
+            m_allocator          = allocator;
+        }
+
+        ~HeapArena()
+        {
+            std::lock_guard<std::mutex> guard(m_threadSafeLock);
+
+            for (HeapDesc* heapDesc : m_heaps)
+            {
+                heapDesc->heap.free();
+                m_heapDescPool.release(heapDesc);
+            }
+            m_heaps.clear();
+        }
+
+        // Returns null when no heap range could be found or allocated
+        Placement* allocate(uint64_t unalignedSize,
+                            uint64_t alignment,
+                            uint32_t heapKind)
+        {
+            if (alignment > m_placementAlignment)
+            {
+                if (m_allocator->logger->isEnabled(Level::ERR))
+                {
+                    char buf[128];
+                    snprintf(buf, sizeof buf, "RTXMU Heap Arena can't place an alignment of %" PRIu64 "\n", alignment);
+                    m_allocator->logger->log(Level::ERR, buf);
+                }
+                return nullptr;
+            }
+
+            const uint64_t size = align(unalignedSize, m_placementAlignment);
+
+            std::lock_guard<std::mutex> guard(m_threadSafeLock);
+
+            // First fit keeps placements packed towards the front of the oldest heaps
+            HeapDesc* heapDesc = nullptr;
+            uint64_t  offset   = 0;
+            for (HeapDesc* candidate : m_heaps)
+            {
+                if ((candidate->heapKind != heapKind) ||
+                    (candidate->size - candidate->usedSize < size))
+                {
+                    continue;
+                }
+
+                for (const auto& freeRange : candidate->freeRanges)
+                {
+                    if (freeRange.second >= size)
+                    {
+                        heapDesc = candidate;
+                        offset   = freeRange.first;
+                        break;
+                    }
+                }
+
+                if (heapDesc != nullptr)
+                {
+                    break;
+                }
+            }
+
+            if (heapDesc == nullptr)
+            {
+                heapDesc = createHeap(std::max(m_heapSize, size), heapKind);
+                if (heapDesc == nullptr)
+                {
+                    return nullptr;
+                }
+                offset = 0;
+            }
+
+            // Idle heaps may have been evicted, bring them back before placing anything in them
+            if (heapDesc->isEvicted)
+            {
+                heapDesc->heap.makeResident();
+                heapDesc->isEvicted = false;
+            }
+
+            auto           freeRangeIter = heapDesc->freeRanges.find(offset);
+            const uint64_t freeRangeSize = freeRangeIter->second;
+            heapDesc->freeRanges.erase(freeRangeIter);
+
+            if (freeRangeSize > size)
+            {
+                heapDesc->freeRanges.emplace(offset + size, freeRangeSize - size);
+            }
+            heapDesc->usedSize += size;
+
+            return m_placementPool.allocate(&heapDesc->heap, offset, size, heapDesc);
+        }
+
+        void free(Placement* placement)
+        {
+            std::lock_guard<std::mutex> guard(m_threadSafeLock);
+
+            HeapDesc* heapDesc = placement->heapDesc;
+            uint64_t  offset   = placement->offset;
+            uint64_t  size     = placement->size;
+            m_placementPool.release(placement);
+
+            heapDesc->usedSize -= size;
+
+            // Coalesce with the neighboring free ranges
+            auto nextRange = heapDesc->freeRanges.lower_bound(offset);
+            if ((nextRange != heapDesc->freeRanges.end()) &&
+                (nextRange->first == offset + size))
+            {
+                size += nextRange->second;
+                nextRange = heapDesc->freeRanges.erase(nextRange);
+            }
+            if (nextRange != heapDesc->freeRanges.begin())
+            {
+                auto prevRange = std::prev(nextRange);
+                if (prevRange->first + prevRange->second == offset)
+                {
+                    offset = prevRange->first;
+                    size  += prevRange->second;
+                    heapDesc->freeRanges.erase(prevRange);
+                }
+            }
+            heapDesc->freeRanges.emplace(offset, size);
+
+            // Keep one empty heap of each kind around so the next block creation stays a placement
+            if (heapDesc->usedSize == 0)
+            {
+                for (HeapDesc* otherHeapDesc : m_heaps)
+                {
+                    if ((otherHeapDesc != heapDesc) &&
+                        (otherHeapDesc->heapKind == heapDesc->heapKind) &&
+                        (otherHeapDesc->usedSize == 0))
+                    {
+                        releaseHeap(heapDesc);
+                        break;
+                    }
+                }
+            }
+        }
+
+        // Evicts heaps without any placements, returns the number of bytes evicted
+        uint64_t evictIdleHeaps()
+        {
+            std::lock_guard<std::mutex> guard(m_threadSafeLock);
+
+            uint64_t evictedSize = 0;
+            for (HeapDesc* heapDesc : m_heaps)
+            {
+                if ((heapDesc->usedSize  == 0) &&
+                    (heapDesc->isEvicted == false) &&
+                    (heapDesc->heap.evict()))
+                {
+                    heapDesc->isEvicted = true;
+                    evictedSize += heapDesc->size;
+                }
+            }
+            return evictedSize;
+        }
+
+        uint64_t getSize()
+        {
+            std::lock_guard<std::mutex> guard(m_threadSafeLock);
+
+            uint64_t size = 0;
+            for (HeapDesc* heapDesc : m_heaps)
+            {
+                size += heapDesc->size;
+            }
+            return size;
+        }
+
+        uint64_t getUsedSize()
+        {
+            std::lock_guard<std::mutex> guard(m_threadSafeLock);
+
+            uint64_t usedSize = 0;
+            for (HeapDesc* heapDesc : m_heaps)
+            {
+                usedSize += heapDesc->usedSize;
+            }
+            return usedSize;
+        }
+
+    private:
+
+        uint64_t align(uint64_t size, uint64_t alignment)
+        {
+            return ((size + (alignment - 1)) & ~(alignment - 1));
+        }
+
+        HeapDesc* createHeap(uint64_t heapSize, uint32_t heapKind)
+        {
+            HeapDesc* heapDesc = m_heapDescPool.allocate();
+            heapDesc->heap.setAllocator(m_allocator);
+            if (heapDesc->heap.allocate(heapSize, heapKind) == false)
+            {
+                m_heapDescPool.release(heapDesc);
+
+                if (m_allocator->logger->isEnabled(Level::ERR))
+                {
+                    char buf[128];
+                    snprintf(buf, sizeof buf, "RTXMU Heap Arena Heap Allocation of size %" PRIu64 " failed\n", heapSize);
+                    m_allocator->logger->log(Level::ERR, buf);
+                }
+                return nullptr;
+            }
+            heapDesc->heapKind = heapKind;
+            heapDesc->size     = heapSize;
+            heapDesc->freeRanges.emplace(0, heapSize);
+            m_heaps.push_back(heapDesc);
+
+            if (m_allocator->logger->isEnabled(Level::DBG))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU Heap Arena Heap Allocation of size %" PRIu64 "\n", heapSize);
+                m_allocator->logger->log(Level::DBG, buf);
+            }
+            return heapDesc;
+        }
+
+        void releaseHeap(HeapDesc* heapDesc)
+        {
+            m_heaps.erase(std::find(m_heaps.begin(), m_heaps.end(), heapDesc));
+
+            heapDesc->heap.free();
+            m_heapDescPool.release(heapDesc);
+        }
+
+        uint64_t                   m_heapSize           = 0;
+        uint64_t                   m_placementAlignment = 0;
+        std::vector<HeapDesc*>     m_heaps;
+        NodePool<HeapDesc, 64>     m_heapDescPool;
+        NodePool<Placement, 256>   m_placementPool;
+        AllocatorType*             m_allocator          = nullptr;
+        std::mutex                 m_threadSafeLock;
+    };
+}
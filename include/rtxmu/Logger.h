@@ -22,6 +22,17 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+// Most verbose level compiled in, numbered like Level. Checks of the levels above it fold to false so their
+// message formatting compiles out, e.g. 3 keeps FATAL, ERR and WARN in shipping builds
+#ifndef RTXMU_LOG_LEVEL
+#define RTXMU_LOG_LEVEL 5
+#endif
+
 // Logger function callback which allows client to implement logging
 namespace rtxmu
 {
@@ -35,15 +46,55 @@ namespace rtxmu
         DBG
     };
 
+    // Messages delivered asynchronously are cut off at this length, terminator included
+    constexpr uint32_t MaxAsyncLogMessageLength = 128;
+
+    // Logging sink of one manager, so managers with different verbosities and callbacks don't overwrite each
+    // other. Messages go straight to the callback unless async delivery is enabled
     class Logger
     {
     public:
 
-        static Level s_loggerVerbosity;
-        static void (*s_loggerCallback)(const char*);
-        static void setLoggerSettings(Level verbosity);
-        static void setLoggerCallback(void (*loggerCallback)(const char*));
-        static void log(Level verbosity, const char* msg);
-        static bool isEnabled(Level verbosity);
+        Logger(Level verbosity = Level::DISABLED);
+
+        ~Logger();
+
+        void setLoggerSettings(Level verbosity);
+
+        void setLoggerCallback(void (*loggerCallback)(const char*));
+
+        // Queues messages in a lock free ring of capacity messages, rounded up to a power of two, instead of
+        // calling the callback from the logging thread. flush delivers them, messages logged while the ring
+        // is full get dropped and counted. 0 goes back to immediate delivery. Must not overlap logging
+        void enableAsyncDelivery(uint32_t capacity);
+
+        // Delivers the queued messages from the calling thread, may overlap logging on other threads
+        void flush();
+
+        void log(Level verbosity, const char* msg);
+
+        bool isEnabled(Level verbosity) const
+        {
+            return (static_cast<int>(verbosity) <= RTXMU_LOG_LEVEL) && (verbosity <= m_verbosity);
+        }
+
+    private:
+
+        struct Slot
+        {
+            // Position the slot is writable at, one past it once the message is written
+            std::atomic<uint64_t> sequence;
+            char                  msg[MaxAsyncLogMessageLength];
+        };
+
+        void (*m_callback)(const char*) = nullptr;
+
+        Level                   m_verbosity;
+        std::unique_ptr<Slot[]> m_slots;
+        uint64_t                m_slotMask = 0;
+        std::atomic<uint64_t>   m_enqueuePosition{0};
+        uint64_t                m_dequeuePosition = 0;
+        std::atomic<uint64_t>   m_droppedCount{0};
+        std::mutex              m_flushLock;
     };
 }// end rtxmu namespace
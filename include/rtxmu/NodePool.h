@@ -0,0 +1,188 @@
+/*
+* Copyright (c) 2024 NVIDIA CORPORATION. All rights reserved
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <new>
+#include <utility>
+#include <cinttypes>
+#include <cstddef>
+
+namespace rtxmu
+{
+    // Fixed size node allocator that carves nodes out of slabs and recycles released nodes
+    // through an intrusive free list, so steady state allocation never touches the heap.
+    // Not thread safe, the owner is expected to hold its own lock.
+    template<typename T, uint32_t NodesPerSlab = 1024>
+    class NodePool
+    {
+    public:
+
+        NodePool() = default;
+        NodePool(const NodePool&) = delete;
+        NodePool& operator=(const NodePool&) = delete;
+
+        // Live nodes are not destructed, release them before the pool goes away
+        ~NodePool() = default;
+
+        template<typename... Args>
+        T* allocate(Args&&... args)
+        {
+            if (m_freeList == nullptr)
+            {
+                addSlab();
+            }
+
+            Node* node = m_freeList;
+            m_freeList = node->next;
+            m_liveNodes++;
+
+            return new (node->storage) T{ std::forward<Args>(args)... };
+        }
+
+        void release(T* object)
+        {
+            object->~T();
+
+            Node* node = reinterpret_cast<Node*>(object);
+            node->next = m_freeList;
+            m_freeList = node;
+            m_liveNodes--;
+        }
+
+        uint64_t getLiveNodeCount() const
+        {
+            return m_liveNodes;
+        }
+
+        uint64_t getCapacity() const
+        {
+            return m_slabs.size() * NodesPerSlab;
+        }
+
+    private:
+
+        union Node
+        {
+            Node* next;
+            alignas(T) unsigned char storage[sizeof(T)];
+        };
+
+        void addSlab()
+        {
+            m_slabs.emplace_back(new Node[NodesPerSlab]);
+            Node* slab = m_slabs.back().get();
+
+            // Thread the new slab onto the free list in address order
+            for (uint32_t nodeIndex = 0; nodeIndex < NodesPerSlab; nodeIndex++)
+            {
+                slab[nodeIndex].next = (nodeIndex + 1 < NodesPerSlab) ? &slab[nodeIndex + 1] : m_freeList;
+            }
+            m_freeList = slab;
+        }
+
+        std::vector<std::unique_ptr<Node[]>> m_slabs;
+        Node*                                m_freeList  = nullptr;
+        uint64_t                             m_liveNodes = 0;
+    };
+
+    // Untyped node of NodeSize bytes, lets node based containers share a NodePool without naming their node type
+    template<size_t NodeSize>
+    struct NodeStorage
+    {
+        alignas(std::max_align_t) unsigned char bytes[NodeSize];
+    };
+
+    // Node size covering the red black tree nodes of std::map and std::set holding ValueType
+    template<typename ValueType>
+    constexpr size_t TreeNodeSize = sizeof(ValueType) + 4 * sizeof(void*);
+
+    // Standard allocator drawing the nodes of std::map, std::set and others from a NodePool, so inserting and
+    // erasing stops going to the heap once the pool has grown to the peak node count. Allocations that don't fit
+    // a node, like the bookkeeping some standard libraries allocate in debug builds, fall back to the heap.
+    // The pool has to outlive every container using it and shares its owner's lock
+    template<typename T, size_t NodeSize>
+    class NodePoolAllocator
+    {
+    public:
+
+        using value_type = T;
+        using Pool       = NodePool<NodeStorage<NodeSize>>;
+
+        template<typename U>
+        struct rebind
+        {
+            using other = NodePoolAllocator<U, NodeSize>;
+        };
+
+        explicit NodePoolAllocator(Pool* pool) : m_pool(pool)
+        {
+        }
+
+        template<typename U>
+        NodePoolAllocator(const NodePoolAllocator<U, NodeSize>& allocator) : m_pool(allocator.getPool())
+        {
+        }
+
+        T* allocate(size_t count)
+        {
+            if (fitsNode(count))
+            {
+                return reinterpret_cast<T*>(m_pool->allocate());
+            }
+            return static_cast<T*>(::operator new(count * sizeof(T)));
+        }
+
+        void deallocate(T* object, size_t count)
+        {
+            if (fitsNode(count))
+            {
+                m_pool->release(reinterpret_cast<NodeStorage<NodeSize>*>(object));
+                return;
+            }
+            ::operator delete(object);
+        }
+
+        Pool* getPool() const
+        {
+            return m_pool;
+        }
+
+        template<typename U>
+        bool operator==(const NodePoolAllocator<U, NodeSize>& allocator) const { return m_pool == allocator.getPool(); }
+
+        template<typename U>
+        bool operator!=(const NodePoolAllocator<U, NodeSize>& allocator) const { return m_pool != allocator.getPool(); }
+
+    private:
+
+        static bool fitsNode(const size_t count)
+        {
+            return (count == 1) && (sizeof(T) <= NodeSize) && (alignof(T) <= alignof(std::max_align_t));
+        }
+
+        Pool* m_pool = nullptr;
+    };
+}// end rtxmu namespace
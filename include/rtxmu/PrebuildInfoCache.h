@@ -0,0 +1,113 @@
+/*
+* Copyright (c) 2024 NVIDIA CORPORATION. All rights reserved
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cinttypes>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+namespace rtxmu
+{
+    // Prebuild infos cached until the cache is cleared on overflow
+    constexpr size_t DefaultPrebuildInfoCacheCapacity = 4096;
+
+    // Prebuild infos of the input shapes seen so far. Lookups from recording threads only share a reader lock,
+    // inserting one more shape than the capacity holds clears the cache instead of tracking recency, shapes in
+    // use get cached again on their next build
+    template<typename Key, typename Info, typename Hash>
+    class PrebuildInfoCache
+    {
+    public:
+
+        bool find(const Key& key,
+                  Info&      info) const
+        {
+            std::shared_lock<std::shared_mutex> guard(m_lock);
+
+            auto cachedInfo = m_infos.find(key);
+            if (cachedInfo == m_infos.end())
+            {
+                return false;
+            }
+            info = cachedInfo->second;
+            return true;
+        }
+
+        void insert(const Key&  key,
+                    const Info& info)
+        {
+            std::unique_lock<std::shared_mutex> guard(m_lock);
+
+            if (m_capacity == 0)
+            {
+                return;
+            }
+            if ((m_infos.size() >= m_capacity) && (m_infos.find(key) == m_infos.end()))
+            {
+                m_infos.clear();
+                m_overflowCount++;
+            }
+            m_infos.emplace(key, info);
+        }
+
+        // 0 turns caching off, a capacity below the current size clears the cache
+        void setCapacity(const size_t capacity)
+        {
+            std::unique_lock<std::shared_mutex> guard(m_lock);
+
+            m_capacity = capacity;
+            if (m_infos.size() > m_capacity)
+            {
+                m_infos.clear();
+            }
+        }
+
+        void clear()
+        {
+            std::unique_lock<std::shared_mutex> guard(m_lock);
+            m_infos.clear();
+        }
+
+        size_t size() const
+        {
+            std::shared_lock<std::shared_mutex> guard(m_lock);
+            return m_infos.size();
+        }
+
+        // Number of times the cache was cleared because it was full
+        uint64_t getOverflowCount() const
+        {
+            std::shared_lock<std::shared_mutex> guard(m_lock);
+            return m_overflowCount;
+        }
+
+    private:
+        std::unordered_map<Key, Info, Hash> m_infos;
+        size_t                              m_capacity      = DefaultPrebuildInfoCacheCapacity;
+        uint64_t                            m_overflowCount = 0;
+        mutable std::shared_mutex           m_lock;
+    };
+}// end rtxmu namespace
@@ -0,0 +1,268 @@
+/*
+* Copyright (c) 2024 NVIDIA CORPORATION. All rights reserved
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "Suballocator.h"
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+namespace rtxmu
+{
+    // Allocations of up to maxAllocationSize bytes are carved out of blocks of blockSize bytes using policy
+    struct SizeClass
+    {
+        uint64_t         maxAllocationSize = 0;
+        uint64_t         blockSize         = 0;
+        AllocationPolicy policy            = AllocationPolicy::BestFit;
+    };
+
+    // Small, medium and large classes derived from the manager block size. Tiny BLAS bump through small blocks,
+    // anything above the large class gets a dedicated block of its own
+    inline std::vector<SizeClass> GetDefaultSizeClasses(uint64_t blockSize)
+    {
+        return { { 65536,         std::max<uint64_t>(blockSize / 4, 65536), AllocationPolicy::Linear  },
+                 { blockSize / 4, blockSize,                                AllocationPolicy::BestFit },
+                 { blockSize * 2, blockSize * 4,                            AllocationPolicy::BestFit } };
+    }
+
+    // Front end routing each allocation to a suballocator sized for it, so a long tail of tiny allocations
+    // doesn't share blocks and block size with a handful of huge ones. Exposes the Suballocator interface,
+    // sub allocations are of the plain Suballocator type
+    template<typename AllocatorType, typename Block>
+    class SizeClassSuballocator
+    {
+    public:
+
+        using Pool          = Suballocator<AllocatorType, Block>;
+        using SubAllocation = typename Pool::SubAllocation;
+        using SubBlockRef   = typename Pool::SubBlockRef;
+
+        SizeClassSuballocator(const std::vector<SizeClass>& sizeClasses,
+                              uint64_t                      allocationAlignment,
+                              AllocatorType*                allocator)
+        {
+            m_allocationAlignment = allocationAlignment;
+            m_sizeClasses         = sizeClasses;
+
+            std::sort(m_sizeClasses.begin(), m_sizeClasses.end(), [](const SizeClass& a, const SizeClass& b)
+            {
+                return a.maxAllocationSize < b.maxAllocationSize;
+            });
+
+            for (SizeClass& sizeClass : m_sizeClasses)
+            {
+                // Class boundaries are compared against aligned sizes and every allocation of a class must fit a block
+                sizeClass.maxAllocationSize = align(sizeClass.maxAllocationSize, m_allocationAlignment);
+                sizeClass.blockSize         = std::max(sizeClass.blockSize, sizeClass.maxAllocationSize);
+
+                m_pools.push_back(std::make_unique<Pool>(sizeClass.blockSize, m_allocationAlignment, allocator, sizeClass.policy));
+            }
+
+            // A block size of zero turns every allocation into a dedicated block
+            m_pools.push_back(std::make_unique<Pool>(0, m_allocationAlignment, allocator));
+        }
+
+        SubAllocation allocate(uint64_t unalignedSize)
+        {
+            return getPool(align(unalignedSize, m_allocationAlignment))->allocate(unalignedSize);
+        }
+
+        // Sub blocks hold their aligned size so they map back to the class they came from
+        void free(SubBlockRef* subBlockRef)
+        {
+            getPool(subBlockRef->getSize())->free(subBlockRef);
+        }
+
+        // The classes share maxLiveBytes, so one call picks no more than a single pool would
+        uint64_t beginEvacuation(double   maxOccupancy,
+                                 uint64_t maxLiveBytes)
+        {
+            uint64_t liveBytes           = 0;
+            uint64_t evacuatedBlockCount = 0;
+            for (auto& pool : m_pools)
+            {
+                evacuatedBlockCount += pool->beginEvacuation(maxOccupancy, maxLiveBytes, liveBytes);
+            }
+            return evacuatedBlockCount;
+        }
+
+        uint64_t evictIdleBlocks()
+        {
+            uint64_t evictedSize = 0;
+            for (auto& pool : m_pools)
+            {
+                evictedSize += pool->evictIdleBlocks();
+            }
+            return evictedSize;
+        }
+
+        void setRetention(const BlockRetention& retention)
+        {
+            for (auto& pool : m_pools)
+            {
+                pool->setRetention(retention);
+            }
+        }
+
+        void nextFrame()
+        {
+            for (auto& pool : m_pools)
+            {
+                pool->nextFrame();
+            }
+        }
+
+        uint64_t trimRetainedBlocks()
+        {
+            uint64_t trimmedSize = 0;
+            for (auto& pool : m_pools)
+            {
+                trimmedSize += pool->trimRetainedBlocks();
+            }
+            return trimmedSize;
+        }
+
+        uint64_t getRetainedSize()
+        {
+            uint64_t retainedSize = 0;
+            for (auto& pool : m_pools)
+            {
+                retainedSize += pool->getRetainedSize();
+            }
+            return retainedSize;
+        }
+
+        uint64_t getEvacuatingBlockCount()
+        {
+            uint64_t evacuatingBlockCount = 0;
+            for (auto& pool : m_pools)
+            {
+                evacuatingBlockCount += pool->getEvacuatingBlockCount();
+            }
+            return evacuatingBlockCount;
+        }
+
+        uint64_t getSize()
+        {
+            uint64_t size = 0;
+            for (auto& pool : m_pools)
+            {
+                size += pool->getSize();
+            }
+            return size;
+        }
+
+        Stats const getStats()
+        {
+            Stats stats;
+
+            // Undo the per class fragmentation metric to combine the sums of squared free ranges
+            double quality = 0.0;
+            for (auto& pool : m_pools)
+            {
+                Stats poolStats = pool->getStats();
+
+                const double unusedSize = static_cast<double>(poolStats.unusedSize);
+                quality += (1.0 - poolStats.fragmentation / 100.0) * unusedSize * unusedSize;
+
+                stats.totalResidentMemorySize += poolStats.totalResidentMemorySize;
+                stats.alignmentSavings        += poolStats.alignmentSavings;
+                stats.unusedSize              += poolStats.unusedSize;
+            }
+
+            if (stats.unusedSize > 0)
+            {
+                const double unusedSize = static_cast<double>(stats.unusedSize);
+                stats.fragmentation = (1.0 - quality / (unusedSize * unusedSize)) * 100.0;
+            }
+            return stats;
+        }
+
+        void setTelemetry(PoolType             poolType,
+                          const TelemetrySink* sink)
+        {
+            for (auto& pool : m_pools)
+            {
+                pool->setTelemetry(poolType, sink);
+            }
+        }
+
+        // Sums the counters of every class. The classes peak independently so the peaks are an upper bound
+        PoolTelemetry getTelemetry()
+        {
+            PoolTelemetry telemetry;
+            for (auto& pool : m_pools)
+            {
+                const PoolTelemetry poolTelemetry = pool->getTelemetry();
+
+                telemetry.usedSize                 += poolTelemetry.usedSize;
+                telemetry.peakUsedSize             += poolTelemetry.peakUsedSize;
+                telemetry.blockSize                += poolTelemetry.blockSize;
+                telemetry.peakBlockSize            += poolTelemetry.peakBlockSize;
+                telemetry.blockCount               += poolTelemetry.blockCount;
+                telemetry.allocationCount          += poolTelemetry.allocationCount;
+                telemetry.failedAllocationCount    += poolTelemetry.failedAllocationCount;
+                telemetry.frameAllocationCount     += poolTelemetry.frameAllocationCount;
+                telemetry.frameFreeCount           += poolTelemetry.frameFreeCount;
+                telemetry.lastFrameAllocationCount += poolTelemetry.lastFrameAllocationCount;
+                telemetry.lastFrameFreeCount       += poolTelemetry.lastFrameFreeCount;
+
+                for (uint32_t bucket = 0; bucket < TelemetryHistogramBucketCount; bucket++)
+                {
+                    telemetry.sizeHistogram[bucket] += poolTelemetry.sizeHistogram[bucket];
+                }
+            }
+            return telemetry;
+        }
+
+        const std::vector<SizeClass>& getSizeClasses() const
+        {
+            return m_sizeClasses;
+        }
+
+    private:
+
+        uint64_t align(uint64_t size, uint64_t alignment)
+        {
+            return ((size + (alignment - 1)) & ~(alignment - 1));
+        }
+
+        Pool* getPool(uint64_t alignedSize)
+        {
+            for (size_t classIndex = 0; classIndex < m_sizeClasses.size(); classIndex++)
+            {
+                if (alignedSize <= m_sizeClasses[classIndex].maxAllocationSize)
+                {
+                    return m_pools[classIndex].get();
+                }
+            }
+            return m_pools.back().get();
+        }
+
+        uint64_t                           m_allocationAlignment = 0;
+        std::vector<SizeClass>             m_sizeClasses;
+        // One pool per size class followed by the dedicated pool for everything larger
+        std::vector<std::unique_ptr<Pool>> m_pools;
+    };
+}
@@ -23,8 +23,16 @@
 #pragma once
 
 #include <vector>
+#include <map>
+#include <set>
+#include <iterator>
+#include <algorithm>
+#include <string>
 #include <mutex>
+#include <atomic>
+#include <chrono>
 #include "Logger.h"
+#include "NodePool.h"
 #include <cmath>
 #include <cinttypes>
 
@@ -39,6 +47,173 @@ namespace rtxmu
         double   fragmentation = 0.0;
     };
 
+    // Pools of a manager, tells apart the pools in telemetry. Backends only own the pools they need
+    enum class PoolType : uint32_t
+    {
+        Scratch,
+        Update,
+        Result,
+        TransientResult,
+        Compaction,
+        CompactionSize,
+        CompactionSizeReadback,
+        SerializedSize,
+        Serialized,
+        SerializedReadback,
+        Upload,
+        Micromap,
+        CompactedMicromap,
+        MicromapCompactionSize,
+        Instance,
+        Count
+    };
+
+    // Bucket i of the size histogram counts live allocations of [256 << i, 512 << i) bytes, the first and
+    // last bucket also take everything smaller and larger
+    constexpr uint32_t TelemetryHistogramBucketCount = 24;
+
+    inline uint32_t GetTelemetryHistogramBucket(uint64_t size)
+    {
+        uint32_t bucket = 0;
+        while ((bucket + 1 < TelemetryHistogramBucketCount) && (size >= (512ull << bucket)))
+        {
+            bucket++;
+        }
+        return bucket;
+    }
+
+    // Counters a pool keeps up to date with every allocation, reading them doesn't walk any blocks.
+    // All sizes are expressed in bytes and allocation sizes are aligned
+    struct PoolTelemetry
+    {
+        uint64_t usedSize                 = 0;
+        uint64_t peakUsedSize             = 0;
+        uint64_t blockSize                = 0;
+        uint64_t peakBlockSize            = 0;
+        uint64_t blockCount               = 0;
+        uint64_t allocationCount          = 0;
+        uint64_t failedAllocationCount    = 0;
+        // Allocations and frees since the last frame advance and during the frame before it
+        uint64_t frameAllocationCount     = 0;
+        uint64_t frameFreeCount           = 0;
+        uint64_t lastFrameAllocationCount = 0;
+        uint64_t lastFrameFreeCount       = 0;
+        uint64_t sizeHistogram[TelemetryHistogramBucketCount] = {};
+    };
+
+    enum class TelemetryEventType : uint32_t
+    {
+        Allocate,
+        Free,
+        BlockCreate,
+        BlockDestroy,
+        // Reported by the manager once a compaction copy got recorded
+        Compaction
+    };
+
+    // Allocation events carry the sub allocation size and offset, block events the block size.
+    // Compaction events carry the id of the acceleration structure and its size before and after
+    struct TelemetryEvent
+    {
+        TelemetryEventType type          = TelemetryEventType::Allocate;
+        PoolType           pool          = PoolType::Result;
+        uint64_t           blockId       = 0;
+        uint64_t           offset        = 0;
+        uint64_t           size          = 0;
+        uint64_t           sizeBefore    = 0;
+        uint64_t           accelStructId = 0;
+    };
+
+    // Called on the thread doing the allocation while the pool is locked, so it must not call back into the
+    // manager and should do little more than copy the event into a capture buffer
+    typedef void (*TelemetryCallback)(const TelemetryEvent& event,
+                                      void*                 userData);
+
+    // Event callback shared by every suballocator of a manager, no callback skips event reporting altogether
+    struct TelemetrySink
+    {
+        TelemetryCallback callback         = nullptr;
+        void*             callbackUserData = nullptr;
+
+        void report(const TelemetryEvent& event) const
+        {
+            if (callback != nullptr)
+            {
+                callback(event, callbackUserData);
+            }
+        }
+    };
+
+    // Called when a new block would grow device memory past the budget. Returning true lets the allocation
+    // go ahead, for example after the application released memory it owns outside of RTXMU, false fails it.
+    // Called on the allocating thread while the pool is locked, so it must not call back into the manager.
+    // Memory held by the manager is freed after the failed call instead, e.g. with TrimRetainedBlocks,
+    // EvictIdleBlocks or RemoveAccelerationStructures, before the failed builds get retried
+    typedef bool (*MemoryBudgetCallback)(uint64_t requestedSize,
+                                         uint64_t allocatedSize,
+                                         uint64_t memoryBudget,
+                                         void*    userData);
+
+    // Device local block memory accounting shared by every suballocator of a manager
+    struct MemoryBudget
+    {
+        // 0 leaves device memory unlimited
+        uint64_t              budget           = 0;
+        std::atomic<uint64_t> allocatedSize    = { 0 };
+        MemoryBudgetCallback  callback         = nullptr;
+        void*                 callbackUserData = nullptr;
+
+        // Returns whether a block of size bytes may be allocated and accounts for it if so
+        bool reserve(uint64_t size)
+        {
+            const uint64_t previousSize = allocatedSize.fetch_add(size);
+
+            if ((budget != 0) && (previousSize + size > budget))
+            {
+                if ((callback == nullptr) ||
+                    (callback(size, previousSize, budget, callbackUserData) == false))
+                {
+                    allocatedSize -= size;
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        void release(uint64_t size)
+        {
+            allocatedSize -= size;
+        }
+    };
+
+    // How a suballocator picks the free range an allocation is carved from
+    enum class AllocationPolicy
+    {
+        // Smallest free range that fits, keeps fragmentation low for mixed sizes
+        BestFit,
+        // Bumps through the untouched tail of the newest block and only looks for holes once it is full,
+        // cheapest for floods of tiny allocations
+        Linear
+    };
+
+    // Controls how long emptied blocks stay allocated and how new blocks grow. The defaults release an emptied
+    // block right away unless it is the last one and keep the block size fixed
+    struct BlockRetention
+    {
+        // Number of empty blocks kept warm for upcoming allocations, 0 disables retention
+        uint64_t maxRetainedBlocks     = 0;
+        // Caps the bytes of empty blocks kept warm, 0 leaves it to maxRetainedBlocks
+        uint64_t maxRetainedBytes      = 0;
+        // Empty blocks get released after being retained for this many frames or milliseconds, checked once
+        // per frame. 0 keeps them until trimmed
+        uint64_t retentionFrames       = 0;
+        uint64_t retentionMilliseconds = 0;
+        // Every new shared block is this much larger than the previous one, 1 keeps the block size fixed
+        double   blockGrowthFactor     = 1.0;
+        // Caps block growth, 0 caps it at 8 times the configured block size
+        uint64_t maxBlockSize          = 0;
+    };
+
     // Block type default implementation to force client to implement
     template<typename AllocatorType, typename Block>
     class Suballocator
@@ -70,9 +245,25 @@ namespace rtxmu
                 SubBlock* subBlock = reinterpret_cast<SubBlock*>(this);
                 return subBlock->isFree;
             }
+
+            // Unique for the lifetime of the suballocator, ids of released blocks are never reused
+            uint64_t getBlockId()
+            {
+                SubBlock* subBlock = reinterpret_cast<SubBlock*>(this);
+                return subBlock->blockDesc->id;
+            }
+
+            // Whether the block is being emptied out by defragmentation
+            bool isEvacuating()
+            {
+                SubBlock* subBlock = reinterpret_cast<SubBlock*>(this);
+                return subBlock->blockDesc->isEvacuating;
+            }
         };
 
         // Contains the memory block, an offset and an opaque reference to a SubBlock
+        // The SubBlock reference is recycled by free() and must not be used afterwards,
+        // it is null when the allocation failed
         struct SubAllocation
         {
             Block block;
@@ -80,14 +271,16 @@ namespace rtxmu
             SubBlockRef* subBlock = nullptr;
         };
 
-        Suballocator(uint64_t blockSize,
-                     uint64_t allocationAlignment,
-                     AllocatorType* allocator)
+        Suballocator(uint64_t         blockSize,
+                     uint64_t         allocationAlignment,
+                     AllocatorType*   allocator,
+                     AllocationPolicy policy = AllocationPolicy::BestFit)
         {
             m_blockSize = blockSize;
+            m_nextBlockSize = blockSize;
             m_allocationAlignment = allocationAlignment;
-
-            Block::setAllocator(allocator);
+            m_policy = policy;
+            m_allocator = allocator;
         }
 
         virtual ~Suballocator()
@@ -99,8 +292,10 @@ namespace rtxmu
             for (uint32_t blockIndex = 0; blockIndex < blockCount; blockIndex++)
             {
                 m_blocks[blockIndex]->block.free();
+                m_blockDescPool.release(m_blocks[blockIndex]);
             }
             m_blocks.clear();
+            m_freeRanges.clear();
         }
         SubAllocation allocate(uint64_t unalignedSize)
         {
@@ -109,95 +304,121 @@ namespace rtxmu
             // Align allocation
             const uint64_t sizeInBytes = align(unalignedSize, m_allocationAlignment);
 
-            // If no previous blocks exist and if the suballocation size isn't larger than block size
-            if (m_blocks.size() == 0 && sizeInBytes <= m_blockSize)
-            {
-                uint64_t newBlockSize = sizeInBytes > m_blockSize ? sizeInBytes : m_blockSize;
-                createBlock(newBlockSize);
-            }
-
-            uint64_t numBlocks = m_blocks.size();
-
-            BlockDesc blockDesc = {};
-            SubBlock* subBlock = new SubBlock{ SubBlockRef(), 0, 0, 0, 0 };
+            SubBlock* subBlock = m_subBlockPool.allocate();
 
             // Do not suballocate if the memory request is larger than the block size
             if (sizeInBytes > m_blockSize)
             {
-                createBlock(sizeInBytes);
-                BlockDesc* block     = m_blocks[m_blocks.size() - 1];
+                BlockDesc* block     = createBlock(sizeInBytes, true);
+                if (block == nullptr)
+                {
+                    m_subBlockPool.release(subBlock);
+                    m_telemetry.failedAllocationCount++;
+                    return {};
+                }
                 subBlock->blockDesc  = block;
                 subBlock->size       = sizeInBytes;
-                subBlock->offset     = block->currentOffset;
+                subBlock->offset     = 0;
 
                 // Capture alignment padding waste
                 subBlock->unusedSize = sizeInBytes - unalignedSize;
 
-                const uint64_t offsetInBytes = block->currentOffset + sizeInBytes;
-                block->currentOffset         = offsetInBytes;
                 block->numSubBlocks++;
+                block->usedSize += sizeInBytes;
 
-                if (Logger::isEnabled(Level::DBG))
+                if (m_allocator->logger->isEnabled(Level::DBG))
                 {
-                    Logger::log(Level::DBG, "RTXMU Allocation Too Large and Can't Suballocate\n");
+                    m_allocator->logger->log(Level::DBG, "RTXMU Allocation Too Large and Can't Suballocate\n");
                 }
             }
             else
             {
-                for (uint32_t blockIndex = 0; blockIndex < numBlocks; blockIndex++)
-                {
-                    BlockDesc* block = m_blocks[blockIndex];
+                FreeRange freeRange = {};
 
-                    // Search within a block to find space for a new allocation
-                    // Modifies subBlock if able to suballocate in the block
-                    bool foundFreeSubBlock = findFreeSubBlock(block, subBlock, sizeInBytes);
+                // Linear allocations bump through the tail end of the newest block while it lasts
+                if ((m_policy == AllocationPolicy::Linear) &&
+                    (m_linearBlock != nullptr) &&
+                    (m_linearBlock->isEvacuating == false) &&
+                    (m_linearBlock->freeRanges.empty() == false))
+                {
+                    auto tailIter = std::prev(m_linearBlock->freeRanges.end());
+                    if ((tailIter->first + tailIter->second == m_linearBlock->size) &&
+                        (tailIter->second >= sizeInBytes))
+                    {
+                        freeRange = FreeRange{ tailIter->second, m_linearBlock->id, tailIter->first, m_linearBlock };
+                    }
+                }
 
-                    bool continueBlockSearch = false;
+                if (freeRange.blockDesc == nullptr)
+                {
+                    // Best fit search over the free ranges of every block
+                    auto freeRangeIter = m_freeRanges.lower_bound(FreeRange{ sizeInBytes, 0, 0, nullptr });
 
-                    // No memory reuse opportunities available so add a new suballocation
-                    if (foundFreeSubBlock == false)
+                    // No free range is large enough so add a new block which starts out as one free range
+                    if (freeRangeIter == m_freeRanges.end())
                     {
-                        const uint64_t offsetInBytes = block->currentOffset + sizeInBytes;
-
-                        // Add a suballocation to the current offset of an existing block
-                        if (offsetInBytes <= block->size)
+                        BlockDesc* newBlock = createBlock(m_nextBlockSize, false);
+                        if (newBlock == nullptr)
                         {
-                            // Only ever change the memory size if this is a new allocation
-                            subBlock->size = sizeInBytes;
-                            subBlock->offset = block->currentOffset;
-                            // Capture alignment padding waste
-                            subBlock->unusedSize = sizeInBytes - unalignedSize;
-
-                            const uint64_t memoryAlignedSize = align(subBlock->size, m_blocks[blockIndex]->block.getAlignment());
-                            m_stats.alignmentSavings += (memoryAlignedSize - subBlock->size);
-
-                            block->currentOffset = offsetInBytes;
-                            block->numSubBlocks++;
+                            m_subBlockPool.release(subBlock);
+                            m_telemetry.failedAllocationCount++;
+                            return {};
                         }
-                        // If this block can't support this allocation
-                        else
+                        m_linearBlock = newBlock;
+
+                        // A pool that keeps running out of blocks gets fewer, larger ones
+                        if (m_retention.blockGrowthFactor > 1.0)
                         {
-                            // If all blocks traversed and suballocation doesn't fit then create a new block
-                            if (blockIndex == numBlocks - 1)
-                            {
-                                // If suballocation block size is too small then do custom allocation of
-                                // individual blocks that match the resource's size
-                                uint64_t newBlockSize = sizeInBytes > m_blockSize ? sizeInBytes : m_blockSize;
-                                createBlock(newBlockSize);
-                                numBlocks++;
-                            }
-                            continueBlockSearch = true;
+                            const uint64_t maxBlockSize = (m_retention.maxBlockSize != 0) ? m_retention.maxBlockSize : 8 * m_blockSize;
+                            const uint64_t grownSize    = static_cast<uint64_t>(static_cast<double>(m_nextBlockSize) * m_retention.blockGrowthFactor);
+                            m_nextBlockSize = std::max(m_nextBlockSize, align(std::min(grownSize, maxBlockSize), m_allocationAlignment));
                         }
+                        freeRangeIter = m_freeRanges.lower_bound(FreeRange{ sizeInBytes, 0, 0, nullptr });
                     }
-                    // Assign SubBlock to the Block and discontinue suballocation search
-                    if (continueBlockSearch == false)
-                    {
-                        subBlock->blockDesc = m_blocks[blockIndex];
-                        break;
-                    }
+
+                    freeRange = *freeRangeIter;
                 }
+
+                BlockDesc* block = freeRange.blockDesc;
+
+                // Idle blocks may have been evicted, bring them back before handing out memory from them
+                if (block->isEvicted)
+                {
+                    block->block.makeResident();
+                    block->isEvicted = false;
+                }
+                if (block->isRetained)
+                {
+                    unretainBlock(block);
+                }
+
+                removeFreeRange(block, freeRange.offset, freeRange.size);
+
+                // Return the remainder of the range back to the free lists
+                if (freeRange.size > sizeInBytes)
+                {
+                    insertFreeRange(block, freeRange.offset + sizeInBytes, freeRange.size - sizeInBytes);
+                }
+                else if (m_allocator->logger->isEnabled(Level::DBG))
+                {
+                    m_allocator->logger->log(Level::DBG, "RTXMU Suballocator Perfect Match\n");
+                }
+
+                subBlock->blockDesc = block;
+                subBlock->size      = sizeInBytes;
+                subBlock->offset    = freeRange.offset;
+                // Capture alignment padding waste
+                subBlock->unusedSize = sizeInBytes - unalignedSize;
+
+                const uint64_t memoryAlignedSize = align(subBlock->size, block->block.getAlignment());
+                m_stats.alignmentSavings += (memoryAlignedSize - subBlock->size);
+
+                block->numSubBlocks++;
+                block->usedSize += sizeInBytes;
             }
 
+            recordAllocation(subBlock);
+
             // Pass a generic SubAllocation struct back to client
             return {subBlock->blockDesc->block, subBlock->offset, subBlock};
         }
@@ -206,236 +427,474 @@ namespace rtxmu
         {
             std::lock_guard<std::mutex> guard(m_threadSafeLock);
 
-            SubBlock* subBlock = reinterpret_cast<SubBlock*>(subBlockRef);
-            uint64_t blockIndex = 0;
-            for (BlockDesc* blockDesc : m_blocks)
+            // The sub block points straight back at the block that owns it
+            SubBlock*  subBlock  = reinterpret_cast<SubBlock*>(subBlockRef);
+            BlockDesc* blockDesc = subBlock->blockDesc;
+
+            subBlock->isFree = true;
+
+            recordFree(subBlock);
+
+            // Release the big chunks that are a single resource
+            if (blockDesc->isDedicated)
             {
-                if (blockDesc->block.getVMA() == subBlock->blockDesc->block.getVMA())
+                releaseBlock(blockDesc);
+                m_subBlockPool.release(subBlock);
+
+                if (m_allocator->logger->isEnabled(Level::DBG))
                 {
-                    const uint64_t memoryAlignedSize = align(subBlock->size, blockDesc->block.getAlignment());
+                    m_allocator->logger->log(Level::DBG, "RTXMU Deallocation of oversized block\n");
+                }
+                return;
+            }
 
-                    subBlock->isFree = true;
+            const uint64_t memoryAlignedSize = align(subBlock->size, blockDesc->block.getAlignment());
+            m_stats.alignmentSavings -= (memoryAlignedSize - subBlock->size);
 
-                    // Release the big chunks that are a single resource
-                    if (subBlock->size == blockDesc->size)
-                    {
-                        blockDesc->block.free();
-                        m_blocks.erase(m_blocks.begin() + blockIndex);
+            // Merge with the neighboring free ranges so holes coalesce back into larger ranges
+            uint64_t offset = subBlock->offset;
+            uint64_t size   = subBlock->size;
 
-                        if (Logger::isEnabled(Level::DBG))
-                        {
-                            Logger::log(Level::DBG, "RTXMU Deallocation of oversized block\n");
-                        }
-                    }
-                    else
-                    {
-                        struct SubBlock freeSubBlock = { SubBlockRef(),
-                                                         subBlock->blockDesc,
-                                                         subBlock->offset,
-                                                         subBlock->size };
+            auto nextIter = blockDesc->freeRanges.lower_bound(offset);
+            if ((nextIter != blockDesc->freeRanges.end()) &&
+                (nextIter->first == offset + size))
+            {
+                size += nextIter->second;
+                removeFreeRange(blockDesc, nextIter->first, nextIter->second);
+                nextIter = blockDesc->freeRanges.lower_bound(offset);
+            }
+            if (nextIter != blockDesc->freeRanges.begin())
+            {
+                auto prevIter = std::prev(nextIter);
+                if (prevIter->first + prevIter->second == offset)
+                {
+                    offset = prevIter->first;
+                    size  += prevIter->second;
+                    removeFreeRange(blockDesc, prevIter->first, prevIter->second);
+                }
+            }
+            insertFreeRange(blockDesc, offset, size);
 
-                        blockDesc->freeSubBlocks.push_back(freeSubBlock);
+            if ((size != subBlock->size) && m_allocator->logger->isEnabled(Level::DBG))
+            {
+                m_allocator->logger->log(Level::DBG, "RTXMU Suballocator Merging Free Blocks\n");
+            }
 
-                        m_stats.alignmentSavings -= (memoryAlignedSize - subBlock->size);
+            blockDesc->numSubBlocks--;
+            blockDesc->usedSize -= subBlock->size;
 
-                        blockDesc->numSubBlocks--;
+            // The sub block node is recycled so the client reference is no longer valid past this point
+            m_subBlockPool.release(subBlock);
 
-                        // If this suballocation was the final remaining allocation then release the suballocator block
-                        // but only if there is more than one block
-                        if ((blockDesc->numSubBlocks == 0) &&
-                            (m_blocks.size() > 1))
-                        {
-                            blockDesc->block.free();
-                            m_blocks.erase(m_blocks.begin() + blockIndex);
-                        }
-                    }
-                    break;
+            // If this suballocation was the final remaining allocation then release the suballocator block
+            // but only if there is more than one block, unless defragmentation was emptying it on purpose.
+            // The retention policy may keep it warm so the next allocation doesn't have to create a block
+            if ((blockDesc->numSubBlocks == 0) &&
+                ((m_blocks.size() > 1) || blockDesc->isEvacuating))
+            {
+                if (blockDesc->isEvacuating)
+                {
+                    m_evacuatingBlockCount--;
+                }
+                else if (retainBlock(blockDesc))
+                {
+                    return;
                 }
-                blockIndex++;
+                removeFreeRange(blockDesc, 0, blockDesc->size);
+                releaseBlock(blockDesc);
             }
         }
 
-        uint64_t getSize()
+        void setRetention(const BlockRetention& retention)
         {
-            uint64_t size = 0;
-            for (auto blockDesc : m_blocks)
-            {
-                size += blockDesc->size;
-            }
-            return size;
+            std::lock_guard<std::mutex> guard(m_threadSafeLock);
+
+            m_retention     = retention;
+            m_nextBlockSize = std::max(m_nextBlockSize, m_blockSize);
+
+            // Drop whatever the new limits no longer allow
+            releaseRetainedBlocks(false);
         }
 
-        //https://asawicki.info/news_1757_a_metric_for_memory_fragmentation
-        double getFragmentation(uint64_t& totalUnusedMemory)
+        // Ages retained blocks by a frame and releases the ones past the retention thresholds
+        void nextFrame()
         {
-            uint64_t quality = 0;
-            totalUnusedMemory = 0;
-            for (auto blockDesc : m_blocks)
+            std::lock_guard<std::mutex> guard(m_threadSafeLock);
+
+            m_frameIndex++;
+            releaseRetainedBlocks(false);
+
+            m_telemetry.lastFrameAllocationCount = m_telemetry.frameAllocationCount;
+            m_telemetry.lastFrameFreeCount       = m_telemetry.frameFreeCount;
+            m_telemetry.frameAllocationCount     = 0;
+            m_telemetry.frameFreeCount           = 0;
+        }
+
+        // Releases every retained block right away, returns the number of bytes released
+        uint64_t trimRetainedBlocks()
+        {
+            std::lock_guard<std::mutex> guard(m_threadSafeLock);
+
+            const uint64_t retainedSize = m_retainedBlockSize;
+            releaseRetainedBlocks(true);
+            return retainedSize - m_retainedBlockSize;
+        }
+
+        uint64_t getRetainedSize()
+        {
+            std::lock_guard<std::mutex> guard(m_threadSafeLock);
+            return m_retainedBlockSize;
+        }
+
+        // Picks the emptiest blocks below maxOccupancy and stops allocating from them so their
+        // live sub blocks can be copied elsewhere. Blocks are picked until their live bytes add up to
+        // maxLiveBytes, each picked block gets released once its last sub block is freed
+        uint64_t beginEvacuation(double   maxOccupancy,
+                                 uint64_t maxLiveBytes)
+        {
+            uint64_t liveBytes = 0;
+            return beginEvacuation(maxOccupancy, maxLiveBytes, liveBytes);
+        }
+
+        // Same as above with liveBytes carrying the live bytes already picked, so several pools can share maxLiveBytes
+        uint64_t beginEvacuation(double    maxOccupancy,
+                                 uint64_t  maxLiveBytes,
+                                 uint64_t& liveBytes)
+        {
+            std::lock_guard<std::mutex> guard(m_threadSafeLock);
+
+            std::vector<BlockDesc*> candidates;
+            for (BlockDesc* blockDesc : m_blocks)
             {
-                for (SubBlock& freeSubBlock : blockDesc->freeSubBlocks)
+                if ((blockDesc->isDedicated  == false) &&
+                    (blockDesc->isEvacuating == false) &&
+                    (blockDesc->numSubBlocks > 0) &&
+                    (static_cast<double>(blockDesc->usedSize) < maxOccupancy * static_cast<double>(blockDesc->size)))
                 {
-                    quality       += freeSubBlock.size * freeSubBlock.size;
-                    totalUnusedMemory += freeSubBlock.size;
+                    candidates.push_back(blockDesc);
                 }
+            }
 
-                // Current offset free block at the tail end
-                uint64_t tailFreeSubBlock = blockDesc->size - blockDesc->currentOffset;
+            std::sort(candidates.begin(), candidates.end(), [](const BlockDesc* a, const BlockDesc* b)
+            {
+                return a->usedSize < b->usedSize;
+            });
 
-                quality += tailFreeSubBlock * tailFreeSubBlock;
-                totalUnusedMemory += tailFreeSubBlock;
+            // Keep the fullest block around to move the sub blocks into
+            if ((candidates.empty() == false) && (candidates.size() == m_blocks.size()))
+            {
+                candidates.pop_back();
             }
 
-            if (quality == 0 || totalUnusedMemory == 0)
+            uint64_t evacuatedBlockCount = 0;
+            for (BlockDesc* blockDesc : candidates)
             {
-                return 0.0;
+                if ((liveBytes > 0) && (liveBytes + blockDesc->usedSize > maxLiveBytes))
+                {
+                    break;
+                }
+
+                // Hide the free ranges from best fit searches so nothing new lands in the block
+                for (auto& freeRange : blockDesc->freeRanges)
+                {
+                    m_freeRanges.erase(FreeRange{ freeRange.second, blockDesc->id, freeRange.first, blockDesc });
+                }
+                blockDesc->isEvacuating = true;
+
+                liveBytes += blockDesc->usedSize;
+                evacuatedBlockCount++;
             }
+            m_evacuatingBlockCount += evacuatedBlockCount;
 
-            double qualityPercent = sqrt(static_cast<double>(quality)) / static_cast<double>(totalUnusedMemory);
-            return (1.0 - (qualityPercent * qualityPercent)) * 100.0;
+            return evacuatedBlockCount;
+        }
+
+        // Evicts every shared block without live sub blocks, they are made resident again once memory is
+        // handed out from them. Returns the number of bytes evicted
+        uint64_t evictIdleBlocks()
+        {
+            std::lock_guard<std::mutex> guard(m_threadSafeLock);
+
+            uint64_t evictedSize = 0;
+            for (BlockDesc* blockDesc : m_blocks)
+            {
+                if ((blockDesc->numSubBlocks == 0) &&
+                    (blockDesc->isEvicted    == false) &&
+                    (blockDesc->block.evict()))
+                {
+                    blockDesc->isEvicted = true;
+                    evictedSize += blockDesc->size;
+                }
+            }
+            return evictedSize;
+        }
+
+        // Number of blocks still waiting for their live sub blocks to be moved out
+        uint64_t getEvacuatingBlockCount()
+        {
+            std::lock_guard<std::mutex> guard(m_threadSafeLock);
+            return m_evacuatingBlockCount;
+        }
+
+        uint64_t getSize()
+        {
+            std::lock_guard<std::mutex> guard(m_threadSafeLock);
+            return getSizeInternal();
+        }
+
+        double getFragmentation(uint64_t& totalUnusedMemory)
+        {
+            std::lock_guard<std::mutex> guard(m_threadSafeLock);
+            return getFragmentationInternal(totalUnusedMemory);
         }
 
         Stats const getStats()
         {
+            std::lock_guard<std::mutex> guard(m_threadSafeLock);
+
             Stats stats;
-            stats.totalResidentMemorySize = getSize();
+            stats.totalResidentMemorySize = getSizeInternal();
             stats.alignmentSavings = m_stats.alignmentSavings;
             uint64_t totalUnusedSize;
             // Calculate fragmentation and total free blocks at the same time
-            stats.fragmentation = getFragmentation(totalUnusedSize);
+            stats.fragmentation = getFragmentationInternal(totalUnusedSize);
             stats.unusedSize = totalUnusedSize;
             return stats;
         }
 
-        const std::vector<BlockDesc*>& getBlocks()
+        // Events of this pool go to sink tagged with pool, the sink has to outlive the pool
+        void setTelemetry(PoolType             pool,
+                          const TelemetrySink* sink)
+        {
+            std::lock_guard<std::mutex> guard(m_threadSafeLock);
+
+            m_poolType      = pool;
+            m_telemetrySink = sink;
+        }
+
+        PoolTelemetry getTelemetry()
         {
+            std::lock_guard<std::mutex> guard(m_threadSafeLock);
+            return m_telemetry;
+        }
+
+        // Returns a snapshot of the blocks since other threads may be allocating from the pool
+        std::vector<BlockDesc*> getBlocks()
+        {
+            std::lock_guard<std::mutex> guard(m_threadSafeLock);
             return m_blocks;
         }
 
     private:
 
-        uint64_t align(uint64_t size, uint64_t alignment)
+        uint64_t getSizeInternal()
         {
-            return ((size + (alignment - 1)) & ~(alignment - 1));
+            return m_telemetry.blockSize;
         }
 
-        void createBlock(uint64_t blockAllocationSize)
+        void reportEvent(TelemetryEventType type,
+                         uint64_t           blockId,
+                         uint64_t           offset,
+                         uint64_t           size)
         {
-            BlockDesc* newBlock = new BlockDesc{};
-            newBlock->block.allocate(blockAllocationSize, std::to_string(m_blocks.size()));
-            newBlock->size = blockAllocationSize;
-            m_blocks.push_back(newBlock);
+            if ((m_telemetrySink != nullptr) && (m_telemetrySink->callback != nullptr))
+            {
+                TelemetryEvent event;
+                event.type    = type;
+                event.pool    = m_poolType;
+                event.blockId = blockId;
+                event.offset  = offset;
+                event.size    = size;
+                m_telemetrySink->report(event);
+            }
         }
 
-        bool findFreeSubBlock(BlockDesc* suballocatorBlock,
-                              SubBlock* subBlock,
-                              uint64_t sizeInBytes)
+        void recordAllocation(SubBlock* subBlock)
         {
-            bool foundFreeSubBlock   = false;
-            auto minUnusedMemoryIter = suballocatorBlock->freeSubBlocks.end();
-            auto freeSubBlockIter    = suballocatorBlock->freeSubBlocks.begin();
+            m_telemetry.usedSize    += subBlock->size;
+            m_telemetry.peakUsedSize = std::max(m_telemetry.peakUsedSize, m_telemetry.usedSize);
+            m_telemetry.allocationCount++;
+            m_telemetry.frameAllocationCount++;
+            m_telemetry.sizeHistogram[GetTelemetryHistogramBucket(subBlock->size)]++;
 
-            uint64_t minUnusedMemorySubBlock = ~0ull;
+            reportEvent(TelemetryEventType::Allocate, subBlock->blockDesc->id, subBlock->offset, subBlock->size);
+        }
+
+        void recordFree(SubBlock* subBlock)
+        {
+            m_telemetry.usedSize -= subBlock->size;
+            m_telemetry.allocationCount--;
+            m_telemetry.frameFreeCount++;
+            m_telemetry.sizeHistogram[GetTelemetryHistogramBucket(subBlock->size)]--;
+
+            reportEvent(TelemetryEventType::Free, subBlock->blockDesc->id, subBlock->offset, subBlock->size);
+        }
 
-            while (freeSubBlockIter != suballocatorBlock->freeSubBlocks.end())
+        //https://asawicki.info/news_1757_a_metric_for_memory_fragmentation
+        double getFragmentationInternal(uint64_t& totalUnusedMemory)
+        {
+            uint64_t quality = 0;
+            totalUnusedMemory = 0;
+            for (auto blockDesc : m_blocks)
             {
-                if (sizeInBytes <= freeSubBlockIter->size)
+                // Free ranges include the untouched tail end of the block
+                for (auto& freeRange : blockDesc->freeRanges)
                 {
-                    // Attempt to find the exact fit and if not fallback to the least wasted unused memory
-                    if (freeSubBlockIter->size - sizeInBytes == 0)
-                    {
-                        // Keep previous allocation size
-                        subBlock->size = freeSubBlockIter->size;
-                        subBlock->offset = freeSubBlockIter->offset;
-                        foundFreeSubBlock = true;
+                    quality           += freeRange.second * freeRange.second;
+                    totalUnusedMemory += freeRange.second;
+                }
+            }
 
-                        // Remove from the list
-                        suballocatorBlock->freeSubBlocks.erase(freeSubBlockIter);
-                        suballocatorBlock->numSubBlocks++;
+            if (quality == 0 || totalUnusedMemory == 0)
+            {
+                return 0.0;
+            }
 
-                        if (Logger::isEnabled(Level::DBG))
-                        {
-                            Logger::log(Level::DBG, "RTXMU Suballocator Perfect Match\n");
-                        }
+            double qualityPercent = sqrt(static_cast<double>(quality)) / static_cast<double>(totalUnusedMemory);
+            return (1.0 - (qualityPercent * qualityPercent)) * 100.0;
+        }
 
-                        break;
-                    }
-                    else
-                    {
-                        // Keep track of the available SubBlock with least fragmentation
-                        const uint64_t unusedMemory = freeSubBlockIter->size - sizeInBytes;
-                        if (unusedMemory < minUnusedMemorySubBlock)
-                        {
-                            minUnusedMemoryIter = freeSubBlockIter;
-                            minUnusedMemorySubBlock = unusedMemory;
-                        }
-                    }
+        uint64_t align(uint64_t size, uint64_t alignment)
+        {
+            return ((size + (alignment - 1)) & ~(alignment - 1));
+        }
+
+        // Returns null when the block memory couldn't be allocated
+        BlockDesc* createBlock(uint64_t blockAllocationSize, bool isDedicated)
+        {
+            BlockDesc* newBlock = m_blockDescPool.allocate(&m_blockFreeRangeNodes);
+            // Blocks keep the allocator of their pool, so pools of managers on different devices don't mix
+            newBlock->block.setAllocator(m_allocator);
+            if (newBlock->block.allocate(blockAllocationSize, std::to_string(m_nextBlockId)) == false)
+            {
+                m_blockDescPool.release(newBlock);
+
+                if (m_allocator->logger->isEnabled(Level::ERR))
+                {
+                    char buf[128];
+                    snprintf(buf, sizeof buf, "RTXMU Suballocator Block Allocation of size %" PRIu64 " failed\n", blockAllocationSize);
+                    m_allocator->logger->log(Level::ERR, buf);
                 }
-                freeSubBlockIter++;
+                return nullptr;
             }
+            newBlock->size        = blockAllocationSize;
+            newBlock->id          = m_nextBlockId++;
+            newBlock->isDedicated = isDedicated;
+            newBlock->slot        = m_blocks.size();
+            m_blocks.push_back(newBlock);
 
-            // Did not find a perfect match so take the closest and get hit with fragmentation
-            // Reject SubBlock if the closest available SubBlock is twice the required size
-            if ((foundFreeSubBlock   == false) &&
-                (minUnusedMemoryIter != suballocatorBlock->freeSubBlocks.end()) &&
-                (minUnusedMemorySubBlock < 2 * sizeInBytes))
+            m_telemetry.blockSize    += blockAllocationSize;
+            m_telemetry.peakBlockSize = std::max(m_telemetry.peakBlockSize, m_telemetry.blockSize);
+            m_telemetry.blockCount++;
+            reportEvent(TelemetryEventType::BlockCreate, newBlock->id, 0, blockAllocationSize);
+
+            // A new shared block starts out as a single free range spanning the entire block
+            if (isDedicated == false)
             {
+                insertFreeRange(newBlock, 0, blockAllocationSize);
+            }
+            return newBlock;
+        }
 
-                const uint64_t memoryAlignedSize = align(minUnusedMemoryIter->size, suballocatorBlock->block.getAlignment());
-                m_stats.alignmentSavings -= (memoryAlignedSize - minUnusedMemoryIter->size);
+        // Blocks are kept densely packed so removal swaps the last block into the vacated slot
+        void releaseBlock(BlockDesc* blockDesc)
+        {
+            if (m_linearBlock == blockDesc)
+            {
+                m_linearBlock = nullptr;
+            }
+            if (blockDesc->isRetained)
+            {
+                unretainBlock(blockDesc);
+            }
 
-                // Keep previous allocation size
-                subBlock->size = minUnusedMemoryIter->size;
-                subBlock->offset = minUnusedMemoryIter->offset;
-                foundFreeSubBlock = true;
+            const uint64_t slot = blockDesc->slot;
+            BlockDesc* lastBlock = m_blocks.back();
+            m_blocks[slot] = lastBlock;
+            lastBlock->slot = slot;
+            m_blocks.pop_back();
 
-                // Remove from the list
-                suballocatorBlock->freeSubBlocks.erase(minUnusedMemoryIter);
-                suballocatorBlock->numSubBlocks++;
+            m_telemetry.blockSize -= blockDesc->size;
+            m_telemetry.blockCount--;
+            reportEvent(TelemetryEventType::BlockDestroy, blockDesc->id, 0, blockDesc->size);
 
-                const uint64_t newMemoryAlignedSize = align(sizeInBytes, suballocatorBlock->block.getAlignment());
-                // Capture the wasted memory from the original allocation because suballoc size does not change
-                subBlock->unusedSize = subBlock->size - sizeInBytes;
-                m_stats.alignmentSavings += (newMemoryAlignedSize - sizeInBytes);
+            blockDesc->block.free();
+            m_blockDescPool.release(blockDesc);
+        }
 
-                if (Logger::isEnabled(Level::DBG))
-                {
-                    Logger::log(Level::DBG, "RTXMU Suballocator Suboptimal Match with wasted memory\n");
-                }
+        // Returns whether the retention policy keeps the emptied block around
+        bool retainBlock(BlockDesc* blockDesc)
+        {
+            if ((m_retainedBlockCount >= m_retention.maxRetainedBlocks) ||
+                ((m_retention.maxRetainedBytes != 0) && (m_retainedBlockSize + blockDesc->size > m_retention.maxRetainedBytes)))
+            {
+                return false;
             }
 
-#if MERGE_FREE_BLOCKS
-            // If no free blocks work then lets merge free blocks to help if we have more than 1
-            if (foundFreeSubBlock == false && suballocatorBlock->freeSubBlocks.size() > 1)
+            blockDesc->isRetained    = true;
+            blockDesc->retainedFrame = m_frameIndex;
+            blockDesc->retainedTime  = std::chrono::steady_clock::now();
+
+            m_retainedBlockCount++;
+            m_retainedBlockSize += blockDesc->size;
+            return true;
+        }
+
+        void unretainBlock(BlockDesc* blockDesc)
+        {
+            blockDesc->isRetained = false;
+
+            m_retainedBlockCount--;
+            m_retainedBlockSize -= blockDesc->size;
+        }
+
+        // Releases retained blocks that expired or exceed the limits, or all of them when releaseAll is set
+        void releaseRetainedBlocks(bool releaseAll)
+        {
+            const auto now = std::chrono::steady_clock::now();
+
+            // Released blocks get the last block swapped into their slot, which was already visited
+            for (size_t slot = m_blocks.size(); slot-- > 0;)
             {
-                std::vector<SubBlock>& freeBlocks = suballocatorBlock->freeSubBlocks;
-                int currentSubBlock = 0;
-                int neighboringSubBlock = 0;
-                while (neighboringSubBlock < freeBlocks.size())
+                BlockDesc* blockDesc = m_blocks[slot];
+                if ((blockDesc->isRetained == false) || (m_blocks.size() == 1))
                 {
-                    uint64_t currentOffset = freeBlocks[currentSubBlock].offset + (freeBlocks[currentSubBlock].size + freeBlocks[currentSubBlock].unusedSize);
-                    if (currentOffset == freeBlocks[neighboringSubBlock + 1].offset)
-                    {
-                        // Add size from the next neighboring block but keep same offset
-                        freeBlocks[currentSubBlock].size += freeBlocks[neighboringSubBlock + 1].size;
-                        freeBlocks[currentSubBlock].unusedSize += freeBlocks[neighboringSubBlock + 1].unusedSize;
+                    continue;
+                }
 
-                        freeBlocks[neighboringSubBlock + 1].offset = -1;
-                        freeBlocks[neighboringSubBlock + 1].size = 0;
+                const uint64_t retainedMilliseconds = static_cast<uint64_t>(
+                    std::chrono::duration_cast<std::chrono::milliseconds>(now - blockDesc->retainedTime).count());
 
-                        if (Logger::isEnabled(Level::DBG))
-                        {
-                            Logger::log(Level::DBG, "RTXMU Suballocator Merging Free Blocks\n");
-                        }
-                    }
-                    else
-                    {
-                        currentSubBlock++;
-                    }
-                    neighboringSubBlock++;
+                const bool expired = releaseAll ||
+                                     (m_retainedBlockCount > m_retention.maxRetainedBlocks) ||
+                                     ((m_retention.maxRetainedBytes != 0) && (m_retainedBlockSize > m_retention.maxRetainedBytes)) ||
+                                     ((m_retention.retentionFrames != 0) && (m_frameIndex - blockDesc->retainedFrame >= m_retention.retentionFrames)) ||
+                                     ((m_retention.retentionMilliseconds != 0) && (retainedMilliseconds >= m_retention.retentionMilliseconds));
+                if (expired)
+                {
+                    removeFreeRange(blockDesc, 0, blockDesc->size);
+                    releaseBlock(blockDesc);
                 }
             }
-#endif
-            return foundFreeSubBlock;
+        }
+
+        // Ranges of evacuating blocks are only tracked per block so best fit never sees them
+        void insertFreeRange(BlockDesc* blockDesc, uint64_t offset, uint64_t size)
+        {
+            blockDesc->freeRanges.emplace(offset, size);
+            if (blockDesc->isEvacuating == false)
+            {
+                m_freeRanges.insert(FreeRange{ size, blockDesc->id, offset, blockDesc });
+            }
+        }
+
+        void removeFreeRange(BlockDesc* blockDesc, uint64_t offset, uint64_t size)
+        {
+            blockDesc->freeRanges.erase(offset);
+            if (blockDesc->isEvacuating == false)
+            {
+                m_freeRanges.erase(FreeRange{ size, blockDesc->id, offset, blockDesc });
+            }
         }
 
         struct SubBlock : public SubBlockRef
@@ -447,19 +906,85 @@ namespace rtxmu
             bool     isFree      = false;
         };
 
+        // Tree nodes of the free range bookkeeping come out of node pools, so splitting and merging ranges on every
+        // allocate and free doesn't go to the heap
+        using BlockFreeRangeAllocator = NodePoolAllocator<std::pair<const uint64_t, uint64_t>,
+                                                          TreeNodeSize<std::pair<const uint64_t, uint64_t>>>;
+
         struct BlockDesc
         {
+            explicit BlockDesc(typename BlockFreeRangeAllocator::Pool* freeRangeNodes) :
+                freeRanges(BlockFreeRangeAllocator(freeRangeNodes))
+            {
+            }
+
             Block block;
-            std::vector<SubBlock> freeSubBlocks;
-            uint64_t currentOffset = 0;
+            // Free ranges within the block keyed by offset, used to merge neighbors on free
+            std::map<uint64_t, uint64_t, std::less<uint64_t>, BlockFreeRangeAllocator> freeRanges;
             uint64_t size          = 0;
+            uint64_t usedSize      = 0;
             uint64_t numSubBlocks  = 0;
+            uint64_t id            = 0;
+            uint64_t slot          = 0;
+            bool     isDedicated   = false;
+            bool     isEvacuating  = false;
+            bool     isEvicted     = false;
+            // Empty block kept warm by the retention policy since retainedFrame
+            bool     isRetained    = false;
+            uint64_t retainedFrame = 0;
+            std::chrono::steady_clock::time_point retainedTime;
+        };
+
+        // Free range of a block ordered by size for best fit searches, ties go to the oldest block
+        // and then the lowest offset so allocations stay packed towards the front of the pool
+        struct FreeRange
+        {
+            uint64_t   size    = 0;
+            uint64_t   blockId = 0;
+            uint64_t   offset  = 0;
+            BlockDesc* blockDesc = nullptr;
+
+            bool operator<(const FreeRange& other) const
+            {
+                if (size != other.size)
+                {
+                    return size < other.size;
+                }
+                if (blockId != other.blockId)
+                {
+                    return blockId < other.blockId;
+                }
+                return offset < other.offset;
+            }
         };
 
+        using FreeRangeAllocator = NodePoolAllocator<FreeRange, TreeNodeSize<FreeRange>>;
+
         uint64_t                m_blockSize;
         uint64_t                m_allocationAlignment;
+        uint64_t                m_nextBlockId = 0;
+        uint64_t                m_evacuatingBlockCount = 0;
+        AllocationPolicy        m_policy = AllocationPolicy::BestFit;
+        BlockRetention          m_retention;
+        // Size of the next shared block, grows with the retention policy's growth factor
+        uint64_t                m_nextBlockSize = 0;
+        uint64_t                m_frameIndex = 0;
+        uint64_t                m_retainedBlockCount = 0;
+        uint64_t                m_retainedBlockSize = 0;
+        // Newest block, which linear allocations bump through
+        BlockDesc*              m_linearBlock = nullptr;
         std::vector<BlockDesc*> m_blocks;
+        // Declared ahead of the containers drawing from them so they are destroyed last
+        typename BlockFreeRangeAllocator::Pool m_blockFreeRangeNodes;
+        typename FreeRangeAllocator::Pool      m_freeRangeNodes;
+        std::set<FreeRange, std::less<FreeRange>, FreeRangeAllocator> m_freeRanges{ FreeRangeAllocator(&m_freeRangeNodes) };
+        NodePool<SubBlock>      m_subBlockPool;
+        NodePool<BlockDesc, 64> m_blockDescPool;
         Stats                   m_stats;
+        PoolTelemetry           m_telemetry;
+        PoolType                m_poolType = PoolType::Result;
+        const TelemetrySink*    m_telemetrySink = nullptr;
+        AllocatorType*          m_allocator = nullptr;
         std::mutex              m_threadSafeLock;
     };
 
@@ -0,0 +1,396 @@
+/*
+* Copyright (c) 2024 NVIDIA CORPORATION. All rights reserved
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+namespace rtxmu
+{
+    // Capacity a top level acceleration structure starts out with and never shrinks below
+    constexpr uint32_t MinTopLevelInstanceCapacity = 64;
+    // Builds in a row the instance count has to stay under a quarter of the capacity before the capacity shrinks
+    constexpr uint32_t TopLevelCapacityShrinkDelay = 120;
+    // Updates touching more than this share of the instances rebuild instead, refits degrade quickly past it
+    constexpr double   DefaultTopLevelRebuildRatio = 0.5;
+
+    // How the next build brings a top level acceleration structure up to date
+    enum class TopLevelBuildMode : uint32_t
+    {
+        // No instance changed since the last build
+        None,
+        Update,
+        Rebuild,
+        // The capacity changed, the rebuild goes to new memory and the previous memory is retired
+        Reallocate
+    };
+
+    // Half open [begin, end) instance ranges written since some point. Appending neighboring or overlapping
+    // ranges extends the last one, anything else gets sorted and merged on the next read
+    class InstanceDirtyRanges
+    {
+    public:
+
+        using Range = std::pair<uint32_t, uint32_t>;
+
+        void add(uint32_t firstInstance,
+                 uint32_t instanceCount)
+        {
+            if (instanceCount == 0)
+            {
+                return;
+            }
+
+            const uint32_t endInstance = firstInstance + instanceCount;
+            if ((m_ranges.empty() == false) &&
+                (firstInstance <= m_ranges.back().second) &&
+                (endInstance   >= m_ranges.back().first))
+            {
+                m_ranges.back().first  = std::min(m_ranges.back().first, firstInstance);
+                m_ranges.back().second = std::max(m_ranges.back().second, endInstance);
+
+                // Growing the last range downwards may run into the ones before it
+                m_isMerged = m_isMerged && ((m_ranges.size() == 1) || (m_ranges[m_ranges.size() - 2].second < m_ranges.back().first));
+                return;
+            }
+
+            m_isMerged = m_isMerged && (m_ranges.empty() || (m_ranges.back().second < firstInstance));
+            m_ranges.emplace_back(firstInstance, endInstance);
+        }
+
+        // Drops everything at and beyond instanceCount
+        void clamp(uint32_t instanceCount)
+        {
+            merge();
+            while ((m_ranges.empty() == false) && (m_ranges.back().first >= instanceCount))
+            {
+                m_ranges.pop_back();
+            }
+            if (m_ranges.empty() == false)
+            {
+                m_ranges.back().second = std::min(m_ranges.back().second, instanceCount);
+            }
+        }
+
+        void clear()
+        {
+            m_ranges.clear();
+            m_isMerged = true;
+        }
+
+        bool empty() const
+        {
+            return m_ranges.empty();
+        }
+
+        // Sorted, disjoint and non adjacent ranges
+        const std::vector<Range>& getRanges()
+        {
+            merge();
+            return m_ranges;
+        }
+
+        uint64_t getInstanceCount()
+        {
+            merge();
+
+            uint64_t instanceCount = 0;
+            for (const Range& range : m_ranges)
+            {
+                instanceCount += range.second - range.first;
+            }
+            return instanceCount;
+        }
+
+    private:
+
+        void merge()
+        {
+            if (m_isMerged)
+            {
+                return;
+            }
+
+            std::sort(m_ranges.begin(), m_ranges.end());
+
+            size_t mergedCount = 0;
+            for (size_t rangeIndex = 1; rangeIndex < m_ranges.size(); rangeIndex++)
+            {
+                if (m_ranges[rangeIndex].first <= m_ranges[mergedCount].second)
+                {
+                    m_ranges[mergedCount].second = std::max(m_ranges[mergedCount].second, m_ranges[rangeIndex].second);
+                }
+                else
+                {
+                    m_ranges[++mergedCount] = m_ranges[rangeIndex];
+                }
+            }
+            m_ranges.resize(mergedCount + 1);
+            m_isMerged = true;
+        }
+
+        std::vector<Range> m_ranges;
+        bool               m_isMerged = true;
+    };
+
+    // CPU side of a top level acceleration structure owned by the manager. Instances are written to a shadow
+    // copy and every build flushes only the instances written since the instance buffer it picked was last
+    // flushed. The buffers form a ring of persistently mapped copies, a buffer is picked again once the build
+    // that last read it completed on the GPU, so the ring only grows while the GPU runs further behind.
+    // InstanceMemory is the suballocation type of the instance buffers, their memory is up to the backend
+    template<typename InstanceDesc, typename InstanceMemory>
+    class TopLevelInstances
+    {
+    public:
+
+        explicit TopLevelInstances(uint32_t instanceCapacity)
+        {
+            m_capacity = std::max(instanceCapacity, MinTopLevelInstanceCapacity);
+        }
+
+        void resize(uint32_t instanceCount)
+        {
+            const uint32_t previousCount = getInstanceCount();
+            if (instanceCount == previousCount)
+            {
+                return;
+            }
+
+            m_instances.resize(instanceCount);
+            m_countChanged = true;
+
+            // Added instances have to reach every buffer, dropped ones are no longer read
+            if (instanceCount > previousCount)
+            {
+                markDirty(previousCount, instanceCount - previousCount);
+            }
+            else
+            {
+                m_changedRanges.clamp(instanceCount);
+                for (Buffer& buffer : m_buffers)
+                {
+                    buffer.dirtyRanges.clamp(instanceCount);
+                }
+            }
+        }
+
+        // Copies instanceCount descs into the shadow copy, the range must be within the instance count
+        void write(uint32_t            firstInstance,
+                   const InstanceDesc* instanceDescs,
+                   uint32_t            instanceCount)
+        {
+            memcpy(&m_instances[firstInstance], instanceDescs, instanceCount * sizeof(InstanceDesc));
+            markDirty(firstInstance, instanceCount);
+        }
+
+        uint32_t getInstanceCount() const
+        {
+            return static_cast<uint32_t>(m_instances.size());
+        }
+
+        uint32_t getCapacity() const
+        {
+            return m_capacity;
+        }
+
+        // Capacity the next build should be sized for. The capacity grows by half once outgrown and shrinks to
+        // twice the instance count after staying under a quarter of it for TopLevelCapacityShrinkDelay builds,
+        // so instance counts moving back and forth never reallocate every frame. Meant to be called once per build
+        uint32_t getTargetCapacity()
+        {
+            const uint32_t instanceCount = getInstanceCount();
+
+            if (instanceCount > m_capacity)
+            {
+                m_lowUsageBuildCount = 0;
+                return std::max(instanceCount, m_capacity + m_capacity / 2);
+            }
+
+            if (instanceCount >= m_capacity / 4)
+            {
+                m_lowUsageBuildCount = 0;
+                return m_capacity;
+            }
+
+            if (++m_lowUsageBuildCount < TopLevelCapacityShrinkDelay)
+            {
+                return m_capacity;
+            }
+
+            m_lowUsageBuildCount = 0;
+            return std::max(instanceCount * 2, MinTopLevelInstanceCapacity);
+        }
+
+        // Switches over to memory sized for capacity. The instance buffers of the previous capacity are too small
+        // from here on and get moved to retiredMemory, the backend releases them once the GPU is done with them.
+        // The new memory holds no build yet, so the next build rebuilds even if this one doesn't get recorded
+        void setCapacity(uint32_t                     capacity,
+                         std::vector<InstanceMemory>& retiredMemory)
+        {
+            m_capacity = capacity;
+            m_isBuilt  = false;
+
+            for (Buffer& buffer : m_buffers)
+            {
+                retiredMemory.push_back(buffer.memory);
+            }
+            m_buffers.clear();
+        }
+
+        // Picks how the next build brings the acceleration structure up to date, reallocate is up to the backend
+        // as it also has to cover missing memory. Rebuilds when never built or the instance count changed, when
+        // refits aren't allowed, the refit policy asks for it or more than rebuildRatio of the instances changed
+        TopLevelBuildMode selectBuildMode(bool   reallocate,
+                                          bool   allowUpdate,
+                                          bool   rebuildDue,
+                                          double rebuildRatio)
+        {
+            if (reallocate)
+            {
+                return TopLevelBuildMode::Reallocate;
+            }
+            if ((m_isBuilt == false) || m_countChanged || rebuildDue)
+            {
+                return TopLevelBuildMode::Rebuild;
+            }
+
+            const uint64_t changedCount = m_changedRanges.getInstanceCount();
+            if (changedCount == 0)
+            {
+                return TopLevelBuildMode::None;
+            }
+            if ((allowUpdate == false) ||
+                (static_cast<double>(changedCount) > rebuildRatio * static_cast<double>(getInstanceCount())))
+            {
+                return TopLevelBuildMode::Rebuild;
+            }
+            return TopLevelBuildMode::Update;
+        }
+
+        // Returns the index of the most recently flushed buffer the GPU is done with, or getBufferCount() if every
+        // buffer may still be read by a build in flight and a new one has to be added
+        uint32_t acquireBuffer(uint64_t completedFenceValue) const
+        {
+            uint32_t acquiredIndex = getBufferCount();
+            for (uint32_t bufferIndex = 0; bufferIndex < getBufferCount(); bufferIndex++)
+            {
+                // The buffer flushed last holds the fewest stale instances
+                if ((m_buffers[bufferIndex].fenceValue <= completedFenceValue) &&
+                    ((acquiredIndex == getBufferCount()) ||
+                     (m_buffers[bufferIndex].fenceValue > m_buffers[acquiredIndex].fenceValue)))
+                {
+                    acquiredIndex = bufferIndex;
+                }
+            }
+            return acquiredIndex;
+        }
+
+        // Adds a buffer in memory sized for the capacity, all of its instances get flushed the first time
+        uint32_t addBuffer(const InstanceMemory& memory)
+        {
+            Buffer buffer;
+            buffer.memory = memory;
+            buffer.dirtyRanges.add(0, getInstanceCount());
+
+            m_buffers.push_back(std::move(buffer));
+            return getBufferCount() - 1;
+        }
+
+        uint32_t getBufferCount() const
+        {
+            return static_cast<uint32_t>(m_buffers.size());
+        }
+
+        const InstanceMemory& getBufferMemory(uint32_t bufferIndex) const
+        {
+            return m_buffers[bufferIndex].memory;
+        }
+
+        // Moves every instance buffer to retiredMemory and forgets about them
+        void releaseBuffers(std::vector<InstanceMemory>& retiredMemory)
+        {
+            setCapacity(m_capacity, retiredMemory);
+        }
+
+        // Copies the instances written since the buffer was last flushed to its mapped memory, the buffer is read
+        // by the build signaling fenceValue. Returns the number of instances copied
+        uint64_t flush(uint32_t bufferIndex,
+                       void*    mappedData,
+                       uint64_t fenceValue)
+        {
+            Buffer& buffer = m_buffers[bufferIndex];
+            InstanceDesc* mappedInstances = static_cast<InstanceDesc*>(mappedData);
+
+            uint64_t flushedCount = 0;
+            for (const InstanceDirtyRanges::Range& range : buffer.dirtyRanges.getRanges())
+            {
+                memcpy(&mappedInstances[range.first], &m_instances[range.first], (range.second - range.first) * sizeof(InstanceDesc));
+                flushedCount += range.second - range.first;
+            }
+
+            buffer.dirtyRanges.clear();
+            buffer.fenceValue = fenceValue;
+            return flushedCount;
+        }
+
+        // Called once a build got recorded, changes after this point count towards the next build
+        void markBuilt()
+        {
+            m_isBuilt      = true;
+            m_countChanged = false;
+            m_changedRanges.clear();
+        }
+
+    private:
+
+        struct Buffer
+        {
+            InstanceMemory      memory;
+            InstanceDirtyRanges dirtyRanges;
+            // Signaled once the last build reading the buffer completed
+            uint64_t            fenceValue = 0;
+        };
+
+        void markDirty(uint32_t firstInstance,
+                       uint32_t instanceCount)
+        {
+            m_changedRanges.add(firstInstance, instanceCount);
+            for (Buffer& buffer : m_buffers)
+            {
+                buffer.dirtyRanges.add(firstInstance, instanceCount);
+            }
+        }
+
+        std::vector<InstanceDesc> m_instances;
+        std::vector<Buffer>       m_buffers;
+        // Instances written since the last build, decides between refit and rebuild
+        InstanceDirtyRanges       m_changedRanges;
+        uint32_t                  m_capacity           = 0;
+        uint32_t                  m_lowUsageBuildCount = 0;
+        bool                      m_countChanged       = false;
+        bool                      m_isBuilt            = false;
+    };
+}
@@ -28,13 +28,72 @@
 
 namespace rtxmu
 {
+    // Memory a top level acceleration structure moved away from, released once the GPU passed fenceValue
+    struct VkRetiredTopLevelMemory
+    {
+        uint64_t fenceValue = 0;
+        Suballocator<Allocator, VkAccelStructBlock>::SubAllocation resultGpuMemory;
+        Suballocator<Allocator, VkScratchBlock>::SubAllocation scratchGpuMemory;
+        Suballocator<Allocator, VkScratchBlock>::SubAllocation updateGpuMemory;
+        std::vector<Suballocator<Allocator, VkInstanceBlock>::SubAllocation> instanceMemory;
+    };
+
+    // Top level acceleration structure created by CreateTopLevel, built from instances the manager uploads
+    struct VkTopLevel
+    {
+        explicit VkTopLevel(const uint32_t instanceCapacity) : instances(instanceCapacity) {}
+
+        TopLevelInstances<vk::AccelerationStructureInstanceKHR,
+                          Suballocator<Allocator, VkInstanceBlock>::SubAllocation> instances;
+        vk::BuildAccelerationStructureFlagsKHR flags;
+        // Signaled once the last recorded build completed
+        uint64_t lastFenceValue = 0;
+        std::vector<VkRetiredTopLevelMemory> retiredMemory;
+    };
+
     struct VkAccelerationStructure : AccelerationStructure
     {
         Suballocator<Allocator, VkScratchBlock>::SubAllocation updateGpuMemory;
         Suballocator<Allocator, VkScratchBlock>::SubAllocation scratchGpuMemory;
         Suballocator<Allocator, VkAccelStructBlock>::SubAllocation resultGpuMemory;
         Suballocator<Allocator, VkAccelStructBlock>::SubAllocation compactionGpuMemory;
+        // Previous compacted location after a defragmentation move, released by garbage collection
+        Suballocator<Allocator, VkAccelStructBlock>::SubAllocation defragSourceMemory;
+        // Result and scratch a rebuild outgrew, released by garbage collection once the GPU is done with them
+        std::vector<Suballocator<Allocator, VkAccelStructBlock>::SubAllocation> retiredResultMemory;
+        std::vector<Suballocator<Allocator, VkScratchBlock>::SubAllocation> retiredScratchMemory;
         Suballocator<Allocator, VkQueryBlock>::SubAllocation queryCompactionSizeMemory;
+        // Serialized size query and serialized copy while serializing, uploaded blob until garbage collection after deserializing
+        Suballocator<Allocator, VkSerializationQueryBlock>::SubAllocation querySerializedSizeMemory;
+        Suballocator<Allocator, VkSerializationBlock>::SubAllocation serializedMemory;
+        Suballocator<Allocator, VkSerializationBlock>::SubAllocation deserializedUploadMemory;
+        uint64_t serializedSize = 0;
+        // Signaled once the serialized size query completed on the GPU
+        uint64_t serializedSizeFenceValue = 0;
+        // Signaled once the serialize copy completed on the GPU
+        uint64_t serializeFenceValue = 0;
+        // Compacted and moved copies are created with the type the acceleration structure was built with
+        vk::AccelerationStructureTypeKHR type = vk::AccelerationStructureTypeKHR::eBottomLevel;
+        // Only set for top level acceleration structures created by CreateTopLevel
+        std::unique_ptr<VkTopLevel> topLevel;
+        // Opacity micromaps share the id table and compaction pipeline but none of the acceleration structure memory
+        bool isMicromap = false;
+#ifdef VK_EXT_opacity_micromap
+        vk::MicromapTypeEXT micromapType = vk::MicromapTypeEXT::eOpacityMicromap;
+        Suballocator<Allocator, VkMicromapBlock>::SubAllocation micromapGpuMemory;
+        Suballocator<Allocator, VkMicromapBlock>::SubAllocation compactedMicromapGpuMemory;
+        Suballocator<Allocator, VkMicromapQueryBlock>::SubAllocation queryMicromapCompactionSizeMemory;
+#endif
+    };
+
+    // Layout of the driver header Vulkan puts in front of serialized acceleration structures
+    struct VkSerializedAccelStructHeader
+    {
+        uint8_t  driverUUID[VK_UUID_SIZE];
+        uint8_t  compatibilityUUID[VK_UUID_SIZE];
+        uint64_t serializedSize;
+        uint64_t deserializedSize;
+        uint64_t handleCount;
     };
 
     class VkAccelStructManager : public AccelStructManager<VkAccelerationStructure>
@@ -46,29 +105,85 @@ namespace rtxmu
                              const vk::PhysicalDevice& physicalDevice,
                              Level                     verbosity = Level::DISABLED);
 
-        // Initializes suballocator block size
-        void Initialize(uint32_t suballocatorBlockSize = DefaultSuballocatorBlockSize);
+        // Initializes suballocator block size. A non zero scratch budget caps build scratch memory by sharing one
+        // scratch buffer of that size between all builds, splitting build batches with a barrier whenever it wraps
+        // around. Refits draw their update scratch from it as well instead of holding on to it between refits.
+        // Recording builds with a scratch budget is serialized and must stay on a single queue. Compaction size
+        // queries are reset on the host as builds allocate them, so the device needs hostQueryReset enabled
+        void Initialize(uint32_t suballocatorBlockSize = DefaultSuballocatorBlockSize,
+                        uint64_t scratchBudget         = 0);
 
         // Resets all queues and frees all memory in suballocators
         void Reset();
 
-        void PopulateUpdateCommandList(vk::CommandBuffer                                  commandList,
+        // Returns false if a rebuild ran out of memory, the previous build is kept for those. Rebuilds of
+        // acceleration structures shared by build deduplication are skipped and make it return false as well.
+        // Refits turn into rebuilds when due by the refit policy, see SetRefitPolicy and RequestRebuild.
+        // Rebuilds that outgrow their memory move to new memory, pass their ids to GarbageCollection once the
+        // GPU is done with the previous build to release the old memory, otherwise it goes on removal
+        bool PopulateUpdateCommandList(vk::CommandBuffer                                  commandList,
                                        vk::AccelerationStructureBuildGeometryInfoKHR*     geomInfos,
                                        const vk::AccelerationStructureBuildRangeInfoKHR** rangeInfos,
                                        const uint32_t**                                   maxPrimitiveCounts,
                                        const uint32_t                                     buildCount,
                                        std::vector<uint64_t>&                             accelStructIds);
 
-        // Receives acceleration structure inputs and returns a command list with build commands
-        void PopulateBuildCommandList(vk::CommandBuffer                                  commandList,
+        // Receives acceleration structure inputs and returns a command list with build commands.
+        // Returns false if a build ran out of memory or ids, its id is then ReservedId and nothing was recorded.
+        // With build deduplication enabled builds matching a live acceleration structure get its id instead, so an
+        // id can show up more than once. The id lists can still be passed on as they are, every other entry point
+        // handles each acceleration structure once and RemoveAccelerationStructures drops one reference per id
+        bool PopulateBuildCommandList(vk::CommandBuffer                                  commandList,
                                       vk::AccelerationStructureBuildGeometryInfoKHR*     geomInfos,
                                       const vk::AccelerationStructureBuildRangeInfoKHR** rangeInfos,
                                       const uint32_t**                                   maxPrimitiveCounts,
                                       const uint32_t                                     buildCount,
                                       std::vector<uint64_t>&                             accelStructIds);
 
-        // Returns a command list with compaction copies if the acceleration structures are ready to be compacted
-        void PopulateCompactionCommandList(vk::CommandBuffer commandList,
+        // Creates a top level acceleration structure whose instances are kept and uploaded by the manager. It gets an
+        // id like any other and memory sized for instanceCapacity instances, 0 picks a small default, which follows
+        // the instance count with some hysteresis from there on. Compaction isn't supported and gets dropped from
+        // flags. Returns ReservedId once every id is in use
+        uint64_t CreateTopLevel(const vk::BuildAccelerationStructureFlagsKHR flags,
+                                const uint32_t                               instanceCapacity = 0);
+
+        // Sets the number of instances, instances added are zeroed until written
+        void SetTopLevelInstanceCount(const uint64_t topLevelId,
+                                      const uint32_t instanceCount);
+
+        // Writes instanceCount instances starting at firstInstance, within the instance count. Instance buffers
+        // only get the instances written since they were last used uploaded to them
+        void SetTopLevelInstances(const uint64_t                              topLevelId,
+                                  const uint32_t                              firstInstance,
+                                  const vk::AccelerationStructureInstanceKHR* instances,
+                                  const uint32_t                              instanceCount);
+
+        // Records the build of a top level acceleration structure followed by a barrier making it readable by all
+        // later commands. Refits when it allows updates and few instances changed, see SetTopLevelRebuildRatio,
+        // rebuilds when the instance count changed and records nothing when no instance did. Instance buffers and
+        // memory replaced by capacity changes are reused and released once completedFenceValue shows the GPU is
+        // done with them, the commands must be submitted so that they signal submitFenceValue. The handle and
+        // address change along with the capacity so fetch them after each call. Returns false if it ran out of
+        // memory. The previous build is kept if that happened before the memory got replaced, otherwise the
+        // acceleration structure stays unbuilt until a later call rebuilds it, so don't trace against it after a
+        // false return
+        bool PopulateTopLevelBuildCommandList(vk::CommandBuffer commandList,
+                                              const uint64_t    topLevelId,
+                                              const uint64_t    completedFenceValue,
+                                              const uint64_t    submitFenceValue);
+
+        // Returns a command list with compaction copies if the acceleration structures are ready to be compacted.
+        // Never waits on the GPU, acceleration structures whose compaction size isn't available yet are skipped
+        // and can be passed in again on a later frame. Ids over the compaction budget are deferred to later calls,
+        // see SetCompactionBudget. The ids compacted by this call, which includes deferred ones from earlier calls,
+        // are appended to compactedAccelStructIds. Only pass those to GarbageCollection once the copies finished,
+        // skipped and deferred ids still need their transient memory
+        void PopulateCompactionCommandList(vk::CommandBuffer            commandList,
+                                           const std::vector<uint64_t>& accelStructIds,
+                                           std::vector<uint64_t>&       compactedAccelStructIds);
+
+        // Same as above for callers that don't track the compacted ids
+        void PopulateCompactionCommandList(vk::CommandBuffer            commandList,
                                            const std::vector<uint64_t>& accelStructIds);
 
         // Receives acceleration structure inputs and places UAV barriers for them
@@ -79,7 +194,128 @@ namespace rtxmu
         void PopulateCompactionSizeCopiesCommandList(vk::CommandBuffer commandList,
                                                      const std::vector<uint64_t>& accelStructIds);
 
-        // Remove all memory that an Acceleration Structure might use
+        // Drives compaction without any manual bookkeeping. Builds handed over with TrackBuilds get their
+        // compaction size queried, get compacted and finally get their transient memory released, each
+        // step as soon as completedFenceValue shows the previous one finished. Fence values are typically
+        // timeline semaphore values and the recorded commands must be submitted so that they signal submitFenceValue
+        void Tick(vk::CommandBuffer commandList,
+                  const uint64_t    completedFenceValue,
+                  const uint64_t    submitFenceValue);
+
+        // Moves compacted acceleration structures out of the emptiest compaction blocks with clone copies,
+        // copying at most byteBudget bytes per call so the work can be spread over frames. Moved ids are
+        // appended to movedAccelStructIds, their new address is returned right away so instance descs
+        // referencing them need patching. Pass the moved ids to GarbageCollection once the copies finished
+        // on the GPU to release their old copy, blocks get released as soon as they are emptied out.
+        // Must not overlap other calls on the manager
+        void PopulateDefragmentationCommandList(vk::CommandBuffer           commandList,
+                                                const uint64_t              byteBudget,
+                                                std::vector<uint64_t>&      movedAccelStructIds,
+                                                const double                maxBlockOccupancy = DefaultDefragmentationOccupancy);
+
+        // Caps the device local memory held by the suballocator blocks, 0 lifts the cap. Blocks that would exceed it
+        // fail to allocate unless the callback lets them through. The callback must not call back into the
+        // manager, see MemoryBudgetCallback
+        void SetMemoryBudget(const uint64_t       memoryBudget,
+                             MemoryBudgetCallback callback         = nullptr,
+                             void*                callbackUserData = nullptr);
+
+        // Returns the device local memory currently held by the suballocator blocks
+        uint64_t GetAllocatedDeviceMemory();
+
+        // Queries the device local heap budget and usage through VK_EXT_memory_budget, returns false if unsupported
+        bool QueryVideoMemoryBudget(uint64_t& budget,
+                                    uint64_t& usage);
+
+        // Vulkan has no explicit residency control, kept for parity with D3D12 and always returns 0
+        uint64_t EvictIdleBlocks();
+
+        // Binds the buffers of blocks allocated from here on to shared allocations of heapSize bytes instead of
+        // a dedicated allocation per block, so block creation no longer allocates device memory and the pools
+        // recycle each other's memory. The arena lives as long as the manager and keeps its heap size once enabled.
+        // Its heaps count against the memory budget in full, the blocks placed in them don't count on their own
+        void EnableHeapArena(const uint64_t heapSize = DefaultHeapArenaSize);
+
+        // Serializes bottom level acceleration structures whose build and compaction completed on the GPU, in
+        // two steps. The first call records the serialized size queries, later calls record the serialize copies
+        // once completedFenceValue shows the size queries finished. Acceleration structures still waiting on
+        // compaction are skipped. The commands must be submitted so that they signal submitFenceValue
+        void PopulateSerializeCommandList(vk::CommandBuffer            commandList,
+                                          const std::vector<uint64_t>& accelStructIds,
+                                          const uint64_t               completedFenceValue,
+                                          const uint64_t               submitFenceValue);
+
+        // Fills blob with the RTXMU header and the serialized data once completedFenceValue shows the serialize copy
+        // completed on the GPU, tagged with geometryKey. Returns false while the acceleration structure isn't serialized yet
+        bool GetSerializedAccelStruct(const uint64_t        accelStructId,
+                                      const uint64_t        geometryKey,
+                                      const uint64_t        completedFenceValue,
+                                      std::vector<uint8_t>& blob);
+
+        // Returns whether a serialized blob was written by this RTXMU version for a compatible driver and device
+        bool IsSerializedAccelStructCompatible(const SerializedAccelStruct& serializedAccelStruct);
+
+        // Deserializes blobs straight into the compaction pool, skipping the build and compaction. Blobs that are
+        // incompatible or out of memory get ReservedId and make it return false. Pass the ids to GarbageCollection
+        // once the copies finished on the GPU to release the uploaded blobs. Deserialized acceleration structures
+        // are final and can't be updated or rebuilt
+        bool PopulateDeserializeCommandList(vk::CommandBuffer                         commandList,
+                                            const std::vector<SerializedAccelStruct>& serializedAccelStructs,
+                                            std::vector<uint64_t>&                    accelStructIds);
+
+#ifdef VK_EXT_opacity_micromap
+        // Builds opacity micromaps into pools of their own. Micromap ids come from the acceleration structure id table
+        // and go through TrackBuilds, Tick, GarbageCollection and RemoveAccelerationStructures like bottom level ones,
+        // micromaps built with eAllowCompaction get compacted. BLAS keep referencing the micromap they were built with,
+        // so build them once GetCompactionComplete is set for compacted micromaps and place PopulateUAVBarriersCommandList
+        // on the ids first. Returns false if a build ran out of memory or ids, its id is then ReservedId and nothing
+        // was recorded, or if the device doesn't have VK_EXT_opacity_micromap enabled
+        bool PopulateMicromapBuildCommandList(vk::CommandBuffer         commandList,
+                                              vk::MicromapBuildInfoEXT* buildInfos,
+                                              const uint32_t            buildCount,
+                                              std::vector<uint64_t>&    micromapIds);
+
+        // Returns the micromap to reference from the opacity micromap triangles of BLAS builds
+        vk::MicromapEXT GetMicromap(const uint64_t micromapId);
+#endif
+
+        // Caps the builds recorded per buildAccelerationStructuresKHR call, 0 lifts the cap. Builds get recorded
+        // largest scratch first and a batch also splits wherever the scratch budget wraps around
+        void SetMaxBuildsPerChunk(const uint32_t maxBuildsPerChunk);
+
+        // Keeps emptied blocks allocated for a while and grows new blocks of pools that keep running out, so
+        // content streaming in and out doesn't allocate and free blocks every frame. See BlockRetention
+        void SetBlockRetention(const BlockRetention& retention);
+
+        // Ages retained blocks, releases the expired ones, starts the per frame telemetry counters over and
+        // delivers log messages queued by async logging. Tick calls it once per call
+        void AdvanceFrame();
+
+        // Releases every retained block right away, returns the number of bytes released
+        uint64_t TrimRetainedBlocks();
+
+        // Binds the buffers of blocks allocated from here on to memory of an external allocator, which has to
+        // outlive them. Null goes back to dedicated allocations
+        void SetMemoryAllocator(VkMemoryAllocator* memoryAllocator);
+
+        // Shares the buffers of blocks allocated from here on between the queue families, so builds and compactions
+        // can be recorded on an async compute queue while the acceleration structures get used on the graphics queue
+        // without queue family ownership transfers. Call before Initialize to cover every block. The recordings only
+        // use acceleration structure build stages, which compute queues support. Fence values passed to TrackBuilds
+        // and Tick have to come from one timeline, like a timeline semaphore signaled by every queue involved
+        void SetQueueFamilies(const std::vector<uint32_t>& queueFamilyIndices);
+
+        // Allocates the memory of blocks allocated from here on on the physical devices of the device group in
+        // deviceMask only, 0 goes back to every physical device of the group. Call before Initialize to cover every
+        // block. Memory of an external allocator, see SetMemoryAllocator, is placed by that allocator instead
+        void SetDeviceMask(const uint32_t deviceMask);
+
+        // Measures every build, update, compaction size query and compaction batch recorded from here on with a pair
+        // of timestamp queries, see GetGpuTimings. The batches must go to a queue with timestampValidBits set.
+        // Returns false if the device doesn't support timestamps or the queries couldn't be created
+        bool EnableGpuTiming();
+
+        // Remove all memory that an Acceleration Structure might use, once the last id sharing it is removed
         void RemoveAccelerationStructures(const std::vector<uint64_t>& accelStructIds);
 
         // Remove all memory used in build process, while only leaving the acceleration structure buffer itself in memory
@@ -122,22 +358,122 @@ namespace rtxmu
 
         Stats GetCompactionPoolMemoryStats();
 
+        // Returns the counters of a pool without walking its blocks, pools this backend doesn't own read all zero
+        PoolTelemetry GetPoolTelemetry(const PoolType pool);
+
         static void logCallbackFunction(const char* msg);
 
     private:
 
+        // Applies the block retention policy to the video memory pools
+        void ApplyBlockRetention();
+
+        // Returns the scratch address for a build, taken from the scratch budget whenever the build fits in it.
+        // needsBarrier reports that builds recorded so far must finish before this one may start
+        vk::DeviceAddress AcquireScratch(VkAccelerationStructure* accelStruct,
+                                         const vk::DeviceSize     scratchSize,
+                                         bool&                    needsBarrier);
+
+        // Fills the deduplication key of bottom level inputs, returns false for inputs that can't be shared
+        bool GetBuildInputKey(const vk::AccelerationStructureBuildGeometryInfoKHR& geomInfo,
+                              const vk::AccelerationStructureBuildRangeInfoKHR*    rangeInfo,
+                              BuildInputKey&                                       key);
+
+        // Returns the scratch address for a refit, from the scratch budget unless the acceleration structure holds its own
+        vk::DeviceAddress AcquireUpdateScratch(VkAccelerationStructure* accelStruct,
+                                               bool&                    needsBarrier);
+
+        // Adds a build to the current chunk of the calling thread, recording the chunk once it is full
+        void QueueBuild(vk::CommandBuffer                                   commandList,
+                        const vk::AccelerationStructureBuildGeometryInfoKHR& geomInfo,
+                        const vk::AccelerationStructureBuildRangeInfoKHR*    rangeInfo);
+
+        // Records the current chunk of builds, followed by a scratch barrier when placeBarrier is set
+        void FlushBuilds(vk::CommandBuffer commandList,
+                         const bool        placeBarrier);
+
+        // Writes the begin timestamp of a batch, returns false if the batch goes unmeasured
+        bool BeginGpuTiming(vk::CommandBuffer    commandList,
+                            const GpuTimingPhase phase,
+                            uint32_t&            queryIndex);
+
+        // Writes the end timestamp of a batch once all of its builds and copies are done
+        void EndGpuTiming(vk::CommandBuffer commandList,
+                          const uint32_t    queryIndex,
+                          const uint64_t    accelStructCount,
+                          const uint64_t    bytes);
+
+        void ResetCompactionSizeQuery(vk::QueryPool  queryPool,
+                                      vk::DeviceSize queryOffset);
+
+        void ReadCompactionSizes(const std::vector<uint64_t>& accelStructIds,
+                                 std::vector<uint64_t>&       readyIds,
+                                 std::vector<vk::DeviceSize>& compactionSizes);
+
+        // Moves a top level acceleration structure to memory sized for instanceCapacity instances, retiring the previous memory
+        bool AllocateTopLevelMemory(const uint64_t topLevelId,
+                                    const uint32_t instanceCapacity);
+
+        // Releases retired top level memory the GPU is done with
+        void ReleaseRetiredTopLevelMemory(VkTopLevel*    topLevel,
+                                          const uint64_t completedFenceValue);
+
+        void ReleaseSerializedMemory(VkAccelerationStructure* accelStruct);
+
+        // Releases the memory rebuilds moved away from
+        void ReleaseRetiredRebuildMemory(VkAccelerationStructure* accelStruct);
+
         void PostBuildRelease(const uint64_t accelStructId);
 
         void ReleaseAccelerationStructures(const uint64_t accelStructId);
 
+#ifdef VK_EXT_opacity_micromap
+        // Records the compaction copy of a micromap, returns false if it's out of memory
+        bool CompactMicromap(vk::CommandBuffer    commandList,
+                             const uint64_t       micromapId,
+                             const vk::DeviceSize compactionSize);
+
+        vk::BufferMemoryBarrier GetMicromapBarrier(const VkAccelerationStructure* accelStruct);
+
+        // Micromap stages only exist with synchronization2, the legacy barriers cover them with all commands
+        void PlaceMicromapBarriers(vk::CommandBuffer                           commandList,
+                                   const std::vector<vk::BufferMemoryBarrier>& barriers);
+
+        // Releases the scratch and, once compacted, the uncompacted copy of a micromap
+        void ReleaseMicromapBuildMemory(VkAccelerationStructure* accelStruct);
+
+        void ReleaseMicromapMemory(VkAccelerationStructure* accelStruct);
+#endif
+
         Allocator m_allocator;
 
+        // Declared ahead of the pools so it outlives the blocks bound to it
+        std::unique_ptr<VkMemoryArena>                                        m_heapArena;
+
         // Suballocation buffers
-        std::unique_ptr<Suballocator<Allocator, VkScratchBlock>>     m_scratchPool;
-        std::unique_ptr<Suballocator<Allocator, VkScratchBlock>>     m_updatePool;
-        std::unique_ptr<Suballocator<Allocator, VkAccelStructBlock>> m_resultPool;
-        std::unique_ptr<Suballocator<Allocator, VkAccelStructBlock>> m_transientResultPool;
-        std::unique_ptr<Suballocator<Allocator, VkAccelStructBlock>> m_compactionPool;
-        std::unique_ptr<Suballocator<Allocator, VkQueryBlock>>       m_queryCompactionSizePool;
+        std::unique_ptr<Suballocator<Allocator, VkScratchBlock>>              m_scratchPool;
+        std::unique_ptr<Suballocator<Allocator, VkScratchBlock>>              m_updatePool;
+        std::unique_ptr<SizeClassSuballocator<Allocator, VkAccelStructBlock>> m_resultPool;
+        std::unique_ptr<SizeClassSuballocator<Allocator, VkAccelStructBlock>> m_transientResultPool;
+        std::unique_ptr<SizeClassSuballocator<Allocator, VkAccelStructBlock>> m_compactionPool;
+        std::unique_ptr<Suballocator<Allocator, VkQueryBlock>>                m_queryCompactionSizePool;
+        std::unique_ptr<Suballocator<Allocator, VkSerializationQueryBlock>>   m_querySerializedSizePool;
+        std::unique_ptr<Suballocator<Allocator, VkSerializationBlock>>        m_serializationPool;
+        std::unique_ptr<Suballocator<Allocator, VkInstanceBlock>>             m_instancePool;
+#ifdef VK_EXT_opacity_micromap
+        std::unique_ptr<SizeClassSuballocator<Allocator, VkMicromapBlock>>    m_micromapPool;
+        std::unique_ptr<SizeClassSuballocator<Allocator, VkMicromapBlock>>    m_compactedMicromapPool;
+        std::unique_ptr<Suballocator<Allocator, VkMicromapQueryBlock>>        m_queryMicromapCompactionSizePool;
+#endif
+
+        // Backing memory of the scratch budget
+        Suballocator<Allocator, VkScratchBlock>::SubAllocation                m_scratchRingMemory = {};
+
+        // Timestamp queries of GPU timing, created by EnableGpuTiming
+        std::unique_ptr<Suballocator<Allocator, VkTimestampQueryBlock>>       m_gpuTimingQueryPool;
+        Suballocator<Allocator, VkTimestampQueryBlock>::SubAllocation         m_gpuTimingQueries = {};
+
+        // Builds per buildAccelerationStructuresKHR call, 0 records each batch in as few calls as possible
+        uint32_t                                                              m_maxBuildsPerChunk = DefaultMaxBuildsPerChunk;
     };
 }
@@ -23,6 +23,7 @@
 #pragma once
 
 #include "Suballocator.h"
+#include "HeapArena.h"
 // #include <assert> #include <string> are included in vulkan.hpp
 #include <vulkan/vulkan.hpp>
 
@@ -38,30 +39,60 @@ namespace rtxmu
 
     constexpr uint32_t DefaultBlockAlignment = 65536;
 
+    // Lets suballocator block buffers be bound to memory owned by an external allocator such as VMA instead of
+    // a dedicated allocation per block. allocate returns a range of at least size bytes in memory of the given
+    // type and a handle that is passed back to free once the block bound to it is released
+    class VkMemoryAllocator
+    {
+    public:
+        virtual ~VkMemoryAllocator() = default;
+
+        virtual bool allocate(vk::DeviceSize    size,
+                              vk::DeviceSize    alignment,
+                              uint32_t          memoryTypeIndex,
+                              vk::DeviceMemory& memory,
+                              vk::DeviceSize&   memoryOffset,
+                              void*&            handle) = 0;
+
+        virtual void free(void* handle) = 0;
+
+        // Whether the memory is accounted against the memory budget itself, blocks bound to it aren't then
+        virtual bool isBudgeted() const { return false; }
+    };
+
     struct Allocator
     {
         vk::Instance       instance;
         vk::Device         device;
         vk::PhysicalDevice physicalDevice;
+        MemoryBudget       memoryBudget;
+        // Null allocates dedicated memory per block
+        VkMemoryAllocator* memoryAllocator = nullptr;
+        // Queue families the block buffers are shared between, fewer than two keeps them exclusive
+        std::vector<uint32_t> queueFamilyIndices;
+        // Physical devices of the device group the block memory gets allocated on, 0 allocates on every one of them
+        uint32_t              deviceMask = 0;
+        // Sink of the manager owning the pools
+        Logger*               logger = nullptr;
+        // Loaded for the device above, so managers on different devices don't share a dispatch table
+        VkDispatchLoaderDynamic dispatchLoader;
     };
 
     class VkBlock
     {
     public:
-        static VkDispatchLoaderDynamic& getDispatchLoader();
-
-        static uint32_t getMemoryIndex(const vk::PhysicalDevice& physicalDevice,
-                                       uint32_t                  memoryTypeBits,
-                                       vk::MemoryPropertyFlags   propFlags,
-                                       vk::MemoryHeapFlags       heapFlags);
-
         static vk::DeviceMemory getMemory(VkBlock block);
 
+        // Offset of the block buffer within its memory, non zero when the memory is shared with other blocks
+        static vk::DeviceSize getMemoryOffset(VkBlock block);
+
+        // Served from the address cached at allocation for buffers created with the device address usage
         static vk::DeviceAddress getDeviceAddress(const vk::Device& device,
-                                                  VkBlock           block,
+                                                  const VkBlock&    block,
                                                   uint64_t          offset);
 
-        void allocate(vk::DeviceSize          size,
+        // Returns false when the memory is out of budget or couldn't be allocated
+        bool allocate(vk::DeviceSize          size,
                       vk::BufferUsageFlags    usageFlags,
                       vk::MemoryPropertyFlags propFlags,
                       vk::MemoryHeapFlags     heapflags,
@@ -69,19 +100,85 @@ namespace rtxmu
 
         void free();
 
+        // Vulkan has no explicit residency control, the driver pages memory on its own
+        bool evict()        { return false; }
+        void makeResident() {}
+
         uint64_t getVMA();
 
         vk::Buffer getBuffer();
 
-        static void setAllocator(Allocator* allocator);
+        void setAllocator(Allocator* allocator);
 
     protected:
-        static Allocator* m_allocator;
+        Allocator* m_allocator = nullptr;
+
+    private:
+        uint32_t getMemoryIndex(uint32_t                memoryTypeBits,
+                                vk::MemoryPropertyFlags propFlags,
+                                vk::MemoryHeapFlags     heapFlags);
+
+        vk::DeviceMemory   m_memory = nullptr;
+        vk::Buffer         m_buffer = nullptr;
+        vk::DeviceSize     m_budgetedSize = 0;
+        // Memory range the buffer is bound to, null for dedicated allocations
+        VkMemoryAllocator* m_memoryAllocator = nullptr;
+        void*              m_memoryHandle = nullptr;
+        vk::DeviceSize     m_memoryOffset = 0;
+        vk::DeviceAddress  m_deviceAddress = 0;
+    };
+
+    // Memory allocation of the built in memory arena, heapKind is the memory type index
+    class VkMemoryHeap
+    {
+    public:
+
+        bool allocate(uint64_t size,
+                      uint32_t heapKind);
+
+        void free();
+
+        // Vulkan has no explicit residency control, the driver pages memory on its own
+        bool evict()        { return false; }
+        void makeResident() {}
+
+        vk::DeviceMemory getMemory();
+
+        void setAllocator(Allocator* allocator);
 
     private:
-        static VkDispatchLoaderDynamic m_dispatchLoader;
-        vk::DeviceMemory               m_memory = nullptr;
-        vk::Buffer                     m_buffer = nullptr;
+        Allocator*       m_allocator    = nullptr;
+        vk::DeviceMemory m_memory       = nullptr;
+        uint64_t         m_budgetedSize = 0;
+    };
+
+    // Built in memory allocator, the block buffers of every pool are bound to a few large allocations per
+    // memory type which get recycled between the pools as blocks come and go. Keeps the allocation count
+    // far below maxMemoryAllocationCount
+    class VkMemoryArena : public VkMemoryAllocator
+    {
+    public:
+
+        VkMemoryArena(Allocator* allocator,
+                      uint64_t   heapSize);
+
+        bool allocate(vk::DeviceSize    size,
+                      vk::DeviceSize    alignment,
+                      uint32_t          memoryTypeIndex,
+                      vk::DeviceMemory& memory,
+                      vk::DeviceSize&   memoryOffset,
+                      void*&            handle) override;
+
+        void free(void* handle) override;
+
+        // Allocations of device local memory types reserve their whole size against the memory budget
+        bool isBudgeted() const override { return true; }
+
+        uint64_t getSize();
+
+    private:
+
+        HeapArena<Allocator, VkMemoryHeap> m_arena;
     };
 
     class VkScratchBlock : public VkBlock
@@ -94,23 +191,28 @@ namespace rtxmu
 
         uint32_t getAlignment() { return alignment; }
 
-        void allocate(vk::DeviceSize size, std::string name)
+        bool allocate(vk::DeviceSize size, std::string name)
         {
-            VkBlock::allocate(size, usageFlags, propertyFlags, heapFlags, alignment);
+            if (VkBlock::allocate(size, usageFlags, propertyFlags, heapFlags, alignment) == false)
+            {
+                return false;
+            }
 
-            if (Logger::isEnabled(Level::DBG))
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
                 char buf[128];
                 snprintf(buf, sizeof buf, "RTXMU Scratch Suballocator Block Allocation of size %" PRIu64 "\n", size);
-                Logger::log(Level::DBG, buf);
+                m_allocator->logger->log(Level::DBG, buf);
             }
+
+            return true;
         }
 
         void free()
         {
-            if (Logger::isEnabled(Level::DBG))
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
-                Logger::log(Level::DBG, "RTXMU Scratch Suballocator Block Release\n");
+                m_allocator->logger->log(Level::DBG, "RTXMU Scratch Suballocator Block Release\n");
             }
             VkBlock::free();
         }
@@ -128,23 +230,28 @@ namespace rtxmu
 
         uint32_t getAlignment() { return alignment; }
 
-        void allocate(vk::DeviceSize size, std::string name)
+        bool allocate(vk::DeviceSize size, std::string name)
         {
-            VkBlock::allocate(size, usageFlags, propertyFlags, heapFlags, alignment);
+            if (VkBlock::allocate(size, usageFlags, propertyFlags, heapFlags, alignment) == false)
+            {
+                return false;
+            }
 
-            if (Logger::isEnabled(Level::DBG))
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
                 char buf[128];
                 snprintf(buf, sizeof buf, "RTXMU Result BLAS Suballocator Block Allocation of size %" PRIu64 "\n", size);
-                Logger::log(Level::DBG, buf);
+                m_allocator->logger->log(Level::DBG, buf);
             }
+
+            return true;
         }
 
         void free()
         {
-            if (Logger::isEnabled(Level::DBG))
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
-                Logger::log(Level::DBG, "RTXMU Result BLAS Suballocator Block Release\n");
+                m_allocator->logger->log(Level::DBG, "RTXMU Result BLAS Suballocator Block Release\n");
             }
             VkBlock::free();
         }
@@ -162,28 +269,75 @@ namespace rtxmu
 
         uint32_t getAlignment() { return alignment; }
 
-        void allocate(vk::DeviceSize size, std::string name)
+        bool allocate(vk::DeviceSize size, std::string name)
         {
-            VkBlock::allocate(size, usageFlags, propertyFlags, heapFlags, alignment);
+            if (VkBlock::allocate(size, usageFlags, propertyFlags, heapFlags, alignment) == false)
+            {
+                return false;
+            }
 
-            if (Logger::isEnabled(Level::DBG))
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
                 char buf[128];
                 snprintf(buf, sizeof buf, "RTXMU Compacted BLAS Suballocator Block Allocation of size %" PRIu64 "\n", size);
-                Logger::log(Level::DBG, buf);
+                m_allocator->logger->log(Level::DBG, buf);
             }
+
+            return true;
         }
 
         void free()
         {
-            if (Logger::isEnabled(Level::DBG))
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
-                Logger::log(Level::DBG, "RTXMU Compacted BLAS Suballocator Block Release\n");
+                m_allocator->logger->log(Level::DBG, "RTXMU Compacted BLAS Suballocator Block Release\n");
             }
             VkBlock::free();
         }
     };
 
+#ifdef VK_EXT_opacity_micromap
+    // Opacity micromaps live in buffers of their own usage, suballocated the same way as acceleration structures
+    class VkMicromapBlock : public VkBlock
+    {
+    public:
+        static constexpr vk::BufferUsageFlags    usageFlags = vk::BufferUsageFlagBits::eMicromapStorageEXT | vk::BufferUsageFlagBits::eShaderDeviceAddress;
+        static constexpr vk::MemoryPropertyFlags propertyFlags = vk::MemoryPropertyFlagBits::eDeviceLocal;
+        static constexpr vk::MemoryHeapFlags     heapFlags = vk::MemoryHeapFlagBits::eDeviceLocal;
+        static constexpr uint32_t                alignment = DefaultBlockAlignment;
+
+        vk::MicromapEXT                          m_micromapHandle;
+
+        uint32_t getAlignment() { return alignment; }
+
+        bool allocate(vk::DeviceSize size, std::string name)
+        {
+            if (VkBlock::allocate(size, usageFlags, propertyFlags, heapFlags, alignment) == false)
+            {
+                return false;
+            }
+
+            if (m_allocator->logger->isEnabled(Level::DBG))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU Micromap Suballocator Block Allocation of size %" PRIu64 "\n", size);
+                m_allocator->logger->log(Level::DBG, buf);
+            }
+
+            return true;
+        }
+
+        void free()
+        {
+            if (m_allocator->logger->isEnabled(Level::DBG))
+            {
+                m_allocator->logger->log(Level::DBG, "RTXMU Micromap Suballocator Block Release\n");
+            }
+            VkBlock::free();
+        }
+    };
+#endif
+
     class VkReadBackBlock : public VkBlock
     {
     public:
@@ -194,23 +348,28 @@ namespace rtxmu
 
         uint32_t getAlignment() { return alignment; }
 
-        void allocate(vk::DeviceSize size, std::string name)
+        bool allocate(vk::DeviceSize size, std::string name)
         {
-            VkBlock::allocate(size, usageFlags, propertyFlags, heapFlags, alignment);
+            if (VkBlock::allocate(size, usageFlags, propertyFlags, heapFlags, alignment) == false)
+            {
+                return false;
+            }
 
-            if (Logger::isEnabled(Level::DBG))
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
                 char buf[128];
                 snprintf(buf, sizeof buf, "RTXMU Readback CPU Suballocator Block Allocation of size %" PRIu64 "\n", size);
-                Logger::log(Level::DBG, buf);
+                m_allocator->logger->log(Level::DBG, buf);
             }
+
+            return true;
         }
 
         void free()
         {
-            if (Logger::isEnabled(Level::DBG))
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
-                Logger::log(Level::DBG, "RTXMU Readback CPU Suballocator Block Release\n");
+                m_allocator->logger->log(Level::DBG, "RTXMU Readback CPU Suballocator Block Release\n");
             }
             VkBlock::free();
         }
@@ -226,23 +385,28 @@ namespace rtxmu
 
         uint32_t getAlignment() { return alignment; }
 
-        void allocate(vk::DeviceSize size, std::string name)
+        bool allocate(vk::DeviceSize size, std::string name)
         {
-            VkBlock::allocate(size, usageFlags, propertyFlags, heapFlags, alignment);
+            if (VkBlock::allocate(size, usageFlags, propertyFlags, heapFlags, alignment) == false)
+            {
+                return false;
+            }
 
-            if (Logger::isEnabled(Level::DBG))
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
                 char buf[128];
                 snprintf(buf, sizeof buf, "RTXMU Compaction Size GPU Suballocator Block Allocation of size %" PRIu64 "\n", size);
-                Logger::log(Level::DBG, buf);
+                m_allocator->logger->log(Level::DBG, buf);
             }
+
+            return true;
         }
 
         void free()
         {
-            if (Logger::isEnabled(Level::DBG))
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
-                Logger::log(Level::DBG, "RTXMU Compaction Size GPU Suballocator Block Release\n");
+                m_allocator->logger->log(Level::DBG, "RTXMU Compaction Size GPU Suballocator Block Release\n");
             }
             VkBlock::free();
         }
@@ -256,34 +420,197 @@ namespace rtxmu
 
         uint32_t getAlignment() { return alignment; }
 
-        void allocate(vk::DeviceSize size, std::string name)
+        bool allocate(vk::DeviceSize size, std::string name)
+        {
+            return allocateQueryPool(size, vk::QueryType::eAccelerationStructureCompactedSizeKHR);
+        }
+
+        void free()
+        {
+            if (queryPool)
+            {
+                m_allocator->device.destroyQueryPool(queryPool, nullptr, m_allocator->dispatchLoader);
+
+                if (m_allocator->logger->isEnabled(Level::DBG))
+                {
+                    m_allocator->logger->log(Level::DBG, "RTXMU Compaction Query Suballocator Block Release\n");
+                }
+            }
+            VkBlock::free();
+        }
+
+    protected:
+
+        bool allocateQueryPool(vk::DeviceSize size, vk::QueryType queryType)
         {
             auto queryPoolInfo = vk::QueryPoolCreateInfo()
-                .setQueryType(vk::QueryType::eAccelerationStructureCompactedSizeKHR)
+                .setQueryType(queryType)
                 .setQueryCount((uint32_t)size);
 
-            queryPool = m_allocator->device.createQueryPool(queryPoolInfo, nullptr, VkBlock::getDispatchLoader());
+            if (m_allocator->device.createQueryPool(&queryPoolInfo, nullptr, &queryPool, m_allocator->dispatchLoader) != vk::Result::eSuccess)
+            {
+                queryPool = nullptr;
+                return false;
+            }
 
-            if (Logger::isEnabled(Level::DBG))
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
                 char buf[128];
                 snprintf(buf, sizeof buf, "RTXMU Compaction Query Suballocator Block Allocation of size %" PRIu64 "\n", size);
-                Logger::log(Level::DBG, buf);
+                m_allocator->logger->log(Level::DBG, buf);
             }
+
+            return true;
+        }
+    };
+
+    // Serialized size queries share the compaction query suballocation scheme, one query per 8 bytes
+    class VkSerializationQueryBlock : public VkQueryBlock
+    {
+    public:
+
+        bool allocate(vk::DeviceSize size, std::string name)
+        {
+            return allocateQueryPool(size, vk::QueryType::eAccelerationStructureSerializationSizeKHR);
+        }
+    };
+
+    // GPU timing timestamps share the compaction query suballocation scheme, one query per 8 bytes
+    class VkTimestampQueryBlock : public VkQueryBlock
+    {
+    public:
+
+        bool allocate(vk::DeviceSize size, std::string name)
+        {
+            return allocateQueryPool(size, vk::QueryType::eTimestamp);
+        }
+    };
+
+#ifdef VK_EXT_opacity_micromap
+    // Micromap compaction size queries share the compaction query suballocation scheme, one query per 8 bytes
+    class VkMicromapQueryBlock : public VkQueryBlock
+    {
+    public:
+
+        bool allocate(vk::DeviceSize size, std::string name)
+        {
+            return allocateQueryPool(size, vk::QueryType::eMicromapCompactedSizeEXT);
+        }
+    };
+#endif
+
+    // Host visible memory the serialize copies write to and deserialize copies read from, mapped for its lifetime
+    class VkSerializationBlock : public VkBlock
+    {
+    public:
+        static constexpr vk::BufferUsageFlags    usageFlags = vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
+                                                              vk::BufferUsageFlagBits::eTransferSrc | vk::BufferUsageFlagBits::eTransferDst;
+        static constexpr vk::MemoryPropertyFlags propertyFlags = vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent;
+        static constexpr vk::MemoryHeapFlags     heapFlags = vk::MemoryHeapFlagBits::eDeviceLocal;
+        static constexpr uint32_t                alignment = DefaultBlockAlignment;
+
+        uint32_t getAlignment() { return alignment; }
+
+        bool allocate(vk::DeviceSize size, std::string name)
+        {
+            if (VkBlock::allocate(size, usageFlags, propertyFlags, heapFlags, alignment) == false)
+            {
+                return false;
+            }
+
+            if (m_allocator->device.mapMemory(VkBlock::getMemory(*this), VkBlock::getMemoryOffset(*this), size, vk::MemoryMapFlags(),
+                                              reinterpret_cast<void**>(&m_mappedData), m_allocator->dispatchLoader) != vk::Result::eSuccess)
+            {
+                m_mappedData = nullptr;
+                VkBlock::free();
+                return false;
+            }
+
+            if (m_allocator->logger->isEnabled(Level::DBG))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU Serialization Suballocator Block Allocation of size %" PRIu64 "\n", size);
+                m_allocator->logger->log(Level::DBG, buf);
+            }
+
+            return true;
         }
 
         void free()
         {
-            if (queryPool)
+            if (m_allocator->logger->isEnabled(Level::DBG))
             {
-                m_allocator->device.destroyQueryPool(queryPool, nullptr, VkBlock::getDispatchLoader());
+                m_allocator->logger->log(Level::DBG, "RTXMU Serialization Suballocator Block Release\n");
+            }
 
-                if (Logger::isEnabled(Level::DBG))
-                {
-                    Logger::log(Level::DBG, "RTXMU Compaction Query Suballocator Block Release\n");
-                }
+            m_allocator->device.unmapMemory(VkBlock::getMemory(*this), m_allocator->dispatchLoader);
+            m_mappedData = nullptr;
+
+            VkBlock::free();
+        }
+
+        // CPU pointer to the start of the block
+        unsigned char* getMappedData() { return m_mappedData; }
+
+    private:
+
+        unsigned char* m_mappedData = nullptr;
+    };
+
+    // Instance buffers of managed top level acceleration structures, stay mapped and get written in place
+    class VkInstanceBlock : public VkBlock
+    {
+    public:
+        static constexpr vk::BufferUsageFlags    usageFlags = vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR;
+        static constexpr vk::MemoryPropertyFlags propertyFlags = vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent;
+        static constexpr vk::MemoryHeapFlags     heapFlags = vk::MemoryHeapFlagBits::eDeviceLocal;
+        static constexpr uint32_t                alignment = DefaultBlockAlignment;
+
+        uint32_t getAlignment() { return alignment; }
+
+        bool allocate(vk::DeviceSize size, std::string name)
+        {
+            if (VkBlock::allocate(size, usageFlags, propertyFlags, heapFlags, alignment) == false)
+            {
+                return false;
+            }
+
+            if (m_allocator->device.mapMemory(VkBlock::getMemory(*this), VkBlock::getMemoryOffset(*this), size, vk::MemoryMapFlags(),
+                                              reinterpret_cast<void**>(&m_mappedData), m_allocator->dispatchLoader) != vk::Result::eSuccess)
+            {
+                m_mappedData = nullptr;
+                VkBlock::free();
+                return false;
+            }
+
+            if (m_allocator->logger->isEnabled(Level::DBG))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU Instance Suballocator Block Allocation of size %" PRIu64 "\n", size);
+                m_allocator->logger->log(Level::DBG, buf);
+            }
+
+            return true;
+        }
+
+        void free()
+        {
+            if (m_allocator->logger->isEnabled(Level::DBG))
+            {
+                m_allocator->logger->log(Level::DBG, "RTXMU Instance Suballocator Block Release\n");
             }
+
+            m_allocator->device.unmapMemory(VkBlock::getMemory(*this), m_allocator->dispatchLoader);
+            m_mappedData = nullptr;
+
             VkBlock::free();
         }
+
+        // CPU pointer to the start of the block
+        unsigned char* getMappedData() { return m_mappedData; }
+
+    private:
+
+        unsigned char* m_mappedData = nullptr;
     };
 }
@@ -21,6 +21,9 @@
 */
 
 #include "rtxmu/D3D12AccelStructManager.h"
+#include <dxgi1_4.h>
+
+#pragma comment(lib, "dxgi.lib")
 
 namespace rtxmu
 {
@@ -31,7 +34,16 @@ namespace rtxmu
     {
         m_allocator.device = device;
 
-        Logger::setLoggerCallback(&DxAccelStructManager::logCallbackFunction);
+        m_allocator.logger = &m_logger;
+        m_logger.setLoggerCallback(&DxAccelStructManager::logCallbackFunction);
+    }
+
+    DxAccelStructManager::~DxAccelStructManager()
+    {
+        if (m_gpuTimingQueryHeap != nullptr)
+        {
+            m_gpuTimingQueryHeap->Release();
+        }
     }
 
     void DxAccelStructManager::logCallbackFunction(const char* msg)
@@ -40,16 +52,46 @@ namespace rtxmu
     }
 
     // Initializes suballocator block size
-    void DxAccelStructManager::Initialize(uint32_t suballocatorBlockSize)
+    void DxAccelStructManager::Initialize(uint32_t suballocatorBlockSize,
+                                          uint64_t scratchBudget)
     {
         m_suballocationBlockSize = suballocatorBlockSize;
+        m_scratchBudget = scratchBudget;
         m_scratchPool = std::make_unique<Suballocator<Allocator, D3D12ScratchBlock>>(m_suballocationBlockSize, AccelStructAlignment, &m_allocator);
         m_updatePool = std::make_unique<Suballocator<Allocator, D3D12ScratchBlock>>(m_suballocationBlockSize, AccelStructAlignment, &m_allocator);
-        m_resultPool = std::make_unique<Suballocator<Allocator, D3D12AccelStructBlock>>(m_suballocationBlockSize, AccelStructAlignment, &m_allocator);
-        m_transientResultPool = std::make_unique<Suballocator<Allocator, D3D12AccelStructBlock>>(m_suballocationBlockSize, AccelStructAlignment, &m_allocator);
-        m_compactionPool = std::make_unique<Suballocator<Allocator, D3D12CompactedAccelStructBlock>>(m_suballocationBlockSize, AccelStructAlignment, &m_allocator);
+        // Acceleration structure sizes range from a few KB to hundreds of MB so they get split into size classes
+        const std::vector<SizeClass> sizeClasses = m_sizeClasses.empty() ? GetDefaultSizeClasses(m_suballocationBlockSize) : m_sizeClasses;
+        m_resultPool = std::make_unique<SizeClassSuballocator<Allocator, D3D12AccelStructBlock>>(sizeClasses, AccelStructAlignment, &m_allocator);
+        m_transientResultPool = std::make_unique<SizeClassSuballocator<Allocator, D3D12AccelStructBlock>>(sizeClasses, AccelStructAlignment, &m_allocator);
+        m_compactionPool = std::make_unique<SizeClassSuballocator<Allocator, D3D12CompactedAccelStructBlock>>(sizeClasses, AccelStructAlignment, &m_allocator);
         m_compactionSizeGpuPool = std::make_unique<Suballocator<Allocator, D3D12CompactionWriteBlock>>(CompactionSizeSuballocationBlockSize, SizeOfCompactionDescriptor, &m_allocator);
         m_compactionSizeCpuPool = std::make_unique<Suballocator<Allocator, D3D12ReadBackBlock>>(CompactionSizeSuballocationBlockSize, SizeOfCompactionDescriptor, &m_allocator);
+        m_serializedGpuPool = std::make_unique<Suballocator<Allocator, D3D12ScratchBlock>>(m_suballocationBlockSize, AccelStructAlignment, &m_allocator);
+        m_serializedCpuPool = std::make_unique<Suballocator<Allocator, D3D12ReadBackBlock>>(m_suballocationBlockSize, AccelStructAlignment, &m_allocator);
+        m_uploadPool = std::make_unique<Suballocator<Allocator, D3D12UploadBlock>>(m_suballocationBlockSize, AccelStructAlignment, &m_allocator);
+        m_instancePool = std::make_unique<Suballocator<Allocator, D3D12UploadBlock>>(m_suballocationBlockSize, AccelStructAlignment, &m_allocator);
+        ApplyBlockRetention();
+
+        m_scratchPool->setTelemetry(PoolType::Scratch, &m_telemetrySink);
+        m_updatePool->setTelemetry(PoolType::Update, &m_telemetrySink);
+        m_resultPool->setTelemetry(PoolType::Result, &m_telemetrySink);
+        m_transientResultPool->setTelemetry(PoolType::TransientResult, &m_telemetrySink);
+        m_compactionPool->setTelemetry(PoolType::Compaction, &m_telemetrySink);
+        m_compactionSizeGpuPool->setTelemetry(PoolType::CompactionSize, &m_telemetrySink);
+        m_compactionSizeCpuPool->setTelemetry(PoolType::CompactionSizeReadback, &m_telemetrySink);
+        m_serializedGpuPool->setTelemetry(PoolType::Serialized, &m_telemetrySink);
+        m_serializedCpuPool->setTelemetry(PoolType::SerializedReadback, &m_telemetrySink);
+        m_uploadPool->setTelemetry(PoolType::Upload, &m_telemetrySink);
+        m_instancePool->setTelemetry(PoolType::Instance, &m_telemetrySink);
+
+        // The scratch budget lives in the scratch pool which got recreated above
+        m_scratchRingMemory = {};
+        if (m_scratchBudget > 0)
+        {
+            m_scratchRingMemory = m_scratchPool->allocate(m_scratchBudget);
+        }
+        // Fall back to per acceleration structure scratch when the budget couldn't be allocated
+        m_scratchRing.reset((m_scratchRingMemory.subBlock != nullptr) ? m_scratchBudget : 0);
     }
 
     // Resets all queues and frees all memory in suballocators
@@ -62,135 +104,418 @@ namespace rtxmu
         m_compactionPool.reset();
         m_compactionSizeGpuPool.reset();
         m_compactionSizeCpuPool.reset();
-        Initialize(m_suballocationBlockSize);
+        m_serializedGpuPool.reset();
+        m_serializedCpuPool.reset();
+        m_uploadPool.reset();
+        m_instancePool.reset();
+        Initialize(m_suballocationBlockSize, m_scratchBudget);
         AccelStructManager::Reset();
+
+        m_prebuildInfoCache.clear();
+    }
+
+    size_t DxAccelStructManager::PrebuildInfoKeyHash::operator()(const PrebuildInfoKey& key) const
+    {
+        return static_cast<size_t>(key.shape.hash);
+    }
+
+    bool DxAccelStructManager::GetBuildInputKey(const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& asInputs,
+                                                BuildInputKey&                                              key)
+    {
+        // Updatable acceleration structures get refit on their own and top level ones depend on instance data
+        if ((asInputs.Type != D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL) ||
+            (asInputs.Flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE))
+        {
+            return false;
+        }
+
+        key = BuildInputKey();
+        key.inputs.add(asInputs.Flags);
+        key.inputs.add(asInputs.NumDescs);
+
+        for (uint32_t descIndex = 0; descIndex < asInputs.NumDescs; descIndex++)
+        {
+            const D3D12_RAYTRACING_GEOMETRY_DESC& geometryDesc =
+                (asInputs.DescsLayout == D3D12_ELEMENTS_LAYOUT_ARRAY) ? asInputs.pGeometryDescs[descIndex] :
+                                                                        *asInputs.ppGeometryDescs[descIndex];
+
+            key.inputs.add((static_cast<uint64_t>(geometryDesc.Type) << 32) | geometryDesc.Flags);
+
+            if (geometryDesc.Type == D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES)
+            {
+                key.inputs.add((static_cast<uint64_t>(geometryDesc.Triangles.IndexFormat) << 32) | geometryDesc.Triangles.VertexFormat);
+                key.inputs.add((static_cast<uint64_t>(geometryDesc.Triangles.IndexCount) << 32) | geometryDesc.Triangles.VertexCount);
+                key.inputs.add(geometryDesc.Triangles.IndexBuffer);
+                key.inputs.add(geometryDesc.Triangles.VertexBuffer.StartAddress);
+                key.inputs.add(geometryDesc.Triangles.VertexBuffer.StrideInBytes);
+                key.inputs.add(geometryDesc.Triangles.Transform3x4);
+            }
+            else if (geometryDesc.Type == D3D12_RAYTRACING_GEOMETRY_TYPE_PROCEDURAL_PRIMITIVE_AABBS)
+            {
+                key.inputs.add(geometryDesc.AABBs.AABBCount);
+                key.inputs.add(geometryDesc.AABBs.AABBs.StartAddress);
+                key.inputs.add(geometryDesc.AABBs.AABBs.StrideInBytes);
+            }
+            else
+            {
+                // Unknown geometry types could depend on data outside the key
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void DxAccelStructManager::GetPrebuildInfo(const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS& asInputs,
+                                               D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO&       prebuildInfo)
+    {
+        // Opacity micromap arrays and other newer types size themselves from inputs outside the key
+        if ((asInputs.Type != D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL) &&
+            (asInputs.Type != D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL))
+        {
+            m_allocator.device->GetRaytracingAccelerationStructurePrebuildInfo(&asInputs, &prebuildInfo);
+            return;
+        }
+
+        PrebuildInfoKey key;
+        key.shape.add(asInputs.Type);
+        key.shape.add(asInputs.Flags);
+        key.shape.add(asInputs.NumDescs);
+
+        if (asInputs.Type == D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL)
+        {
+            for (uint32_t descIndex = 0; descIndex < asInputs.NumDescs; descIndex++)
+            {
+                const D3D12_RAYTRACING_GEOMETRY_DESC& geometryDesc =
+                    (asInputs.DescsLayout == D3D12_ELEMENTS_LAYOUT_ARRAY) ? asInputs.pGeometryDescs[descIndex] :
+                                                                            *asInputs.ppGeometryDescs[descIndex];
+
+                key.shape.add(geometryDesc.Type);
+                key.shape.add(geometryDesc.Flags);
+
+                if (geometryDesc.Type == D3D12_RAYTRACING_GEOMETRY_TYPE_TRIANGLES)
+                {
+                    key.shape.add((static_cast<uint64_t>(geometryDesc.Triangles.IndexFormat) << 32) | geometryDesc.Triangles.VertexFormat);
+                    key.shape.add((static_cast<uint64_t>(geometryDesc.Triangles.IndexCount) << 32) | geometryDesc.Triangles.VertexCount);
+                    key.shape.add(geometryDesc.Triangles.Transform3x4 != 0);
+                }
+                else if (geometryDesc.Type == D3D12_RAYTRACING_GEOMETRY_TYPE_PROCEDURAL_PRIMITIVE_AABBS)
+                {
+                    key.shape.add(geometryDesc.AABBs.AABBCount);
+                }
+                else
+                {
+                    // Unknown geometry types could depend on data outside the key so always ask the driver
+                    m_allocator.device->GetRaytracingAccelerationStructurePrebuildInfo(&asInputs, &prebuildInfo);
+                    return;
+                }
+            }
+        }
+
+        if (m_prebuildInfoCache.find(key, prebuildInfo))
+        {
+            return;
+        }
+
+        m_allocator.device->GetRaytracingAccelerationStructurePrebuildInfo(&asInputs, &prebuildInfo);
+        m_prebuildInfoCache.insert(key, prebuildInfo);
+    }
+
+    void DxAccelStructManager::SetPrebuildInfoCacheCapacity(const size_t capacity)
+    {
+        m_prebuildInfoCache.setCapacity(capacity);
     }
 
     // Receives acceleration structure inputs and returns a command list with build commands
-    void DxAccelStructManager::PopulateUpdateCommandList(ID3D12GraphicsCommandList4*                                 commandList,
+    bool DxAccelStructManager::PopulateUpdateCommandList(ID3D12GraphicsCommandList4*                                 commandList,
                                                          const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS* asInputs,
                                                          const uint32_t                                              buildCount,
                                                          const std::vector<uint64_t>&                                accelStructIds)
     {
-        std::lock_guard<std::mutex> guard(m_threadSafeLock);
+        // Recordings sharing the scratch budget must not interleave
+        std::unique_lock<std::mutex> scratchRingGuard(m_scratchRingLock, std::defer_lock);
+        if (m_scratchBudget > 0)
+        {
+            scratchRingGuard.lock();
+            m_scratchRing.beginRecording();
+        }
+
+        bool allBuildsRecorded = true;
+
+        uint32_t   gpuTimingQuery = 0;
+        const bool timeUpdates    = (buildCount > 0) && BeginGpuTiming(commandList, GpuTimingPhase::Update, gpuTimingQuery);
+        uint64_t   updatedCount   = 0;
+        uint64_t   updatedBytes   = 0;
 
         for (uint32_t buildIndex = 0; buildIndex < buildCount; buildIndex++)
         {
             const uint64_t accelStructId = accelStructIds[buildIndex];
+            if (IsLiveId(accelStructId) == false)
+            {
+                continue;
+            }
             DxAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
 
-            if ((asInputs[buildIndex].Flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE) &&
-                (asInputs[buildIndex].Flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE))
+            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS inputs = asInputs[buildIndex];
+
+            const bool performUpdate = (inputs.Flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE) &&
+                                       (inputs.Flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE);
+
+            // Refits only move the existing BVH around so rebuild from time to time to restore its quality
+            if (performUpdate && IsRebuildDue(accelStruct))
+            {
+                inputs.Flags &= ~D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE;
+
+                if (m_logger.isEnabled(Level::DBG))
+                {
+                    char buf[128];
+                    snprintf(buf, sizeof buf, "RTXMU Refit %" PRIu64 " turned into a rebuild after %u refits\n", accelStructId, accelStruct->refitCount);
+                    m_logger.log(Level::DBG, buf);
+                }
+            }
+
+            if (performUpdate && (inputs.Flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE))
             {
                 // Setup build desc and allocator scratch and result buffers
                 D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC buildDesc = {};
-                buildDesc.Inputs = asInputs[buildIndex];
-                buildDesc.ScratchAccelerationStructureData = D3D12Block::getGPUVA(accelStruct->updateGpuMemory.block,
-                                                                                  accelStruct->updateGpuMemory.offset);
+                buildDesc.Inputs = inputs;
+                buildDesc.ScratchAccelerationStructureData = AcquireUpdateScratch(commandList, accelStruct);
                 buildDesc.DestAccelerationStructureData   = GetAccelStructGPUVA(accelStructId);
                 buildDesc.SourceAccelerationStructureData = GetAccelStructGPUVA(accelStructId);
 
+                if (buildDesc.ScratchAccelerationStructureData == 0)
+                {
+                    if (m_logger.isEnabled(Level::ERR))
+                    {
+                        char buf[128];
+                        snprintf(buf, sizeof buf, "RTXMU Update/Refit Build %" PRIu64 " is out of scratch memory and was skipped\n", accelStructId);
+                        m_logger.log(Level::ERR, buf);
+                    }
+                    allBuildsRecorded = false;
+                    continue;
+                }
+
                 commandList->BuildRaytracingAccelerationStructure(&buildDesc, 0, nullptr);
+                accelStruct->refitCount++;
+                updatedCount++;
+                updatedBytes += accelStruct->isCompacted ? accelStruct->compactionSize : accelStruct->resultSize;
 
-                if (Logger::isEnabled(Level::DBG))
+                RecordTrace(AllocationTraceRecordType::Update, accelStructId, accelStruct->updateScratchSize);
+
+                if (m_logger.isEnabled(Level::DBG))
                 {
                     char buf[128];
                     snprintf(buf, sizeof buf, "RTXMU Update/Refit Build %" PRIu64 "\n", accelStructId);
-                    Logger::log(Level::DBG, buf);
+                    m_logger.log(Level::DBG, buf);
                 }
             }
             else
             {
+                // Other ids share the acceleration structure and still expect the inputs it was built from
+                if (GetReferenceCount(accelStructId) > 1)
+                {
+                    if (m_logger.isEnabled(Level::ERR))
+                    {
+                        char buf[128];
+                        snprintf(buf, sizeof buf, "RTXMU Rebuild %" PRIu64 " is shared by build deduplication and was skipped\n", accelStructId);
+                        m_logger.log(Level::ERR, buf);
+                    }
+                    allBuildsRecorded = false;
+                    continue;
+                }
+                UnregisterDeduplicatedBuild(accelStructId);
+
                 // Setup build desc and allocator scratch and result buffers
                 D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC buildDesc = {};
-                buildDesc.Inputs                                             = asInputs[buildIndex];
+                buildDesc.Inputs                                             = inputs;
 
                 // Request build size information and suballocate the scratch and result buffers
                 D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO prebuildInfo = {};
-                m_allocator.device->GetRaytracingAccelerationStructurePrebuildInfo(&asInputs[buildIndex], &prebuildInfo);
+                GetPrebuildInfo(inputs, prebuildInfo);
+
+                uint32_t traceFlags = AllocationTraceRebuild;
 
                 // If the previous memory stores for the acceleration structure are not adequate then reallocate
-                if (accelStruct->scratchGpuMemory.subBlock->getSize() < prebuildInfo.ScratchDataSizeInBytes ||
+                if (accelStruct->scratchSize < prebuildInfo.ScratchDataSizeInBytes ||
+                    accelStruct->resultGpuMemory.subBlock == nullptr ||
                     accelStruct->resultGpuMemory.subBlock->getSize() < prebuildInfo.ResultDataMaxSizeInBytes)
                 {
 
-                    if (Logger::isEnabled(Level::WARN))
+                    if (m_logger.isEnabled(Level::WARN))
+                    {
+                        m_logger.log(Level::WARN, "Rebuild memory size is too small so reallocate\n");
+                    }
+
+                    // Stay in the pool the result was originally allocated from so it is released to the right pool
+                    auto resultGpuMemory = accelStruct->requestedCompaction ?
+                                               m_transientResultPool->allocate(prebuildInfo.ResultDataMaxSizeInBytes) :
+                                               m_resultPool->allocate(prebuildInfo.ResultDataMaxSizeInBytes);
+
+                    // Out of memory, keep the previous build around and skip the rebuild
+                    if (resultGpuMemory.subBlock == nullptr)
+                    {
+                        if (m_logger.isEnabled(Level::ERR))
+                        {
+                            char buf[128];
+                            snprintf(buf, sizeof buf, "RTXMU Rebuild %" PRIu64 " is out of memory and was skipped\n", accelStructId);
+                            m_logger.log(Level::ERR, buf);
+                        }
+                        allBuildsRecorded = false;
+                        continue;
+                    }
+                    // The GPU may still read the previous build and write its scratch, so both wait for garbage collection
+                    if (accelStruct->resultGpuMemory.subBlock != nullptr)
+                    {
+                        accelStruct->retiredResultMemory.push_back(accelStruct->resultGpuMemory);
+                    }
+                    if (accelStruct->scratchGpuMemory.subBlock != nullptr)
                     {
-                        Logger::log(Level::WARN, "Rebuild memory size is too small so reallocate and leak memory\n");
+                        accelStruct->retiredScratchMemory.push_back(accelStruct->scratchGpuMemory);
                     }
 
-                    accelStruct->resultGpuMemory = m_resultPool->allocate(prebuildInfo.ResultDataMaxSizeInBytes);
+                    accelStruct->resultGpuMemory = resultGpuMemory;
+                    PublishAddress(accelStructId, GetAccelStructGPUVA(accelStructId));
+                    traceFlags |= AllocationTraceReallocated;
 
-                    accelStruct->scratchGpuMemory = m_scratchPool->allocate(prebuildInfo.ScratchDataSizeInBytes);
-                    accelStruct->scratchSize = accelStruct->scratchGpuMemory.subBlock->getSize();
+                    // Scratch is acquired below, dropping the reference makes it reallocate at the new size
+                    accelStruct->scratchGpuMemory = {};
+                    accelStruct->scratchSize = prebuildInfo.ScratchDataSizeInBytes;
 
+                    m_totalUncompactedMemory -= accelStruct->resultSize;
                     m_totalUncompactedMemory += accelStruct->resultGpuMemory.subBlock->getSize();
                     accelStruct->resultSize = accelStruct->resultGpuMemory.subBlock->getSize();
+                    accelStruct->initialSize = prebuildInfo.ResultDataMaxSizeInBytes;
 
                     // Double check to make sure memory is large enough
-                    if (accelStruct->scratchGpuMemory.subBlock->getSize() < prebuildInfo.ScratchDataSizeInBytes ||
-                        accelStruct->resultGpuMemory.subBlock->getSize() < prebuildInfo.ResultDataMaxSizeInBytes)
+                    if (accelStruct->resultGpuMemory.subBlock->getSize() < prebuildInfo.ResultDataMaxSizeInBytes)
                     {
-                        if (Logger::isEnabled(Level::FATAL))
+                        if (m_logger.isEnabled(Level::FATAL))
                         {
-                            Logger::log(Level::FATAL, "Rebuild memory size is too small after reallocating\n");
+                            m_logger.log(Level::FATAL, "Rebuild memory size is too small after reallocating\n");
                             assert(0);
                         }
                     }
                 }
 
                 // All scratch is discarded after the build is performed but if a recurring build happens
-                // then we need to reallocate the same size
-                if ((accelStruct->scratchGpuMemory.subBlock == nullptr) ||
-                    (accelStruct->scratchGpuMemory.subBlock->isFree() == true))
-                {
-                    accelStruct->scratchGpuMemory =
-                        m_scratchPool->allocate(accelStruct->scratchGpuMemory.subBlock->getSize());
-                }
-
-                buildDesc.ScratchAccelerationStructureData = D3D12Block::getGPUVA(accelStruct->scratchGpuMemory.block,
-                                                                                  accelStruct->scratchGpuMemory.offset);
+                // then we need to reacquire the same size
+                buildDesc.ScratchAccelerationStructureData = AcquireScratch(commandList, accelStruct, accelStruct->scratchSize);
                 buildDesc.DestAccelerationStructureData    = D3D12Block::getGPUVA(accelStruct->resultGpuMemory.block,
                                                                                   accelStruct->resultGpuMemory.offset);
 
-                commandList->BuildRaytracingAccelerationStructure(&buildDesc, 0, nullptr);
+                if (buildDesc.ScratchAccelerationStructureData == 0)
+                {
+                    if (m_logger.isEnabled(Level::ERR))
+                    {
+                        char buf[128];
+                        snprintf(buf, sizeof buf, "RTXMU Rebuild %" PRIu64 " is out of scratch memory and was skipped\n", accelStructId);
+                        m_logger.log(Level::ERR, buf);
+                    }
+                    allBuildsRecorded = false;
+                    continue;
+                }
 
-                if (Logger::isEnabled(Level::DBG))
+                commandList->BuildRaytracingAccelerationStructure(&buildDesc, 0, nullptr);
+                accelStruct->refitCount       = 0;
+                accelStruct->rebuildRequested = false;
+                updatedCount++;
+                updatedBytes += accelStruct->resultSize;
+
+                RecordTrace(AllocationTraceRecordType::Update,
+                            accelStructId,
+                            prebuildInfo.ResultDataMaxSizeInBytes,
+                            prebuildInfo.ScratchDataSizeInBytes,
+                            traceFlags);
+
+                if (m_logger.isEnabled(Level::DBG))
                 {
                     char buf[128];
                     snprintf(buf, sizeof buf, "RTXMU Rebuild %" PRIu64 "\n", accelStructId);
-                    Logger::log(Level::DBG, buf);
+                    m_logger.log(Level::DBG, buf);
                 }
             }
         }
+
+        if (timeUpdates)
+        {
+            EndGpuTiming(commandList, gpuTimingQuery, updatedCount, updatedBytes);
+        }
+
+        return allBuildsRecorded;
     }
 
     // Receives acceleration structure inputs and returns a command list with build commands
-    void DxAccelStructManager::PopulateBuildCommandList(ID3D12GraphicsCommandList4*                                 commandList,
+    bool DxAccelStructManager::PopulateBuildCommandList(ID3D12GraphicsCommandList4*                                 commandList,
                                                         const D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS* asInputs,
                                                         const uint64_t                                              buildCount,
                                                         std::vector<uint64_t>&                                      accelStructIds)
     {
-        std::lock_guard<std::mutex> guard(m_threadSafeLock);
+        // Recordings sharing the scratch budget must not interleave
+        std::unique_lock<std::mutex> scratchRingGuard(m_scratchRingLock, std::defer_lock);
+        if (m_scratchBudget > 0)
+        {
+            scratchRingGuard.lock();
+            m_scratchRing.beginRecording();
+        }
+
+        bool allBuildsRecorded = true;
+
+        const bool    deduplicateBuilds = IsBuildDeduplicationEnabled();
+        BuildInputKey buildInputKey;
+
+        uint32_t   gpuTimingQuery = 0;
+        const bool timeBuilds     = (buildCount > 0) && BeginGpuTiming(commandList, GpuTimingPhase::Build, gpuTimingQuery);
+        uint64_t   builtCount     = 0;
+        uint64_t   builtBytes     = 0;
 
         accelStructIds.reserve(buildCount);
         for (uint32_t buildIndex = 0; buildIndex < buildCount; buildIndex++)
         {
+            // Inputs already built, possibly earlier in this batch, share that acceleration structure
+            const bool deduplicateBuild = deduplicateBuilds && GetBuildInputKey(asInputs[buildIndex], buildInputKey);
+            if (deduplicateBuild)
+            {
+                const uint64_t sharedId = AcquireDeduplicatedBuild(buildInputKey);
+                if (sharedId != ReservedId)
+                {
+                    accelStructIds.push_back(sharedId);
+                    continue;
+                }
+            }
+
             uint64_t asId = GetAccelStructId();
 
             // Assign an id for the acceleration structure
             accelStructIds.push_back(asId);
 
+            // Out of ids, skip the build
+            if (asId == ReservedId)
+            {
+                allBuildsRecorded = false;
+                continue;
+            }
+
             // Request build size information and suballocate the scratch and result buffers
             D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO prebuildInfo = {};
-            m_allocator.device->GetRaytracingAccelerationStructurePrebuildInfo(&asInputs[buildIndex], &prebuildInfo);
+            GetPrebuildInfo(asInputs[buildIndex], prebuildInfo);
 
             DxAccelerationStructure* accelStruct = m_asBufferBuildQueue[asId];
 
-            if (asInputs[buildIndex].Flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_COMPACTION)
+            const bool allowCompaction = (asInputs[buildIndex].Flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_COMPACTION) != 0;
+            const bool allowUpdate     = (asInputs[buildIndex].Flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE) != 0;
+
+            // Tag as not yet compacted
+            accelStruct->isCompacted         = false;
+            accelStruct->requestedCompaction = allowCompaction;
+
+            if (allowCompaction)
             {
                 // Allocate from transient result pool because it will be deallocated post compaction
                 accelStruct->resultGpuMemory = m_transientResultPool->allocate(prebuildInfo.ResultDataMaxSizeInBytes);
+
+                // Suballocate the gpu memory that the builder will use to write the compaction size post build
+                // along with the readback memory it gets copied to
+                accelStruct->compactionSizeGpuMemory = m_compactionSizeGpuPool->allocate(SizeOfCompactionDescriptor);
+                accelStruct->compactionSizeCpuMemory = m_compactionSizeCpuPool->allocate(SizeOfCompactionDescriptor);
             }
             else
             {
@@ -198,180 +523,1293 @@ namespace rtxmu
                 accelStruct->resultGpuMemory = m_resultPool->allocate(prebuildInfo.ResultDataMaxSizeInBytes);
             }
 
-            if (asInputs[buildIndex].Flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE)
-            {
-                accelStruct->updateGpuMemory = m_updatePool->allocate(prebuildInfo.UpdateScratchDataSizeInBytes);
-            }
+            // Update scratch that fits the scratch budget is drawn from it with every refit instead of being held on to
+            const bool holdsUpdateScratch = allowUpdate && (prebuildInfo.UpdateScratchDataSizeInBytes > m_scratchRing.getSize());
+            if (holdsUpdateScratch)
+            {
+                accelStruct->updateGpuMemory = m_updatePool->allocate(prebuildInfo.UpdateScratchDataSizeInBytes);
+            }
+
+            accelStruct->scratchSize       = prebuildInfo.ScratchDataSizeInBytes;
+            accelStruct->updateScratchSize = prebuildInfo.UpdateScratchDataSizeInBytes;
+
+            // Setup build desc and allocator scratch and result buffers
+            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC buildDesc = {};
+            buildDesc.Inputs = asInputs[buildIndex];
+
+            bool allocationFailed = (accelStruct->resultGpuMemory.subBlock == nullptr) ||
+                                    (holdsUpdateScratch && (accelStruct->updateGpuMemory.subBlock == nullptr)) ||
+                                    (allowCompaction && ((accelStruct->compactionSizeGpuMemory.subBlock == nullptr) ||
+                                                         (accelStruct->compactionSizeCpuMemory.subBlock == nullptr)));
+            if (allocationFailed == false)
+            {
+                buildDesc.ScratchAccelerationStructureData = AcquireScratch(commandList, accelStruct, accelStruct->scratchSize);
+                allocationFailed = (buildDesc.ScratchAccelerationStructureData == 0);
+            }
+
+            // Out of memory, hand back whatever got allocated and skip the build
+            if (allocationFailed)
+            {
+                if (m_logger.isEnabled(Level::ERR))
+                {
+                    char buf[128];
+                    snprintf(buf, sizeof buf, "RTXMU Initial Build %u is out of memory and was skipped\n", buildIndex);
+                    m_logger.log(Level::ERR, buf);
+                }
+
+                ReleaseAccelerationStructures(asId);
+                accelStructIds.back() = ReservedId;
+                allBuildsRecorded = false;
+                continue;
+            }
+
+            m_totalUncompactedMemory += accelStruct->resultGpuMemory.subBlock->getSize();
+            accelStruct->resultSize = accelStruct->resultGpuMemory.subBlock->getSize();
+            accelStruct->initialSize = prebuildInfo.ResultDataMaxSizeInBytes;
+
+            buildDesc.DestAccelerationStructureData = D3D12Block::getGPUVA(accelStruct->resultGpuMemory.block,
+                                                                           accelStruct->resultGpuMemory.offset);
+            PublishAddress(asId, buildDesc.DestAccelerationStructureData);
+
+            if (deduplicateBuild)
+            {
+                RegisterDeduplicatedBuild(asId, buildInputKey);
+            }
+
+            RecordTrace(AllocationTraceRecordType::Build,
+                        asId,
+                        prebuildInfo.ResultDataMaxSizeInBytes,
+                        prebuildInfo.ScratchDataSizeInBytes,
+                        (allowCompaction ? AllocationTraceAllowCompaction : 0) | (allowUpdate ? AllocationTraceAllowUpdate : 0));
+
+            builtCount++;
+            builtBytes += accelStruct->resultSize;
+
+            // Only perform compaction of the build inputs that include compaction
+            if (allowCompaction)
+            {
+                // Request to get compaction size post build
+                auto gpuVA = D3D12Block::getGPUVA(accelStruct->compactionSizeGpuMemory.block,
+                                                  accelStruct->compactionSizeGpuMemory.offset);
+
+                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_DESC postBuildInfo [] = 
+                { gpuVA, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_COMPACTED_SIZE };
+
+                commandList->BuildRaytracingAccelerationStructure(&buildDesc,
+                                                                  sizeof(postBuildInfo) / sizeof(postBuildInfo[0]),
+                                                                  postBuildInfo);
+
+                if (m_logger.isEnabled(Level::DBG))
+                {
+                    char buf[128];
+                    snprintf(buf, sizeof buf, "RTXMU Initial Build Enabled Compaction %" PRIu64 "\n", asId);
+                    m_logger.log(Level::DBG, buf);
+                }
+            }
+            else
+            {
+                // This build doesn't request compaction
+                commandList->BuildRaytracingAccelerationStructure(&buildDesc,
+                                                                  0,
+                                                                  nullptr);
+
+                if (m_logger.isEnabled(Level::DBG))
+                {
+                    char buf[128];
+                    snprintf(buf, sizeof buf, "RTXMU Initial Build Disabled Compaction %" PRIu64 "\n", asId);
+                    m_logger.log(Level::DBG, buf);
+                }
+            }
+        }
+
+        if (timeBuilds)
+        {
+            EndGpuTiming(commandList, gpuTimingQuery, builtCount, builtBytes);
+        }
+
+        return allBuildsRecorded;
+    }
+
+    uint64_t DxAccelStructManager::CreateTopLevel(const D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAGS flags,
+                                                  const uint32_t                                            instanceCapacity)
+    {
+        const uint64_t topLevelId = GetAccelStructId();
+        if (topLevelId == ReservedId)
+        {
+            return ReservedId;
+        }
+        DxAccelerationStructure* accelStruct = m_asBufferBuildQueue[topLevelId];
+
+        // Top level acceleration structures are rebuilt too often for compaction to pay off
+        accelStruct->topLevel        = std::make_unique<DxTopLevel>(instanceCapacity);
+        accelStruct->topLevel->flags = flags & ~D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_COMPACTION;
+
+        if (m_logger.isEnabled(Level::DBG))
+        {
+            char buf[128];
+            snprintf(buf, sizeof buf, "RTXMU Create Top Level %" PRIu64 "\n", topLevelId);
+            m_logger.log(Level::DBG, buf);
+        }
+        return topLevelId;
+    }
+
+    void DxAccelStructManager::SetTopLevelInstanceCount(const uint64_t topLevelId,
+                                                        const uint32_t instanceCount)
+    {
+        if (IsLiveId(topLevelId) && (m_asBufferBuildQueue[topLevelId]->topLevel != nullptr))
+        {
+            m_asBufferBuildQueue[topLevelId]->topLevel->instances.resize(instanceCount);
+        }
+    }
+
+    void DxAccelStructManager::SetTopLevelInstances(const uint64_t                        topLevelId,
+                                                    const uint32_t                        firstInstance,
+                                                    const D3D12_RAYTRACING_INSTANCE_DESC* instanceDescs,
+                                                    const uint32_t                        instanceCount)
+    {
+        if ((IsLiveId(topLevelId) == false) || (m_asBufferBuildQueue[topLevelId]->topLevel == nullptr))
+        {
+            return;
+        }
+        DxTopLevel* topLevel = m_asBufferBuildQueue[topLevelId]->topLevel.get();
+
+        if (static_cast<uint64_t>(firstInstance) + instanceCount > topLevel->instances.getInstanceCount())
+        {
+            if (m_logger.isEnabled(Level::ERR))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU Top Level %" PRIu64 " instances %u to %u are out of range and were skipped\n",
+                         topLevelId, firstInstance, firstInstance + instanceCount);
+                m_logger.log(Level::ERR, buf);
+            }
+            return;
+        }
+        topLevel->instances.write(firstInstance, instanceDescs, instanceCount);
+    }
+
+    bool DxAccelStructManager::PopulateTopLevelBuildCommandList(ID3D12GraphicsCommandList4* commandList,
+                                                                const uint64_t              topLevelId,
+                                                                const uint64_t              completedFenceValue,
+                                                                const uint64_t              submitFenceValue)
+    {
+        if ((IsLiveId(topLevelId) == false) || (m_asBufferBuildQueue[topLevelId]->topLevel == nullptr))
+        {
+            return false;
+        }
+        DxAccelerationStructure* accelStruct = m_asBufferBuildQueue[topLevelId];
+        DxTopLevel*              topLevel    = accelStruct->topLevel.get();
+
+        ReleaseRetiredTopLevelMemory(topLevel, completedFenceValue);
+
+        const bool     allowUpdate    = (topLevel->flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE) != 0;
+        const uint32_t targetCapacity = topLevel->instances.getTargetCapacity();
+        const bool     reallocate     = (targetCapacity != topLevel->instances.getCapacity()) ||
+                                        (accelStruct->resultGpuMemory.subBlock == nullptr);
+        const TopLevelBuildMode buildMode = topLevel->instances.selectBuildMode(reallocate,
+                                                                                allowUpdate,
+                                                                                IsRebuildDue(accelStruct),
+                                                                                m_topLevelRebuildRatio);
+        if (buildMode == TopLevelBuildMode::None)
+        {
+            return true;
+        }
+
+        // Recordings sharing the scratch budget must not interleave
+        std::unique_lock<std::mutex> scratchRingGuard(m_scratchRingLock, std::defer_lock);
+        if (m_scratchBudget > 0)
+        {
+            scratchRingGuard.lock();
+            m_scratchRing.beginRecording();
+        }
+
+        if ((buildMode == TopLevelBuildMode::Reallocate) &&
+            (AllocateTopLevelMemory(topLevelId, targetCapacity) == false))
+        {
+            return false;
+        }
+
+        // Flush the instances written since the picked instance buffer was last read
+        uint32_t bufferIndex = topLevel->instances.acquireBuffer(completedFenceValue);
+        if (bufferIndex == topLevel->instances.getBufferCount())
+        {
+            auto instanceMemory = m_instancePool->allocate(static_cast<uint64_t>(topLevel->instances.getCapacity()) *
+                                                           sizeof(D3D12_RAYTRACING_INSTANCE_DESC));
+            if (instanceMemory.subBlock == nullptr)
+            {
+                if (m_logger.isEnabled(Level::ERR))
+                {
+                    char buf[128];
+                    snprintf(buf, sizeof buf, "RTXMU Top Level %" PRIu64 " is out of instance memory and was skipped\n", topLevelId);
+                    m_logger.log(Level::ERR, buf);
+                }
+                return false;
+            }
+            bufferIndex = topLevel->instances.addBuffer(instanceMemory);
+        }
+
+        const auto& instanceMemory = topLevel->instances.getBufferMemory(bufferIndex);
+        const uint64_t flushedCount = topLevel->instances.flush(bufferIndex,
+                                                                instanceMemory.block.getMappedData() + instanceMemory.offset,
+                                                                submitFenceValue);
+
+        D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC buildDesc = {};
+        buildDesc.Inputs.Type          = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL;
+        buildDesc.Inputs.Flags         = topLevel->flags;
+        buildDesc.Inputs.NumDescs      = topLevel->instances.getInstanceCount();
+        buildDesc.Inputs.DescsLayout   = D3D12_ELEMENTS_LAYOUT_ARRAY;
+        buildDesc.Inputs.InstanceDescs = D3D12Block::getGPUVA(instanceMemory.block, instanceMemory.offset);
+        buildDesc.DestAccelerationStructureData = GetAccelStructGPUVA(topLevelId);
+
+        if (buildMode == TopLevelBuildMode::Update)
+        {
+            buildDesc.Inputs.Flags |= D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_PERFORM_UPDATE;
+            buildDesc.SourceAccelerationStructureData  = buildDesc.DestAccelerationStructureData;
+            buildDesc.ScratchAccelerationStructureData = AcquireUpdateScratch(commandList, accelStruct);
+        }
+        else
+        {
+            buildDesc.ScratchAccelerationStructureData = AcquireScratch(commandList, accelStruct, accelStruct->scratchSize);
+        }
+
+        if (buildDesc.ScratchAccelerationStructureData == 0)
+        {
+            if (m_logger.isEnabled(Level::ERR))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU Top Level %" PRIu64 " is out of scratch memory and was skipped\n", topLevelId);
+                m_logger.log(Level::ERR, buf);
+            }
+            return false;
+        }
+
+        const GpuTimingPhase gpuTimingPhase = (buildMode == TopLevelBuildMode::Update) ? GpuTimingPhase::Update : GpuTimingPhase::Build;
+        uint32_t   gpuTimingQuery = 0;
+        const bool timeBuild      = BeginGpuTiming(commandList, gpuTimingPhase, gpuTimingQuery);
+
+        commandList->BuildRaytracingAccelerationStructure(&buildDesc, 0, nullptr);
+
+        if (timeBuild)
+        {
+            EndGpuTiming(commandList, gpuTimingQuery, 1, accelStruct->resultSize);
+        }
+
+        // Rays are usually traced against it right after
+        D3D12_RESOURCE_BARRIER uavBarrier = {};
+        uavBarrier.Type          = D3D12_RESOURCE_BARRIER_TYPE_UAV;
+        uavBarrier.UAV.pResource = accelStruct->resultGpuMemory.block.getResource();
+        commandList->ResourceBarrier(1, &uavBarrier);
+
+        if (buildMode == TopLevelBuildMode::Update)
+        {
+            accelStruct->refitCount++;
+            RecordTrace(AllocationTraceRecordType::Update, topLevelId, accelStruct->updateScratchSize);
+        }
+        else
+        {
+            accelStruct->refitCount       = 0;
+            accelStruct->rebuildRequested = false;
+            if (buildMode == TopLevelBuildMode::Rebuild)
+            {
+                RecordTrace(AllocationTraceRecordType::Update,
+                            topLevelId,
+                            accelStruct->initialSize,
+                            accelStruct->scratchSize,
+                            AllocationTraceRebuild);
+            }
+        }
+
+        topLevel->instances.markBuilt();
+        topLevel->lastFenceValue = submitFenceValue;
+
+        if (m_logger.isEnabled(Level::DBG))
+        {
+            char buf[128];
+            snprintf(buf, sizeof buf, "RTXMU Top Level %s %" PRIu64 " uploaded %" PRIu64 " instances\n",
+                     (buildMode == TopLevelBuildMode::Update) ? "Refit" : "Rebuild", topLevelId, flushedCount);
+            m_logger.log(Level::DBG, buf);
+        }
+        return true;
+    }
+
+    bool DxAccelStructManager::AllocateTopLevelMemory(const uint64_t topLevelId,
+                                                      const uint32_t instanceCapacity)
+    {
+        DxAccelerationStructure* accelStruct = m_asBufferBuildQueue[topLevelId];
+        DxTopLevel*              topLevel    = accelStruct->topLevel.get();
+
+        D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_INPUTS inputs = {};
+        inputs.Type        = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL;
+        inputs.Flags       = topLevel->flags;
+        inputs.NumDescs    = instanceCapacity;
+        inputs.DescsLayout = D3D12_ELEMENTS_LAYOUT_ARRAY;
+
+        D3D12_RAYTRACING_ACCELERATION_STRUCTURE_PREBUILD_INFO prebuildInfo = {};
+        GetPrebuildInfo(inputs, prebuildInfo);
+
+        const bool allowUpdate        = (topLevel->flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_UPDATE) != 0;
+        const bool holdsUpdateScratch = allowUpdate && (prebuildInfo.UpdateScratchDataSizeInBytes > m_scratchRing.getSize());
+
+        auto resultGpuMemory = m_resultPool->allocate(prebuildInfo.ResultDataMaxSizeInBytes);
+        Suballocator<Allocator, D3D12ScratchBlock>::SubAllocation updateGpuMemory = {};
+        if (holdsUpdateScratch && (resultGpuMemory.subBlock != nullptr))
+        {
+            updateGpuMemory = m_updatePool->allocate(prebuildInfo.UpdateScratchDataSizeInBytes);
+        }
+
+        // Out of memory, the previous memory and capacity stay
+        if ((resultGpuMemory.subBlock == nullptr) ||
+            (holdsUpdateScratch && (updateGpuMemory.subBlock == nullptr)))
+        {
+            if (resultGpuMemory.subBlock != nullptr)
+            {
+                m_resultPool->free(resultGpuMemory.subBlock);
+            }
+            if (m_logger.isEnabled(Level::ERR))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU Top Level %" PRIu64 " is out of memory for %u instances and was skipped\n", topLevelId, instanceCapacity);
+                m_logger.log(Level::ERR, buf);
+            }
+            return false;
+        }
+
+        const bool isReallocation = (accelStruct->resultGpuMemory.subBlock != nullptr);
+
+        // Frames still in flight may trace against the previous memory or build from its instance buffers
+        DxRetiredTopLevelMemory retiredMemory;
+        retiredMemory.fenceValue       = topLevel->lastFenceValue;
+        retiredMemory.resultGpuMemory  = accelStruct->resultGpuMemory;
+        retiredMemory.scratchGpuMemory = accelStruct->scratchGpuMemory;
+        retiredMemory.updateGpuMemory  = accelStruct->updateGpuMemory;
+        topLevel->instances.setCapacity(instanceCapacity, retiredMemory.instanceMemory);
+        topLevel->retiredMemory.push_back(std::move(retiredMemory));
+
+        m_totalUncompactedMemory -= accelStruct->resultSize;
+
+        // Scratch is acquired by the build, dropping the reference makes it reallocate at the new size
+        accelStruct->resultGpuMemory   = resultGpuMemory;
+        accelStruct->updateGpuMemory   = updateGpuMemory;
+        accelStruct->scratchGpuMemory  = {};
+        accelStruct->scratchSize       = prebuildInfo.ScratchDataSizeInBytes;
+        accelStruct->updateScratchSize = prebuildInfo.UpdateScratchDataSizeInBytes;
+        accelStruct->resultSize        = resultGpuMemory.subBlock->getSize();
+        accelStruct->initialSize       = prebuildInfo.ResultDataMaxSizeInBytes;
+        m_totalUncompactedMemory += accelStruct->resultSize;
+
+        PublishAddress(topLevelId, GetAccelStructGPUVA(topLevelId));
+
+        const uint32_t updateFlag = allowUpdate ? AllocationTraceAllowUpdate : 0;
+        RecordTrace(isReallocation ? AllocationTraceRecordType::Update : AllocationTraceRecordType::Build,
+                    topLevelId,
+                    prebuildInfo.ResultDataMaxSizeInBytes,
+                    prebuildInfo.ScratchDataSizeInBytes,
+                    isReallocation ? (AllocationTraceRebuild | AllocationTraceReallocated) : updateFlag);
+
+        if (m_logger.isEnabled(Level::DBG))
+        {
+            char buf[128];
+            snprintf(buf, sizeof buf, "RTXMU Top Level %" PRIu64 " sized for %u instances\n", topLevelId, instanceCapacity);
+            m_logger.log(Level::DBG, buf);
+        }
+        return true;
+    }
+
+    void DxAccelStructManager::ReleaseRetiredTopLevelMemory(DxTopLevel*    topLevel,
+                                                            const uint64_t completedFenceValue)
+    {
+        auto retiredMemory = topLevel->retiredMemory.begin();
+        while (retiredMemory != topLevel->retiredMemory.end())
+        {
+            if (retiredMemory->fenceValue > completedFenceValue)
+            {
+                ++retiredMemory;
+                continue;
+            }
+
+            if (retiredMemory->resultGpuMemory.subBlock != nullptr)
+            {
+                m_resultPool->free(retiredMemory->resultGpuMemory.subBlock);
+            }
+            if (retiredMemory->scratchGpuMemory.subBlock != nullptr)
+            {
+                m_scratchPool->free(retiredMemory->scratchGpuMemory.subBlock);
+            }
+            if (retiredMemory->updateGpuMemory.subBlock != nullptr)
+            {
+                m_updatePool->free(retiredMemory->updateGpuMemory.subBlock);
+            }
+            for (auto& instanceMemory : retiredMemory->instanceMemory)
+            {
+                m_instancePool->free(instanceMemory.subBlock);
+            }
+            retiredMemory = topLevel->retiredMemory.erase(retiredMemory);
+        }
+    }
+
+    // Compaction size copies
+    void DxAccelStructManager::PopulateCompactionSizeCopiesCommandList(ID3D12GraphicsCommandList4* commandList,
+                                                                       const std::vector<uint64_t>& accelStructIds)
+    {
+        std::vector<uint64_t> liveIds;
+        GetLiveIds(accelStructIds, liveIds);
+
+        for (const uint64_t& accelStructId : liveIds)
+        {
+            DxAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
+            accelStruct->compactionSizeCopied = accelStruct->requestedCompaction;
+        }
+
+        // Copy ranges of compaction sizes still pending, neighboring sizes in the same blocks get coalesced
+        // into one copy instead of copying whole blocks of mostly stale sizes
+        struct SizeCopy
+        {
+            ID3D12Resource* gpuResource;
+            ID3D12Resource* cpuResource;
+            uint64_t        gpuOffset;
+            uint64_t        cpuOffset;
+            uint64_t        size;
+        };
+
+        std::vector<SizeCopy> sizeCopies;
+        sizeCopies.reserve(liveIds.size());
+        for (const uint64_t& accelStructId : liveIds)
+        {
+            DxAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
+            if (accelStruct->requestedCompaction)
+            {
+                sizeCopies.push_back({ accelStruct->compactionSizeGpuMemory.block.getResource(),
+                                       accelStruct->compactionSizeCpuMemory.block.getResource(),
+                                       accelStruct->compactionSizeGpuMemory.offset,
+                                       accelStruct->compactionSizeCpuMemory.offset,
+                                       SizeOfCompactionDescriptor });
+            }
+        }
+
+        if (sizeCopies.empty())
+        {
+            return;
+        }
+
+        uint32_t       gpuTimingQuery = 0;
+        const bool     timeSizeCopies = BeginGpuTiming(commandList, GpuTimingPhase::CompactionSizeCopy, gpuTimingQuery);
+        const uint64_t sizeCopyCount  = sizeCopies.size();
+
+        std::sort(sizeCopies.begin(), sizeCopies.end(), [](const SizeCopy& a, const SizeCopy& b)
+        {
+            if (a.gpuResource != b.gpuResource)
+            {
+                return a.gpuResource < b.gpuResource;
+            }
+            if (a.cpuResource != b.cpuResource)
+            {
+                return a.cpuResource < b.cpuResource;
+            }
+            return a.gpuOffset < b.gpuOffset;
+        });
+
+        size_t coalescedCount = 0;
+        for (size_t i = 1; i < sizeCopies.size(); i++)
+        {
+            SizeCopy&       last = sizeCopies[coalescedCount];
+            const SizeCopy& next = sizeCopies[i];
+            if ((next.gpuResource == last.gpuResource) &&
+                (next.cpuResource == last.cpuResource) &&
+                (next.gpuOffset   == last.gpuOffset + last.size) &&
+                (next.cpuOffset   == last.cpuOffset + last.size))
+            {
+                last.size += next.size;
+            }
+            else
+            {
+                sizeCopies[++coalescedCount] = next;
+            }
+        }
+        sizeCopies.resize(coalescedCount + 1);
+
+        // Copy command lists can't transition to or from unordered access. There the blocks rely on buffers decaying
+        // to the common state between submissions and getting promoted to copy source on the copy queue
+        const bool transitionBlocks = (commandList->GetType() != D3D12_COMMAND_LIST_TYPE_COPY);
+
+        // Transition only the gpu compaction size suballocator blocks being copied from, sorted so each shows up once
+        std::vector<D3D12_RESOURCE_BARRIER> barriers;
+        for (const SizeCopy& sizeCopy : sizeCopies)
+        {
+            if (transitionBlocks &&
+                (barriers.empty() || (barriers.back().Transition.pResource != sizeCopy.gpuResource)))
+            {
+                D3D12_RESOURCE_BARRIER rb = {};
+                rb.Transition.pResource   = sizeCopy.gpuResource;
+                rb.Transition.StateBefore = D3D12_RESOURCE_STATE_UNORDERED_ACCESS;
+                rb.Transition.StateAfter  = D3D12_RESOURCE_STATE_COPY_SOURCE;
+                rb.Type                   = D3D12_RESOURCE_BARRIER_TYPE_TRANSITION;
+                barriers.push_back(rb);
+            }
+        }
+
+        if (barriers.empty() == false)
+        {
+            commandList->ResourceBarrier(static_cast<UINT>(barriers.size()), barriers.data());
+        }
+
+        for (const SizeCopy& sizeCopy : sizeCopies)
+        {
+            commandList->CopyBufferRegion(sizeCopy.cpuResource, sizeCopy.cpuOffset, sizeCopy.gpuResource, sizeCopy.gpuOffset, sizeCopy.size);
+        }
+
+        // Transition the gpu written compaction size suballocator blocks back over to unordered for later use
+        for (D3D12_RESOURCE_BARRIER& barrier : barriers)
+        {
+            barrier.Transition.StateBefore = D3D12_RESOURCE_STATE_COPY_SOURCE;
+            barrier.Transition.StateAfter = D3D12_RESOURCE_STATE_UNORDERED_ACCESS;
+        }
+
+        if (barriers.empty() == false)
+        {
+            commandList->ResourceBarrier(static_cast<UINT>(barriers.size()), barriers.data());
+        }
+
+        if (timeSizeCopies)
+        {
+            EndGpuTiming(commandList, gpuTimingQuery, sizeCopyCount, sizeCopyCount * SizeOfCompactionDescriptor);
+        }
+    }
+
+    // Receives acceleration structure inputs and places UAV barriers for them
+    void DxAccelStructManager::PopulateUAVBarriersCommandList(ID3D12GraphicsCommandList4*  commandList,
+                                                              const std::vector<uint64_t>& accelStructIds)
+    {
+        std::vector<uint64_t> liveIds;
+        GetLiveIds(accelStructIds, liveIds);
+
+        // Many acceleration structures share a suballocator block so only place one barrier per resource
+        std::vector<D3D12_RESOURCE_BARRIER> barriers;
+        barriers.reserve(liveIds.size());
+
+        for (uint64_t accelStructId : liveIds)
+        {
+            ID3D12Resource* resource = m_asBufferBuildQueue[accelStructId]->isCompacted ?
+                m_asBufferBuildQueue[accelStructId]->compactionGpuMemory.block.getResource() :
+                m_asBufferBuildQueue[accelStructId]->resultGpuMemory.block.getResource();
+
+            bool alreadyPlaced = false;
+            for (const D3D12_RESOURCE_BARRIER& barrier : barriers)
+            {
+                if (barrier.UAV.pResource == resource)
+                {
+                    alreadyPlaced = true;
+                    break;
+                }
+            }
+
+            if (alreadyPlaced == false)
+            {
+                D3D12_RESOURCE_BARRIER rb = {};
+                rb.UAV.pResource = resource;
+                rb.Type = D3D12_RESOURCE_BARRIER_TYPE_UAV;
+                barriers.push_back(rb);
+            }
+        }
+
+        if (barriers.empty() == false)
+        {
+            commandList->ResourceBarrier(static_cast<UINT>(barriers.size()), barriers.data());
+        }
+    }
+
+    // Returns a command list with compaction copies if the acceleration structures are ready to be compacted
+    void DxAccelStructManager::PopulateCompactionCommandList(ID3D12GraphicsCommandList4*  commandList,
+                                                             const std::vector<uint64_t>& accelStructIds)
+    {
+        std::vector<uint64_t> compactedAccelStructIds;
+        PopulateCompactionCommandList(commandList, accelStructIds, compactedAccelStructIds);
+    }
+
+    void DxAccelStructManager::PopulateCompactionCommandList(ID3D12GraphicsCommandList4*  commandList,
+                                                             const std::vector<uint64_t>& accelStructIds,
+                                                             std::vector<uint64_t>&       compactedAccelStructIds)
+    {
+        // Keep track of last compacted resource to include barrier if the
+        // app requires a subsequent TLAS build or other read operation of the compacted version
+        ID3D12Resource* compactionResourceBarrier = nullptr;
+
+        // Compactions held back by the budget during earlier calls go along with the ones passed in
+        std::vector<uint64_t> compactionIds;
+        GetLiveIds(accelStructIds, compactionIds);
+        TakeDeferredCompactions(compactionIds);
+
+        // Only do compaction on the confirmed completion of the original build execution,
+        // the readback blocks stay mapped so the sizes are read straight out of system memory
+        std::vector<uint64_t> compactionSizes;
+        compactionSizes.reserve(compactionIds.size());
+
+        size_t pendingCount = 0;
+        for (const uint64_t& accelStructId : compactionIds)
+        {
+            DxAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
+            if ((accelStruct->requestedCompaction == true) &&
+                (accelStruct->isCompacted         == false))
+            {
+                uint64_t compactionSize = 0;
+                memcpy(&compactionSize,
+                       accelStruct->compactionSizeCpuMemory.block.getMappedData() + accelStruct->compactionSizeCpuMemory.offset,
+                       SizeOfCompactionDescriptor);
+
+                compactionIds[pendingCount++] = accelStructId;
+                compactionSizes.push_back(compactionSize);
+            }
+        }
+        compactionIds.resize(pendingCount);
+
+        ApplyCompactionBudget(compactionIds, compactionSizes);
+
+        uint32_t   gpuTimingQuery  = 0;
+        const bool timeCompactions = (compactionIds.empty() == false) &&
+                                     BeginGpuTiming(commandList, GpuTimingPhase::Compaction, gpuTimingQuery);
+        uint64_t   compactedCount  = 0;
+        uint64_t   compactedBytes  = 0;
+
+        for (size_t compactionIndex = 0; compactionIndex < compactionIds.size(); compactionIndex++)
+        {
+            const uint64_t accelStructId = compactionIds[compactionIndex];
+            CopyCompaction(commandList, accelStructId, compactionSizes[compactionIndex]);
+
+            if (m_asBufferBuildQueue[accelStructId]->isCompacted)
+            {
+                compactionResourceBarrier = m_asBufferBuildQueue[accelStructId]->compactionGpuMemory.block.getResource();
+                compactedCount++;
+                compactedBytes += m_asBufferBuildQueue[accelStructId]->compactionSize;
+                compactedAccelStructIds.push_back(accelStructId);
+            }
+        }
+
+        // Include resource barrier after final compaction
+        if (compactionResourceBarrier != nullptr)
+        {
+            D3D12_RESOURCE_BARRIER rb = {};
+            rb.UAV.pResource          = compactionResourceBarrier;
+            rb.Type                   = D3D12_RESOURCE_BARRIER_TYPE_UAV;
+            commandList->ResourceBarrier(1, &rb);
+        }
+
+        if (timeCompactions)
+        {
+            EndGpuTiming(commandList, gpuTimingQuery, compactedCount, compactedBytes);
+        }
+    }
+
+    // Advances the fence tracked pipeline and records the size copies and compactions that became possible
+    void DxAccelStructManager::Tick(ID3D12GraphicsCommandList4* commandList,
+                                    const uint64_t              completedFenceValue,
+                                    const uint64_t              submitFenceValue)
+    {
+        Tick(commandList, commandList, completedFenceValue, submitFenceValue);
+    }
+
+    void DxAccelStructManager::Tick(ID3D12GraphicsCommandList4* commandList,
+                                    ID3D12GraphicsCommandList4* copyCommandList,
+                                    const uint64_t              completedFenceValue,
+                                    const uint64_t              submitFenceValue)
+    {
+        // Timestamps of the completed submissions are already resolved into the mapped readback memory
+        if (m_gpuTimingQueryHeap != nullptr)
+        {
+            const unsigned char* timestamps = m_gpuTimingReadbackMemory.block.getMappedData() + m_gpuTimingReadbackMemory.offset;
+            CollectGpuTimings(completedFenceValue, [&](uint32_t queryIndex, uint64_t& beginTick, uint64_t& endTick)
+            {
+                memcpy(&beginTick, timestamps + queryIndex * sizeof(uint64_t), sizeof(uint64_t));
+                memcpy(&endTick, timestamps + (queryIndex + 1) * sizeof(uint64_t), sizeof(uint64_t));
+                return true;
+            });
+        }
+
+        PipelineWork work;
+        BeginPipelineTick(completedFenceValue, work);
+
+        // Release transient memory first so the compactions below can reuse it
+        if (work.garbageCollectionIds.empty() == false)
+        {
+            GarbageCollection(work.garbageCollectionIds);
+        }
+
+        if (work.sizeCopyIds.empty() == false)
+        {
+            PopulateCompactionSizeCopiesCommandList(copyCommandList, work.sizeCopyIds);
+        }
+
+        // Compactions the budget held back last tick are picked up from the backlog, tracked along with the new ones
+        std::vector<uint64_t> compactedIds;
+        PopulateCompactionCommandList(commandList, work.compactionIds, compactedIds);
+        work.compactionIds.insert(work.compactionIds.end(), compactedIds.begin(), compactedIds.end());
+        std::sort(work.compactionIds.begin(), work.compactionIds.end());
+        work.compactionIds.erase(std::unique(work.compactionIds.begin(), work.compactionIds.end()), work.compactionIds.end());
+
+        EndPipelineTick(submitFenceValue, work);
+
+        AdvanceFrame();
+
+        if (m_logger.isEnabled(Level::DBG))
+        {
+            char buf[128];
+            snprintf(buf, sizeof buf, "RTXMU Tick size copies %zu compactions %zu garbage collections %zu\n",
+                     work.sizeCopyIds.size(), work.compactionIds.size(), work.garbageCollectionIds.size());
+            m_logger.log(Level::DBG, buf);
+        }
+    }
+
+    // Moves compacted acceleration structures out of sparsely used compaction blocks
+    void DxAccelStructManager::PopulateDefragmentationCommandList(ID3D12GraphicsCommandList4* commandList,
+                                                                  const uint64_t              byteBudget,
+                                                                  std::vector<uint64_t>&      movedAccelStructIds,
+                                                                  const double                maxBlockOccupancy)
+    {
+        // Finish emptying the blocks picked earlier before picking new ones
+        if (m_compactionPool->getEvacuatingBlockCount() == 0)
+        {
+            m_compactionPool->beginEvacuation(maxBlockOccupancy, byteBudget);
+        }
+
+        const size_t firstMovedIndex = movedAccelStructIds.size();
+        uint64_t     copiedBytes     = 0;
+
+        const uint64_t entryCount = m_asBufferBuildQueue.size();
+        for (uint64_t accelStructId = ReservedId + 1; accelStructId < entryCount; accelStructId++)
+        {
+            DxAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
+
+            // Acceleration structures still waiting for their previous move to be garbage collected stay put
+            if ((accelStruct == nullptr) ||
+                (accelStruct->isCompacted == false) ||
+                (accelStruct->compactionGpuMemory.subBlock == nullptr) ||
+                (accelStruct->defragSourceMemory.subBlock != nullptr) ||
+                (accelStruct->compactionGpuMemory.subBlock->isEvacuating() == false))
+            {
+                continue;
+            }
+
+            const uint64_t allocatedSize = accelStruct->compactionGpuMemory.subBlock->getSize();
+            if ((copiedBytes > 0) && (copiedBytes + allocatedSize > byteBudget))
+            {
+                break;
+            }
+
+            const uint64_t compactedSize = allocatedSize - accelStruct->compactionGpuMemory.subBlock->getUnusedSize();
+
+            auto compactionGpuMemory = m_compactionPool->allocate(compactedSize);
+
+            // Out of memory, try again on a later call
+            if (compactionGpuMemory.subBlock == nullptr)
+            {
+                break;
+            }
+
+            accelStruct->defragSourceMemory  = accelStruct->compactionGpuMemory;
+            accelStruct->compactionGpuMemory = compactionGpuMemory;
+            PublishAddress(accelStructId, GetAccelStructGPUVA(accelStructId));
+
+            commandList->CopyRaytracingAccelerationStructure(D3D12Block::getGPUVA(accelStruct->compactionGpuMemory.block, accelStruct->compactionGpuMemory.offset),
+                                                             D3D12Block::getGPUVA(accelStruct->defragSourceMemory.block, accelStruct->defragSourceMemory.offset),
+                                                             D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_CLONE);
+
+            copiedBytes += allocatedSize;
+            movedAccelStructIds.push_back(accelStructId);
+        }
+
+        // Make the clones visible to any following TLAS build
+        if (movedAccelStructIds.size() > firstMovedIndex)
+        {
+            PopulateUAVBarriersCommandList(commandList, std::vector<uint64_t>(movedAccelStructIds.begin() + firstMovedIndex,
+                                                                              movedAccelStructIds.end()));
+        }
+
+        if (m_logger.isEnabled(Level::DBG))
+        {
+            char buf[128];
+            snprintf(buf, sizeof buf, "RTXMU Defragmentation moved %zu acceleration structures, %" PRIu64 " bytes\n",
+                     movedAccelStructIds.size() - firstMovedIndex, copiedBytes);
+            m_logger.log(Level::DBG, buf);
+        }
+    }
+
+    void DxAccelStructManager::PopulateSerializeCommandList(ID3D12GraphicsCommandList4*  commandList,
+                                                            const std::vector<uint64_t>& accelStructIds,
+                                                            const uint64_t               completedFenceValue,
+                                                            const uint64_t               submitFenceValue)
+    {
+        std::vector<ID3D12Resource*> sizeResources;
+        std::vector<uint64_t>        sizeQueryIds;
+        std::vector<ID3D12Resource*> serializedResources;
+        std::vector<uint64_t>        serializeIds;
+
+        std::vector<uint64_t> liveIds;
+        GetLiveIds(accelStructIds, liveIds);
+
+        for (const uint64_t& accelStructId : liveIds)
+        {
+            DxAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
+
+            if (accelStruct->serializationState == SerializationState::None)
+            {
+                // Serializing the uncompacted copy would be wasted once compaction replaces it
+                if (accelStruct->requestedCompaction && (accelStruct->isCompacted == false))
+                {
+                    continue;
+                }
+
+                accelStruct->serializedSizeGpuMemory = m_compactionSizeGpuPool->allocate(sizeof(D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_SERIALIZATION_DESC));
+                accelStruct->serializedSizeCpuMemory = m_compactionSizeCpuPool->allocate(sizeof(D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_SERIALIZATION_DESC));
+
+                if ((accelStruct->serializedSizeGpuMemory.subBlock == nullptr) ||
+                    (accelStruct->serializedSizeCpuMemory.subBlock == nullptr))
+                {
+                    if (m_logger.isEnabled(Level::ERR))
+                    {
+                        char buf[128];
+                        snprintf(buf, sizeof buf, "RTXMU Serialize %" PRIu64 " is out of memory and was skipped\n", accelStructId);
+                        m_logger.log(Level::ERR, buf);
+                    }
+                    ReleaseSerializedMemory(accelStruct);
+                    continue;
+                }
+
+                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_DESC postbuildInfo = {};
+                postbuildInfo.DestBuffer = D3D12Block::getGPUVA(accelStruct->serializedSizeGpuMemory.block, accelStruct->serializedSizeGpuMemory.offset);
+                postbuildInfo.InfoType   = D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_SERIALIZATION;
+
+                const D3D12_GPU_VIRTUAL_ADDRESS source = GetAccelStructGPUVA(accelStructId);
+                commandList->EmitRaytracingAccelerationStructurePostbuildInfo(&postbuildInfo, 1, &source);
+
+                accelStruct->serializationState       = SerializationState::SizeRequested;
+                accelStruct->serializedSizeFenceValue = submitFenceValue;
+                sizeResources.push_back(accelStruct->serializedSizeGpuMemory.block.getResource());
+                sizeQueryIds.push_back(accelStructId);
+            }
+            else if (accelStruct->serializationState == SerializationState::SizeRequested)
+            {
+                // The readback memory holds the size only once the query and its copy completed on the GPU
+                if (accelStruct->serializedSizeFenceValue > completedFenceValue)
+                {
+                    continue;
+                }
+
+                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_SERIALIZATION_DESC serializationDesc = {};
+                memcpy(&serializationDesc,
+                       accelStruct->serializedSizeCpuMemory.block.getMappedData() + accelStruct->serializedSizeCpuMemory.offset,
+                       sizeof(serializationDesc));
+
+                accelStruct->serializedGpuMemory = m_serializedGpuPool->allocate(serializationDesc.SerializedSizeInBytes);
+                accelStruct->serializedCpuMemory = m_serializedCpuPool->allocate(serializationDesc.SerializedSizeInBytes);
+
+                // Out of memory, keep the size around and try again on a later call
+                if ((accelStruct->serializedGpuMemory.subBlock == nullptr) ||
+                    (accelStruct->serializedCpuMemory.subBlock == nullptr))
+                {
+                    if (m_logger.isEnabled(Level::ERR))
+                    {
+                        char buf[128];
+                        snprintf(buf, sizeof buf, "RTXMU Serialize %" PRIu64 " is out of memory and was skipped\n", accelStructId);
+                        m_logger.log(Level::ERR, buf);
+                    }
+                    if (accelStruct->serializedGpuMemory.subBlock != nullptr)
+                    {
+                        m_serializedGpuPool->free(accelStruct->serializedGpuMemory.subBlock);
+                        accelStruct->serializedGpuMemory.subBlock = nullptr;
+                    }
+                    if (accelStruct->serializedCpuMemory.subBlock != nullptr)
+                    {
+                        m_serializedCpuPool->free(accelStruct->serializedCpuMemory.subBlock);
+                        accelStruct->serializedCpuMemory.subBlock = nullptr;
+                    }
+                    continue;
+                }
+
+                commandList->CopyRaytracingAccelerationStructure(D3D12Block::getGPUVA(accelStruct->serializedGpuMemory.block, accelStruct->serializedGpuMemory.offset),
+                                                                 GetAccelStructGPUVA(accelStructId),
+                                                                 D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_SERIALIZE);
+
+                accelStruct->serializedSize     = serializationDesc.SerializedSizeInBytes;
+                accelStruct->serializationState = SerializationState::Serializing;
+                accelStruct->serializeFenceValue = submitFenceValue;
+                serializedResources.push_back(accelStruct->serializedGpuMemory.block.getResource());
+                serializeIds.push_back(accelStructId);
+            }
+        }
+
+        // Bring the sizes and serialized data over to the readback blocks, the blocks they were written to
+        // stay in the unordered access state between calls
+        TransitionResources(commandList, sizeResources, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_COPY_SOURCE);
+        TransitionResources(commandList, serializedResources, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_COPY_SOURCE);
+
+        for (const uint64_t& accelStructId : sizeQueryIds)
+        {
+            DxAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
+            commandList->CopyBufferRegion(accelStruct->serializedSizeCpuMemory.block.getResource(),
+                                          accelStruct->serializedSizeCpuMemory.offset,
+                                          accelStruct->serializedSizeGpuMemory.block.getResource(),
+                                          accelStruct->serializedSizeGpuMemory.offset,
+                                          sizeof(D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_SERIALIZATION_DESC));
+        }
+        for (const uint64_t& accelStructId : serializeIds)
+        {
+            DxAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
+            commandList->CopyBufferRegion(accelStruct->serializedCpuMemory.block.getResource(),
+                                          accelStruct->serializedCpuMemory.offset,
+                                          accelStruct->serializedGpuMemory.block.getResource(),
+                                          accelStruct->serializedGpuMemory.offset,
+                                          accelStruct->serializedSize);
+        }
+
+        TransitionResources(commandList, sizeResources, D3D12_RESOURCE_STATE_COPY_SOURCE, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+        TransitionResources(commandList, serializedResources, D3D12_RESOURCE_STATE_COPY_SOURCE, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+
+        if (m_logger.isEnabled(Level::DBG))
+        {
+            char buf[128];
+            snprintf(buf, sizeof buf, "RTXMU Serialize %zu size queries, %zu copies\n", sizeQueryIds.size(), serializeIds.size());
+            m_logger.log(Level::DBG, buf);
+        }
+    }
 
-            accelStruct->scratchGpuMemory = m_scratchPool->allocate(prebuildInfo.ScratchDataSizeInBytes);
-            accelStruct->scratchSize = accelStruct->scratchGpuMemory.subBlock->getSize();
+    bool DxAccelStructManager::GetSerializedAccelStruct(const uint64_t        accelStructId,
+                                                        const uint64_t        geometryKey,
+                                                        const uint64_t        completedFenceValue,
+                                                        std::vector<uint8_t>& blob)
+    {
+        if (IsLiveId(accelStructId) == false)
+        {
+            return false;
+        }
 
-            m_totalUncompactedMemory += accelStruct->resultGpuMemory.subBlock->getSize();
-            accelStruct->resultSize = accelStruct->resultGpuMemory.subBlock->getSize();
+        DxAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
+        // The copy into the readback memory may still be in flight, which also keeps the memory from being released
+        if ((accelStruct->serializationState != SerializationState::Serializing) ||
+            (accelStruct->serializeFenceValue > completedFenceValue))
+        {
+            return false;
+        }
 
-            // Setup build desc and allocator scratch and result buffers
-            D3D12_BUILD_RAYTRACING_ACCELERATION_STRUCTURE_DESC buildDesc = {};
-            buildDesc.Inputs                                             = asInputs[buildIndex];
-            buildDesc.ScratchAccelerationStructureData = D3D12Block::getGPUVA(accelStruct->scratchGpuMemory.block,
-                                                                              accelStruct->scratchGpuMemory.offset);
-            buildDesc.DestAccelerationStructureData    = D3D12Block::getGPUVA(accelStruct->resultGpuMemory.block,
-                                                                              accelStruct->resultGpuMemory.offset);
+        SerializedAccelStructHeader header;
+        header.geometryKey    = geometryKey;
+        header.driverBlobSize = accelStruct->serializedSize;
 
-            // Only perform compaction of the build inputs that include compaction
-            if (asInputs[buildIndex].Flags & D3D12_RAYTRACING_ACCELERATION_STRUCTURE_BUILD_FLAG_ALLOW_COMPACTION)
-            {
-                // Tag as not yet compacted
-                accelStruct->isCompacted = false;
-                accelStruct->requestedCompaction = true;
+        blob.resize(sizeof(header) + accelStruct->serializedSize);
+        memcpy(blob.data(), &header, sizeof(header));
+        memcpy(blob.data() + sizeof(header),
+               accelStruct->serializedCpuMemory.block.getMappedData() + accelStruct->serializedCpuMemory.offset,
+               accelStruct->serializedSize);
 
-                // Suballocate the gpu memory that the builder will use to write the compaction size post build
-                accelStruct->compactionSizeGpuMemory = m_compactionSizeGpuPool->allocate(SizeOfCompactionDescriptor);
+        ReleaseSerializedMemory(accelStruct);
+        accelStruct->serializationState = SerializationState::None;
 
-                // Request to get compaction size post build
-                auto gpuVA = D3D12Block::getGPUVA(accelStruct->compactionSizeGpuMemory.block,
-                                                  accelStruct->compactionSizeGpuMemory.offset);
+        return true;
+    }
 
-                D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_DESC postBuildInfo [] = 
-                { gpuVA, D3D12_RAYTRACING_ACCELERATION_STRUCTURE_POSTBUILD_INFO_COMPACTED_SIZE };
+    bool DxAccelStructManager::IsSerializedAccelStructCompatible(const SerializedAccelStruct& serializedAccelStruct)
+    {
+        const SerializedAccelStructHeader* header = GetSerializedAccelStructHeader(serializedAccelStruct, sizeof(D3D12_SERIALIZED_RAYTRACING_ACCELERATION_STRUCTURE_HEADER));
+        if (header == nullptr)
+        {
+            return false;
+        }
 
-                commandList->BuildRaytracingAccelerationStructure(&buildDesc,
-                                                                  sizeof(postBuildInfo) / sizeof(postBuildInfo[0]),
-                                                                  postBuildInfo);
+        // Top level acceleration structures reference bottom level ones by address, which don't survive a reload
+        const D3D12_SERIALIZED_RAYTRACING_ACCELERATION_STRUCTURE_HEADER* driverHeader =
+            reinterpret_cast<const D3D12_SERIALIZED_RAYTRACING_ACCELERATION_STRUCTURE_HEADER*>(header + 1);
+        return (driverHeader->NumBottomLevelAccelerationStructurePointersAfterHeader == 0) &&
+               (m_allocator.device->CheckDriverMatchingIdentifier(D3D12_SERIALIZED_DATA_RAYTRACING_ACCELERATION_STRUCTURE,
+                                                                  &driverHeader->DriverMatchingIdentifier) == D3D12_DRIVER_MATCHING_IDENTIFIER_COMPATIBLE_WITH_DEVICE);
+    }
 
-                // Suballocate the readback memory
-                accelStruct->compactionSizeCpuMemory = m_compactionSizeCpuPool->allocate(SizeOfCompactionDescriptor);
+    bool DxAccelStructManager::PopulateDeserializeCommandList(ID3D12GraphicsCommandList4*               commandList,
+                                                              const std::vector<SerializedAccelStruct>& serializedAccelStructs,
+                                                              std::vector<uint64_t>&                    accelStructIds)
+    {
+        bool allDeserialized = true;
+        bool anyDeserialized = false;
 
-                if (Logger::isEnabled(Level::DBG))
+        accelStructIds.reserve(accelStructIds.size() + serializedAccelStructs.size());
+        for (size_t blobIndex = 0; blobIndex < serializedAccelStructs.size(); blobIndex++)
+        {
+            const SerializedAccelStruct& serializedAccelStruct = serializedAccelStructs[blobIndex];
+
+            // Stale blobs from another driver or device have to be rebuilt by the app
+            if (IsSerializedAccelStructCompatible(serializedAccelStruct) == false)
+            {
+                if (m_logger.isEnabled(Level::WARN))
                 {
                     char buf[128];
-                    snprintf(buf, sizeof buf, "RTXMU Initial Build Enabled Compaction %" PRIu64 "\n", asId);
-                    Logger::log(Level::DBG, buf);
+                    snprintf(buf, sizeof buf, "RTXMU Serialized Acceleration Structure %zu is incompatible and was skipped\n", blobIndex);
+                    m_logger.log(Level::WARN, buf);
                 }
+                accelStructIds.push_back(ReservedId);
+                allDeserialized = false;
+                continue;
             }
-            else
+
+            const SerializedAccelStructHeader* header = static_cast<const SerializedAccelStructHeader*>(serializedAccelStruct.data);
+            const D3D12_SERIALIZED_RAYTRACING_ACCELERATION_STRUCTURE_HEADER* driverHeader =
+                reinterpret_cast<const D3D12_SERIALIZED_RAYTRACING_ACCELERATION_STRUCTURE_HEADER*>(header + 1);
+
+            const uint64_t asId = GetAccelStructId();
+            if (asId == ReservedId)
             {
-                // This build doesn't request compaction
-                accelStruct->isCompacted = false;
-                accelStruct->requestedCompaction = false;
-                commandList->BuildRaytracingAccelerationStructure(&buildDesc,
-                                                                  0,
-                                                                  nullptr);
+                accelStructIds.push_back(ReservedId);
+                allDeserialized = false;
+                continue;
+            }
+            DxAccelerationStructure* accelStruct = m_asBufferBuildQueue[asId];
+
+            accelStruct->compactionGpuMemory      = m_compactionPool->allocate(driverHeader->DeserializedSizeInBytesInclPadding);
+            accelStruct->deserializedUploadMemory = m_uploadPool->allocate(header->driverBlobSize);
 
-                if (Logger::isEnabled(Level::DBG))
+            // Out of memory, hand back whatever got allocated
+            if ((accelStruct->compactionGpuMemory.subBlock == nullptr) ||
+                (accelStruct->deserializedUploadMemory.subBlock == nullptr))
+            {
+                if (m_logger.isEnabled(Level::ERR))
                 {
                     char buf[128];
-                    snprintf(buf, sizeof buf, "RTXMU Initial Build Disabled Compaction %" PRIu64 "\n", asId);
-                    Logger::log(Level::DBG, buf);
+                    snprintf(buf, sizeof buf, "RTXMU Deserialize %zu is out of memory and was skipped\n", blobIndex);
+                    m_logger.log(Level::ERR, buf);
                 }
+                ReleaseAccelerationStructures(asId);
+                accelStructIds.push_back(ReservedId);
+                allDeserialized = false;
+                continue;
+            }
+
+            memcpy(accelStruct->deserializedUploadMemory.block.getMappedData() + accelStruct->deserializedUploadMemory.offset,
+                   header + 1,
+                   header->driverBlobSize);
+
+            commandList->CopyRaytracingAccelerationStructure(D3D12Block::getGPUVA(accelStruct->compactionGpuMemory.block, accelStruct->compactionGpuMemory.offset),
+                                                             D3D12Block::getGPUVA(accelStruct->deserializedUploadMemory.block, accelStruct->deserializedUploadMemory.offset),
+                                                             D3D12_RAYTRACING_ACCELERATION_STRUCTURE_COPY_MODE_DESERIALIZE);
+
+            // Lands in the same state a finished compaction leaves behind
+            accelStruct->isCompacted         = true;
+            accelStruct->requestedCompaction = false;
+            accelStruct->initialSize         = driverHeader->DeserializedSizeInBytesInclPadding;
+            accelStruct->compactionSize      = accelStruct->compactionGpuMemory.subBlock->getSize();
+            m_totalCompactedMemory += accelStruct->compactionSize;
+            PublishAddress(asId, GetAccelStructGPUVA(asId));
+            RecordTrace(AllocationTraceRecordType::Deserialize, asId, accelStruct->compactionSize);
+
+            accelStructIds.push_back(asId);
+            anyDeserialized = true;
+
+            if (m_logger.isEnabled(Level::DBG))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU Deserialize %" PRIu64 "\n", asId);
+                m_logger.log(Level::DBG, buf);
             }
         }
+
+        // Make the deserialized acceleration structures visible to the builds and traces that follow
+        if (anyDeserialized)
+        {
+            D3D12_RESOURCE_BARRIER rb = {};
+            rb.UAV.pResource          = nullptr;
+            rb.Type                   = D3D12_RESOURCE_BARRIER_TYPE_UAV;
+            commandList->ResourceBarrier(1, &rb);
+        }
+
+        return allDeserialized;
     }
 
-    // Compaction size copies
-    void DxAccelStructManager::PopulateCompactionSizeCopiesCommandList(ID3D12GraphicsCommandList4* commandList,
-                                                                       const std::vector<uint64_t>& accelStructIds)
+    void DxAccelStructManager::SetMemoryBudget(const uint64_t       memoryBudget,
+                                               MemoryBudgetCallback callback,
+                                               void*                callbackUserData)
     {
-        std::lock_guard<std::mutex> guard(m_threadSafeLock);
+        m_allocator.memoryBudget.budget           = memoryBudget;
+        m_allocator.memoryBudget.callback         = callback;
+        m_allocator.memoryBudget.callbackUserData = callbackUserData;
+    }
 
-        (void)accelStructIds;
+    uint64_t DxAccelStructManager::GetAllocatedDeviceMemory()
+    {
+        return m_allocator.memoryBudget.allocatedSize;
+    }
 
-        auto gpuSizeBlocks = m_compactionSizeGpuPool->getBlocks();
-        auto cpuSizeBlocks = m_compactionSizeCpuPool->getBlocks();
-        for (int i = 0; i < gpuSizeBlocks.size(); i++)
+    bool DxAccelStructManager::QueryVideoMemoryBudget(uint64_t& budget,
+                                                      uint64_t& usage)
+    {
+        IDXGIFactory4* factory = nullptr;
+        if (FAILED(CreateDXGIFactory1(IID_PPV_ARGS(&factory))))
         {
-            auto gpuSizeBlock = gpuSizeBlocks[i];
-            auto cpuSizeBlock = cpuSizeBlocks[i];
+            return false;
+        }
 
-            // Transition the gpu compaction size suballocator block to copy over to mappable cpu memory
-            D3D12_RESOURCE_BARRIER rb = {};
-            rb.Transition.pResource = gpuSizeBlock->block.getResource();
-            rb.Transition.StateBefore = D3D12_RESOURCE_STATE_UNORDERED_ACCESS;
-            rb.Transition.StateAfter = D3D12_RESOURCE_STATE_COPY_SOURCE;
-            rb.Type = D3D12_RESOURCE_BARRIER_TYPE_TRANSITION;
+        // Find the adapter the device was created on
+        IDXGIAdapter3* adapter = nullptr;
+        const HRESULT  result  = factory->EnumAdapterByLuid(m_allocator.device->GetAdapterLuid(), IID_PPV_ARGS(&adapter));
+        factory->Release();
 
-            commandList->ResourceBarrier(1, &rb);
+        if (FAILED(result))
+        {
+            return false;
+        }
 
-            // Copy the entire resource to avoid individually copying over each compaction size in strides of 8 bytes
-            commandList->CopyResource(cpuSizeBlock->block.getResource(), gpuSizeBlock->block.getResource());
+        DXGI_QUERY_VIDEO_MEMORY_INFO memoryInfo = {};
+        const bool queried = SUCCEEDED(adapter->QueryVideoMemoryInfo(0, DXGI_MEMORY_SEGMENT_GROUP_LOCAL, &memoryInfo));
+        adapter->Release();
 
-            // Transition the gpu written compaction size suballocator block back over to unordered for later use
-            rb = {};
-            rb.Transition.pResource = gpuSizeBlock->block.getResource();
-            rb.Transition.StateBefore = D3D12_RESOURCE_STATE_COPY_SOURCE;
-            rb.Transition.StateAfter = D3D12_RESOURCE_STATE_UNORDERED_ACCESS;
-            rb.Type = D3D12_RESOURCE_BARRIER_TYPE_TRANSITION;
+        budget = memoryInfo.Budget;
+        usage  = memoryInfo.CurrentUsage;
 
-            commandList->ResourceBarrier(1, &rb);
+        return queried;
+    }
+
+    uint64_t DxAccelStructManager::EvictIdleBlocks()
+    {
+        // Readback and compaction size blocks are tiny so only the video memory pools are worth evicting
+        uint64_t evictedSize = m_scratchPool->evictIdleBlocks() +
+                               m_updatePool->evictIdleBlocks() +
+                               m_resultPool->evictIdleBlocks() +
+                               m_transientResultPool->evictIdleBlocks() +
+                               m_compactionPool->evictIdleBlocks();
+
+        // Placed blocks are paged out together with their heap
+        if (m_heapArena != nullptr)
+        {
+            evictedSize += m_heapArena->evictIdleHeaps();
         }
+        return evictedSize;
     }
 
-    // Receives acceleration structure inputs and places UAV barriers for them
-    void DxAccelStructManager::PopulateUAVBarriersCommandList(ID3D12GraphicsCommandList4*  commandList,
-                                                              const std::vector<uint64_t>& accelStructIds)
+    void DxAccelStructManager::SetBlockRetention(const BlockRetention& retention)
+    {
+        m_blockRetention = retention;
+        ApplyBlockRetention();
+    }
+
+    void DxAccelStructManager::ApplyBlockRetention()
+    {
+        // Readback and compaction size blocks are tiny so only the video memory pools retain blocks
+        m_scratchPool->setRetention(m_blockRetention);
+        m_updatePool->setRetention(m_blockRetention);
+        m_resultPool->setRetention(m_blockRetention);
+        m_transientResultPool->setRetention(m_blockRetention);
+        m_compactionPool->setRetention(m_blockRetention);
+    }
+
+    void DxAccelStructManager::AdvanceFrame()
+    {
+        RecordTrace(AllocationTraceRecordType::Frame);
+
+        m_scratchPool->nextFrame();
+        m_updatePool->nextFrame();
+        m_resultPool->nextFrame();
+        m_transientResultPool->nextFrame();
+        m_compactionPool->nextFrame();
+        m_compactionSizeGpuPool->nextFrame();
+        m_compactionSizeCpuPool->nextFrame();
+        m_serializedGpuPool->nextFrame();
+        m_serializedCpuPool->nextFrame();
+        m_uploadPool->nextFrame();
+        m_instancePool->nextFrame();
+
+        m_logger.flush();
+    }
+
+    uint64_t DxAccelStructManager::TrimRetainedBlocks()
     {
-        std::lock_guard<std::mutex> guard(m_threadSafeLock);
+        return m_scratchPool->trimRetainedBlocks() +
+               m_updatePool->trimRetainedBlocks() +
+               m_resultPool->trimRetainedBlocks() +
+               m_transientResultPool->trimRetainedBlocks() +
+               m_compactionPool->trimRetainedBlocks();
+    }
 
-        for (uint64_t accelStructId : accelStructIds)
+    void DxAccelStructManager::EnableHeapArena(const uint64_t heapSize)
+    {
+        if (m_heapArena == nullptr)
         {
-            D3D12_RESOURCE_BARRIER rb = {};
-            rb.UAV.pResource = m_asBufferBuildQueue[accelStructId]->isCompacted ?
-                m_asBufferBuildQueue[accelStructId]->compactionGpuMemory.block.getResource() :
-                m_asBufferBuildQueue[accelStructId]->resultGpuMemory.block.getResource();
-            rb.Type = D3D12_RESOURCE_BARRIER_TYPE_UAV;
-            commandList->ResourceBarrier(1, &rb);
+            m_heapArena = std::make_unique<D3D12HeapArena>(&m_allocator, heapSize);
         }
+        m_allocator.heapAllocator = m_heapArena.get();
     }
 
-    // Returns a command list with compaction copies if the acceleration structures are ready to be compacted
-    void DxAccelStructManager::PopulateCompactionCommandList(ID3D12GraphicsCommandList4*  commandList,
-                                                             const std::vector<uint64_t>& accelStructIds)
+    void DxAccelStructManager::SetHeapAllocator(D3D12HeapAllocator* heapAllocator)
     {
-        std::lock_guard<std::mutex> guard(m_threadSafeLock);
+        m_allocator.heapAllocator = heapAllocator;
+    }
 
-        // Keep track of last compacted resource to include barrier if the
-        // app requires a subsequent TLAS build or other read operation of the compacted version
-        ID3D12Resource* compactionResourceBarrier = nullptr;
+    void DxAccelStructManager::SetNodeMask(const uint32_t creationNodeMask,
+                                           const uint32_t visibleNodeMask)
+    {
+        m_allocator.creationNodeMask = creationNodeMask;
+        m_allocator.visibleNodeMask  = visibleNodeMask | creationNodeMask;
+    }
 
-        for (const uint64_t& accelStructId : accelStructIds)
+    bool DxAccelStructManager::EnableGpuTiming(const uint64_t timestampFrequency)
+    {
+        if (timestampFrequency == 0)
+        {
+            return false;
+        }
+
+        if (m_gpuTimingQueryHeap == nullptr)
         {
-            // Only do compaction on the confirmed completion of the original build execution.
-            if (m_asBufferBuildQueue[accelStructId]->requestedCompaction == true)
+            D3D12_QUERY_HEAP_DESC queryHeapDesc = {};
+            queryHeapDesc.Type     = D3D12_QUERY_HEAP_TYPE_TIMESTAMP;
+            queryHeapDesc.Count    = GpuTimingQueryCount;
+            queryHeapDesc.NodeMask = m_allocator.creationNodeMask;
+
+            ID3D12QueryHeap* queryHeap = nullptr;
+            if (FAILED(m_allocator.device->CreateQueryHeap(&queryHeapDesc, IID_PPV_ARGS(&queryHeap))))
             {
-                CopyCompaction(commandList, accelStructId);
+                if (m_logger.isEnabled(Level::ERR))
+                {
+                    m_logger.log(Level::ERR, "RTXMU GPU Timing query heap couldn't be created\n");
+                }
+                return false;
+            }
 
-                compactionResourceBarrier = m_asBufferBuildQueue[accelStructId]->compactionGpuMemory.block.getResource();
+            // Every query resolves to one 8 byte tick count
+            m_gpuTimingReadbackPool   = std::make_unique<Suballocator<Allocator, D3D12ReadBackBlock>>(GpuTimingQueryCount * sizeof(uint64_t), sizeof(uint64_t), &m_allocator);
+            m_gpuTimingReadbackMemory = m_gpuTimingReadbackPool->allocate(GpuTimingQueryCount * sizeof(uint64_t));
+            if (m_gpuTimingReadbackMemory.subBlock == nullptr)
+            {
+                if (m_logger.isEnabled(Level::ERR))
+                {
+                    m_logger.log(Level::ERR, "RTXMU GPU Timing readback memory couldn't be allocated\n");
+                }
+                queryHeap->Release();
+                m_gpuTimingReadbackPool.reset();
+                return false;
             }
+            m_gpuTimingQueryHeap = queryHeap;
         }
 
-        // Include resource barrier after final compaction
-        if (compactionResourceBarrier != nullptr)
-        {
-            D3D12_RESOURCE_BARRIER rb = {};
-            rb.UAV.pResource          = compactionResourceBarrier;
-            rb.Type                   = D3D12_RESOURCE_BARRIER_TYPE_UAV;
-            commandList->ResourceBarrier(1, &rb);
-        }
+        StartGpuTiming(1000000000.0 / static_cast<double>(timestampFrequency));
+        return true;
     }
 
     // Remove all memory that an Acceleration Structure might use
     void DxAccelStructManager::RemoveAccelerationStructures(const std::vector<uint64_t>& accelStructIds)
     {
-        std::lock_guard<std::mutex> guard(m_threadSafeLock);
-
         for (const uint64_t& accelStructId : accelStructIds)
         {
-            ReleaseAccelerationStructures(accelStructId);
+            // Ids shared by build deduplication keep the acceleration structure alive
+            if (IsLiveId(accelStructId) && ReleaseReference(accelStructId))
+            {
+                RecordTrace(AllocationTraceRecordType::Remove, accelStructId);
+                ReleaseAccelerationStructures(accelStructId);
+            }
         }
     }
 
     // Remove all memory used in build process, while only leaving the acceleration structure buffer itself in memory
     void DxAccelStructManager::GarbageCollection(const std::vector<uint64_t>& accelStructIds)
     {
-        std::lock_guard<std::mutex> guard(m_threadSafeLock);
+        std::vector<uint64_t> liveIds;
+        GetLiveIds(accelStructIds, liveIds);
 
         // Complete queue indicates cleanup for acceleration structures
-        for (const uint64_t& accelStructId : accelStructIds)
+        for (const uint64_t& accelStructId : liveIds)
         {
+            RecordTrace(AllocationTraceRecordType::GarbageCollection, accelStructId);
             PostBuildRelease(accelStructId);
             m_asBufferBuildQueue[accelStructId]->readyToFree = true;
         }
@@ -380,6 +1818,11 @@ namespace rtxmu
     // Returns GPUVA of the acceleration structure based on the state of the accelstruct
     D3D12_GPU_VIRTUAL_ADDRESS DxAccelStructManager::GetAccelStructGPUVA(const uint64_t accelStructId)
     {
+        if (IsLiveId(accelStructId) == false)
+        {
+            return 0;
+        }
+
         DxAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
 
         return accelStruct->isCompacted ?
@@ -392,6 +1835,11 @@ namespace rtxmu
     // Returns the GPUVA of the compacted buffer for the specified accelstruct
     D3D12_GPU_VIRTUAL_ADDRESS DxAccelStructManager::GetAccelStructCompactedGPUVA(const uint64_t accelStructId)
     {
+        if (IsLiveId(accelStructId) == false)
+        {
+            return 0;
+        }
+
         DxAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
 
         return accelStruct->compactionGpuMemory.subBlock == nullptr ? 0 : D3D12Block::getGPUVA(accelStruct->compactionGpuMemory.block,
@@ -400,14 +1848,24 @@ namespace rtxmu
 
     uint64_t DxAccelStructManager::GetInitialAccelStructSize(const uint64_t accelStructId)
     {
+        if (IsLiveId(accelStructId) == false)
+        {
+            return 0;
+        }
+
         DxAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
 
-        return accelStruct->resultGpuMemory.subBlock->getSize() -
-               accelStruct->resultGpuMemory.subBlock->getUnusedSize();
+        // The result buffer is released once compaction is garbage collected so use the recorded size
+        return accelStruct->initialSize;
     }
 
     uint64_t DxAccelStructManager::GetCompactedAccelStructSize(const uint64_t accelStructId)
     {
+        if (IsLiveId(accelStructId) == false)
+        {
+            return 0;
+        }
+
         DxAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
 
         return accelStruct->compactionGpuMemory.subBlock->getSize() -
@@ -416,19 +1874,17 @@ namespace rtxmu
 
     bool DxAccelStructManager::GetRequestedCompaction(const uint64_t accelStructId)
     {
-        DxAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
-        return accelStruct->requestedCompaction;
+        return IsLiveId(accelStructId) && m_asBufferBuildQueue[accelStructId]->requestedCompaction;
     }
 
     bool DxAccelStructManager::GetCompactionComplete(const uint64_t accelStructId)
     {
-        DxAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
-        return accelStruct->isCompacted;
+        return IsLiveId(accelStructId) && m_asBufferBuildQueue[accelStructId]->isCompacted;
     }
 
     bool DxAccelStructManager::IsValid(const uint64_t accelStructId)
     {
-        return (accelStructId > ReservedId && accelStructId < m_asBufferBuildQueue.size()) && (m_asBufferBuildQueue[accelStructId] != nullptr);
+        return IsLiveId(accelStructId);
     }
 
     // Returns a const char* containing memory consumption information
@@ -454,8 +1910,98 @@ namespace rtxmu
         return m_buildLogger.c_str();
     }
 
+    D3D12_GPU_VIRTUAL_ADDRESS DxAccelStructManager::AcquireScratch(ID3D12GraphicsCommandList4* commandList,
+                                                                   DxAccelerationStructure*   accelStruct,
+                                                                   const uint64_t              scratchSize)
+    {
+        uint64_t ringOffset   = 0;
+        bool     needsBarrier = false;
+
+        if (m_scratchRing.acquire(scratchSize, ringOffset, needsBarrier))
+        {
+            // Builds recorded before this point may still be writing to the same scratch range
+            if (needsBarrier)
+            {
+                D3D12_RESOURCE_BARRIER rb = {};
+                rb.UAV.pResource = m_scratchRingMemory.block.getResource();
+                rb.Type = D3D12_RESOURCE_BARRIER_TYPE_UAV;
+                commandList->ResourceBarrier(1, &rb);
+            }
+
+            return D3D12Block::getGPUVA(m_scratchRingMemory.block, m_scratchRingMemory.offset + ringOffset);
+        }
+
+        if ((m_scratchBudget > 0) && m_logger.isEnabled(Level::WARN))
+        {
+            char buf[128];
+            snprintf(buf, sizeof buf, "RTXMU Scratch of %" PRIu64 " bytes exceeds the scratch budget\n", scratchSize);
+            m_logger.log(Level::WARN, buf);
+        }
+
+        // Without a budget each acceleration structure keeps its own scratch until garbage collection
+        if (accelStruct->scratchGpuMemory.subBlock == nullptr)
+        {
+            accelStruct->scratchGpuMemory = m_scratchPool->allocate(scratchSize);
+        }
+
+        // Out of memory
+        if (accelStruct->scratchGpuMemory.subBlock == nullptr)
+        {
+            return 0;
+        }
+
+        return D3D12Block::getGPUVA(accelStruct->scratchGpuMemory.block, accelStruct->scratchGpuMemory.offset);
+    }
+
+    D3D12_GPU_VIRTUAL_ADDRESS DxAccelStructManager::AcquireUpdateScratch(ID3D12GraphicsCommandList4* commandList,
+                                                                         DxAccelerationStructure*    accelStruct)
+    {
+        if (accelStruct->updateGpuMemory.subBlock != nullptr)
+        {
+            return D3D12Block::getGPUVA(accelStruct->updateGpuMemory.block, accelStruct->updateGpuMemory.offset);
+        }
+
+        // Only acceleration structures whose update scratch fits the scratch budget get here
+        return AcquireScratch(commandList, accelStruct, accelStruct->updateScratchSize);
+    }
+
+    bool DxAccelStructManager::BeginGpuTiming(ID3D12GraphicsCommandList4* commandList,
+                                              const GpuTimingPhase        phase,
+                                              uint32_t&                   queryIndex)
+    {
+        // Copy queues tick at a frequency of their own, if they support timestamps at all
+        if ((m_gpuTimingQueryHeap == nullptr) ||
+            (commandList->GetType() == D3D12_COMMAND_LIST_TYPE_COPY) ||
+            (AcquireGpuTimingQueries(phase, queryIndex) == false))
+        {
+            return false;
+        }
+
+        commandList->EndQuery(m_gpuTimingQueryHeap, D3D12_QUERY_TYPE_TIMESTAMP, queryIndex);
+        return true;
+    }
+
+    void DxAccelStructManager::EndGpuTiming(ID3D12GraphicsCommandList4* commandList,
+                                            const uint32_t              queryIndex,
+                                            const uint64_t              accelStructCount,
+                                            const uint64_t              bytes)
+    {
+        commandList->EndQuery(m_gpuTimingQueryHeap, D3D12_QUERY_TYPE_TIMESTAMP, queryIndex + 1);
+
+        // Resolved right away so Tick only has to read the mapped memory once the fence completed
+        commandList->ResolveQueryData(m_gpuTimingQueryHeap,
+                                      D3D12_QUERY_TYPE_TIMESTAMP,
+                                      queryIndex,
+                                      2,
+                                      m_gpuTimingReadbackMemory.block.getResource(),
+                                      m_gpuTimingReadbackMemory.offset + queryIndex * sizeof(uint64_t));
+
+        FinishGpuTimingBatch(queryIndex, accelStructCount, bytes);
+    }
+
     void DxAccelStructManager::CopyCompaction(ID3D12GraphicsCommandList4* commandList,
-                                              const uint64_t              accelStructId)
+                                              const uint64_t              accelStructId,
+                                              const uint64_t              compactionSize)
     {
         DxAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
 
@@ -463,20 +2009,25 @@ namespace rtxmu
         if ((accelStruct->isCompacted         == false) &&
             (accelStruct->requestedCompaction == true))
         {
-            unsigned char* data           = nullptr;
-            uint64_t       compactionSize = 0;
-            uint64_t       offset         = accelStruct->compactionSizeCpuMemory.offset;
-
-            // Map the readback gpu memory to system memory to fetch compaction size
-            D3D12_RANGE readbackBufferRange{offset, offset + SizeOfCompactionDescriptor};
-            accelStruct->compactionSizeCpuMemory.block.getResource()->Map(0, &readbackBufferRange, (void**)&data);
-            memcpy(&compactionSize, &data[offset], SizeOfCompactionDescriptor);
-
             // Suballocate the gpu memory needed for compaction copy
             accelStruct->compactionGpuMemory = m_compactionPool->allocate(compactionSize);
 
+            // Out of memory, stay uncompacted so the compaction can be retried later
+            if (accelStruct->compactionGpuMemory.subBlock == nullptr)
+            {
+                if (m_logger.isEnabled(Level::ERR))
+                {
+                    char buf[128];
+                    snprintf(buf, sizeof buf, "RTXMU Copy Compaction %" PRIu64 " is out of memory and was skipped\n", accelStructId);
+                    m_logger.log(Level::ERR, buf);
+                }
+                return;
+            }
+
             accelStruct->compactionSize = accelStruct->compactionGpuMemory.subBlock->getSize();
             m_totalCompactedMemory += accelStruct->compactionGpuMemory.subBlock->getSize();
+            ReportCompaction(accelStructId, accelStruct->resultSize, accelStruct->compactionSize);
+            RecordTrace(AllocationTraceRecordType::Compaction, accelStructId, accelStruct->compactionSize, accelStruct->resultSize);
 
             // Copy the result buffer into the compacted buffer
             commandList->CopyRaytracingAccelerationStructure(D3D12Block::getGPUVA(accelStruct->compactionGpuMemory.block, accelStruct->compactionGpuMemory.offset),
@@ -485,61 +2036,149 @@ namespace rtxmu
 
             // Tag as compaction complete
             accelStruct->isCompacted = true;
+            PublishAddress(accelStructId, GetAccelStructGPUVA(accelStructId));
 
-            if (Logger::isEnabled(Level::DBG))
+            if (m_logger.isEnabled(Level::DBG))
             {
                 char buf[128];
                 snprintf(buf, sizeof buf, "RTXMU Copy Compaction %" PRIu64 "\n", accelStructId);
-                Logger::log(Level::DBG, buf);
+                m_logger.log(Level::DBG, buf);
+            }
+        }
+    }
+
+    void DxAccelStructManager::TransitionResources(ID3D12GraphicsCommandList4*   commandList,
+                                                   std::vector<ID3D12Resource*>& resources,
+                                                   const D3D12_RESOURCE_STATES   stateBefore,
+                                                   const D3D12_RESOURCE_STATES   stateAfter)
+    {
+        std::sort(resources.begin(), resources.end());
+        resources.erase(std::unique(resources.begin(), resources.end()), resources.end());
+
+        std::vector<D3D12_RESOURCE_BARRIER> barriers(resources.size());
+        for (size_t i = 0; i < resources.size(); i++)
+        {
+            barriers[i] = {};
+            barriers[i].Transition.pResource   = resources[i];
+            barriers[i].Transition.StateBefore = stateBefore;
+            barriers[i].Transition.StateAfter  = stateAfter;
+            barriers[i].Type                   = D3D12_RESOURCE_BARRIER_TYPE_TRANSITION;
+        }
+
+        if (barriers.empty() == false)
+        {
+            commandList->ResourceBarrier(static_cast<UINT>(barriers.size()), barriers.data());
+        }
+    }
+
+    void DxAccelStructManager::ReleaseSerializedMemory(DxAccelerationStructure* accelStruct)
+    {
+        if (accelStruct->serializedSizeGpuMemory.subBlock != nullptr)
+        {
+            m_compactionSizeGpuPool->free(accelStruct->serializedSizeGpuMemory.subBlock);
+            accelStruct->serializedSizeGpuMemory.subBlock = nullptr;
+        }
+        if (accelStruct->serializedSizeCpuMemory.subBlock != nullptr)
+        {
+            m_compactionSizeCpuPool->free(accelStruct->serializedSizeCpuMemory.subBlock);
+            accelStruct->serializedSizeCpuMemory.subBlock = nullptr;
+        }
+        if (accelStruct->serializedGpuMemory.subBlock != nullptr)
+        {
+            m_serializedGpuPool->free(accelStruct->serializedGpuMemory.subBlock);
+            accelStruct->serializedGpuMemory.subBlock = nullptr;
+        }
+        if (accelStruct->serializedCpuMemory.subBlock != nullptr)
+        {
+            m_serializedCpuPool->free(accelStruct->serializedCpuMemory.subBlock);
+            accelStruct->serializedCpuMemory.subBlock = nullptr;
+        }
+    }
+
+    void DxAccelStructManager::ReleaseRetiredRebuildMemory(DxAccelerationStructure* accelStruct)
+    {
+        for (auto& resultGpuMemory : accelStruct->retiredResultMemory)
+        {
+            if (accelStruct->requestedCompaction)
+            {
+                m_transientResultPool->free(resultGpuMemory.subBlock);
             }
+            else
+            {
+                m_resultPool->free(resultGpuMemory.subBlock);
+            }
+        }
+        accelStruct->retiredResultMemory.clear();
+
+        for (auto& scratchGpuMemory : accelStruct->retiredScratchMemory)
+        {
+            m_scratchPool->free(scratchGpuMemory.subBlock);
         }
+        accelStruct->retiredScratchMemory.clear();
     }
 
     void DxAccelStructManager::PostBuildRelease(const uint64_t accelStructId)
     {
         DxAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
 
+        // The clone copy of a defragmentation move has finished so the old location can go
+        if (accelStruct->defragSourceMemory.subBlock != nullptr)
+        {
+            m_compactionPool->free(accelStruct->defragSourceMemory.subBlock);
+            accelStruct->defragSourceMemory.subBlock = nullptr;
+        }
+
+        // Deserialization has finished reading the uploaded blob
+        if (accelStruct->deserializedUploadMemory.subBlock != nullptr)
+        {
+            m_uploadPool->free(accelStruct->deserializedUploadMemory.subBlock);
+            accelStruct->deserializedUploadMemory.subBlock = nullptr;
+        }
+
+        // The build that outgrew its memory has finished so the memory it moved away from can go
+        ReleaseRetiredRebuildMemory(accelStruct);
+
         // Only delete compaction size and result if compaction was performed
         if (accelStruct->isCompacted == true)
         {
             // Deallocate all the buffers used to create a compaction AS buffer
-            if ((accelStruct->resultGpuMemory.subBlock != nullptr) &&
-                (accelStruct->resultGpuMemory.subBlock->isFree() == false))
+            if (accelStruct->resultGpuMemory.subBlock != nullptr)
             {
                 m_transientResultPool->free(accelStruct->resultGpuMemory.subBlock);
+                accelStruct->resultGpuMemory.subBlock = nullptr;
             }
-            if ((accelStruct->compactionSizeGpuMemory.subBlock != nullptr) &&
-                (accelStruct->compactionSizeGpuMemory.subBlock->isFree() == false))
+            if (accelStruct->compactionSizeGpuMemory.subBlock != nullptr)
             {
                 m_compactionSizeGpuPool->free(accelStruct->compactionSizeGpuMemory.subBlock);
+                accelStruct->compactionSizeGpuMemory.subBlock = nullptr;
             }
-            if ((accelStruct->compactionSizeCpuMemory.subBlock != nullptr) &&
-                (accelStruct->compactionSizeCpuMemory.subBlock->isFree() == false))
+            if (accelStruct->compactionSizeCpuMemory.subBlock != nullptr)
             {
                 m_compactionSizeCpuPool->free(accelStruct->compactionSizeCpuMemory.subBlock);
+                accelStruct->compactionSizeCpuMemory.subBlock = nullptr;
             }
 
-            if (Logger::isEnabled(Level::DBG))
+            if (m_logger.isEnabled(Level::DBG))
             {
                 char buf[128];
                 snprintf(buf, sizeof buf, "RTXMU Garbage Collection For Compacted %" PRIu64 "\n", accelStructId);
-                Logger::log(Level::DBG, buf);
+                m_logger.log(Level::DBG, buf);
             }
         }
 
         // Be cautious here and if the acceleration structure did not request compaction then
         // assume rebuilds or updates will deployed and do not deallocate scratch
         if ((accelStruct->requestedCompaction == true) &&
-            (accelStruct->scratchGpuMemory.subBlock != nullptr) &&
-            (accelStruct->scratchGpuMemory.subBlock->isFree() == false))
+            (accelStruct->scratchGpuMemory.subBlock != nullptr))
         {
             m_scratchPool->free(accelStruct->scratchGpuMemory.subBlock);
+            accelStruct->scratchGpuMemory.subBlock = nullptr;
 
-            if (Logger::isEnabled(Level::DBG))
+            if (m_logger.isEnabled(Level::DBG))
             {
                 char buf[128];
                 snprintf(buf, sizeof buf, "RTXMU Garbage Collection Deleting Scratch %" PRIu64 "\n", accelStructId);
-                Logger::log(Level::DBG, buf);
+                m_logger.log(Level::DBG, buf);
             }
         }
     }
@@ -552,20 +2191,17 @@ namespace rtxmu
         m_totalUncompactedMemory -= accelStruct->resultSize;
 
         // Deallocate all the buffers used for acceleration structures
-        if ((accelStruct->scratchGpuMemory.subBlock != nullptr) &&
-            (accelStruct->scratchGpuMemory.subBlock->isFree() == false))
+        if (accelStruct->scratchGpuMemory.subBlock != nullptr)
         {
             m_scratchPool->free(accelStruct->scratchGpuMemory.subBlock);
             accelStruct->scratchGpuMemory.subBlock = nullptr;
         }
-        if ((accelStruct->updateGpuMemory.subBlock != nullptr) &&
-            (accelStruct->updateGpuMemory.subBlock->isFree() == false))
+        if (accelStruct->updateGpuMemory.subBlock != nullptr)
         {
             m_updatePool->free(accelStruct->updateGpuMemory.subBlock);
             accelStruct->updateGpuMemory.subBlock = nullptr;
         }
-        if ((accelStruct->resultGpuMemory.subBlock != nullptr) &&
-            (accelStruct->resultGpuMemory.subBlock->isFree() == false))
+        if (accelStruct->resultGpuMemory.subBlock != nullptr)
         {
             if (accelStruct->requestedCompaction)
             {
@@ -577,20 +2213,52 @@ namespace rtxmu
             }
             accelStruct->resultGpuMemory.subBlock = nullptr;
         }
-        if ((accelStruct->compactionGpuMemory.subBlock != nullptr) &&
-            (accelStruct->compactionGpuMemory.subBlock->isFree() == false))
+        if (accelStruct->compactionGpuMemory.subBlock != nullptr)
         {
             m_compactionPool->free(accelStruct->compactionGpuMemory.subBlock);
             accelStruct->compactionGpuMemory.subBlock = nullptr;
         }
+        if (accelStruct->defragSourceMemory.subBlock != nullptr)
+        {
+            m_compactionPool->free(accelStruct->defragSourceMemory.subBlock);
+            accelStruct->defragSourceMemory.subBlock = nullptr;
+        }
+        if (accelStruct->compactionSizeGpuMemory.subBlock != nullptr)
+        {
+            m_compactionSizeGpuPool->free(accelStruct->compactionSizeGpuMemory.subBlock);
+            accelStruct->compactionSizeGpuMemory.subBlock = nullptr;
+        }
+        if (accelStruct->compactionSizeCpuMemory.subBlock != nullptr)
+        {
+            m_compactionSizeCpuPool->free(accelStruct->compactionSizeCpuMemory.subBlock);
+            accelStruct->compactionSizeCpuMemory.subBlock = nullptr;
+        }
+
+        if (accelStruct->deserializedUploadMemory.subBlock != nullptr)
+        {
+            m_uploadPool->free(accelStruct->deserializedUploadMemory.subBlock);
+            accelStruct->deserializedUploadMemory.subBlock = nullptr;
+        }
+        ReleaseSerializedMemory(accelStruct);
+        ReleaseRetiredRebuildMemory(accelStruct);
+
+        // Managed top level acceleration structures also hold their instance buffers and memory they moved away from
+        if (accelStruct->topLevel != nullptr)
+        {
+            DxRetiredTopLevelMemory retiredMemory;
+            accelStruct->topLevel->instances.releaseBuffers(retiredMemory.instanceMemory);
+            accelStruct->topLevel->retiredMemory.push_back(std::move(retiredMemory));
+
+            ReleaseRetiredTopLevelMemory(accelStruct->topLevel.get(), UINT64_MAX);
+        }
 
         ReleaseAccelStructId(accelStructId);
 
-        if (Logger::isEnabled(Level::DBG))
+        if (m_logger.isEnabled(Level::DBG))
         {
             char buf[128];
             snprintf(buf, sizeof buf, "RTXMU Remove %" PRIu64 "\n", accelStructId);
-            Logger::log(Level::DBG, buf);
+            m_logger.log(Level::DBG, buf);
         }
     }
 
@@ -608,4 +2276,23 @@ namespace rtxmu
     {
         return m_compactionPool->getStats();
     }
+
+    PoolTelemetry DxAccelStructManager::GetPoolTelemetry(const PoolType pool)
+    {
+        switch (pool)
+        {
+        case PoolType::Scratch:                return m_scratchPool->getTelemetry();
+        case PoolType::Update:                 return m_updatePool->getTelemetry();
+        case PoolType::Result:                 return m_resultPool->getTelemetry();
+        case PoolType::TransientResult:        return m_transientResultPool->getTelemetry();
+        case PoolType::Compaction:             return m_compactionPool->getTelemetry();
+        case PoolType::CompactionSize:         return m_compactionSizeGpuPool->getTelemetry();
+        case PoolType::CompactionSizeReadback: return m_compactionSizeCpuPool->getTelemetry();
+        case PoolType::Serialized:             return m_serializedGpuPool->getTelemetry();
+        case PoolType::SerializedReadback:     return m_serializedCpuPool->getTelemetry();
+        case PoolType::Upload:                 return m_uploadPool->getTelemetry();
+        case PoolType::Instance:               return m_instancePool->getTelemetry();
+        default:                               return {};
+        }
+    }
 }
\ No newline at end of file
@@ -25,16 +25,15 @@
 
 namespace rtxmu
 {
-    Allocator* D3D12Block::m_allocator = nullptr;
     void D3D12Block::setAllocator(Allocator* allocator)
     {
         m_allocator = allocator;
     }
 
-    D3D12_GPU_VIRTUAL_ADDRESS D3D12Block::getGPUVA(D3D12Block block,
-                                                    uint64_t   offset)
+    D3D12_GPU_VIRTUAL_ADDRESS D3D12Block::getGPUVA(const D3D12Block& block,
+                                                    uint64_t          offset)
     {
-        D3D12_GPU_VIRTUAL_ADDRESS gpuVA = block.m_resource->GetGPUVirtualAddress() + offset;
+        D3D12_GPU_VIRTUAL_ADDRESS gpuVA = block.m_gpuVA + offset;
         return gpuVA;
     }
 
@@ -43,13 +42,28 @@ namespace rtxmu
         return m_resource;
     }
 
-    void D3D12Block::allocate(uint64_t              size,
+    bool D3D12Block::allocate(uint64_t              size,
                               D3D12_HEAP_TYPE       heapType,
                               D3D12_RESOURCE_STATES state,
                               uint32_t              alignment)
     {
         ID3D12Device5* device = m_allocator->device;
 
+        // Only video memory counts against the budget, readback and upload heaps live in system memory.
+        // Blocks placed in budgeted heaps are covered by their heap
+        const bool isBudgeted = (heapType == D3D12_HEAP_TYPE_DEFAULT) &&
+                                ((m_allocator->heapAllocator == nullptr) || (m_allocator->heapAllocator->isBudgeted() == false));
+        if (isBudgeted && (m_allocator->memoryBudget.reserve(size) == false))
+        {
+            if (m_allocator->logger->isEnabled(Level::WARN))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU Block Allocation of size %" PRIu64 " exceeds the memory budget\n", size);
+                m_allocator->logger->log(Level::WARN, buf);
+            }
+            return false;
+        }
+
         D3D12_RESOURCE_DESC desc = {};
         desc.Dimension           = D3D12_RESOURCE_DIMENSION_BUFFER;
         desc.Alignment           = alignment;
@@ -76,22 +90,228 @@ namespace rtxmu
         heapProperties.Type                  = heapType;
         heapProperties.MemoryPoolPreference  = D3D12_MEMORY_POOL_UNKNOWN;
         heapProperties.CPUPageProperty       = D3D12_CPU_PAGE_PROPERTY_UNKNOWN;
-        heapProperties.CreationNodeMask      = 1;
-        heapProperties.VisibleNodeMask       = 1;
+        heapProperties.CreationNodeMask      = m_allocator->creationNodeMask;
+        heapProperties.VisibleNodeMask       = m_allocator->visibleNodeMask;
+
+        HRESULT result = S_OK;
+        if (m_allocator->heapAllocator != nullptr)
+        {
+            // Placing the block in an existing heap avoids an OS allocation per block
+            ID3D12Heap* heap       = nullptr;
+            uint64_t    heapOffset = 0;
+            if (m_allocator->heapAllocator->allocate(size, alignment, heapType, heap, heapOffset, m_heapHandle))
+            {
+                result = device->CreatePlacedResource(heap,
+                                                      heapOffset,
+                                                      &desc,
+                                                      state,
+                                                      nullptr,
+                                                      IID_PPV_ARGS(&m_resource));
+                if (FAILED(result))
+                {
+                    m_allocator->heapAllocator->free(m_heapHandle);
+                    m_heapHandle = nullptr;
+                }
+                else
+                {
+                    m_heapAllocator = m_allocator->heapAllocator;
+                }
+            }
+            else
+            {
+                m_heapHandle = nullptr;
+                result       = E_OUTOFMEMORY;
+            }
+        }
+        else
+        {
+            result = device->CreateCommittedResource(&heapProperties,
+                                                     D3D12_HEAP_FLAG_NONE,
+                                                     &desc,
+                                                     state,
+                                                     nullptr,
+                                                     IID_PPV_ARGS(&m_resource));
+        }
 
-        device->CreateCommittedResource(&heapProperties,
-                                        D3D12_HEAP_FLAG_NONE,
-                                        &desc,
-                                        state,
-                                        nullptr,
-                                        IID_PPV_ARGS(&m_resource));
+        if (FAILED(result))
+        {
+            m_resource = nullptr;
+            if (isBudgeted)
+            {
+                m_allocator->memoryBudget.release(size);
+            }
+
+            if (m_allocator->logger->isEnabled(Level::ERR))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU Block resource creation of size %" PRIu64 " failed with 0x%08X\n", size, static_cast<uint32_t>(result));
+                m_allocator->logger->log(Level::ERR, buf);
+            }
+            return false;
+        }
+
+        // The address never changes for the lifetime of the resource, so query it once instead of per lookup
+        m_gpuVA        = m_resource->GetGPUVirtualAddress();
+        m_budgetedSize = isBudgeted ? size : 0;
+        return true;
     }
 
     void D3D12Block::free()
     {
         m_resource->Release();
         m_resource = nullptr;
+        m_gpuVA    = 0;
+        m_allocator->memoryBudget.release(m_budgetedSize);
+        m_budgetedSize = 0;
+
+        if (m_heapHandle != nullptr)
+        {
+            m_heapAllocator->free(m_heapHandle);
+            m_heapHandle    = nullptr;
+            m_heapAllocator = nullptr;
+        }
     }
 
-    uint64_t D3D12Block::getVMA() { return static_cast<uint64_t>(m_resource->GetGPUVirtualAddress()); }
+    bool D3D12Block::evict()
+    {
+        if (m_heapHandle != nullptr)
+        {
+            return false;
+        }
+
+        ID3D12Pageable* pageable = m_resource;
+        return SUCCEEDED(m_allocator->device->Evict(1, &pageable));
+    }
+
+    void D3D12Block::makeResident()
+    {
+        if (m_heapHandle != nullptr)
+        {
+            return;
+        }
+
+        ID3D12Pageable* pageable = m_resource;
+        m_allocator->device->MakeResident(1, &pageable);
+    }
+
+    uint64_t D3D12Block::getVMA() { return static_cast<uint64_t>(m_gpuVA); }
+
+    void D3D12Heap::setAllocator(Allocator* allocator)
+    {
+        m_allocator = allocator;
+    }
+
+    bool D3D12Heap::allocate(uint64_t size,
+                             uint32_t heapKind)
+    {
+        const bool isDeviceLocal = (static_cast<D3D12_HEAP_TYPE>(heapKind) == D3D12_HEAP_TYPE_DEFAULT);
+        if (isDeviceLocal && (m_allocator->memoryBudget.reserve(size) == false))
+        {
+            if (m_allocator->logger->isEnabled(Level::WARN))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU Heap Arena heap of size %" PRIu64 " exceeds the memory budget\n", size);
+                m_allocator->logger->log(Level::WARN, buf);
+            }
+            return false;
+        }
+
+        D3D12_HEAP_DESC desc                 = {};
+        desc.SizeInBytes                     = size;
+        desc.Properties.Type                 = static_cast<D3D12_HEAP_TYPE>(heapKind);
+        desc.Properties.MemoryPoolPreference = D3D12_MEMORY_POOL_UNKNOWN;
+        desc.Properties.CPUPageProperty      = D3D12_CPU_PAGE_PROPERTY_UNKNOWN;
+        desc.Properties.CreationNodeMask     = m_allocator->creationNodeMask;
+        desc.Properties.VisibleNodeMask      = m_allocator->visibleNodeMask;
+        desc.Alignment                       = D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT;
+        // Buffer only heaps work on every resource heap tier
+        desc.Flags                           = D3D12_HEAP_FLAG_ALLOW_ONLY_BUFFERS;
+
+        HRESULT result = m_allocator->device->CreateHeap(&desc, IID_PPV_ARGS(&m_heap));
+        if (FAILED(result))
+        {
+            m_heap = nullptr;
+            if (isDeviceLocal)
+            {
+                m_allocator->memoryBudget.release(size);
+            }
+
+            if (m_allocator->logger->isEnabled(Level::ERR))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU CreateHeap of size %" PRIu64 " failed with 0x%08X\n", size, static_cast<uint32_t>(result));
+                m_allocator->logger->log(Level::ERR, buf);
+            }
+            return false;
+        }
+
+        m_heap->SetName(L"RTXMU Heap Arena Heap");
+        m_budgetedSize = isDeviceLocal ? size : 0;
+        return true;
+    }
+
+    void D3D12Heap::free()
+    {
+        m_heap->Release();
+        m_heap = nullptr;
+        m_allocator->memoryBudget.release(m_budgetedSize);
+        m_budgetedSize = 0;
+    }
+
+    bool D3D12Heap::evict()
+    {
+        ID3D12Pageable* pageable = m_heap;
+        return SUCCEEDED(m_allocator->device->Evict(1, &pageable));
+    }
+
+    void D3D12Heap::makeResident()
+    {
+        ID3D12Pageable* pageable = m_heap;
+        m_allocator->device->MakeResident(1, &pageable);
+    }
+
+    ID3D12Heap* D3D12Heap::getHeap()
+    {
+        return m_heap;
+    }
+
+    D3D12HeapArena::D3D12HeapArena(Allocator* allocator,
+                                   uint64_t   heapSize) :
+        m_arena(heapSize, D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT, allocator)
+    {
+    }
+
+    bool D3D12HeapArena::allocate(uint64_t        size,
+                                  uint64_t        alignment,
+                                  D3D12_HEAP_TYPE heapType,
+                                  ID3D12Heap*&    heap,
+                                  uint64_t&       heapOffset,
+                                  void*&          handle)
+    {
+        auto placement = m_arena.allocate(size, alignment, static_cast<uint32_t>(heapType));
+        if (placement == nullptr)
+        {
+            return false;
+        }
+
+        heap       = placement->heap->getHeap();
+        heapOffset = placement->offset;
+        handle     = placement;
+        return true;
+    }
+
+    void D3D12HeapArena::free(void* handle)
+    {
+        m_arena.free(static_cast<HeapArena<Allocator, D3D12Heap>::Placement*>(handle));
+    }
+
+    uint64_t D3D12HeapArena::evictIdleHeaps()
+    {
+        return m_arena.evictIdleHeaps();
+    }
+
+    uint64_t D3D12HeapArena::getSize()
+    {
+        return m_arena.getSize();
+    }
 }
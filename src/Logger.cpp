@@ -21,32 +21,137 @@
 */
 
 #include "rtxmu/Logger.h"
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
 
 // Logger function callback which allows client to implement logging
 namespace rtxmu
 {
-    Level Logger::s_loggerVerbosity = Level::DISABLED;
-    void (*Logger::s_loggerCallback)(const char*) = nullptr;
+    Logger::Logger(Level verbosity) :
+        m_verbosity(verbosity)
+    {
+    }
+
+    Logger::~Logger()
+    {
+        flush();
+    }
+
     void Logger::setLoggerSettings(Level verbosity)
     {
-        s_loggerVerbosity = verbosity;
+        m_verbosity = verbosity;
     }
+
     void Logger::setLoggerCallback(void (*loggerCallback)(const char*))
     {
-        s_loggerCallback = loggerCallback;
+        m_callback = loggerCallback;
     }
-    void Logger::log(Level verbosity, const char* msg)
+
+    void Logger::enableAsyncDelivery(uint32_t capacity)
     {
-        if (verbosity <= s_loggerVerbosity)
+        // Messages queued so far go out before the ring changes
+        flush();
+
+        std::lock_guard<std::mutex> guard(m_flushLock);
+
+        m_slots.reset();
+        m_slotMask = 0;
+        m_enqueuePosition.store(0, std::memory_order_relaxed);
+        m_dequeuePosition = 0;
+
+        if (capacity == 0)
         {
-            if (s_loggerCallback != nullptr)
+            return;
+        }
+
+        uint64_t slotCount = 2;
+        while (slotCount < capacity)
+        {
+            slotCount *= 2;
+        }
+
+        m_slots.reset(new Slot[slotCount]);
+        for (uint64_t slotIndex = 0; slotIndex < slotCount; slotIndex++)
+        {
+            m_slots[slotIndex].sequence.store(slotIndex, std::memory_order_relaxed);
+        }
+        m_slotMask = slotCount - 1;
+    }
+
+    void Logger::flush()
+    {
+        std::lock_guard<std::mutex> guard(m_flushLock);
+
+        if (m_slots != nullptr)
+        {
+            for (;;)
             {
-                s_loggerCallback(msg);
+                Slot& slot = m_slots[m_dequeuePosition & m_slotMask];
+                if (slot.sequence.load(std::memory_order_acquire) != m_dequeuePosition + 1)
+                {
+                    break;
+                }
+
+                if (m_callback != nullptr)
+                {
+                    m_callback(slot.msg);
+                }
+
+                // Hands the slot back to producers for the next lap around the ring
+                slot.sequence.store(m_dequeuePosition + m_slotMask + 1, std::memory_order_release);
+                m_dequeuePosition++;
             }
         }
+
+        const uint64_t droppedCount = m_droppedCount.exchange(0, std::memory_order_relaxed);
+        if ((droppedCount > 0) && (m_callback != nullptr))
+        {
+            char buf[128];
+            snprintf(buf, sizeof buf, "RTXMU Dropped %" PRIu64 " log messages, the async log ring was full\n", droppedCount);
+            m_callback(buf);
+        }
     }
-    bool Logger::isEnabled(Level verbosity)
+
+    void Logger::log(Level verbosity, const char* msg)
     {
-        return (verbosity <= s_loggerVerbosity) ? true : false;
+        if ((isEnabled(verbosity) == false) || (m_callback == nullptr))
+        {
+            return;
+        }
+
+        if (m_slots == nullptr)
+        {
+            m_callback(msg);
+            return;
+        }
+
+        // Producers claim a slot by bumping the enqueue position, the slot sequence tells whether the consumer
+        // is done with it and publishes the message once written
+        uint64_t position = m_enqueuePosition.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Slot&         slot       = m_slots[position & m_slotMask];
+            const int64_t difference = static_cast<int64_t>(slot.sequence.load(std::memory_order_acquire) - position);
+            if (difference == 0)
+            {
+                if (m_enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    strncpy(slot.msg, msg, MaxAsyncLogMessageLength - 1);
+                    slot.msg[MaxAsyncLogMessageLength - 1] = '\0';
+                    slot.sequence.store(position + 1, std::memory_order_release);
+                    return;
+                }
+            }
+            else if (difference < 0)
+            {
+                m_droppedCount.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            else
+            {
+                position = m_enqueuePosition.load(std::memory_order_relaxed);
+            }
+        }
     }
 }// end rtxmu namespace
@@ -21,9 +21,32 @@
 */
 
 #include "rtxmu/VkAccelStructManager.h"
+#include <algorithm>
+#include <cstring>
+#include <functional>
 
 namespace rtxmu
 {
+    namespace
+    {
+        // Arrays handed to the driver per recording, kept per thread and reused so recording stops allocating
+        // once they have grown to the largest batch
+        struct BuildArena
+        {
+            std::vector<vk::AccelerationStructureBuildSizesInfoKHR>        buildSizes;
+            std::vector<uint32_t>                                          buildOrder;
+            // Builds recorded since the last flush
+            std::vector<vk::AccelerationStructureBuildGeometryInfoKHR>     chunkGeomInfos;
+            std::vector<const vk::AccelerationStructureBuildRangeInfoKHR*> chunkRangeInfos;
+        };
+
+        BuildArena& GetBuildArena()
+        {
+            thread_local BuildArena buildArena;
+            return buildArena;
+        }
+    }
+
     VkAccelStructManager::VkAccelStructManager(const vk::Instance&       instance,
                                                const vk::Device&         device,
                                                const vk::PhysicalDevice& physicalDevice,
@@ -34,7 +57,12 @@ namespace rtxmu
         m_allocator.device = device;
         m_allocator.physicalDevice = physicalDevice;
 
-        Logger::setLoggerCallback(&VkAccelStructManager::logCallbackFunction);
+        // Every manager loads the dispatch table of its own device
+        VkDynamicLoader dl;
+        m_allocator.dispatchLoader.init(m_allocator.instance, m_allocator.device, dl);
+
+        m_allocator.logger = &m_logger;
+        m_logger.setLoggerCallback(&VkAccelStructManager::logCallbackFunction);
     }
 
     void VkAccelStructManager::logCallbackFunction(const char* msg)
@@ -43,23 +71,53 @@ namespace rtxmu
     }
 
     // Initializes suballocator block size
-    void VkAccelStructManager::Initialize(uint32_t suballocatorBlockSize)
+    void VkAccelStructManager::Initialize(uint32_t suballocatorBlockSize,
+                                          uint64_t scratchBudget)
     {
         m_suballocationBlockSize = suballocatorBlockSize;
+        m_scratchBudget = scratchBudget;
 
         m_scratchPool = std::make_unique<Suballocator<Allocator, VkScratchBlock>>(m_suballocationBlockSize, AccelStructAlignment, &m_allocator);
         m_updatePool = std::make_unique<Suballocator<Allocator, VkScratchBlock>>(m_suballocationBlockSize, AccelStructAlignment, &m_allocator);
-        m_resultPool = std::make_unique<Suballocator<Allocator, VkAccelStructBlock>>(m_suballocationBlockSize, AccelStructAlignment, &m_allocator);
-        m_transientResultPool = std::make_unique<Suballocator<Allocator, VkAccelStructBlock>>(m_suballocationBlockSize, AccelStructAlignment, &m_allocator);
-        m_compactionPool = std::make_unique<Suballocator<Allocator, VkAccelStructBlock>>(m_suballocationBlockSize, AccelStructAlignment, &m_allocator);
+        // Acceleration structure sizes range from a few KB to hundreds of MB so they get split into size classes
+        const std::vector<SizeClass> sizeClasses = m_sizeClasses.empty() ? GetDefaultSizeClasses(m_suballocationBlockSize) : m_sizeClasses;
+        m_resultPool = std::make_unique<SizeClassSuballocator<Allocator, VkAccelStructBlock>>(sizeClasses, AccelStructAlignment, &m_allocator);
+        m_transientResultPool = std::make_unique<SizeClassSuballocator<Allocator, VkAccelStructBlock>>(sizeClasses, AccelStructAlignment, &m_allocator);
+        m_compactionPool = std::make_unique<SizeClassSuballocator<Allocator, VkAccelStructBlock>>(sizeClasses, AccelStructAlignment, &m_allocator);
         m_queryCompactionSizePool = std::make_unique<Suballocator<Allocator, VkQueryBlock>>(CompactionSizeSuballocationBlockSize, SizeOfCompactionDescriptor, &m_allocator);
-
-        // Load dispatch table if not loaded
-        if (VkBlock::getDispatchLoader().vkGetInstanceProcAddr == nullptr)
+        m_querySerializedSizePool = std::make_unique<Suballocator<Allocator, VkSerializationQueryBlock>>(CompactionSizeSuballocationBlockSize, SizeOfCompactionDescriptor, &m_allocator);
+        m_serializationPool = std::make_unique<Suballocator<Allocator, VkSerializationBlock>>(m_suballocationBlockSize, AccelStructAlignment, &m_allocator);
+        m_instancePool = std::make_unique<Suballocator<Allocator, VkInstanceBlock>>(m_suballocationBlockSize, AccelStructAlignment, &m_allocator);
+#ifdef VK_EXT_opacity_micromap
+        m_micromapPool = std::make_unique<SizeClassSuballocator<Allocator, VkMicromapBlock>>(sizeClasses, AccelStructAlignment, &m_allocator);
+        m_compactedMicromapPool = std::make_unique<SizeClassSuballocator<Allocator, VkMicromapBlock>>(sizeClasses, AccelStructAlignment, &m_allocator);
+        m_queryMicromapCompactionSizePool = std::make_unique<Suballocator<Allocator, VkMicromapQueryBlock>>(CompactionSizeSuballocationBlockSize, SizeOfCompactionDescriptor, &m_allocator);
+#endif
+        ApplyBlockRetention();
+
+        m_scratchPool->setTelemetry(PoolType::Scratch, &m_telemetrySink);
+        m_updatePool->setTelemetry(PoolType::Update, &m_telemetrySink);
+        m_resultPool->setTelemetry(PoolType::Result, &m_telemetrySink);
+        m_transientResultPool->setTelemetry(PoolType::TransientResult, &m_telemetrySink);
+        m_compactionPool->setTelemetry(PoolType::Compaction, &m_telemetrySink);
+        m_queryCompactionSizePool->setTelemetry(PoolType::CompactionSize, &m_telemetrySink);
+        m_querySerializedSizePool->setTelemetry(PoolType::SerializedSize, &m_telemetrySink);
+        m_serializationPool->setTelemetry(PoolType::Serialized, &m_telemetrySink);
+        m_instancePool->setTelemetry(PoolType::Instance, &m_telemetrySink);
+#ifdef VK_EXT_opacity_micromap
+        m_micromapPool->setTelemetry(PoolType::Micromap, &m_telemetrySink);
+        m_compactedMicromapPool->setTelemetry(PoolType::CompactedMicromap, &m_telemetrySink);
+        m_queryMicromapCompactionSizePool->setTelemetry(PoolType::MicromapCompactionSize, &m_telemetrySink);
+#endif
+
+        // The scratch budget lives in the scratch pool which got recreated above
+        m_scratchRingMemory = {};
+        if (m_scratchBudget > 0)
         {
-            VkDynamicLoader dl;
-            VkBlock::getDispatchLoader().init(m_allocator.instance, m_allocator.device, dl);
+            m_scratchRingMemory = m_scratchPool->allocate(m_scratchBudget);
         }
+        // Fall back to per acceleration structure scratch when the budget couldn't be allocated
+        m_scratchRing.reset((m_scratchRingMemory.subBlock != nullptr) ? m_scratchBudget : 0);
     }
 
     // Resets all queues and frees all memory in suballocators
@@ -71,347 +129,2203 @@ namespace rtxmu
         m_transientResultPool.reset();
         m_compactionPool.reset();
         m_queryCompactionSizePool.reset();
-        Initialize(m_suballocationBlockSize);
+        m_querySerializedSizePool.reset();
+        m_serializationPool.reset();
+        m_instancePool.reset();
+#ifdef VK_EXT_opacity_micromap
+        m_micromapPool.reset();
+        m_compactedMicromapPool.reset();
+        m_queryMicromapCompactionSizePool.reset();
+#endif
+        Initialize(m_suballocationBlockSize, m_scratchBudget);
         AccelStructManager::Reset();
     }
 
-    void VkAccelStructManager::PopulateUpdateCommandList(vk::CommandBuffer                                  commandList,
+    bool VkAccelStructManager::PopulateUpdateCommandList(vk::CommandBuffer                                  commandList,
                                                          vk::AccelerationStructureBuildGeometryInfoKHR*     geomInfos,
                                                          const vk::AccelerationStructureBuildRangeInfoKHR** rangeInfos,
                                                          const uint32_t**                                   maxPrimitiveCounts,
                                                          const uint32_t                                     buildCount,
                                                          std::vector<uint64_t>&                             accelStructIds)
     {
-        std::lock_guard<std::mutex> guard(m_threadSafeLock);
+        // Recordings sharing the scratch budget must not interleave
+        std::unique_lock<std::mutex> scratchRingGuard(m_scratchRingLock, std::defer_lock);
+        if (m_scratchBudget > 0)
+        {
+            scratchRingGuard.lock();
+            m_scratchRing.beginRecording();
+        }
+
+        bool allBuildsRecorded = true;
+
+        uint32_t   gpuTimingQuery = 0;
+        const bool timeUpdates    = (buildCount > 0) && BeginGpuTiming(commandList, GpuTimingPhase::Update, gpuTimingQuery);
+        uint64_t   updatedCount   = 0;
+        uint64_t   updatedBytes   = 0;
 
         for (uint32_t buildIndex = 0; buildIndex < buildCount; buildIndex++)
         {
             const uint64_t asId = accelStructIds[buildIndex];
             auto& geomInfo = geomInfos[buildIndex];
 
+            if (IsLiveId(asId) == false)
+            {
+                continue;
+            }
             VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[asId];
 
-            if (geomInfo.flags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate &&
-                geomInfo.mode == vk::BuildAccelerationStructureModeKHR::eUpdate)
+            // Micromaps can't be refit and get rebuilt through PopulateMicromapBuildCommandList
+            if (accelStruct->isMicromap)
+            {
+                if (m_logger.isEnabled(Level::ERR))
+                {
+                    char buf[128];
+                    snprintf(buf, sizeof buf, "RTXMU Update/Refit Build %" PRIu64 " is a micromap and was skipped\n", asId);
+                    m_logger.log(Level::ERR, buf);
+                }
+                allBuildsRecorded = false;
+                continue;
+            }
+
+            const bool performUpdate = (geomInfo.flags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate) &&
+                                       (geomInfo.mode == vk::BuildAccelerationStructureModeKHR::eUpdate);
+
+            // Refits only move the existing BVH around so rebuild from time to time to restore its quality
+            if (performUpdate && IsRebuildDue(accelStruct))
+            {
+                geomInfo.mode                     = vk::BuildAccelerationStructureModeKHR::eBuild;
+                geomInfo.srcAccelerationStructure = nullptr;
+
+                if (m_logger.isEnabled(Level::DBG))
+                {
+                    char buf[128];
+                    snprintf(buf, sizeof buf, "RTXMU Refit %" PRIu64 " turned into a rebuild after %u refits\n", asId, accelStruct->refitCount);
+                    m_logger.log(Level::DBG, buf);
+                }
+            }
+
+            if (performUpdate && (geomInfo.mode == vk::BuildAccelerationStructureModeKHR::eUpdate))
             {
-                geomInfo.scratchData.deviceAddress = VkBlock::getDeviceAddress(m_allocator.device, accelStruct->updateGpuMemory.block, accelStruct->updateGpuMemory.offset);
+                bool needsBarrier = false;
+                geomInfo.scratchData.deviceAddress = AcquireUpdateScratch(accelStruct, needsBarrier);
 
                 geomInfo.dstAccelerationStructure = GetAccelerationStruct(asId);
                 geomInfo.srcAccelerationStructure = GetAccelerationStruct(asId);
 
-                if (Logger::isEnabled(Level::DBG))
+                if (geomInfo.scratchData.deviceAddress == 0)
+                {
+                    if (m_logger.isEnabled(Level::ERR))
+                    {
+                        char buf[128];
+                        snprintf(buf, sizeof buf, "RTXMU Update/Refit Build %" PRIu64 " is out of scratch memory and was skipped\n", asId);
+                        m_logger.log(Level::ERR, buf);
+                    }
+
+                    allBuildsRecorded = false;
+                    continue;
+                }
+
+                if (needsBarrier)
+                {
+                    FlushBuilds(commandList, true);
+                }
+                accelStruct->refitCount++;
+                updatedBytes += accelStruct->isCompacted ? accelStruct->compactionSize : accelStruct->resultSize;
+
+                RecordTrace(AllocationTraceRecordType::Update, asId, accelStruct->updateScratchSize);
+
+                if (m_logger.isEnabled(Level::DBG))
                 {
                     char buf[128];
                     snprintf(buf, sizeof buf, "RTXMU Update/Refit Build %" PRIu64 "\n", asId);
-                    Logger::log(Level::DBG, buf);
+                    m_logger.log(Level::DBG, buf);
                 }
             }
             else
             {
+                // Other ids share the acceleration structure and still expect the inputs it was built from
+                if (GetReferenceCount(asId) > 1)
+                {
+                    if (m_logger.isEnabled(Level::ERR))
+                    {
+                        char buf[128];
+                        snprintf(buf, sizeof buf, "RTXMU Rebuild %" PRIu64 " is shared by build deduplication and was skipped\n", asId);
+                        m_logger.log(Level::ERR, buf);
+                    }
+                    allBuildsRecorded = false;
+                    continue;
+                }
+                UnregisterDeduplicatedBuild(asId);
+
                 auto buildSizeInfo = vk::AccelerationStructureBuildSizesInfoKHR();
-                m_allocator.device.getAccelerationStructureBuildSizesKHR(vk::AccelerationStructureBuildTypeKHR::eDevice, &geomInfos[buildIndex], maxPrimitiveCounts[buildIndex], &buildSizeInfo, VkBlock::getDispatchLoader());
+                m_allocator.device.getAccelerationStructureBuildSizesKHR(vk::AccelerationStructureBuildTypeKHR::eDevice, &geomInfos[buildIndex], maxPrimitiveCounts[buildIndex], &buildSizeInfo, m_allocator.dispatchLoader);
+
+                uint32_t traceFlags = AllocationTraceRebuild;
 
                 // If the previous memory stores for the acceleration structure are not adequate then reallocate
-                if (accelStruct->scratchGpuMemory.subBlock->getSize() < buildSizeInfo.buildScratchSize ||
+                if (accelStruct->scratchSize < buildSizeInfo.buildScratchSize ||
+                    accelStruct->resultGpuMemory.subBlock == nullptr ||
                     accelStruct->resultGpuMemory.subBlock->getSize() < buildSizeInfo.accelerationStructureSize)
                 {
-                    if (Logger::isEnabled(Level::WARN))
+                    if (m_logger.isEnabled(Level::WARN))
+                    {
+                        m_logger.log(Level::WARN, "Rebuild memory size is too small so reallocate\n");
+                    }
+
+                    // Stay in the pool the result was originally allocated from so it is released to the right pool
+                    auto resultGpuMemory = accelStruct->requestedCompaction ?
+                                               m_transientResultPool->allocate(buildSizeInfo.accelerationStructureSize) :
+                                               m_resultPool->allocate(buildSizeInfo.accelerationStructureSize);
+
+                    // Out of memory, keep the previous build around and leave the rebuild out of the recorded chunks
+                    if (resultGpuMemory.subBlock == nullptr)
                     {
-                        Logger::log(Level::WARN, "Rebuild memory size is too small so reallocate and leak memory\n");
+                        if (m_logger.isEnabled(Level::ERR))
+                        {
+                            char buf[128];
+                            snprintf(buf, sizeof buf, "RTXMU Rebuild %" PRIu64 " is out of memory and was skipped\n", asId);
+                            m_logger.log(Level::ERR, buf);
+                        }
+
+                        allBuildsRecorded = false;
+                        continue;
+                    }
+                    // The GPU may still read the previous build and write its scratch, so both wait for garbage collection
+                    if (accelStruct->resultGpuMemory.subBlock != nullptr)
+                    {
+                        accelStruct->retiredResultMemory.push_back(accelStruct->resultGpuMemory);
+                    }
+                    if (accelStruct->scratchGpuMemory.subBlock != nullptr)
+                    {
+                        accelStruct->retiredScratchMemory.push_back(accelStruct->scratchGpuMemory);
                     }
 
-                    accelStruct->resultGpuMemory = m_resultPool->allocate(buildSizeInfo.accelerationStructureSize);
+                    accelStruct->resultGpuMemory = resultGpuMemory;
+                    PublishAddress(asId, GetDeviceAddress(asId));
+                    traceFlags |= AllocationTraceReallocated;
 
-                    accelStruct->scratchGpuMemory = m_scratchPool->allocate(buildSizeInfo.buildScratchSize);
-                    accelStruct->scratchSize = accelStruct->scratchGpuMemory.subBlock->getSize();
+                    // Scratch is acquired below, dropping the reference makes it reallocate at the new size
+                    accelStruct->scratchGpuMemory = {};
+                    accelStruct->scratchSize = buildSizeInfo.buildScratchSize;
 
+                    m_totalUncompactedMemory -= accelStruct->resultSize;
                     m_totalUncompactedMemory += accelStruct->resultGpuMemory.subBlock->getSize();
                     accelStruct->resultSize = accelStruct->resultGpuMemory.subBlock->getSize();
+                    accelStruct->initialSize = buildSizeInfo.accelerationStructureSize;
 
                     // Double check to make sure memory is large enough
-                    if (accelStruct->scratchGpuMemory.subBlock->getSize() < buildSizeInfo.buildScratchSize ||
-                        accelStruct->resultGpuMemory.subBlock->getSize() < buildSizeInfo.accelerationStructureSize)
+                    if (accelStruct->resultGpuMemory.subBlock->getSize() < buildSizeInfo.accelerationStructureSize)
                     {
-                        if (Logger::isEnabled(Level::FATAL))
+                        if (m_logger.isEnabled(Level::FATAL))
                         {
-                            Logger::log(Level::FATAL, "Rebuild memory size is too small after reallocating\n");
+                            m_logger.log(Level::FATAL, "Rebuild memory size is too small after reallocating\n");
                             assert(0);
                         }
                     }
 
                     auto asCreateInfo = vk::AccelerationStructureCreateInfoKHR()
-                        .setType(geomInfos->type)
+                        .setType(geomInfo.type)
                         .setSize(buildSizeInfo.accelerationStructureSize)
                         .setBuffer(accelStruct->resultGpuMemory.block.getBuffer())
                         .setOffset(accelStruct->resultGpuMemory.offset);
 
-                    auto asHandle = m_allocator.device.createAccelerationStructureKHR(asCreateInfo, nullptr, VkBlock::getDispatchLoader());
+                    auto asHandle = m_allocator.device.createAccelerationStructureKHR(asCreateInfo, nullptr, m_allocator.dispatchLoader);
                     accelStruct->resultGpuMemory.block.m_asHandle = asHandle;
-
-                    geomInfos[buildIndex].scratchData.deviceAddress = VkBlock::getDeviceAddress(m_allocator.device, accelStruct->scratchGpuMemory.block,
-                        accelStruct->scratchGpuMemory.offset);
-                    geomInfos[buildIndex].dstAccelerationStructure = asHandle;
                 }
 
                 // All scratch is discarded after the build is performed but if a recurring build happens
-                // then we need to reallocate
-                if ((accelStruct->scratchGpuMemory.subBlock == nullptr) ||
-                    (accelStruct->scratchGpuMemory.subBlock->isFree() == true))
+                // then we need to reacquire the same size
+                bool needsBarrier = false;
+                geomInfo.scratchData.deviceAddress = AcquireScratch(accelStruct, accelStruct->scratchSize, needsBarrier);
+                geomInfo.dstAccelerationStructure = accelStruct->resultGpuMemory.block.m_asHandle;
+
+                if (geomInfo.scratchData.deviceAddress == 0)
                 {
-                    accelStruct->scratchGpuMemory =
-                        m_scratchPool->allocate(accelStruct->scratchGpuMemory.subBlock->getSize());
+                    if (m_logger.isEnabled(Level::ERR))
+                    {
+                        char buf[128];
+                        snprintf(buf, sizeof buf, "RTXMU Rebuild %" PRIu64 " is out of scratch memory and was skipped\n", asId);
+                        m_logger.log(Level::ERR, buf);
+                    }
+
+                    allBuildsRecorded = false;
+                    continue;
                 }
 
-                geomInfo.scratchData.deviceAddress = VkBlock::getDeviceAddress(m_allocator.device, accelStruct->scratchGpuMemory.block, accelStruct->scratchGpuMemory.offset);
-                geomInfo.dstAccelerationStructure = accelStruct->resultGpuMemory.block.m_asHandle;
+                if (needsBarrier)
+                {
+                    FlushBuilds(commandList, true);
+                }
+                accelStruct->refitCount       = 0;
+                accelStruct->rebuildRequested = false;
+                updatedBytes += accelStruct->resultSize;
 
-                if (Logger::isEnabled(Level::DBG))
+                RecordTrace(AllocationTraceRecordType::Update,
+                            asId,
+                            buildSizeInfo.accelerationStructureSize,
+                            buildSizeInfo.buildScratchSize,
+                            traceFlags);
+
+                if (m_logger.isEnabled(Level::DBG))
                 {
                     char buf[128];
                     snprintf(buf, sizeof buf, "RTXMU Rebuild %" PRIu64 "\n", asId);
-                    Logger::log(Level::DBG, buf);
+                    m_logger.log(Level::DBG, buf);
                 }
             }
 
+            QueueBuild(commandList, geomInfo, rangeInfos[buildIndex]);
+            updatedCount++;
+        }
+
+        FlushBuilds(commandList, false);
+
+        if (timeUpdates)
+        {
+            EndGpuTiming(commandList, gpuTimingQuery, updatedCount, updatedBytes);
         }
-        commandList.buildAccelerationStructuresKHR(buildCount, geomInfos, rangeInfos, VkBlock::getDispatchLoader());
+
+        return allBuildsRecorded;
     }
 
     // Receives acceleration structure inputs and returns a command list with build commands
-    void VkAccelStructManager::PopulateBuildCommandList(vk::CommandBuffer                                  commandList,
+    bool VkAccelStructManager::PopulateBuildCommandList(vk::CommandBuffer                                  commandList,
                                                         vk::AccelerationStructureBuildGeometryInfoKHR*     geomInfos,
                                                         const vk::AccelerationStructureBuildRangeInfoKHR** rangeInfos,
                                                         const uint32_t**                                   maxPrimitiveCounts,
                                                         const uint32_t                                     buildCount,
                                                         std::vector<uint64_t>&                             accelStructIds)
     {
-        std::lock_guard<std::mutex> guard(m_threadSafeLock);
+        // Recordings sharing the scratch budget must not interleave
+        std::unique_lock<std::mutex> scratchRingGuard(m_scratchRingLock, std::defer_lock);
+        if (m_scratchBudget > 0)
+        {
+            scratchRingGuard.lock();
+            m_scratchRing.beginRecording();
+        }
 
-        accelStructIds.reserve(buildCount);
+        bool allBuildsRecorded = true;
+
+        // Query every build size up front to record the builds largest scratch first, so builds of similar
+        // size end up in the same chunks and the scratch budget gets filled by the big builds before it wraps
+        BuildArena& buildArena = GetBuildArena();
+        buildArena.buildSizes.resize(buildCount);
+        buildArena.buildOrder.resize(buildCount);
         for (uint32_t buildIndex = 0; buildIndex < buildCount; buildIndex++)
         {
+            buildArena.buildSizes[buildIndex] = vk::AccelerationStructureBuildSizesInfoKHR();
+            m_allocator.device.getAccelerationStructureBuildSizesKHR(vk::AccelerationStructureBuildTypeKHR::eDevice, &geomInfos[buildIndex], maxPrimitiveCounts[buildIndex], &buildArena.buildSizes[buildIndex], m_allocator.dispatchLoader);
+            buildArena.buildOrder[buildIndex] = buildIndex;
+        }
+
+        std::stable_sort(buildArena.buildOrder.begin(), buildArena.buildOrder.end(), [&](uint32_t a, uint32_t b)
+        {
+            return buildArena.buildSizes[a].buildScratchSize > buildArena.buildSizes[b].buildScratchSize;
+        });
+
+        // Ids stay in input order no matter the recording order
+        const size_t firstIdIndex = accelStructIds.size();
+        accelStructIds.resize(firstIdIndex + buildCount, ReservedId);
+
+        const bool    deduplicateBuilds = IsBuildDeduplicationEnabled();
+        BuildInputKey buildInputKey;
+
+        uint32_t   gpuTimingQuery = 0;
+        const bool timeBuilds     = (buildCount > 0) && BeginGpuTiming(commandList, GpuTimingPhase::Build, gpuTimingQuery);
+        uint64_t   builtCount     = 0;
+        uint64_t   builtBytes     = 0;
+
+        for (const uint32_t& buildIndex : buildArena.buildOrder)
+        {
+            // Inputs already built, possibly earlier in this batch, share that acceleration structure
+            const bool deduplicateBuild = deduplicateBuilds && GetBuildInputKey(geomInfos[buildIndex], rangeInfos[buildIndex], buildInputKey);
+            if (deduplicateBuild)
+            {
+                const uint64_t sharedId = AcquireDeduplicatedBuild(buildInputKey);
+                if (sharedId != ReservedId)
+                {
+                    accelStructIds[firstIdIndex + buildIndex] = sharedId;
+                    continue;
+                }
+            }
+
             uint64_t asId = GetAccelStructId();
 
+            // Assign an id for the acceleration structure
+            accelStructIds[firstIdIndex + buildIndex] = asId;
+
+            // Out of ids, leave the build out of the recorded chunks
+            if (asId == ReservedId)
+            {
+                allBuildsRecorded = false;
+                continue;
+            }
+
             VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[asId];
 
-            // Assign an id for the acceleration structure
-            accelStructIds.push_back(asId);
+            const vk::AccelerationStructureBuildSizesInfoKHR& buildSizeInfo = buildArena.buildSizes[buildIndex];
+
+            const bool allowCompaction = static_cast<bool>(geomInfos[buildIndex].flags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction);
+            const bool allowUpdate     = static_cast<bool>(geomInfos[buildIndex].flags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate);
 
-            auto buildSizeInfo = vk::AccelerationStructureBuildSizesInfoKHR();
-            m_allocator.device.getAccelerationStructureBuildSizesKHR(vk::AccelerationStructureBuildTypeKHR::eDevice, &geomInfos[buildIndex], maxPrimitiveCounts[buildIndex], &buildSizeInfo, VkBlock::getDispatchLoader());
+            // Tag as not yet compacted
+            accelStruct->isCompacted         = false;
+            accelStruct->requestedCompaction = allowCompaction;
+            accelStruct->type                = geomInfos[buildIndex].type;
 
-            if (geomInfos[buildIndex].flags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction)
+            if (allowCompaction)
             {
                 accelStruct->resultGpuMemory = m_transientResultPool->allocate(buildSizeInfo.accelerationStructureSize);
+                accelStruct->queryCompactionSizeMemory = m_queryCompactionSizePool->allocate(SizeOfCompactionDescriptor);
+                if (accelStruct->queryCompactionSizeMemory.subBlock != nullptr)
+                {
+                    ResetCompactionSizeQuery(accelStruct->queryCompactionSizeMemory.block.queryPool,
+                                             accelStruct->queryCompactionSizeMemory.offset);
+                }
             }
             else
             {
                 accelStruct->resultGpuMemory = m_resultPool->allocate(buildSizeInfo.accelerationStructureSize);
             }
 
-            accelStruct->scratchGpuMemory = m_scratchPool->allocate(buildSizeInfo.buildScratchSize);
-            accelStruct->scratchSize = accelStruct->scratchGpuMemory.subBlock->getSize();
+            // Update scratch that fits the scratch budget is drawn from it with every refit instead of being held on to
+            const bool holdsUpdateScratch = allowUpdate && (buildSizeInfo.updateScratchSize > m_scratchRing.getSize());
+            if (holdsUpdateScratch)
+            {
+                accelStruct->updateGpuMemory = m_updatePool->allocate(buildSizeInfo.updateScratchSize);
+            }
+
+            accelStruct->scratchSize       = buildSizeInfo.buildScratchSize;
+            accelStruct->updateScratchSize = buildSizeInfo.updateScratchSize;
+
+            bool needsBarrier     = false;
+            bool allocationFailed = (accelStruct->resultGpuMemory.subBlock == nullptr) ||
+                                    (holdsUpdateScratch && (accelStruct->updateGpuMemory.subBlock == nullptr)) ||
+                                    (allowCompaction && (accelStruct->queryCompactionSizeMemory.subBlock == nullptr));
+            if (allocationFailed == false)
+            {
+                geomInfos[buildIndex].scratchData.deviceAddress = AcquireScratch(accelStruct, accelStruct->scratchSize, needsBarrier);
+                allocationFailed = (geomInfos[buildIndex].scratchData.deviceAddress == 0);
+            }
+
+            // Out of memory, hand back whatever got allocated and leave the build out of the recorded chunks
+            if (allocationFailed)
+            {
+                if (m_logger.isEnabled(Level::ERR))
+                {
+                    char buf[128];
+                    snprintf(buf, sizeof buf, "RTXMU Initial Build %u is out of memory and was skipped\n", buildIndex);
+                    m_logger.log(Level::ERR, buf);
+                }
+
+                ReleaseAccelerationStructures(asId);
+                accelStructIds[firstIdIndex + buildIndex] = ReservedId;
+                allBuildsRecorded = false;
+                continue;
+            }
+
             m_totalUncompactedMemory += accelStruct->resultGpuMemory.subBlock->getSize();
             accelStruct->resultSize = accelStruct->resultGpuMemory.subBlock->getSize();
+            accelStruct->initialSize = buildSizeInfo.accelerationStructureSize;
+            PublishAddress(asId, GetDeviceAddress(asId));
 
             auto asCreateInfo = vk::AccelerationStructureCreateInfoKHR()
-                .setType(geomInfos->type)
+                .setType(geomInfos[buildIndex].type)
                 .setSize(buildSizeInfo.accelerationStructureSize)
                 .setBuffer(accelStruct->resultGpuMemory.block.getBuffer())
                 .setOffset(accelStruct->resultGpuMemory.offset);
 
-            auto asHandle = m_allocator.device.createAccelerationStructureKHR(asCreateInfo, nullptr, VkBlock::getDispatchLoader());
+            auto asHandle = m_allocator.device.createAccelerationStructureKHR(asCreateInfo, nullptr, m_allocator.dispatchLoader);
             accelStruct->resultGpuMemory.block.m_asHandle = asHandle;
 
-            if (geomInfos[buildIndex].flags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate)
+            geomInfos[buildIndex].dstAccelerationStructure = asHandle;
+
+            if (deduplicateBuild)
             {
-                accelStruct->updateGpuMemory = m_updatePool->allocate(buildSizeInfo.updateScratchSize);
+                RegisterDeduplicatedBuild(asId, buildInputKey);
             }
 
-            geomInfos[buildIndex].scratchData.deviceAddress = VkBlock::getDeviceAddress(m_allocator.device, accelStruct->scratchGpuMemory.block,
-                accelStruct->scratchGpuMemory.offset);
-            geomInfos[buildIndex].dstAccelerationStructure = asHandle;
+            RecordTrace(AllocationTraceRecordType::Build,
+                        asId,
+                        buildSizeInfo.accelerationStructureSize,
+                        buildSizeInfo.buildScratchSize,
+                        (allowCompaction ? AllocationTraceAllowCompaction : 0) | (allowUpdate ? AllocationTraceAllowUpdate : 0));
 
-            if (geomInfos[buildIndex].flags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction)
+            if (needsBarrier)
             {
-                accelStruct->isCompacted = false;
-                accelStruct->requestedCompaction = true;
+                FlushBuilds(commandList, true);
+            }
+            QueueBuild(commandList, geomInfos[buildIndex], rangeInfos[buildIndex]);
+            builtCount++;
+            builtBytes += accelStruct->resultSize;
 
-                accelStruct->queryCompactionSizeMemory = m_queryCompactionSizePool->allocate(SizeOfCompactionDescriptor);
+            if (m_logger.isEnabled(Level::DBG))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU Initial Build %s Compaction %" PRIu64 "\n", allowCompaction ? "Enabled" : "Disabled", asId);
+                m_logger.log(Level::DBG, buf);
+            }
+        }
+
+        FlushBuilds(commandList, false);
+
+        if (timeBuilds)
+        {
+            EndGpuTiming(commandList, gpuTimingQuery, builtCount, builtBytes);
+        }
+
+        return allBuildsRecorded;
+    }
+
+    uint64_t VkAccelStructManager::CreateTopLevel(const vk::BuildAccelerationStructureFlagsKHR flags,
+                                                  const uint32_t                               instanceCapacity)
+    {
+        const uint64_t topLevelId = GetAccelStructId();
+        if (topLevelId == ReservedId)
+        {
+            return ReservedId;
+        }
+        VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[topLevelId];
+
+        // Top level acceleration structures are rebuilt too often for compaction to pay off
+        accelStruct->type            = vk::AccelerationStructureTypeKHR::eTopLevel;
+        accelStruct->topLevel        = std::make_unique<VkTopLevel>(instanceCapacity);
+        accelStruct->topLevel->flags = flags & ~vk::BuildAccelerationStructureFlagsKHR(vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction);
+
+        if (m_logger.isEnabled(Level::DBG))
+        {
+            char buf[128];
+            snprintf(buf, sizeof buf, "RTXMU Create Top Level %" PRIu64 "\n", topLevelId);
+            m_logger.log(Level::DBG, buf);
+        }
+        return topLevelId;
+    }
+
+    void VkAccelStructManager::SetTopLevelInstanceCount(const uint64_t topLevelId,
+                                                        const uint32_t instanceCount)
+    {
+        if (IsLiveId(topLevelId) && (m_asBufferBuildQueue[topLevelId]->topLevel != nullptr))
+        {
+            m_asBufferBuildQueue[topLevelId]->topLevel->instances.resize(instanceCount);
+        }
+    }
+
+    void VkAccelStructManager::SetTopLevelInstances(const uint64_t                              topLevelId,
+                                                    const uint32_t                              firstInstance,
+                                                    const vk::AccelerationStructureInstanceKHR* instances,
+                                                    const uint32_t                              instanceCount)
+    {
+        if ((IsLiveId(topLevelId) == false) || (m_asBufferBuildQueue[topLevelId]->topLevel == nullptr))
+        {
+            return;
+        }
+        VkTopLevel* topLevel = m_asBufferBuildQueue[topLevelId]->topLevel.get();
+
+        if (static_cast<uint64_t>(firstInstance) + instanceCount > topLevel->instances.getInstanceCount())
+        {
+            if (m_logger.isEnabled(Level::ERR))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU Top Level %" PRIu64 " instances %u to %u are out of range and were skipped\n",
+                         topLevelId, firstInstance, firstInstance + instanceCount);
+                m_logger.log(Level::ERR, buf);
+            }
+            return;
+        }
+        topLevel->instances.write(firstInstance, instances, instanceCount);
+    }
+
+    bool VkAccelStructManager::PopulateTopLevelBuildCommandList(vk::CommandBuffer commandList,
+                                                                const uint64_t    topLevelId,
+                                                                const uint64_t    completedFenceValue,
+                                                                const uint64_t    submitFenceValue)
+    {
+        if ((IsLiveId(topLevelId) == false) || (m_asBufferBuildQueue[topLevelId]->topLevel == nullptr))
+        {
+            return false;
+        }
+        VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[topLevelId];
+        VkTopLevel*              topLevel    = accelStruct->topLevel.get();
+
+        ReleaseRetiredTopLevelMemory(topLevel, completedFenceValue);
+
+        const bool     allowUpdate    = static_cast<bool>(topLevel->flags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate);
+        const uint32_t targetCapacity = topLevel->instances.getTargetCapacity();
+        const bool     reallocate     = (targetCapacity != topLevel->instances.getCapacity()) ||
+                                        (accelStruct->resultGpuMemory.subBlock == nullptr);
+        const TopLevelBuildMode buildMode = topLevel->instances.selectBuildMode(reallocate,
+                                                                                allowUpdate,
+                                                                                IsRebuildDue(accelStruct),
+                                                                                m_topLevelRebuildRatio);
+        if (buildMode == TopLevelBuildMode::None)
+        {
+            return true;
+        }
+
+        // Recordings sharing the scratch budget must not interleave
+        std::unique_lock<std::mutex> scratchRingGuard(m_scratchRingLock, std::defer_lock);
+        if (m_scratchBudget > 0)
+        {
+            scratchRingGuard.lock();
+            m_scratchRing.beginRecording();
+        }
+
+        if ((buildMode == TopLevelBuildMode::Reallocate) &&
+            (AllocateTopLevelMemory(topLevelId, targetCapacity) == false))
+        {
+            return false;
+        }
+
+        // Flush the instances written since the picked instance buffer was last read
+        uint32_t bufferIndex = topLevel->instances.acquireBuffer(completedFenceValue);
+        if (bufferIndex == topLevel->instances.getBufferCount())
+        {
+            auto instanceMemory = m_instancePool->allocate(static_cast<uint64_t>(topLevel->instances.getCapacity()) *
+                                                           sizeof(vk::AccelerationStructureInstanceKHR));
+            if (instanceMemory.subBlock == nullptr)
+            {
+                if (m_logger.isEnabled(Level::ERR))
+                {
+                    char buf[128];
+                    snprintf(buf, sizeof buf, "RTXMU Top Level %" PRIu64 " is out of instance memory and was skipped\n", topLevelId);
+                    m_logger.log(Level::ERR, buf);
+                }
+                return false;
+            }
+            bufferIndex = topLevel->instances.addBuffer(instanceMemory);
+        }
+
+        const auto& instanceMemory = topLevel->instances.getBufferMemory(bufferIndex);
+        const uint64_t flushedCount = topLevel->instances.flush(bufferIndex,
+                                                                instanceMemory.block.getMappedData() + instanceMemory.offset,
+                                                                submitFenceValue);
+
+        auto instancesData = vk::AccelerationStructureGeometryInstancesDataKHR()
+            .setArrayOfPointers(VK_FALSE)
+            .setData(VkBlock::getDeviceAddress(m_allocator.device, instanceMemory.block, instanceMemory.offset));
+
+        auto geometry = vk::AccelerationStructureGeometryKHR()
+            .setGeometryType(vk::GeometryTypeKHR::eInstances)
+            .setGeometry(instancesData);
+
+        auto geomInfo = vk::AccelerationStructureBuildGeometryInfoKHR()
+            .setType(vk::AccelerationStructureTypeKHR::eTopLevel)
+            .setFlags(topLevel->flags)
+            .setGeometryCount(1)
+            .setPGeometries(&geometry)
+            .setDstAccelerationStructure(accelStruct->resultGpuMemory.block.m_asHandle);
+
+        bool needsBarrier = false;
+        if (buildMode == TopLevelBuildMode::Update)
+        {
+            geomInfo.mode                      = vk::BuildAccelerationStructureModeKHR::eUpdate;
+            geomInfo.srcAccelerationStructure  = accelStruct->resultGpuMemory.block.m_asHandle;
+            geomInfo.scratchData.deviceAddress = AcquireUpdateScratch(accelStruct, needsBarrier);
+        }
+        else
+        {
+            geomInfo.mode                      = vk::BuildAccelerationStructureModeKHR::eBuild;
+            geomInfo.scratchData.deviceAddress = AcquireScratch(accelStruct, accelStruct->scratchSize, needsBarrier);
+        }
+
+        if (geomInfo.scratchData.deviceAddress == 0)
+        {
+            if (m_logger.isEnabled(Level::ERR))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU Top Level %" PRIu64 " is out of scratch memory and was skipped\n", topLevelId);
+                m_logger.log(Level::ERR, buf);
+            }
+            return false;
+        }
+
+        // Nothing is queued here so this only places the scratch barrier
+        if (needsBarrier)
+        {
+            FlushBuilds(commandList, true);
+        }
+
+        const auto rangeInfo = vk::AccelerationStructureBuildRangeInfoKHR()
+            .setPrimitiveCount(topLevel->instances.getInstanceCount());
+        const vk::AccelerationStructureBuildRangeInfoKHR* rangeInfos = &rangeInfo;
+
+        const GpuTimingPhase gpuTimingPhase = (buildMode == TopLevelBuildMode::Update) ? GpuTimingPhase::Update : GpuTimingPhase::Build;
+        uint32_t   gpuTimingQuery = 0;
+        const bool timeBuild      = BeginGpuTiming(commandList, gpuTimingPhase, gpuTimingQuery);
+
+        commandList.buildAccelerationStructuresKHR(1, &geomInfo, &rangeInfos, m_allocator.dispatchLoader);
+
+        if (timeBuild)
+        {
+            EndGpuTiming(commandList, gpuTimingQuery, 1, accelStruct->resultSize);
+        }
+
+        // Rays are usually traced against it right after, from whichever stage
+        auto barrier = vk::BufferMemoryBarrier()
+            .setSrcAccessMask(vk::AccessFlagBits::eAccelerationStructureWriteKHR)
+            .setDstAccessMask(vk::AccessFlagBits::eAccelerationStructureReadKHR)
+            .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+            .setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+            .setBuffer(accelStruct->resultGpuMemory.block.getBuffer())
+            .setOffset(accelStruct->resultGpuMemory.offset)
+            .setSize(accelStruct->resultGpuMemory.subBlock->getSize());
+
+        commandList.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+            vk::PipelineStageFlagBits::eAllCommands,
+            vk::DependencyFlags(), 0, nullptr, 1, &barrier, 0, nullptr, m_allocator.dispatchLoader);
+
+        if (buildMode == TopLevelBuildMode::Update)
+        {
+            accelStruct->refitCount++;
+            RecordTrace(AllocationTraceRecordType::Update, topLevelId, accelStruct->updateScratchSize);
+        }
+        else
+        {
+            accelStruct->refitCount       = 0;
+            accelStruct->rebuildRequested = false;
+            if (buildMode == TopLevelBuildMode::Rebuild)
+            {
+                RecordTrace(AllocationTraceRecordType::Update,
+                            topLevelId,
+                            accelStruct->initialSize,
+                            accelStruct->scratchSize,
+                            AllocationTraceRebuild);
+            }
+        }
+
+        topLevel->instances.markBuilt();
+        topLevel->lastFenceValue = submitFenceValue;
+
+        if (m_logger.isEnabled(Level::DBG))
+        {
+            char buf[128];
+            snprintf(buf, sizeof buf, "RTXMU Top Level %s %" PRIu64 " uploaded %" PRIu64 " instances\n",
+                     (buildMode == TopLevelBuildMode::Update) ? "Refit" : "Rebuild", topLevelId, flushedCount);
+            m_logger.log(Level::DBG, buf);
+        }
+        return true;
+    }
+
+    bool VkAccelStructManager::AllocateTopLevelMemory(const uint64_t topLevelId,
+                                                      const uint32_t instanceCapacity)
+    {
+        VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[topLevelId];
+        VkTopLevel*              topLevel    = accelStruct->topLevel.get();
+
+        // Sizes only depend on the geometry type, flags and instance count
+        auto geometry = vk::AccelerationStructureGeometryKHR()
+            .setGeometryType(vk::GeometryTypeKHR::eInstances)
+            .setGeometry(vk::AccelerationStructureGeometryInstancesDataKHR());
+
+        auto geomInfo = vk::AccelerationStructureBuildGeometryInfoKHR()
+            .setType(vk::AccelerationStructureTypeKHR::eTopLevel)
+            .setFlags(topLevel->flags)
+            .setMode(vk::BuildAccelerationStructureModeKHR::eBuild)
+            .setGeometryCount(1)
+            .setPGeometries(&geometry);
+
+        auto buildSizeInfo = vk::AccelerationStructureBuildSizesInfoKHR();
+        m_allocator.device.getAccelerationStructureBuildSizesKHR(vk::AccelerationStructureBuildTypeKHR::eDevice, &geomInfo, &instanceCapacity, &buildSizeInfo, m_allocator.dispatchLoader);
+
+        const bool allowUpdate        = static_cast<bool>(topLevel->flags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate);
+        const bool holdsUpdateScratch = allowUpdate && (buildSizeInfo.updateScratchSize > m_scratchRing.getSize());
+
+        auto resultGpuMemory = m_resultPool->allocate(buildSizeInfo.accelerationStructureSize);
+        Suballocator<Allocator, VkScratchBlock>::SubAllocation updateGpuMemory = {};
+        if (holdsUpdateScratch && (resultGpuMemory.subBlock != nullptr))
+        {
+            updateGpuMemory = m_updatePool->allocate(buildSizeInfo.updateScratchSize);
+        }
+
+        // Out of memory, the previous memory and capacity stay
+        if ((resultGpuMemory.subBlock == nullptr) ||
+            (holdsUpdateScratch && (updateGpuMemory.subBlock == nullptr)))
+        {
+            if (resultGpuMemory.subBlock != nullptr)
+            {
+                m_resultPool->free(resultGpuMemory.subBlock);
+            }
+            if (m_logger.isEnabled(Level::ERR))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU Top Level %" PRIu64 " is out of memory for %u instances and was skipped\n", topLevelId, instanceCapacity);
+                m_logger.log(Level::ERR, buf);
+            }
+            return false;
+        }
+
+        const bool isReallocation = (accelStruct->resultGpuMemory.subBlock != nullptr);
+
+        // Frames still in flight may trace against the previous memory or build from its instance buffers
+        VkRetiredTopLevelMemory retiredMemory;
+        retiredMemory.fenceValue       = topLevel->lastFenceValue;
+        retiredMemory.resultGpuMemory  = accelStruct->resultGpuMemory;
+        retiredMemory.scratchGpuMemory = accelStruct->scratchGpuMemory;
+        retiredMemory.updateGpuMemory  = accelStruct->updateGpuMemory;
+        topLevel->instances.setCapacity(instanceCapacity, retiredMemory.instanceMemory);
+        topLevel->retiredMemory.push_back(std::move(retiredMemory));
+
+        m_totalUncompactedMemory -= accelStruct->resultSize;
+
+        // Scratch is acquired by the build, dropping the reference makes it reallocate at the new size
+        accelStruct->resultGpuMemory   = resultGpuMemory;
+        accelStruct->updateGpuMemory   = updateGpuMemory;
+        accelStruct->scratchGpuMemory  = {};
+        accelStruct->scratchSize       = buildSizeInfo.buildScratchSize;
+        accelStruct->updateScratchSize = buildSizeInfo.updateScratchSize;
+        accelStruct->resultSize        = resultGpuMemory.subBlock->getSize();
+        accelStruct->initialSize       = buildSizeInfo.accelerationStructureSize;
+        m_totalUncompactedMemory += accelStruct->resultSize;
+
+        auto asCreateInfo = vk::AccelerationStructureCreateInfoKHR()
+            .setType(vk::AccelerationStructureTypeKHR::eTopLevel)
+            .setSize(buildSizeInfo.accelerationStructureSize)
+            .setBuffer(accelStruct->resultGpuMemory.block.getBuffer())
+            .setOffset(accelStruct->resultGpuMemory.offset);
+        accelStruct->resultGpuMemory.block.m_asHandle = m_allocator.device.createAccelerationStructureKHR(asCreateInfo, nullptr, m_allocator.dispatchLoader);
+
+        PublishAddress(topLevelId, GetDeviceAddress(topLevelId));
+
+        const uint32_t updateFlag = allowUpdate ? AllocationTraceAllowUpdate : 0;
+        RecordTrace(isReallocation ? AllocationTraceRecordType::Update : AllocationTraceRecordType::Build,
+                    topLevelId,
+                    buildSizeInfo.accelerationStructureSize,
+                    buildSizeInfo.buildScratchSize,
+                    isReallocation ? (AllocationTraceRebuild | AllocationTraceReallocated) : updateFlag);
+
+        if (m_logger.isEnabled(Level::DBG))
+        {
+            char buf[128];
+            snprintf(buf, sizeof buf, "RTXMU Top Level %" PRIu64 " sized for %u instances\n", topLevelId, instanceCapacity);
+            m_logger.log(Level::DBG, buf);
+        }
+        return true;
+    }
+
+    void VkAccelStructManager::ReleaseRetiredTopLevelMemory(VkTopLevel*    topLevel,
+                                                            const uint64_t completedFenceValue)
+    {
+        auto retiredMemory = topLevel->retiredMemory.begin();
+        while (retiredMemory != topLevel->retiredMemory.end())
+        {
+            if (retiredMemory->fenceValue > completedFenceValue)
+            {
+                ++retiredMemory;
+                continue;
+            }
+
+            if (retiredMemory->resultGpuMemory.subBlock != nullptr)
+            {
+                m_allocator.device.destroyAccelerationStructureKHR(retiredMemory->resultGpuMemory.block.m_asHandle, nullptr, m_allocator.dispatchLoader);
+                m_resultPool->free(retiredMemory->resultGpuMemory.subBlock);
+            }
+            if (retiredMemory->scratchGpuMemory.subBlock != nullptr)
+            {
+                m_scratchPool->free(retiredMemory->scratchGpuMemory.subBlock);
+            }
+            if (retiredMemory->updateGpuMemory.subBlock != nullptr)
+            {
+                m_updatePool->free(retiredMemory->updateGpuMemory.subBlock);
+            }
+            for (auto& instanceMemory : retiredMemory->instanceMemory)
+            {
+                m_instancePool->free(instanceMemory.subBlock);
+            }
+            retiredMemory = topLevel->retiredMemory.erase(retiredMemory);
+        }
+    }
+
+    vk::DeviceAddress VkAccelStructManager::AcquireScratch(VkAccelerationStructure* accelStruct,
+                                                           const vk::DeviceSize     scratchSize,
+                                                           bool&                    needsBarrier)
+    {
+        uint64_t ringOffset = 0;
+
+        needsBarrier = false;
+        if (m_scratchRing.acquire(scratchSize, ringOffset, needsBarrier))
+        {
+            return VkBlock::getDeviceAddress(m_allocator.device, m_scratchRingMemory.block, m_scratchRingMemory.offset + ringOffset);
+        }
+
+        if ((m_scratchBudget > 0) && m_logger.isEnabled(Level::WARN))
+        {
+            char buf[128];
+            snprintf(buf, sizeof buf, "RTXMU Scratch of %" PRIu64 " bytes exceeds the scratch budget\n", scratchSize);
+            m_logger.log(Level::WARN, buf);
+        }
+
+        // Without a budget each acceleration structure keeps its own scratch until garbage collection
+        if (accelStruct->scratchGpuMemory.subBlock == nullptr)
+        {
+            accelStruct->scratchGpuMemory = m_scratchPool->allocate(scratchSize);
+        }
+
+        // Out of memory
+        if (accelStruct->scratchGpuMemory.subBlock == nullptr)
+        {
+            return 0;
+        }
+
+        return VkBlock::getDeviceAddress(m_allocator.device, accelStruct->scratchGpuMemory.block, accelStruct->scratchGpuMemory.offset);
+    }
+
+    vk::DeviceAddress VkAccelStructManager::AcquireUpdateScratch(VkAccelerationStructure* accelStruct,
+                                                                 bool&                    needsBarrier)
+    {
+        needsBarrier = false;
+        if (accelStruct->updateGpuMemory.subBlock != nullptr)
+        {
+            return VkBlock::getDeviceAddress(m_allocator.device, accelStruct->updateGpuMemory.block, accelStruct->updateGpuMemory.offset);
+        }
+
+        // Only acceleration structures whose update scratch fits the scratch budget get here
+        return AcquireScratch(accelStruct, accelStruct->updateScratchSize, needsBarrier);
+    }
+
+    bool VkAccelStructManager::GetBuildInputKey(const vk::AccelerationStructureBuildGeometryInfoKHR& geomInfo,
+                                                const vk::AccelerationStructureBuildRangeInfoKHR*    rangeInfo,
+                                                BuildInputKey&                                       key)
+    {
+        // Updatable acceleration structures get refit on their own, top level ones depend on instance data
+        // and extension structures could carry inputs outside the key
+        if ((geomInfo.type != vk::AccelerationStructureTypeKHR::eBottomLevel) ||
+            (geomInfo.flags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate) ||
+            (geomInfo.pNext != nullptr))
+        {
+            return false;
+        }
+
+        key = BuildInputKey();
+        key.inputs.add(static_cast<uint32_t>(geomInfo.flags));
+        key.inputs.add(geomInfo.geometryCount);
+
+        for (uint32_t geometryIndex = 0; geometryIndex < geomInfo.geometryCount; geometryIndex++)
+        {
+            const vk::AccelerationStructureGeometryKHR& geometry = (geomInfo.pGeometries != nullptr) ? geomInfo.pGeometries[geometryIndex] :
+                                                                                                       *geomInfo.ppGeometries[geometryIndex];
+            const vk::AccelerationStructureBuildRangeInfoKHR& range = rangeInfo[geometryIndex];
+
+            key.inputs.add((static_cast<uint64_t>(geometry.geometryType) << 32) | static_cast<uint32_t>(geometry.flags));
+            key.inputs.add((static_cast<uint64_t>(range.primitiveCount) << 32) | range.primitiveOffset);
+            key.inputs.add((static_cast<uint64_t>(range.firstVertex) << 32) | range.transformOffset);
+
+            if ((geometry.geometryType == vk::GeometryTypeKHR::eTriangles) &&
+                (geometry.geometry.triangles.pNext == nullptr))
+            {
+                const vk::AccelerationStructureGeometryTrianglesDataKHR& triangles = geometry.geometry.triangles;
+                key.inputs.add((static_cast<uint64_t>(triangles.vertexFormat) << 32) | static_cast<uint32_t>(triangles.indexType));
+                key.inputs.add((static_cast<uint64_t>(triangles.maxVertex) << 32) | static_cast<uint32_t>(triangles.vertexStride));
+                key.inputs.add(triangles.vertexData.deviceAddress);
+                key.inputs.add(triangles.indexData.deviceAddress);
+                key.inputs.add(triangles.transformData.deviceAddress);
+            }
+            else if ((geometry.geometryType == vk::GeometryTypeKHR::eAabbs) &&
+                     (geometry.geometry.aabbs.pNext == nullptr))
+            {
+                key.inputs.add(geometry.geometry.aabbs.data.deviceAddress);
+                key.inputs.add(geometry.geometry.aabbs.stride);
+            }
+            else
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void VkAccelStructManager::QueueBuild(vk::CommandBuffer                                   commandList,
+                                          const vk::AccelerationStructureBuildGeometryInfoKHR& geomInfo,
+                                          const vk::AccelerationStructureBuildRangeInfoKHR*    rangeInfo)
+    {
+        BuildArena& buildArena = GetBuildArena();
+        buildArena.chunkGeomInfos.push_back(geomInfo);
+        buildArena.chunkRangeInfos.push_back(rangeInfo);
+
+        if ((m_maxBuildsPerChunk > 0) && (buildArena.chunkGeomInfos.size() >= m_maxBuildsPerChunk))
+        {
+            FlushBuilds(commandList, false);
+        }
+    }
+
+    void VkAccelStructManager::FlushBuilds(vk::CommandBuffer commandList,
+                                           const bool        placeBarrier)
+    {
+        BuildArena& buildArena = GetBuildArena();
+        if (buildArena.chunkGeomInfos.empty() == false)
+        {
+            commandList.buildAccelerationStructuresKHR(static_cast<uint32_t>(buildArena.chunkGeomInfos.size()),
+                                                       buildArena.chunkGeomInfos.data(),
+                                                       buildArena.chunkRangeInfos.data(),
+                                                       m_allocator.dispatchLoader);
+            buildArena.chunkGeomInfos.clear();
+            buildArena.chunkRangeInfos.clear();
+        }
+
+        // Earlier builds have to be done with the scratch budget before the following builds reuse it
+        if (placeBarrier)
+        {
+            auto barrier = vk::BufferMemoryBarrier()
+                .setSrcAccessMask(vk::AccessFlagBits::eAccelerationStructureWriteKHR | vk::AccessFlagBits::eAccelerationStructureReadKHR)
+                .setDstAccessMask(vk::AccessFlagBits::eAccelerationStructureWriteKHR | vk::AccessFlagBits::eAccelerationStructureReadKHR)
+                .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+                .setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+                .setBuffer(m_scratchRingMemory.block.getBuffer())
+                .setOffset(m_scratchRingMemory.offset)
+                .setSize(m_scratchBudget);
+
+            commandList.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                vk::DependencyFlags(), 0, nullptr, 1, &barrier, 0, nullptr, m_allocator.dispatchLoader);
+        }
+    }
+
+    // Performs copies to bring over any compaction size data
+    void VkAccelStructManager::PopulateCompactionSizeCopiesCommandList(vk::CommandBuffer commandList,
+                                                                       const std::vector<uint64_t>& accelStructIds)
+    {
+        std::vector<uint64_t> liveIds;
+        GetLiveIds(accelStructIds, liveIds);
+
+        uint32_t   gpuTimingQuery = 0;
+        const bool timeSizeCopies = (liveIds.empty() == false) &&
+                                    BeginGpuTiming(commandList, GpuTimingPhase::CompactionSizeCopy, gpuTimingQuery);
+
+        struct PendingQuery
+        {
+            VkQueryPool                  pool;
+            uint32_t                     queryIndex;
+            vk::AccelerationStructureKHR asHandle;
+        };
+
+        std::vector<PendingQuery> pendingQueries;
+        pendingQueries.reserve(liveIds.size());
+#ifdef VK_EXT_opacity_micromap
+        std::vector<VkAccelerationStructure*> pendingMicromaps;
+#endif
+
+        for (const uint64_t& asId : liveIds)
+        {
+            VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[asId];
+
+            if (accelStruct->requestedCompaction == true &&
+                accelStruct->isCompacted == false)
+            {
+                accelStruct->compactionSizeCopied = true;
+
+#ifdef VK_EXT_opacity_micromap
+                if (accelStruct->isMicromap)
+                {
+                    pendingMicromaps.push_back(accelStruct);
+                    continue;
+                }
+#endif
+                pendingQueries.push_back({ static_cast<VkQueryPool>(accelStruct->queryCompactionSizeMemory.block.queryPool),
+                                           (uint32_t)(accelStruct->queryCompactionSizeMemory.offset / SizeOfCompactionDescriptor),
+                                           accelStruct->resultGpuMemory.block.m_asHandle });
+            }
+        }
+
+        // Builds of a batch get neighboring query slots, ordered by slot they reset and write in one call per range
+        std::sort(pendingQueries.begin(), pendingQueries.end(),
+            [](const PendingQuery& a, const PendingQuery& b)
+            {
+                if (a.pool != b.pool)
+                {
+                    return std::less<VkQueryPool>()(a.pool, b.pool);
+                }
+                return a.queryIndex < b.queryIndex;
+            });
+
+        std::vector<vk::AccelerationStructureKHR> asHandles;
+        asHandles.reserve(pendingQueries.size());
+        for (const PendingQuery& pendingQuery : pendingQueries)
+        {
+            asHandles.push_back(pendingQuery.asHandle);
+        }
+
+        size_t rangeStart = 0;
+        while (rangeStart < pendingQueries.size())
+        {
+            size_t rangeEnd = rangeStart + 1;
+            while ((rangeEnd < pendingQueries.size()) &&
+                   (pendingQueries[rangeEnd].pool == pendingQueries[rangeStart].pool) &&
+                   (pendingQueries[rangeEnd].queryIndex == pendingQueries[rangeEnd - 1].queryIndex + 1))
+            {
+                rangeEnd++;
+            }
+
+            const vk::QueryPool pool       = vk::QueryPool(pendingQueries[rangeStart].pool);
+            const uint32_t      firstQuery = pendingQueries[rangeStart].queryIndex;
+            const uint32_t      queryCount = (uint32_t)(rangeEnd - rangeStart);
+
+            commandList.resetQueryPool(pool, firstQuery, queryCount, m_allocator.dispatchLoader);
+            commandList.writeAccelerationStructuresPropertiesKHR(queryCount,
+                                                                 &asHandles[rangeStart],
+                                                                 vk::QueryType::eAccelerationStructureCompactedSizeKHR,
+                                                                 pool,
+                                                                 firstQuery,
+                                                                 m_allocator.dispatchLoader);
+            rangeStart = rangeEnd;
+        }
+
+        uint64_t sizeCopyCount = pendingQueries.size();
+
+#ifdef VK_EXT_opacity_micromap
+        // There is a micromap per mesh at most so their queries go one by one
+        for (VkAccelerationStructure* accelStruct : pendingMicromaps)
+        {
+            const vk::QueryPool pool       = accelStruct->queryMicromapCompactionSizeMemory.block.queryPool;
+            const uint32_t      queryIndex = (uint32_t)(accelStruct->queryMicromapCompactionSizeMemory.offset / SizeOfCompactionDescriptor);
+
+            commandList.resetQueryPool(pool, queryIndex, 1, m_allocator.dispatchLoader);
+            commandList.writeMicromapsPropertiesEXT(1,
+                                                    &accelStruct->micromapGpuMemory.block.m_micromapHandle,
+                                                    vk::QueryType::eMicromapCompactedSizeEXT,
+                                                    pool,
+                                                    queryIndex,
+                                                    m_allocator.dispatchLoader);
+        }
+        sizeCopyCount += pendingMicromaps.size();
+#endif
+
+        if (timeSizeCopies)
+        {
+            EndGpuTiming(commandList, gpuTimingQuery, sizeCopyCount, sizeCopyCount * SizeOfCompactionDescriptor);
+        }
+    }
+
+    // Receives acceleration structure inputs and places UAV barriers for them
+    void VkAccelStructManager::PopulateUAVBarriersCommandList(vk::CommandBuffer commandList,
+                                                              const std::vector<uint64_t>& accelStructIds)
+    {
+        std::vector<uint64_t> liveIds;
+        GetLiveIds(accelStructIds, liveIds);
+
+        for (const uint64_t& asId : liveIds)
+        {
+#ifdef VK_EXT_opacity_micromap
+            if (m_asBufferBuildQueue[asId]->isMicromap)
+            {
+                PlaceMicromapBarriers(commandList, { GetMicromapBarrier(m_asBufferBuildQueue[asId]) });
+                continue;
+            }
+#endif
+
+            // Barrier for compaction size query
+            auto barrier = vk::BufferMemoryBarrier()
+                .setSrcAccessMask(vk::AccessFlagBits::eAccelerationStructureWriteKHR)
+                .setDstAccessMask(vk::AccessFlagBits::eAccelerationStructureReadKHR)
+                .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+                .setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+                .setBuffer(m_asBufferBuildQueue[asId]->isCompacted ?
+                    m_asBufferBuildQueue[asId]->compactionGpuMemory.block.getBuffer() :
+                    m_asBufferBuildQueue[asId]->resultGpuMemory.block.getBuffer())
+                .setOffset(m_asBufferBuildQueue[asId]->isCompacted ?
+                    m_asBufferBuildQueue[asId]->compactionGpuMemory.offset :
+                    m_asBufferBuildQueue[asId]->resultGpuMemory.offset)
+                .setSize(m_asBufferBuildQueue[asId]->isCompacted ?
+                    m_asBufferBuildQueue[asId]->compactionGpuMemory.subBlock->getSize() :
+                    m_asBufferBuildQueue[asId]->resultGpuMemory.subBlock->getSize());
+
+            commandList.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                vk::DependencyFlags(), 0, nullptr, 1, &barrier, 0, nullptr, m_allocator.dispatchLoader);
+        }
+    }
+
+    // Returns a command list with compaction copies if the acceleration structures are ready to be compacted
+    void VkAccelStructManager::PopulateCompactionCommandList(vk::CommandBuffer            commandList,
+                                                             const std::vector<uint64_t>& accelStructIds)
+    {
+        std::vector<uint64_t> compactedAccelStructIds;
+        PopulateCompactionCommandList(commandList, accelStructIds, compactedAccelStructIds);
+    }
+
+    void VkAccelStructManager::PopulateCompactionCommandList(vk::CommandBuffer commandList,
+                                                             const std::vector<uint64_t>& accelStructIds,
+                                                             std::vector<uint64_t>&       compactedAccelStructIds)
+    {
+        // Only compact the acceleration structures whose compaction size has already landed,
+        // the rest stay pending and can be passed in again next frame
+        std::vector<uint64_t> readyIds;
+        std::vector<vk::DeviceSize> compactionSizes;
+
+        // Compactions held back by the budget during earlier calls go along with the ones passed in
+        std::vector<uint64_t> compactionIds;
+        GetLiveIds(accelStructIds, compactionIds);
+        TakeDeferredCompactions(compactionIds);
+        ReadCompactionSizes(compactionIds, readyIds, compactionSizes);
+
+        ApplyCompactionBudget(readyIds, compactionSizes);
+
+        uint32_t   gpuTimingQuery  = 0;
+        const bool timeCompactions = (readyIds.empty() == false) &&
+                                     BeginGpuTiming(commandList, GpuTimingPhase::Compaction, gpuTimingQuery);
+        uint64_t   compactedCount  = 0;
+        uint64_t   compactedBytes  = 0;
+
+        for (size_t readyIndex = 0; readyIndex < readyIds.size(); readyIndex++)
+        {
+            const uint64_t accelStructId = readyIds[readyIndex];
+            const vk::DeviceSize compactionSize = compactionSizes[readyIndex];
+            VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
+
+#ifdef VK_EXT_opacity_micromap
+            if (accelStruct->isMicromap)
+            {
+                if (CompactMicromap(commandList, accelStructId, compactionSize))
+                {
+                    compactedCount++;
+                    compactedBytes += accelStruct->compactionSize;
+                    compactedAccelStructIds.push_back(accelStructId);
+                }
+                continue;
+            }
+#endif
+
+            accelStruct->compactionGpuMemory = m_compactionPool->allocate(compactionSize);
+
+            // Out of memory, stay uncompacted so the compaction can be retried later
+            if (accelStruct->compactionGpuMemory.subBlock == nullptr)
+            {
+                if (m_logger.isEnabled(Level::ERR))
+                {
+                    char buf[128];
+                    snprintf(buf, sizeof buf, "RTXMU Copy Compaction %" PRIu64 " is out of memory and was skipped\n", accelStructId);
+                    m_logger.log(Level::ERR, buf);
+                }
+                continue;
+            }
+
+            accelStruct->compactionSize = accelStruct->compactionGpuMemory.subBlock->getSize();
+            m_totalCompactedMemory += accelStruct->compactionGpuMemory.subBlock->getSize();
+            ReportCompaction(accelStructId, accelStruct->resultSize, accelStruct->compactionSize);
+            RecordTrace(AllocationTraceRecordType::Compaction, accelStructId, accelStruct->compactionSize, accelStruct->resultSize);
+
+            auto asCreateInfo = vk::AccelerationStructureCreateInfoKHR()
+                .setType(accelStruct->type)
+                .setSize(compactionSize)
+                .setBuffer(accelStruct->compactionGpuMemory.block.getBuffer())
+                .setOffset(accelStruct->compactionGpuMemory.offset);
+            auto asHandle = m_allocator.device.createAccelerationStructureKHR(asCreateInfo, nullptr, m_allocator.dispatchLoader);
+            accelStruct->compactionGpuMemory.block.m_asHandle = asHandle;
+
+            auto copyInfo = vk::CopyAccelerationStructureInfoKHR()
+                .setMode(vk::CopyAccelerationStructureModeKHR::eCompact)
+                .setSrc(accelStruct->resultGpuMemory.block.m_asHandle)
+                .setDst(accelStruct->compactionGpuMemory.block.m_asHandle);
+            commandList.copyAccelerationStructureKHR(copyInfo, m_allocator.dispatchLoader);
+
+            accelStruct->isCompacted = true;
+            PublishAddress(accelStructId, GetDeviceAddress(accelStructId));
+            compactedCount++;
+            compactedBytes += accelStruct->compactionSize;
+            compactedAccelStructIds.push_back(accelStructId);
+
+            if (m_logger.isEnabled(Level::DBG))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU Copy Compaction %" PRIu64 "\n", accelStructId);
+                m_logger.log(Level::DBG, buf);
+            }
+        }
+
+        if (readyIds.size() > 0)
+        {
+            std::vector<vk::BufferMemoryBarrier> barriers;
+            barriers.reserve(readyIds.size());
+#ifdef VK_EXT_opacity_micromap
+            std::vector<vk::BufferMemoryBarrier> micromapBarriers;
+#endif
+
+            for (const uint64_t& accelStructId : readyIds)
+            {
+                VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
+
+                if (accelStruct->isCompacted == false)
+                {
+                    continue;
+                }
+
+#ifdef VK_EXT_opacity_micromap
+                if (accelStruct->isMicromap)
+                {
+                    micromapBarriers.push_back(GetMicromapBarrier(accelStruct));
+                    continue;
+                }
+#endif
+
+                barriers.push_back(vk::BufferMemoryBarrier()
+                    .setSrcAccessMask(vk::AccessFlagBits::eAccelerationStructureWriteKHR)
+                    .setDstAccessMask(vk::AccessFlagBits::eAccelerationStructureReadKHR)
+                    .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+                    .setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+                    .setBuffer(accelStruct->compactionGpuMemory.block.getBuffer())
+                    .setOffset(accelStruct->compactionGpuMemory.offset)
+                    .setSize(accelStruct->compactionGpuMemory.subBlock->getSize()));
+            }
+
+            if (barriers.size() > 0)
+            {
+                commandList.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                    vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                    vk::DependencyFlags(), 0, nullptr, (uint32_t)barriers.size(), barriers.data(), 0, nullptr, m_allocator.dispatchLoader);
+            }
+
+#ifdef VK_EXT_opacity_micromap
+            if (micromapBarriers.size() > 0)
+            {
+                PlaceMicromapBarriers(commandList, micromapBarriers);
+            }
+#endif
+        }
+
+        if (timeCompactions)
+        {
+            EndGpuTiming(commandList, gpuTimingQuery, compactedCount, compactedBytes);
+        }
+    }
+
+    bool VkAccelStructManager::BeginGpuTiming(vk::CommandBuffer    commandList,
+                                              const GpuTimingPhase phase,
+                                              uint32_t&            queryIndex)
+    {
+        if ((m_gpuTimingQueries.subBlock == nullptr) ||
+            (AcquireGpuTimingQueries(phase, queryIndex) == false))
+        {
+            return false;
+        }
+
+        const uint32_t firstQuery = (uint32_t)(m_gpuTimingQueries.offset / SizeOfCompactionDescriptor);
+
+        // The begin timestamp waits on earlier acceleration structure work so the batch is measured on its own
+        commandList.resetQueryPool(m_gpuTimingQueries.block.queryPool, firstQuery + queryIndex, 2, m_allocator.dispatchLoader);
+        commandList.writeTimestamp(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                                   m_gpuTimingQueries.block.queryPool,
+                                   firstQuery + queryIndex,
+                                   m_allocator.dispatchLoader);
+        return true;
+    }
+
+    void VkAccelStructManager::EndGpuTiming(vk::CommandBuffer commandList,
+                                            const uint32_t    queryIndex,
+                                            const uint64_t    accelStructCount,
+                                            const uint64_t    bytes)
+    {
+        const uint32_t firstQuery = (uint32_t)(m_gpuTimingQueries.offset / SizeOfCompactionDescriptor);
+
+        commandList.writeTimestamp(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                                   m_gpuTimingQueries.block.queryPool,
+                                   firstQuery + queryIndex + 1,
+                                   m_allocator.dispatchLoader);
+
+        FinishGpuTimingBatch(queryIndex, accelStructCount, bytes);
+    }
+
+    // Recycled query slots keep the availability of their previous acceleration structure until reset, the reset
+    // recorded with the size copy only runs on the GPU so the slot is also reset right away to never read stale sizes
+    void VkAccelStructManager::ResetCompactionSizeQuery(vk::QueryPool  queryPool,
+                                                        vk::DeviceSize queryOffset)
+    {
+        m_allocator.device.resetQueryPool(queryPool,
+                                          (uint32_t)(queryOffset / SizeOfCompactionDescriptor),
+                                          1,
+                                          m_allocator.dispatchLoader);
+    }
+
+    // Reads back the compaction sizes of all pending acceleration structures without waiting on the GPU
+    void VkAccelStructManager::ReadCompactionSizes(const std::vector<uint64_t>& accelStructIds,
+                                                   std::vector<uint64_t>&       readyIds,
+                                                   std::vector<vk::DeviceSize>& compactionSizes)
+    {
+        struct PendingQuery
+        {
+            VkQueryPool pool;
+            uint32_t    queryIndex;
+            uint64_t    accelStructId;
+        };
+
+        std::vector<PendingQuery> pendingQueries;
+        pendingQueries.reserve(accelStructIds.size());
+
+        for (const uint64_t& accelStructId : accelStructIds)
+        {
+            VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
+
+            // Without a size copy recorded the query slot holds nothing of this acceleration structure
+            if (accelStruct->requestedCompaction == true &&
+                accelStruct->isCompacted == false &&
+                accelStruct->compactionSizeCopied == true)
+            {
+                VkQueryPool    pool        = static_cast<VkQueryPool>(accelStruct->queryCompactionSizeMemory.block.queryPool);
+                vk::DeviceSize queryOffset = accelStruct->queryCompactionSizeMemory.offset;
+#ifdef VK_EXT_opacity_micromap
+                // Micromap queries come from query pools of their own so they never share a range with the others
+                if (accelStruct->isMicromap)
+                {
+                    pool        = static_cast<VkQueryPool>(accelStruct->queryMicromapCompactionSizeMemory.block.queryPool);
+                    queryOffset = accelStruct->queryMicromapCompactionSizeMemory.offset;
+                }
+#endif
+                pendingQueries.push_back({ pool, (uint32_t)(queryOffset / SizeOfCompactionDescriptor), accelStructId });
+            }
+        }
+
+        // Order by pool and query slot so neighboring slots can be read back in a single call
+        std::sort(pendingQueries.begin(), pendingQueries.end(),
+            [](const PendingQuery& a, const PendingQuery& b)
+            {
+                if (a.pool != b.pool)
+                {
+                    return std::less<VkQueryPool>()(a.pool, b.pool);
+                }
+                return a.queryIndex < b.queryIndex;
+            });
+
+        // Every query returns the compaction size followed by its availability
+        std::vector<uint64_t> queryResults;
+
+        size_t rangeStart = 0;
+        while (rangeStart < pendingQueries.size())
+        {
+            size_t rangeEnd = rangeStart + 1;
+            while ((rangeEnd < pendingQueries.size()) &&
+                   (pendingQueries[rangeEnd].pool == pendingQueries[rangeStart].pool) &&
+                   (pendingQueries[rangeEnd].queryIndex == pendingQueries[rangeEnd - 1].queryIndex + 1))
+            {
+                rangeEnd++;
+            }
+
+            const uint32_t queryCount = (uint32_t)(rangeEnd - rangeStart);
+            queryResults.assign(queryCount * 2, 0);
+
+            // Without the wait flag this returns eNotReady instead of stalling if any build is still in flight
+            auto result = m_allocator.device.getQueryPoolResults(vk::QueryPool(pendingQueries[rangeStart].pool),
+                                                                 pendingQueries[rangeStart].queryIndex,
+                                                                 queryCount,
+                                                                 queryResults.size() * sizeof(uint64_t),
+                                                                 (void*)queryResults.data(),
+                                                                 (vk::DeviceSize)(2 * sizeof(uint64_t)),
+                                                                 vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWithAvailability,
+                                                                 m_allocator.dispatchLoader);
+            (void)result;
+
+            for (uint32_t queryOffset = 0; queryOffset < queryCount; queryOffset++)
+            {
+                if (queryResults[queryOffset * 2 + 1] != 0)
+                {
+                    readyIds.push_back(pendingQueries[rangeStart + queryOffset].accelStructId);
+                    compactionSizes.push_back(queryResults[queryOffset * 2]);
+                }
+            }
+
+            rangeStart = rangeEnd;
+        }
+
+        if ((readyIds.size() < pendingQueries.size()) && m_logger.isEnabled(Level::DBG))
+        {
+            char buf[128];
+            snprintf(buf, sizeof buf, "RTXMU Compaction Sizes Not Ready %" PRIu64 "\n", (uint64_t)(pendingQueries.size() - readyIds.size()));
+            m_logger.log(Level::DBG, buf);
+        }
+    }
+
+    // Advances the fence tracked pipeline and records the size queries and compactions that became possible
+    void VkAccelStructManager::Tick(vk::CommandBuffer commandList,
+                                    const uint64_t    completedFenceValue,
+                                    const uint64_t    submitFenceValue)
+    {
+        // The submissions behind completed fences wrote their timestamps so the results are available without waiting
+        if (m_gpuTimingQueries.subBlock != nullptr)
+        {
+            const uint32_t firstQuery = (uint32_t)(m_gpuTimingQueries.offset / SizeOfCompactionDescriptor);
+            CollectGpuTimings(completedFenceValue, [&](uint32_t queryIndex, uint64_t& beginTick, uint64_t& endTick)
+            {
+                uint64_t timestamps[2] = {};
+                auto result = m_allocator.device.getQueryPoolResults(m_gpuTimingQueries.block.queryPool,
+                                                                     firstQuery + queryIndex,
+                                                                     2,
+                                                                     sizeof(timestamps),
+                                                                     (void*)timestamps,
+                                                                     (vk::DeviceSize)sizeof(uint64_t),
+                                                                     vk::QueryResultFlagBits::e64,
+                                                                     m_allocator.dispatchLoader);
+                beginTick = timestamps[0];
+                endTick   = timestamps[1];
+                return result == vk::Result::eSuccess;
+            });
+        }
+
+        PipelineWork work;
+        BeginPipelineTick(completedFenceValue, work);
+
+        // Release transient memory first so the compactions below can reuse it
+        if (work.garbageCollectionIds.empty() == false)
+        {
+            GarbageCollection(work.garbageCollectionIds);
+        }
+
+        if (work.sizeCopyIds.empty() == false)
+        {
+            // Submission order alone doesn't make the build writes visible to the size queries
+            PopulateUAVBarriersCommandList(commandList, work.sizeCopyIds);
+            PopulateCompactionSizeCopiesCommandList(commandList, work.sizeCopyIds);
+        }
+
+        // Compactions the budget held back last tick are picked up from the backlog, tracked along with the new ones
+        std::vector<uint64_t> compactedIds;
+        PopulateCompactionCommandList(commandList, work.compactionIds, compactedIds);
+        work.compactionIds.insert(work.compactionIds.end(), compactedIds.begin(), compactedIds.end());
+        std::sort(work.compactionIds.begin(), work.compactionIds.end());
+        work.compactionIds.erase(std::unique(work.compactionIds.begin(), work.compactionIds.end()), work.compactionIds.end());
+
+        EndPipelineTick(submitFenceValue, work);
+
+        AdvanceFrame();
+
+        if (m_logger.isEnabled(Level::DBG))
+        {
+            char buf[128];
+            snprintf(buf, sizeof buf, "RTXMU Tick size queries %zu compactions %zu garbage collections %zu\n",
+                     work.sizeCopyIds.size(), work.compactionIds.size(), work.garbageCollectionIds.size());
+            m_logger.log(Level::DBG, buf);
+        }
+    }
+
+    // Moves compacted acceleration structures out of sparsely used compaction blocks
+    void VkAccelStructManager::PopulateDefragmentationCommandList(vk::CommandBuffer           commandList,
+                                                                  const uint64_t              byteBudget,
+                                                                  std::vector<uint64_t>&      movedAccelStructIds,
+                                                                  const double                maxBlockOccupancy)
+    {
+        // Finish emptying the blocks picked earlier before picking new ones
+        if (m_compactionPool->getEvacuatingBlockCount() == 0)
+        {
+            m_compactionPool->beginEvacuation(maxBlockOccupancy, byteBudget);
+        }
+
+        std::vector<vk::BufferMemoryBarrier> barriers;
+        uint64_t copiedBytes = 0;
+
+        const uint64_t entryCount = m_asBufferBuildQueue.size();
+        for (uint64_t accelStructId = ReservedId + 1; accelStructId < entryCount; accelStructId++)
+        {
+            VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
+
+            // Acceleration structures still waiting for their previous move to be garbage collected stay put
+            if ((accelStruct == nullptr) ||
+                (accelStruct->isCompacted == false) ||
+                (accelStruct->compactionGpuMemory.subBlock == nullptr) ||
+                (accelStruct->defragSourceMemory.subBlock != nullptr) ||
+                (accelStruct->compactionGpuMemory.subBlock->isEvacuating() == false))
+            {
+                continue;
+            }
+
+            const uint64_t allocatedSize = accelStruct->compactionGpuMemory.subBlock->getSize();
+            if ((copiedBytes > 0) && (copiedBytes + allocatedSize > byteBudget))
+            {
+                break;
+            }
+
+            const vk::DeviceSize compactedSize = allocatedSize - accelStruct->compactionGpuMemory.subBlock->getUnusedSize();
+
+            auto compactionGpuMemory = m_compactionPool->allocate(compactedSize);
+
+            // Out of memory, try again on a later call
+            if (compactionGpuMemory.subBlock == nullptr)
+            {
+                break;
+            }
+
+            accelStruct->defragSourceMemory  = accelStruct->compactionGpuMemory;
+            accelStruct->compactionGpuMemory = compactionGpuMemory;
+            PublishAddress(accelStructId, GetDeviceAddress(accelStructId));
+
+            auto asCreateInfo = vk::AccelerationStructureCreateInfoKHR()
+                .setType(accelStruct->type)
+                .setSize(compactedSize)
+                .setBuffer(accelStruct->compactionGpuMemory.block.getBuffer())
+                .setOffset(accelStruct->compactionGpuMemory.offset);
+            accelStruct->compactionGpuMemory.block.m_asHandle = m_allocator.device.createAccelerationStructureKHR(asCreateInfo, nullptr, m_allocator.dispatchLoader);
+
+            auto copyInfo = vk::CopyAccelerationStructureInfoKHR()
+                .setMode(vk::CopyAccelerationStructureModeKHR::eClone)
+                .setSrc(accelStruct->defragSourceMemory.block.m_asHandle)
+                .setDst(accelStruct->compactionGpuMemory.block.m_asHandle);
+            commandList.copyAccelerationStructureKHR(copyInfo, m_allocator.dispatchLoader);
+
+            barriers.push_back(vk::BufferMemoryBarrier()
+                .setSrcAccessMask(vk::AccessFlagBits::eAccelerationStructureWriteKHR)
+                .setDstAccessMask(vk::AccessFlagBits::eAccelerationStructureReadKHR)
+                .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+                .setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+                .setBuffer(accelStruct->compactionGpuMemory.block.getBuffer())
+                .setOffset(accelStruct->compactionGpuMemory.offset)
+                .setSize(accelStruct->compactionGpuMemory.subBlock->getSize()));
+
+            copiedBytes += allocatedSize;
+            movedAccelStructIds.push_back(accelStructId);
+        }
+
+        // Make the clones visible to any following TLAS build
+        if (barriers.size() > 0)
+        {
+            commandList.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                vk::DependencyFlags(), 0, nullptr, (uint32_t)barriers.size(), barriers.data(), 0, nullptr, m_allocator.dispatchLoader);
+        }
+
+        if (m_logger.isEnabled(Level::DBG))
+        {
+            char buf[128];
+            snprintf(buf, sizeof buf, "RTXMU Defragmentation moved %zu acceleration structures, %" PRIu64 " bytes\n",
+                     barriers.size(), copiedBytes);
+            m_logger.log(Level::DBG, buf);
+        }
+    }
+
+    void VkAccelStructManager::PopulateSerializeCommandList(vk::CommandBuffer            commandList,
+                                                            const std::vector<uint64_t>& accelStructIds,
+                                                            const uint64_t               completedFenceValue,
+                                                            const uint64_t               submitFenceValue)
+    {
+        size_t sizeQueryCount = 0;
+        std::vector<vk::BufferMemoryBarrier> barriers;
+
+        std::vector<uint64_t> liveIds;
+        GetLiveIds(accelStructIds, liveIds);
+
+        for (const uint64_t& accelStructId : liveIds)
+        {
+            VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
+
+            if (accelStruct->serializationState == SerializationState::None)
+            {
+                // Serializing the uncompacted copy would be wasted once compaction replaces it, micromaps aren't serialized
+                if ((accelStruct->requestedCompaction && (accelStruct->isCompacted == false)) ||
+                    accelStruct->isMicromap)
+                {
+                    continue;
+                }
+
+                accelStruct->querySerializedSizeMemory = m_querySerializedSizePool->allocate(SizeOfCompactionDescriptor);
+                if (accelStruct->querySerializedSizeMemory.subBlock == nullptr)
+                {
+                    if (m_logger.isEnabled(Level::ERR))
+                    {
+                        char buf[128];
+                        snprintf(buf, sizeof buf, "RTXMU Serialize %" PRIu64 " is out of memory and was skipped\n", accelStructId);
+                        m_logger.log(Level::ERR, buf);
+                    }
+                    continue;
+                }
+
+                vk::QueryPool pool = accelStruct->querySerializedSizeMemory.block.queryPool;
+                uint32_t queryIndex = (uint32_t)accelStruct->querySerializedSizeMemory.offset / SizeOfCompactionDescriptor;
+                vk::AccelerationStructureKHR asHandle = GetAccelerationStruct(accelStructId);
+
+                commandList.resetQueryPool(pool, queryIndex, 1, m_allocator.dispatchLoader);
+                commandList.writeAccelerationStructuresPropertiesKHR(1, &asHandle, vk::QueryType::eAccelerationStructureSerializationSizeKHR, pool, queryIndex, m_allocator.dispatchLoader);
+
+                accelStruct->serializationState       = SerializationState::SizeRequested;
+                accelStruct->serializedSizeFenceValue = submitFenceValue;
+                sizeQueryCount++;
+            }
+            else if (accelStruct->serializationState == SerializationState::SizeRequested)
+            {
+                // Recycled query slots may still hold the availability of an earlier query until the reset recorded
+                // with the size query ran, so only read it once the submission completed
+                if (accelStruct->serializedSizeFenceValue > completedFenceValue)
+                {
+                    continue;
+                }
+
+                // Without the wait flag this returns the availability instead of stalling if the query is still in flight
+                uint64_t queryResult[2] = {};
+                auto result = m_allocator.device.getQueryPoolResults(accelStruct->querySerializedSizeMemory.block.queryPool,
+                                                                     (uint32_t)accelStruct->querySerializedSizeMemory.offset / SizeOfCompactionDescriptor,
+                                                                     1,
+                                                                     sizeof(queryResult),
+                                                                     (void*)queryResult,
+                                                                     (vk::DeviceSize)sizeof(queryResult),
+                                                                     vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWithAvailability,
+                                                                     m_allocator.dispatchLoader);
+                (void)result;
+
+                if (queryResult[1] == 0)
+                {
+                    continue;
+                }
+
+                accelStruct->serializedMemory = m_serializationPool->allocate(queryResult[0]);
+
+                // Out of memory, the query result stays around so it can be tried again on a later call
+                if (accelStruct->serializedMemory.subBlock == nullptr)
+                {
+                    if (m_logger.isEnabled(Level::ERR))
+                    {
+                        char buf[128];
+                        snprintf(buf, sizeof buf, "RTXMU Serialize %" PRIu64 " is out of memory and was skipped\n", accelStructId);
+                        m_logger.log(Level::ERR, buf);
+                    }
+                    continue;
+                }
+
+                auto copyInfo = vk::CopyAccelerationStructureToMemoryInfoKHR()
+                    .setMode(vk::CopyAccelerationStructureModeKHR::eSerialize)
+                    .setSrc(GetAccelerationStruct(accelStructId))
+                    .setDst(vk::DeviceOrHostAddressKHR().setDeviceAddress(VkBlock::getDeviceAddress(m_allocator.device,
+                                                                                                    accelStruct->serializedMemory.block,
+                                                                                                    accelStruct->serializedMemory.offset)));
+                commandList.copyAccelerationStructureToMemoryKHR(copyInfo, m_allocator.dispatchLoader);
+
+                accelStruct->serializedSize     = queryResult[0];
+                accelStruct->serializationState = SerializationState::Serializing;
+                accelStruct->serializeFenceValue = submitFenceValue;
+
+                barriers.push_back(vk::BufferMemoryBarrier()
+                    .setSrcAccessMask(vk::AccessFlagBits::eAccelerationStructureWriteKHR)
+                    .setDstAccessMask(vk::AccessFlagBits::eHostRead)
+                    .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+                    .setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+                    .setBuffer(accelStruct->serializedMemory.block.getBuffer())
+                    .setOffset(accelStruct->serializedMemory.offset)
+                    .setSize(accelStruct->serializedSize));
+            }
+        }
+
+        // Make the serialized data visible to the host once the submission completed
+        if (barriers.size() > 0)
+        {
+            commandList.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                vk::PipelineStageFlagBits::eHost,
+                vk::DependencyFlags(), 0, nullptr, (uint32_t)barriers.size(), barriers.data(), 0, nullptr, m_allocator.dispatchLoader);
+        }
+
+        if (m_logger.isEnabled(Level::DBG))
+        {
+            char buf[128];
+            snprintf(buf, sizeof buf, "RTXMU Serialize %zu size queries, %zu copies\n", sizeQueryCount, barriers.size());
+            m_logger.log(Level::DBG, buf);
+        }
+    }
+
+    bool VkAccelStructManager::GetSerializedAccelStruct(const uint64_t        accelStructId,
+                                                        const uint64_t        geometryKey,
+                                                        const uint64_t        completedFenceValue,
+                                                        std::vector<uint8_t>& blob)
+    {
+        if (IsLiveId(accelStructId) == false)
+        {
+            return false;
+        }
+
+        VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
+        // The copy into the readback memory may still be in flight, which also keeps the memory from being released
+        if ((accelStruct->serializationState != SerializationState::Serializing) ||
+            (accelStruct->serializeFenceValue > completedFenceValue))
+        {
+            return false;
+        }
+
+        SerializedAccelStructHeader header;
+        header.geometryKey    = geometryKey;
+        header.driverBlobSize = accelStruct->serializedSize;
+
+        blob.resize(sizeof(header) + accelStruct->serializedSize);
+        memcpy(blob.data(), &header, sizeof(header));
+        memcpy(blob.data() + sizeof(header),
+               accelStruct->serializedMemory.block.getMappedData() + accelStruct->serializedMemory.offset,
+               accelStruct->serializedSize);
+
+        ReleaseSerializedMemory(accelStruct);
+        accelStruct->serializationState = SerializationState::None;
+
+        return true;
+    }
+
+    bool VkAccelStructManager::IsSerializedAccelStructCompatible(const SerializedAccelStruct& serializedAccelStruct)
+    {
+        const SerializedAccelStructHeader* header = GetSerializedAccelStructHeader(serializedAccelStruct, sizeof(VkSerializedAccelStructHeader));
+        if (header == nullptr)
+        {
+            return false;
+        }
+
+        // Top level acceleration structures reference bottom level ones by handle, which don't survive a reload
+        const VkSerializedAccelStructHeader* driverHeader = reinterpret_cast<const VkSerializedAccelStructHeader*>(header + 1);
+        if (driverHeader->handleCount != 0)
+        {
+            return false;
+        }
+
+        // The version data is the driver and compatibility UUIDs leading the driver blob
+        auto versionInfo = vk::AccelerationStructureVersionInfoKHR()
+            .setPVersionData(driverHeader->driverUUID);
+        return m_allocator.device.getAccelerationStructureCompatibilityKHR(versionInfo, m_allocator.dispatchLoader) ==
+               vk::AccelerationStructureCompatibilityKHR::eCompatible;
+    }
+
+    bool VkAccelStructManager::PopulateDeserializeCommandList(vk::CommandBuffer                         commandList,
+                                                              const std::vector<SerializedAccelStruct>& serializedAccelStructs,
+                                                              std::vector<uint64_t>&                    accelStructIds)
+    {
+        bool allDeserialized = true;
+        std::vector<vk::BufferMemoryBarrier> barriers;
+
+        accelStructIds.reserve(accelStructIds.size() + serializedAccelStructs.size());
+        for (size_t blobIndex = 0; blobIndex < serializedAccelStructs.size(); blobIndex++)
+        {
+            const SerializedAccelStruct& serializedAccelStruct = serializedAccelStructs[blobIndex];
+
+            // Stale blobs from another driver or device have to be rebuilt by the app
+            if (IsSerializedAccelStructCompatible(serializedAccelStruct) == false)
+            {
+                if (m_logger.isEnabled(Level::WARN))
+                {
+                    char buf[128];
+                    snprintf(buf, sizeof buf, "RTXMU Serialized Acceleration Structure %zu is incompatible and was skipped\n", blobIndex);
+                    m_logger.log(Level::WARN, buf);
+                }
+                accelStructIds.push_back(ReservedId);
+                allDeserialized = false;
+                continue;
+            }
+
+            const SerializedAccelStructHeader* header = static_cast<const SerializedAccelStructHeader*>(serializedAccelStruct.data);
+            const VkSerializedAccelStructHeader* driverHeader = reinterpret_cast<const VkSerializedAccelStructHeader*>(header + 1);
+
+            const uint64_t asId = GetAccelStructId();
+            if (asId == ReservedId)
+            {
+                accelStructIds.push_back(ReservedId);
+                allDeserialized = false;
+                continue;
+            }
+            VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[asId];
+
+            accelStruct->compactionGpuMemory      = m_compactionPool->allocate(driverHeader->deserializedSize);
+            accelStruct->deserializedUploadMemory = m_serializationPool->allocate(header->driverBlobSize);
+
+            // Lands in the same state a finished compaction leaves behind, set up front so a release
+            // below hands the compaction memory back to the right pool
+            accelStruct->isCompacted         = true;
+            accelStruct->requestedCompaction = false;
+
+            // Out of memory, hand back whatever got allocated
+            if ((accelStruct->compactionGpuMemory.subBlock == nullptr) ||
+                (accelStruct->deserializedUploadMemory.subBlock == nullptr))
+            {
+                if (m_logger.isEnabled(Level::ERR))
+                {
+                    char buf[128];
+                    snprintf(buf, sizeof buf, "RTXMU Deserialize %zu is out of memory and was skipped\n", blobIndex);
+                    m_logger.log(Level::ERR, buf);
+                }
+                ReleaseAccelerationStructures(asId);
+                accelStructIds.push_back(ReservedId);
+                allDeserialized = false;
+                continue;
+            }
+
+            memcpy(accelStruct->deserializedUploadMemory.block.getMappedData() + accelStruct->deserializedUploadMemory.offset,
+                   header + 1,
+                   header->driverBlobSize);
+
+            auto asCreateInfo = vk::AccelerationStructureCreateInfoKHR()
+                .setType(vk::AccelerationStructureTypeKHR::eBottomLevel)
+                .setSize(driverHeader->deserializedSize)
+                .setBuffer(accelStruct->compactionGpuMemory.block.getBuffer())
+                .setOffset(accelStruct->compactionGpuMemory.offset);
+            accelStruct->compactionGpuMemory.block.m_asHandle = m_allocator.device.createAccelerationStructureKHR(asCreateInfo, nullptr, m_allocator.dispatchLoader);
+
+            auto copyInfo = vk::CopyMemoryToAccelerationStructureInfoKHR()
+                .setMode(vk::CopyAccelerationStructureModeKHR::eDeserialize)
+                .setSrc(vk::DeviceOrHostAddressConstKHR().setDeviceAddress(VkBlock::getDeviceAddress(m_allocator.device,
+                                                                                                     accelStruct->deserializedUploadMemory.block,
+                                                                                                     accelStruct->deserializedUploadMemory.offset)))
+                .setDst(accelStruct->compactionGpuMemory.block.m_asHandle);
+            commandList.copyMemoryToAccelerationStructureKHR(copyInfo, m_allocator.dispatchLoader);
+
+            accelStruct->initialSize    = driverHeader->deserializedSize;
+            accelStruct->compactionSize = accelStruct->compactionGpuMemory.subBlock->getSize();
+            m_totalCompactedMemory += accelStruct->compactionSize;
+            PublishAddress(asId, GetDeviceAddress(asId));
+            RecordTrace(AllocationTraceRecordType::Deserialize, asId, accelStruct->compactionSize);
+
+            barriers.push_back(vk::BufferMemoryBarrier()
+                .setSrcAccessMask(vk::AccessFlagBits::eAccelerationStructureWriteKHR)
+                .setDstAccessMask(vk::AccessFlagBits::eAccelerationStructureReadKHR)
+                .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+                .setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+                .setBuffer(accelStruct->compactionGpuMemory.block.getBuffer())
+                .setOffset(accelStruct->compactionGpuMemory.offset)
+                .setSize(accelStruct->compactionGpuMemory.subBlock->getSize()));
+
+            accelStructIds.push_back(asId);
+
+            if (m_logger.isEnabled(Level::DBG))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU Deserialize %" PRIu64 "\n", asId);
+                m_logger.log(Level::DBG, buf);
+            }
+        }
+
+        // Make the deserialized acceleration structures visible to the builds and traces that follow
+        if (barriers.size() > 0)
+        {
+            commandList.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                vk::DependencyFlags(), 0, nullptr, (uint32_t)barriers.size(), barriers.data(), 0, nullptr, m_allocator.dispatchLoader);
+        }
+
+        return allDeserialized;
+    }
+
+#ifdef VK_EXT_opacity_micromap
+    bool VkAccelStructManager::PopulateMicromapBuildCommandList(vk::CommandBuffer         commandList,
+                                                                vk::MicromapBuildInfoEXT* buildInfos,
+                                                                const uint32_t            buildCount,
+                                                                std::vector<uint64_t>&    micromapIds)
+    {
+        const size_t firstIdIndex = micromapIds.size();
+        micromapIds.resize(firstIdIndex + buildCount, ReservedId);
+
+        // The entry points are only loaded when the device was created with VK_EXT_opacity_micromap
+        if (m_allocator.dispatchLoader.vkCmdBuildMicromapsEXT == nullptr)
+        {
+            if ((buildCount > 0) && m_logger.isEnabled(Level::ERR))
+            {
+                m_logger.log(Level::ERR, "RTXMU Micromap Builds need VK_EXT_opacity_micromap and were skipped\n");
+            }
+            return (buildCount == 0);
+        }
+
+        bool allBuildsRecorded = true;
+
+        std::vector<vk::MicromapBuildInfoEXT> recordedBuildInfos;
+        recordedBuildInfos.reserve(buildCount);
+
+        for (uint32_t buildIndex = 0; buildIndex < buildCount; buildIndex++)
+        {
+            auto buildSizeInfo = vk::MicromapBuildSizesInfoEXT();
+            m_allocator.device.getMicromapBuildSizesEXT(vk::AccelerationStructureBuildTypeKHR::eDevice, &buildInfos[buildIndex], &buildSizeInfo, m_allocator.dispatchLoader);
+
+            const uint64_t micromapId = GetAccelStructId();
+
+            micromapIds[firstIdIndex + buildIndex] = micromapId;
+
+            // Out of ids, leave the build out of the recorded chunks
+            if (micromapId == ReservedId)
+            {
+                allBuildsRecorded = false;
+                continue;
+            }
+
+            VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[micromapId];
+
+            const bool allowCompaction = static_cast<bool>(buildInfos[buildIndex].flags & vk::BuildMicromapFlagBitsEXT::eAllowCompaction);
+
+            accelStruct->isMicromap          = true;
+            accelStruct->micromapType        = buildInfos[buildIndex].type;
+            accelStruct->isCompacted         = false;
+            accelStruct->requestedCompaction = allowCompaction;
 
-                if (Logger::isEnabled(Level::DBG))
+            // Micromaps are never updated so their scratch stays out of the scratch budget and goes with garbage collection
+            accelStruct->micromapGpuMemory = m_micromapPool->allocate(buildSizeInfo.micromapSize);
+            accelStruct->scratchGpuMemory  = m_scratchPool->allocate(buildSizeInfo.buildScratchSize);
+            accelStruct->scratchSize       = buildSizeInfo.buildScratchSize;
+            if (allowCompaction)
+            {
+                accelStruct->queryMicromapCompactionSizeMemory = m_queryMicromapCompactionSizePool->allocate(SizeOfCompactionDescriptor);
+                if (accelStruct->queryMicromapCompactionSizeMemory.subBlock != nullptr)
                 {
-                    char buf[128];
-                    snprintf(buf, sizeof buf, "RTXMU Initial Build Enabled Compaction %" PRIu64 "\n", asId);
-                    Logger::log(Level::DBG, buf);
+                    ResetCompactionSizeQuery(accelStruct->queryMicromapCompactionSizeMemory.block.queryPool,
+                                             accelStruct->queryMicromapCompactionSizeMemory.offset);
                 }
             }
-            else
-            {
-                // This build doesn't request compaction
-                accelStruct->isCompacted = false;
-                accelStruct->requestedCompaction = false;
 
-                if (Logger::isEnabled(Level::DBG))
+            // Out of memory, hand back whatever got allocated and leave the build out
+            if ((accelStruct->micromapGpuMemory.subBlock == nullptr) ||
+                (accelStruct->scratchGpuMemory.subBlock == nullptr) ||
+                (allowCompaction && (accelStruct->queryMicromapCompactionSizeMemory.subBlock == nullptr)))
+            {
+                if (m_logger.isEnabled(Level::ERR))
                 {
                     char buf[128];
-                    snprintf(buf, sizeof buf, "RTXMU Initial Build Disabled Compaction %" PRIu64 "\n", asId);
-                    Logger::log(Level::DBG, buf);
+                    snprintf(buf, sizeof buf, "RTXMU Micromap Build %u is out of memory and was skipped\n", buildIndex);
+                    m_logger.log(Level::ERR, buf);
                 }
+
+                ReleaseAccelerationStructures(micromapId);
+                micromapIds[firstIdIndex + buildIndex] = ReservedId;
+                allBuildsRecorded = false;
+                continue;
+            }
+
+            accelStruct->resultSize  = accelStruct->micromapGpuMemory.subBlock->getSize();
+            accelStruct->initialSize = buildSizeInfo.micromapSize;
+            PublishAddress(micromapId, GetDeviceAddress(micromapId));
+
+            auto micromapCreateInfo = vk::MicromapCreateInfoEXT()
+                .setType(accelStruct->micromapType)
+                .setSize(buildSizeInfo.micromapSize)
+                .setBuffer(accelStruct->micromapGpuMemory.block.getBuffer())
+                .setOffset(accelStruct->micromapGpuMemory.offset);
+            accelStruct->micromapGpuMemory.block.m_micromapHandle = m_allocator.device.createMicromapEXT(micromapCreateInfo, nullptr, m_allocator.dispatchLoader);
+
+            buildInfos[buildIndex].dstMicromap               = accelStruct->micromapGpuMemory.block.m_micromapHandle;
+            buildInfos[buildIndex].scratchData.deviceAddress = VkBlock::getDeviceAddress(m_allocator.device,
+                                                                                         accelStruct->scratchGpuMemory.block,
+                                                                                         accelStruct->scratchGpuMemory.offset);
+            recordedBuildInfos.push_back(buildInfos[buildIndex]);
+
+            if (m_logger.isEnabled(Level::DBG))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU Micromap Build %s Compaction %" PRIu64 "\n", allowCompaction ? "Enabled" : "Disabled", micromapId);
+                m_logger.log(Level::DBG, buf);
             }
         }
 
-        commandList.buildAccelerationStructuresKHR(buildCount, geomInfos, rangeInfos, VkBlock::getDispatchLoader());
+        if (recordedBuildInfos.empty() == false)
+        {
+            commandList.buildMicromapsEXT(static_cast<uint32_t>(recordedBuildInfos.size()), recordedBuildInfos.data(), m_allocator.dispatchLoader);
+        }
+
+        return allBuildsRecorded;
     }
 
-    // Performs copies to bring over any compaction size data
-    void VkAccelStructManager::PopulateCompactionSizeCopiesCommandList(vk::CommandBuffer commandList,
-                                                                       const std::vector<uint64_t>& accelStructIds)
+    vk::MicromapEXT VkAccelStructManager::GetMicromap(const uint64_t micromapId)
     {
-        std::lock_guard<std::mutex> guard(m_threadSafeLock);
-        for (const uint64_t& asId : accelStructIds)
+        if (IsLiveId(micromapId) == false)
         {
-            VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[asId];
+            return {};
+        }
 
-            if (accelStruct->requestedCompaction == true &&
-                accelStruct->isCompacted == false)
+        VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[micromapId];
+
+        return accelStruct->isCompacted ?
+                   accelStruct->compactedMicromapGpuMemory.block.m_micromapHandle :
+                   accelStruct->micromapGpuMemory.block.m_micromapHandle;
+    }
+#endif
+
+    void VkAccelStructManager::SetMemoryBudget(const uint64_t       memoryBudget,
+                                               MemoryBudgetCallback callback,
+                                               void*                callbackUserData)
+    {
+        m_allocator.memoryBudget.budget           = memoryBudget;
+        m_allocator.memoryBudget.callback         = callback;
+        m_allocator.memoryBudget.callbackUserData = callbackUserData;
+    }
+
+    uint64_t VkAccelStructManager::GetAllocatedDeviceMemory()
+    {
+        return m_allocator.memoryBudget.allocatedSize;
+    }
+
+    bool VkAccelStructManager::QueryVideoMemoryBudget(uint64_t& budget,
+                                                      uint64_t& usage)
+    {
+        uint32_t extensionCount = 0;
+        m_allocator.physicalDevice.enumerateDeviceExtensionProperties(nullptr, &extensionCount, nullptr, m_allocator.dispatchLoader);
+        std::vector<vk::ExtensionProperties> extensions(extensionCount);
+        m_allocator.physicalDevice.enumerateDeviceExtensionProperties(nullptr, &extensionCount, extensions.data(), m_allocator.dispatchLoader);
+
+        bool memoryBudgetSupported = false;
+        for (const vk::ExtensionProperties& extension : extensions)
+        {
+            if (strcmp(extension.extensionName, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) == 0)
             {
-                vk::QueryPool pool = accelStruct->queryCompactionSizeMemory.block.queryPool;
-                uint32_t queryIndex = (uint32_t)accelStruct->queryCompactionSizeMemory.offset / SizeOfCompactionDescriptor;
-                vk::AccelerationStructureKHR asHandle = accelStruct->resultGpuMemory.block.m_asHandle;
+                memoryBudgetSupported = true;
+                break;
+            }
+        }
+
+        if (memoryBudgetSupported == false)
+        {
+            return false;
+        }
+
+        auto budgetProperties = vk::PhysicalDeviceMemoryBudgetPropertiesEXT();
+        auto memoryProperties = vk::PhysicalDeviceMemoryProperties2().setPNext(&budgetProperties);
+        m_allocator.physicalDevice.getMemoryProperties2(&memoryProperties, m_allocator.dispatchLoader);
 
-                // Need to batch builds/sychornization/compaction size writes
-                commandList.resetQueryPool(pool, queryIndex, 1, VkBlock::getDispatchLoader());
-                commandList.writeAccelerationStructuresPropertiesKHR(1, &asHandle, vk::QueryType::eAccelerationStructureCompactedSizeKHR, pool, queryIndex, VkBlock::getDispatchLoader());
+        // Suballocator blocks all live in device local heaps
+        budget = 0;
+        usage  = 0;
+        for (uint32_t heapIndex = 0; heapIndex < memoryProperties.memoryProperties.memoryHeapCount; heapIndex++)
+        {
+            if (memoryProperties.memoryProperties.memoryHeaps[heapIndex].flags & vk::MemoryHeapFlagBits::eDeviceLocal)
+            {
+                budget += budgetProperties.heapBudget[heapIndex];
+                usage  += budgetProperties.heapUsage[heapIndex];
             }
         }
+
+        return true;
     }
 
-    // Receives acceleration structure inputs and places UAV barriers for them
-    void VkAccelStructManager::PopulateUAVBarriersCommandList(vk::CommandBuffer commandList,
-                                                              const std::vector<uint64_t>& accelStructIds)
+    uint64_t VkAccelStructManager::EvictIdleBlocks()
     {
-        std::lock_guard<std::mutex> guard(m_threadSafeLock);
+        return m_scratchPool->evictIdleBlocks() +
+               m_updatePool->evictIdleBlocks() +
+               m_resultPool->evictIdleBlocks() +
+               m_transientResultPool->evictIdleBlocks() +
+#ifdef VK_EXT_opacity_micromap
+               m_micromapPool->evictIdleBlocks() +
+               m_compactedMicromapPool->evictIdleBlocks() +
+#endif
+               m_compactionPool->evictIdleBlocks();
+    }
 
-        for (const uint64_t& asId : accelStructIds)
-        {
-            // Barrier for compaction size query
-            auto barrier = vk::BufferMemoryBarrier()
-                .setSrcAccessMask(vk::AccessFlagBits::eAccelerationStructureWriteKHR)
-                .setDstAccessMask(vk::AccessFlagBits::eAccelerationStructureReadKHR)
-                .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
-                .setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
-                .setBuffer(m_asBufferBuildQueue[asId]->isCompacted ?
-                    m_asBufferBuildQueue[asId]->compactionGpuMemory.block.getBuffer() :
-                    m_asBufferBuildQueue[asId]->resultGpuMemory.block.getBuffer())
-                .setOffset(m_asBufferBuildQueue[asId]->isCompacted ?
-                    m_asBufferBuildQueue[asId]->compactionGpuMemory.offset :
-                    m_asBufferBuildQueue[asId]->resultGpuMemory.offset)
-                .setSize(m_asBufferBuildQueue[asId]->resultGpuMemory.subBlock->getSize());
+    void VkAccelStructManager::SetBlockRetention(const BlockRetention& retention)
+    {
+        m_blockRetention = retention;
+        ApplyBlockRetention();
+    }
 
-            commandList.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
-                vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
-                vk::DependencyFlags(), 0, nullptr, 1, &barrier, 0, nullptr, VkBlock::getDispatchLoader());
-        }
+    void VkAccelStructManager::ApplyBlockRetention()
+    {
+        // Readback and compaction size blocks are tiny so only the video memory pools retain blocks
+        m_scratchPool->setRetention(m_blockRetention);
+        m_updatePool->setRetention(m_blockRetention);
+        m_resultPool->setRetention(m_blockRetention);
+        m_transientResultPool->setRetention(m_blockRetention);
+        m_compactionPool->setRetention(m_blockRetention);
+#ifdef VK_EXT_opacity_micromap
+        m_micromapPool->setRetention(m_blockRetention);
+        m_compactedMicromapPool->setRetention(m_blockRetention);
+#endif
     }
 
-    // Returns a command list with compaction copies if the acceleration structures are ready to be compacted
-    void VkAccelStructManager::PopulateCompactionCommandList(vk::CommandBuffer commandList,
-                                                             const std::vector<uint64_t>& accelStructIds)
+    void VkAccelStructManager::AdvanceFrame()
     {
-        std::lock_guard<std::mutex> guard(m_threadSafeLock);
+        RecordTrace(AllocationTraceRecordType::Frame);
+
+        m_scratchPool->nextFrame();
+        m_updatePool->nextFrame();
+        m_resultPool->nextFrame();
+        m_transientResultPool->nextFrame();
+        m_compactionPool->nextFrame();
+        m_queryCompactionSizePool->nextFrame();
+        m_querySerializedSizePool->nextFrame();
+        m_serializationPool->nextFrame();
+        m_instancePool->nextFrame();
+#ifdef VK_EXT_opacity_micromap
+        m_micromapPool->nextFrame();
+        m_compactedMicromapPool->nextFrame();
+        m_queryMicromapCompactionSizePool->nextFrame();
+#endif
+
+        m_logger.flush();
+    }
 
-        bool compactionCopiesPerformed = false;
-        for (const uint64_t& accelStructId : accelStructIds)
-        {
-            VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
+    uint64_t VkAccelStructManager::TrimRetainedBlocks()
+    {
+        return m_scratchPool->trimRetainedBlocks() +
+               m_updatePool->trimRetainedBlocks() +
+               m_resultPool->trimRetainedBlocks() +
+               m_transientResultPool->trimRetainedBlocks() +
+#ifdef VK_EXT_opacity_micromap
+               m_micromapPool->trimRetainedBlocks() +
+               m_compactedMicromapPool->trimRetainedBlocks() +
+#endif
+               m_compactionPool->trimRetainedBlocks();
+    }
 
-            // Only do compaction on the confirmed completion of the original build execution.
-            if (accelStruct->requestedCompaction == true &&
-                accelStruct->isCompacted == false)
-            {
-                uint32_t queryIndex = (uint32_t)accelStruct->queryCompactionSizeMemory.offset / SizeOfCompactionDescriptor;
-                vk::QueryPool& pool = accelStruct->queryCompactionSizeMemory.block.queryPool;
+    void VkAccelStructManager::EnableHeapArena(const uint64_t heapSize)
+    {
+        if (m_heapArena == nullptr)
+        {
+            m_heapArena = std::make_unique<VkMemoryArena>(&m_allocator, heapSize);
+        }
+        m_allocator.memoryAllocator = m_heapArena.get();
+    }
 
-                vk::DeviceSize compactionSize;
-                auto result = m_allocator.device.getQueryPoolResults(pool, queryIndex, 1, (size_t)sizeof(vk::DeviceSize), (void*)&compactionSize,
-                    (vk::DeviceSize)SizeOfCompactionDescriptor, vk::QueryResultFlagBits::eWait | vk::QueryResultFlagBits::e64, VkBlock::getDispatchLoader());
-                (void)result;
+    void VkAccelStructManager::SetMaxBuildsPerChunk(const uint32_t maxBuildsPerChunk)
+    {
+        m_maxBuildsPerChunk = maxBuildsPerChunk;
+    }
 
-                accelStruct->compactionGpuMemory = m_compactionPool->allocate(compactionSize);
-                accelStruct->compactionSize = accelStruct->compactionGpuMemory.subBlock->getSize();
-                m_totalCompactedMemory += accelStruct->compactionGpuMemory.subBlock->getSize();
+    void VkAccelStructManager::SetMemoryAllocator(VkMemoryAllocator* memoryAllocator)
+    {
+        m_allocator.memoryAllocator = memoryAllocator;
+    }
 
-                auto asCreateInfo = vk::AccelerationStructureCreateInfoKHR()
-                    .setType(vk::AccelerationStructureTypeKHR::eBottomLevel)
-                    .setSize(compactionSize)
-                    .setBuffer(accelStruct->compactionGpuMemory.block.getBuffer())
-                    .setOffset(accelStruct->compactionGpuMemory.offset);
-                auto asHandle = m_allocator.device.createAccelerationStructureKHR(asCreateInfo, nullptr, VkBlock::getDispatchLoader());
-                accelStruct->compactionGpuMemory.block.m_asHandle = asHandle;
+    void VkAccelStructManager::SetQueueFamilies(const std::vector<uint32_t>& queueFamilyIndices)
+    {
+        m_allocator.queueFamilyIndices = queueFamilyIndices;
 
-                auto copyInfo = vk::CopyAccelerationStructureInfoKHR()
-                    .setMode(vk::CopyAccelerationStructureModeKHR::eCompact)
-                    .setSrc(accelStruct->resultGpuMemory.block.m_asHandle)
-                    .setDst(accelStruct->compactionGpuMemory.block.m_asHandle);
-                commandList.copyAccelerationStructureKHR(copyInfo, VkBlock::getDispatchLoader());
+        // Duplicates aren't allowed in the concurrent sharing list
+        std::sort(m_allocator.queueFamilyIndices.begin(), m_allocator.queueFamilyIndices.end());
+        m_allocator.queueFamilyIndices.erase(std::unique(m_allocator.queueFamilyIndices.begin(), m_allocator.queueFamilyIndices.end()),
+                                             m_allocator.queueFamilyIndices.end());
+    }
 
-                accelStruct->isCompacted = true;
-                compactionCopiesPerformed = true;
+    void VkAccelStructManager::SetDeviceMask(const uint32_t deviceMask)
+    {
+        m_allocator.deviceMask = deviceMask;
+    }
 
-                if (Logger::isEnabled(Level::DBG))
-                {
-                    char buf[128];
-                    snprintf(buf, sizeof buf, "RTXMU Copy Compaction %" PRIu64 "\n", accelStructId);
-                    Logger::log(Level::DBG, buf);
-                }
+    bool VkAccelStructManager::EnableGpuTiming()
+    {
+        const vk::PhysicalDeviceLimits limits = m_allocator.physicalDevice.getProperties(m_allocator.dispatchLoader).limits;
+        if ((limits.timestampComputeAndGraphics == VK_FALSE) || (limits.timestampPeriod <= 0.0f))
+        {
+            if (m_logger.isEnabled(Level::WARN))
+            {
+                m_logger.log(Level::WARN, "RTXMU GPU Timing is not supported by the device\n");
             }
+            return false;
         }
-        if (compactionCopiesPerformed)
+
+        if (m_gpuTimingQueries.subBlock == nullptr)
         {
-            for (const uint64_t& accelStructId : accelStructIds)
+            m_gpuTimingQueryPool = std::make_unique<Suballocator<Allocator, VkTimestampQueryBlock>>(GpuTimingQueryCount * SizeOfCompactionDescriptor, SizeOfCompactionDescriptor, &m_allocator);
+            m_gpuTimingQueries   = m_gpuTimingQueryPool->allocate(GpuTimingQueryCount * SizeOfCompactionDescriptor);
+            if (m_gpuTimingQueries.subBlock == nullptr)
             {
-                VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
-
-                // Only do compaction on the confirmed completion of the original build execution.
-                if (accelStruct->requestedCompaction == true)
+                if (m_logger.isEnabled(Level::ERR))
                 {
-                    auto barrier = vk::BufferMemoryBarrier()
-                        .setSrcAccessMask(vk::AccessFlagBits::eAccelerationStructureWriteKHR)
-                        .setDstAccessMask(vk::AccessFlagBits::eAccelerationStructureReadKHR)
-                        .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
-                        .setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
-                        .setBuffer(accelStruct->compactionGpuMemory.block.getBuffer())
-                        .setOffset(accelStruct->compactionGpuMemory.offset)
-                        .setSize(accelStruct->compactionGpuMemory.subBlock->getSize());
-
-                    commandList.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
-                        vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
-                        vk::DependencyFlags(), 0, nullptr, 1, &barrier, 0, nullptr, VkBlock::getDispatchLoader());
+                    m_logger.log(Level::ERR, "RTXMU GPU Timing query pool couldn't be created\n");
                 }
+                m_gpuTimingQueryPool.reset();
+                return false;
             }
         }
+
+        StartGpuTiming(static_cast<double>(limits.timestampPeriod));
+        return true;
     }
 
     // Remove all memory that an Acceleration Structure might use
     void VkAccelStructManager::RemoveAccelerationStructures(const std::vector<uint64_t>& accelStructIds)
     {
-        std::lock_guard<std::mutex> guard(m_threadSafeLock);
-
         for (const uint64_t& accelStructId : accelStructIds)
         {
-            ReleaseAccelerationStructures(accelStructId);
+            // Ids shared by build deduplication keep the acceleration structure alive
+            if (IsLiveId(accelStructId) && ReleaseReference(accelStructId))
+            {
+                RecordTrace(AllocationTraceRecordType::Remove, accelStructId);
+                ReleaseAccelerationStructures(accelStructId);
+            }
         }
     }
 
     // Remove all memory used in build process, while only leaving the acceleration structure buffer itself in memory
     void VkAccelStructManager::GarbageCollection(const std::vector<uint64_t>& accelStructIds)
     {
-        std::lock_guard<std::mutex> guard(m_threadSafeLock);
+        std::vector<uint64_t> liveIds;
+        GetLiveIds(accelStructIds, liveIds);
 
         // Complete queue indicates cleanup for acceleration structures
-        for (const uint64_t& accelStructId : accelStructIds)
+        for (const uint64_t& accelStructId : liveIds)
         {
+            RecordTrace(AllocationTraceRecordType::GarbageCollection, accelStructId);
             PostBuildRelease(accelStructId);
             m_asBufferBuildQueue[accelStructId]->readyToFree = true;
         }
@@ -420,8 +2334,22 @@ namespace rtxmu
     // Returns GPUVA of the acceleration structure
     vk::DeviceMemory VkAccelStructManager::GetMemory(const uint64_t accelStructId)
     {
+        if (IsLiveId(accelStructId) == false)
+        {
+            return {};
+        }
+
         VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
 
+#ifdef VK_EXT_opacity_micromap
+        if (accelStruct->isMicromap)
+        {
+            return accelStruct->isCompacted ?
+                       VkBlock::getMemory(accelStruct->compactedMicromapGpuMemory.block) :
+                       VkBlock::getMemory(accelStruct->micromapGpuMemory.block);
+        }
+#endif
+
         return accelStruct->isCompacted ?
                    VkBlock::getMemory(accelStruct->compactionGpuMemory.block) :
                    VkBlock::getMemory(accelStruct->resultGpuMemory.block);
@@ -429,17 +2357,48 @@ namespace rtxmu
 
     vk::DeviceSize VkAccelStructManager::GetMemoryOffset(const uint64_t accelStructId)
     {
+        if (IsLiveId(accelStructId) == false)
+        {
+            return {};
+        }
+
         VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
 
+#ifdef VK_EXT_opacity_micromap
+        if (accelStruct->isMicromap)
+        {
+            return (VkDeviceSize)(accelStruct->isCompacted ?
+                                      VkBlock::getMemoryOffset(accelStruct->compactedMicromapGpuMemory.block) + accelStruct->compactedMicromapGpuMemory.offset :
+                                      VkBlock::getMemoryOffset(accelStruct->micromapGpuMemory.block) + accelStruct->micromapGpuMemory.offset);
+        }
+#endif
+
         return (VkDeviceSize)(accelStruct->isCompacted ?
-                                  accelStruct->compactionGpuMemory.offset :
-                                  accelStruct->resultGpuMemory.offset);
+                                  VkBlock::getMemoryOffset(accelStruct->compactionGpuMemory.block) + accelStruct->compactionGpuMemory.offset :
+                                  VkBlock::getMemoryOffset(accelStruct->resultGpuMemory.block) + accelStruct->resultGpuMemory.offset);
     }
 
     vk::DeviceAddress VkAccelStructManager::GetDeviceAddress(const uint64_t accelStructId)
     {
+        if (IsLiveId(accelStructId) == false)
+        {
+            return {};
+        }
+
         VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
 
+#ifdef VK_EXT_opacity_micromap
+        if (accelStruct->isMicromap)
+        {
+            return accelStruct->isCompacted ? VkBlock::getDeviceAddress(m_allocator.device,
+                                                                        accelStruct->compactedMicromapGpuMemory.block,
+                                                                        accelStruct->compactedMicromapGpuMemory.offset) :
+                                              VkBlock::getDeviceAddress(m_allocator.device,
+                                                                        accelStruct->micromapGpuMemory.block,
+                                                                        accelStruct->micromapGpuMemory.offset);
+        }
+#endif
+
         return accelStruct->isCompacted ? VkBlock::getDeviceAddress(m_allocator.device,
                                                                     accelStruct->compactionGpuMemory.block,
                                                                     accelStruct->compactionGpuMemory.offset) :
@@ -450,6 +2409,11 @@ namespace rtxmu
 
     vk::AccelerationStructureKHR VkAccelStructManager::GetAccelerationStruct(const uint64_t accelStructId)
     {
+        if (IsLiveId(accelStructId) == false)
+        {
+            return {};
+        }
+
         VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
 
         return accelStruct->isCompacted ?
@@ -459,6 +2423,11 @@ namespace rtxmu
 
     vk::AccelerationStructureKHR VkAccelStructManager::GetAccelerationStructCompacted(const uint64_t accelStructId)
     {
+        if (IsLiveId(accelStructId) == false)
+        {
+            return {};
+        }
+
         VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
 
         return accelStruct->compactionGpuMemory.subBlock == nullptr ? vk::AccelerationStructureKHR() :
@@ -467,8 +2436,22 @@ namespace rtxmu
 
     vk::Buffer VkAccelStructManager::GetBuffer(const uint64_t accelStructId)
     {
+        if (IsLiveId(accelStructId) == false)
+        {
+            return {};
+        }
+
         VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
 
+#ifdef VK_EXT_opacity_micromap
+        if (accelStruct->isMicromap)
+        {
+            return accelStruct->isCompacted ?
+                       accelStruct->compactedMicromapGpuMemory.block.getBuffer() :
+                       accelStruct->micromapGpuMemory.block.getBuffer();
+        }
+#endif
+
         return accelStruct->isCompacted ?
                    accelStruct->compactionGpuMemory.block.getBuffer() :
                    accelStruct->resultGpuMemory.block.getBuffer();
@@ -476,35 +2459,51 @@ namespace rtxmu
 
     uint64_t VkAccelStructManager::GetInitialAccelStructSize(const uint64_t accelStructId)
     {
+        if (IsLiveId(accelStructId) == false)
+        {
+            return {};
+        }
+
         VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
 
-        return accelStruct->resultGpuMemory.subBlock->getSize() -
-               accelStruct->resultGpuMemory.subBlock->getUnusedSize();
+        // The result buffer is released once compaction is garbage collected so use the recorded size
+        return accelStruct->initialSize;
     }
 
     uint64_t VkAccelStructManager::GetCompactedAccelStructSize(const uint64_t accelStructId)
     {
+        if (IsLiveId(accelStructId) == false)
+        {
+            return {};
+        }
+
         VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
 
+#ifdef VK_EXT_opacity_micromap
+        if (accelStruct->isMicromap)
+        {
+            return accelStruct->compactedMicromapGpuMemory.subBlock->getSize() -
+                   accelStruct->compactedMicromapGpuMemory.subBlock->getUnusedSize();
+        }
+#endif
+
         return accelStruct->compactionGpuMemory.subBlock->getSize() -
                accelStruct->compactionGpuMemory.subBlock->getUnusedSize();
     }
 
     bool VkAccelStructManager::GetRequestedCompaction(const uint64_t accelStructId)
     {
-        VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
-        return accelStruct->requestedCompaction;
+        return IsLiveId(accelStructId) && m_asBufferBuildQueue[accelStructId]->requestedCompaction;
     }
 
     bool VkAccelStructManager::GetCompactionComplete(const uint64_t accelStructId)
     {
-        VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
-        return accelStruct->isCompacted;
+        return IsLiveId(accelStructId) && m_asBufferBuildQueue[accelStructId]->isCompacted;
     }
 
     bool VkAccelStructManager::IsValid(const uint64_t accelStructId)
     {
-        return (accelStructId < m_asBufferBuildQueue.size()) && (m_asBufferBuildQueue[accelStructId] != nullptr);
+        return IsLiveId(accelStructId);
     }
 
     // Returns a const char* containing memory consumption information
@@ -526,57 +2525,127 @@ namespace rtxmu
             "Update suballocator memory:             " + std::to_string(m_updatePool->getSize()          / 1000000.0f) + " MB\n"
             "Compaction fragmented percentage:       " + std::to_string(fragmentedRatio                  * 100.0f)     + " %%\n"
         );
+#ifdef VK_EXT_opacity_micromap
+        m_buildLogger.append(
+            "Micromap suballocator memory:           " + std::to_string(m_micromapPool->getSize()          / 1000000.0f) + " MB\n"
+            "Compacted Micromap suballocator memory: " + std::to_string(m_compactedMicromapPool->getSize() / 1000000.0f) + " MB\n"
+        );
+#endif
 
         return m_buildLogger.c_str();
     }
 
+    void VkAccelStructManager::ReleaseSerializedMemory(VkAccelerationStructure* accelStruct)
+    {
+        if (accelStruct->querySerializedSizeMemory.subBlock != nullptr)
+        {
+            m_querySerializedSizePool->free(accelStruct->querySerializedSizeMemory.subBlock);
+            accelStruct->querySerializedSizeMemory.subBlock = nullptr;
+        }
+        if (accelStruct->serializedMemory.subBlock != nullptr)
+        {
+            m_serializationPool->free(accelStruct->serializedMemory.subBlock);
+            accelStruct->serializedMemory.subBlock = nullptr;
+        }
+    }
+
+    void VkAccelStructManager::ReleaseRetiredRebuildMemory(VkAccelerationStructure* accelStruct)
+    {
+        for (auto& resultGpuMemory : accelStruct->retiredResultMemory)
+        {
+            m_allocator.device.destroyAccelerationStructureKHR(resultGpuMemory.block.m_asHandle, nullptr, m_allocator.dispatchLoader);
+            if (accelStruct->requestedCompaction)
+            {
+                m_transientResultPool->free(resultGpuMemory.subBlock);
+            }
+            else
+            {
+                m_resultPool->free(resultGpuMemory.subBlock);
+            }
+        }
+        accelStruct->retiredResultMemory.clear();
+
+        for (auto& scratchGpuMemory : accelStruct->retiredScratchMemory)
+        {
+            m_scratchPool->free(scratchGpuMemory.subBlock);
+        }
+        accelStruct->retiredScratchMemory.clear();
+    }
+
     void VkAccelStructManager::PostBuildRelease(const uint64_t accelStructId)
     {
         VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
 
+#ifdef VK_EXT_opacity_micromap
+        if (accelStruct->isMicromap)
+        {
+            ReleaseMicromapBuildMemory(accelStruct);
+            return;
+        }
+#endif
+
+        // The clone copy of a defragmentation move has finished so the old location can go
+        if (accelStruct->defragSourceMemory.subBlock != nullptr)
+        {
+            m_allocator.device.destroyAccelerationStructureKHR(accelStruct->defragSourceMemory.block.m_asHandle, nullptr, m_allocator.dispatchLoader);
+            accelStruct->defragSourceMemory.block.m_asHandle = nullptr;
+            m_compactionPool->free(accelStruct->defragSourceMemory.subBlock);
+            accelStruct->defragSourceMemory.subBlock = nullptr;
+        }
+
+        // Deserialization has finished reading the uploaded blob
+        if (accelStruct->deserializedUploadMemory.subBlock != nullptr)
+        {
+            m_serializationPool->free(accelStruct->deserializedUploadMemory.subBlock);
+            accelStruct->deserializedUploadMemory.subBlock = nullptr;
+        }
+
+        // The build that outgrew its memory has finished so the memory it moved away from can go
+        ReleaseRetiredRebuildMemory(accelStruct);
+
         // Only delete compaction size and result if compaction was performed
         if (accelStruct->isCompacted == true)
         {
             // Deallocate all the buffers used to create a compaction AS buffer
-            if ((accelStruct->resultGpuMemory.subBlock != nullptr) &&
-                (accelStruct->resultGpuMemory.subBlock->isFree() == false))
+            if (accelStruct->resultGpuMemory.subBlock != nullptr)
             {
                 m_transientResultPool->free(accelStruct->resultGpuMemory.subBlock);
+                accelStruct->resultGpuMemory.subBlock = nullptr;
             }
-            if ((accelStruct->queryCompactionSizeMemory.subBlock != nullptr) &&
-                (accelStruct->queryCompactionSizeMemory.subBlock->isFree() == false))
+            if (accelStruct->queryCompactionSizeMemory.subBlock != nullptr)
             {
                 m_queryCompactionSizePool->free(accelStruct->queryCompactionSizeMemory.subBlock);
+                accelStruct->queryCompactionSizeMemory.subBlock = nullptr;
             }
             //Destroy the result AccelStruct, because the compaction AccelStruct is used
             auto& resultAS = accelStruct->resultGpuMemory.block.m_asHandle;
             if(resultAS)
             {
-                m_allocator.device.destroyAccelerationStructureKHR(resultAS, nullptr, VkBlock::getDispatchLoader());
+                m_allocator.device.destroyAccelerationStructureKHR(resultAS, nullptr, m_allocator.dispatchLoader);
                 resultAS = nullptr;
             }
 
-            if (Logger::isEnabled(Level::DBG))
+            if (m_logger.isEnabled(Level::DBG))
             {
                 char buf[128];
                 snprintf(buf, sizeof buf, "RTXMU Garbage Collection For Compacted %" PRIu64 "\n", accelStructId);
-                Logger::log(Level::DBG, buf);
+                m_logger.log(Level::DBG, buf);
             }
         }
 
         // Be cautious here and if the acceleration structure did not request compaction then
         // assume rebuilds or updates will deployed and do not deallocate scratch
         if ((accelStruct->requestedCompaction == true) &&
-            (accelStruct->scratchGpuMemory.subBlock != nullptr) &&
-            (accelStruct->scratchGpuMemory.subBlock->isFree() == false))
+            (accelStruct->scratchGpuMemory.subBlock != nullptr))
         {
             m_scratchPool->free(accelStruct->scratchGpuMemory.subBlock);
+            accelStruct->scratchGpuMemory.subBlock = nullptr;
 
-            if (Logger::isEnabled(Level::DBG))
+            if (m_logger.isEnabled(Level::DBG))
             {
                 char buf[128];
                 snprintf(buf, sizeof buf, "RTXMU Garbage Collection Deleting Scratch %" PRIu64 "\n", accelStructId);
-                Logger::log(Level::DBG, buf);
+                m_logger.log(Level::DBG, buf);
             }
         }
     }
@@ -585,24 +2654,25 @@ namespace rtxmu
     {
         VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[accelStructId];
 
-        m_totalCompactedMemory -= accelStruct->compactionSize;
-        m_totalUncompactedMemory -= accelStruct->resultSize;
+        // Micromaps stay out of the acceleration structure totals
+        if (accelStruct->isMicromap == false)
+        {
+            m_totalCompactedMemory -= accelStruct->compactionSize;
+            m_totalUncompactedMemory -= accelStruct->resultSize;
+        }
 
         // Deallocate all the buffers used for acceleration structures
-        if ((accelStruct->scratchGpuMemory.subBlock != nullptr) &&
-            (accelStruct->scratchGpuMemory.subBlock->isFree() == false))
+        if (accelStruct->scratchGpuMemory.subBlock != nullptr)
         {
             m_scratchPool->free(accelStruct->scratchGpuMemory.subBlock);
             accelStruct->scratchGpuMemory.subBlock = nullptr;
         }
-        if ((accelStruct->updateGpuMemory.subBlock != nullptr) &&
-            (accelStruct->updateGpuMemory.subBlock->isFree() == false))
+        if (accelStruct->updateGpuMemory.subBlock != nullptr)
         {
             m_updatePool->free(accelStruct->updateGpuMemory.subBlock);
             accelStruct->updateGpuMemory.subBlock = nullptr;
         }
-        if ((accelStruct->resultGpuMemory.subBlock != nullptr) &&
-            (accelStruct->resultGpuMemory.subBlock->isFree() == false))
+        if (accelStruct->resultGpuMemory.subBlock != nullptr)
         {
             if (accelStruct->requestedCompaction)
             {
@@ -614,36 +2684,200 @@ namespace rtxmu
             }
             accelStruct->resultGpuMemory.subBlock = nullptr;
         }
-        if ((accelStruct->compactionGpuMemory.subBlock != nullptr) &&
-            (accelStruct->compactionGpuMemory.subBlock->isFree() == false))
+        if (accelStruct->compactionGpuMemory.subBlock != nullptr)
         {
             m_compactionPool->free(accelStruct->compactionGpuMemory.subBlock);
             accelStruct->compactionGpuMemory.subBlock = nullptr;
         }
+        if (accelStruct->defragSourceMemory.subBlock != nullptr)
+        {
+            m_allocator.device.destroyAccelerationStructureKHR(accelStruct->defragSourceMemory.block.m_asHandle, nullptr, m_allocator.dispatchLoader);
+            accelStruct->defragSourceMemory.block.m_asHandle = nullptr;
+            m_compactionPool->free(accelStruct->defragSourceMemory.subBlock);
+            accelStruct->defragSourceMemory.subBlock = nullptr;
+        }
+        if (accelStruct->queryCompactionSizeMemory.subBlock != nullptr)
+        {
+            m_queryCompactionSizePool->free(accelStruct->queryCompactionSizeMemory.subBlock);
+            accelStruct->queryCompactionSizeMemory.subBlock = nullptr;
+        }
+        if (accelStruct->deserializedUploadMemory.subBlock != nullptr)
+        {
+            m_serializationPool->free(accelStruct->deserializedUploadMemory.subBlock);
+            accelStruct->deserializedUploadMemory.subBlock = nullptr;
+        }
+        ReleaseSerializedMemory(accelStruct);
+        ReleaseRetiredRebuildMemory(accelStruct);
+#ifdef VK_EXT_opacity_micromap
+        ReleaseMicromapMemory(accelStruct);
+#endif
+
+        // Managed top level acceleration structures also hold their instance buffers and memory they moved away from
+        if (accelStruct->topLevel != nullptr)
+        {
+            VkRetiredTopLevelMemory retiredMemory;
+            accelStruct->topLevel->instances.releaseBuffers(retiredMemory.instanceMemory);
+            accelStruct->topLevel->retiredMemory.push_back(std::move(retiredMemory));
+
+            ReleaseRetiredTopLevelMemory(accelStruct->topLevel.get(), UINT64_MAX);
+        }
 
         auto&compactionAS = accelStruct->compactionGpuMemory.block.m_asHandle;
         auto& resultAS = accelStruct->resultGpuMemory.block.m_asHandle;
         // Destroy the acceleration structures
         if (accelStruct->isCompacted && compactionAS)
         {
-            m_allocator.device.destroyAccelerationStructureKHR(compactionAS, nullptr, VkBlock::getDispatchLoader());
+            m_allocator.device.destroyAccelerationStructureKHR(compactionAS, nullptr, m_allocator.dispatchLoader);
         }
         if (resultAS)
         {
-            m_allocator.device.destroyAccelerationStructureKHR(resultAS, nullptr, VkBlock::getDispatchLoader());
+            m_allocator.device.destroyAccelerationStructureKHR(resultAS, nullptr, m_allocator.dispatchLoader);
         }
         accelStruct->resultGpuMemory.block.m_asHandle = nullptr;
         accelStruct->compactionGpuMemory.block.m_asHandle = nullptr;
 
         ReleaseAccelStructId(accelStructId);
 
-        if (Logger::isEnabled(Level::DBG))
+        if (m_logger.isEnabled(Level::DBG))
         {
             char buf[128];
             snprintf(buf, sizeof buf, "RTXMU Remove %" PRIu64 "\n", accelStructId);
-            Logger::log(Level::DBG, buf);
+            m_logger.log(Level::DBG, buf);
+        }
+    }
+
+#ifdef VK_EXT_opacity_micromap
+    bool VkAccelStructManager::CompactMicromap(vk::CommandBuffer    commandList,
+                                               const uint64_t       micromapId,
+                                               const vk::DeviceSize compactionSize)
+    {
+        VkAccelerationStructure* accelStruct = m_asBufferBuildQueue[micromapId];
+
+        accelStruct->compactedMicromapGpuMemory = m_compactedMicromapPool->allocate(compactionSize);
+
+        // Out of memory, stay uncompacted so the compaction can be retried later
+        if (accelStruct->compactedMicromapGpuMemory.subBlock == nullptr)
+        {
+            if (m_logger.isEnabled(Level::ERR))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU Micromap Compaction %" PRIu64 " is out of memory and was skipped\n", micromapId);
+                m_logger.log(Level::ERR, buf);
+            }
+            return false;
+        }
+
+        accelStruct->compactionSize = accelStruct->compactedMicromapGpuMemory.subBlock->getSize();
+        ReportCompaction(micromapId, accelStruct->resultSize, accelStruct->compactionSize, PoolType::CompactedMicromap);
+
+        auto micromapCreateInfo = vk::MicromapCreateInfoEXT()
+            .setType(accelStruct->micromapType)
+            .setSize(compactionSize)
+            .setBuffer(accelStruct->compactedMicromapGpuMemory.block.getBuffer())
+            .setOffset(accelStruct->compactedMicromapGpuMemory.offset);
+        accelStruct->compactedMicromapGpuMemory.block.m_micromapHandle = m_allocator.device.createMicromapEXT(micromapCreateInfo, nullptr, m_allocator.dispatchLoader);
+
+        auto copyInfo = vk::CopyMicromapInfoEXT()
+            .setMode(vk::CopyMicromapModeEXT::eCompact)
+            .setSrc(accelStruct->micromapGpuMemory.block.m_micromapHandle)
+            .setDst(accelStruct->compactedMicromapGpuMemory.block.m_micromapHandle);
+        commandList.copyMicromapEXT(copyInfo, m_allocator.dispatchLoader);
+
+        accelStruct->isCompacted = true;
+        PublishAddress(micromapId, GetDeviceAddress(micromapId));
+
+        if (m_logger.isEnabled(Level::DBG))
+        {
+            char buf[128];
+            snprintf(buf, sizeof buf, "RTXMU Micromap Copy Compaction %" PRIu64 "\n", micromapId);
+            m_logger.log(Level::DBG, buf);
+        }
+        return true;
+    }
+
+    vk::BufferMemoryBarrier VkAccelStructManager::GetMicromapBarrier(const VkAccelerationStructure* accelStruct)
+    {
+        const auto& micromapGpuMemory = accelStruct->isCompacted ? accelStruct->compactedMicromapGpuMemory :
+                                                                   accelStruct->micromapGpuMemory;
+
+        return vk::BufferMemoryBarrier()
+            .setSrcAccessMask(vk::AccessFlagBits::eMemoryWrite)
+            .setDstAccessMask(vk::AccessFlagBits::eMemoryRead)
+            .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+            .setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+            .setBuffer(micromapGpuMemory.block.getBuffer())
+            .setOffset(micromapGpuMemory.offset)
+            .setSize(micromapGpuMemory.subBlock->getSize());
+    }
+
+    void VkAccelStructManager::PlaceMicromapBarriers(vk::CommandBuffer                           commandList,
+                                                     const std::vector<vk::BufferMemoryBarrier>& barriers)
+    {
+        commandList.pipelineBarrier(vk::PipelineStageFlagBits::eAllCommands,
+            vk::PipelineStageFlagBits::eAllCommands,
+            vk::DependencyFlags(), 0, nullptr, (uint32_t)barriers.size(), barriers.data(), 0, nullptr, m_allocator.dispatchLoader);
+    }
+
+    void VkAccelStructManager::ReleaseMicromapBuildMemory(VkAccelerationStructure* accelStruct)
+    {
+        if (accelStruct->scratchGpuMemory.subBlock != nullptr)
+        {
+            m_scratchPool->free(accelStruct->scratchGpuMemory.subBlock);
+            accelStruct->scratchGpuMemory.subBlock = nullptr;
+        }
+
+        // The compacted copy replaced the uncompacted one
+        if (accelStruct->isCompacted == true)
+        {
+            if (accelStruct->micromapGpuMemory.block.m_micromapHandle)
+            {
+                m_allocator.device.destroyMicromapEXT(accelStruct->micromapGpuMemory.block.m_micromapHandle, nullptr, m_allocator.dispatchLoader);
+                accelStruct->micromapGpuMemory.block.m_micromapHandle = nullptr;
+            }
+            if (accelStruct->micromapGpuMemory.subBlock != nullptr)
+            {
+                m_micromapPool->free(accelStruct->micromapGpuMemory.subBlock);
+                accelStruct->micromapGpuMemory.subBlock = nullptr;
+            }
+            if (accelStruct->queryMicromapCompactionSizeMemory.subBlock != nullptr)
+            {
+                m_queryMicromapCompactionSizePool->free(accelStruct->queryMicromapCompactionSizeMemory.subBlock);
+                accelStruct->queryMicromapCompactionSizeMemory.subBlock = nullptr;
+            }
+        }
+    }
+
+    void VkAccelStructManager::ReleaseMicromapMemory(VkAccelerationStructure* accelStruct)
+    {
+        ReleaseMicromapBuildMemory(accelStruct);
+
+        if (accelStruct->micromapGpuMemory.block.m_micromapHandle)
+        {
+            m_allocator.device.destroyMicromapEXT(accelStruct->micromapGpuMemory.block.m_micromapHandle, nullptr, m_allocator.dispatchLoader);
+            accelStruct->micromapGpuMemory.block.m_micromapHandle = nullptr;
+        }
+        if (accelStruct->compactedMicromapGpuMemory.block.m_micromapHandle)
+        {
+            m_allocator.device.destroyMicromapEXT(accelStruct->compactedMicromapGpuMemory.block.m_micromapHandle, nullptr, m_allocator.dispatchLoader);
+            accelStruct->compactedMicromapGpuMemory.block.m_micromapHandle = nullptr;
+        }
+        if (accelStruct->micromapGpuMemory.subBlock != nullptr)
+        {
+            m_micromapPool->free(accelStruct->micromapGpuMemory.subBlock);
+            accelStruct->micromapGpuMemory.subBlock = nullptr;
+        }
+        if (accelStruct->compactedMicromapGpuMemory.subBlock != nullptr)
+        {
+            m_compactedMicromapPool->free(accelStruct->compactedMicromapGpuMemory.subBlock);
+            accelStruct->compactedMicromapGpuMemory.subBlock = nullptr;
+        }
+        if (accelStruct->queryMicromapCompactionSizeMemory.subBlock != nullptr)
+        {
+            m_queryMicromapCompactionSizePool->free(accelStruct->queryMicromapCompactionSizeMemory.subBlock);
+            accelStruct->queryMicromapCompactionSizeMemory.subBlock = nullptr;
         }
     }
+#endif
 
     Stats VkAccelStructManager::GetResultPoolMemoryStats()
     {
@@ -659,4 +2893,26 @@ namespace rtxmu
     {
         return m_compactionPool->getStats();
     }
+
+    PoolTelemetry VkAccelStructManager::GetPoolTelemetry(const PoolType pool)
+    {
+        switch (pool)
+        {
+        case PoolType::Scratch:                return m_scratchPool->getTelemetry();
+        case PoolType::Update:                 return m_updatePool->getTelemetry();
+        case PoolType::Result:                 return m_resultPool->getTelemetry();
+        case PoolType::TransientResult:        return m_transientResultPool->getTelemetry();
+        case PoolType::Compaction:             return m_compactionPool->getTelemetry();
+        case PoolType::CompactionSize:         return m_queryCompactionSizePool->getTelemetry();
+        case PoolType::SerializedSize:         return m_querySerializedSizePool->getTelemetry();
+        case PoolType::Serialized:             return m_serializationPool->getTelemetry();
+        case PoolType::Instance:               return m_instancePool->getTelemetry();
+#ifdef VK_EXT_opacity_micromap
+        case PoolType::Micromap:               return m_micromapPool->getTelemetry();
+        case PoolType::CompactedMicromap:      return m_compactedMicromapPool->getTelemetry();
+        case PoolType::MicromapCompactionSize: return m_queryMicromapCompactionSizePool->getTelemetry();
+#endif
+        default:                               return {};
+        }
+    }
 }
\ No newline at end of file
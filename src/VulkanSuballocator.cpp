@@ -24,26 +24,17 @@
 
 namespace rtxmu
 {
-    Allocator* VkBlock::m_allocator = nullptr;
     void VkBlock::setAllocator(Allocator* allocator)
     {
         m_allocator = allocator;
     }
 
-    VkDispatchLoaderDynamic VkBlock::m_dispatchLoader;
-
-    VkDispatchLoaderDynamic& VkBlock::getDispatchLoader()
-    {
-        return m_dispatchLoader;
-    }
-
-    uint32_t VkBlock::getMemoryIndex(const vk::PhysicalDevice& physicalDevice,
-                                     uint32_t memoryTypeBits,
+    uint32_t VkBlock::getMemoryIndex(uint32_t                memoryTypeBits,
                                      vk::MemoryPropertyFlags propFlags,
-                                     vk::MemoryHeapFlags heapFlags)
+                                     vk::MemoryHeapFlags     heapFlags)
     {
         vk::PhysicalDeviceMemoryProperties memProperties;
-        physicalDevice.getMemoryProperties(&memProperties, m_dispatchLoader);
+        m_allocator->physicalDevice.getMemoryProperties(&memProperties, m_allocator->dispatchLoader);
 
         for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++)
         {
@@ -64,13 +55,24 @@ namespace rtxmu
         return block.m_memory;
     }
 
+    vk::DeviceSize VkBlock::getMemoryOffset(VkBlock block)
+    {
+        return block.m_memoryOffset;
+    }
+
     vk::DeviceAddress VkBlock::getDeviceAddress(const vk::Device& device,
-                                               VkBlock block,
-                                               uint64_t offset)
+                                               const VkBlock&    block,
+                                               uint64_t          offset)
     {
+        // Blocks without the device address usage have no cached address
+        if (block.m_deviceAddress != 0)
+        {
+            return block.m_deviceAddress + offset;
+        }
+
         auto addrInfo = vk::BufferDeviceAddressInfo().setBuffer(block.m_buffer);
 
-        return device.getBufferAddress(addrInfo, VkBlock::getDispatchLoader()) + offset;
+        return device.getBufferAddress(addrInfo, block.m_allocator->dispatchLoader) + offset;
     }
 
     vk::Buffer VkBlock::getBuffer()
@@ -78,49 +80,259 @@ namespace rtxmu
         return m_buffer;
     }
 
-    void VkBlock::allocate(vk::DeviceSize          size,
+    bool VkBlock::allocate(vk::DeviceSize          size,
                            vk::BufferUsageFlags    usageFlags,
                            vk::MemoryPropertyFlags propFlags,
                            vk::MemoryHeapFlags     heapflags,
                            uint32_t                alignment)
     {
+        // Host visible blocks stay mapped and memory can only be mapped once, so they never share memory
+        const bool isHostVisible = static_cast<bool>(propFlags & vk::MemoryPropertyFlagBits::eHostVisible);
+        const bool isShared      = (m_allocator->memoryAllocator != nullptr) && (isHostVisible == false);
+
+        // Only device local memory counts against the budget, blocks bound to budgeted shared memory are covered by it
+        const bool isBudgeted = static_cast<bool>(propFlags & vk::MemoryPropertyFlagBits::eDeviceLocal) &&
+                                ((isShared == false) || (m_allocator->memoryAllocator->isBudgeted() == false));
+        if (isBudgeted && (m_allocator->memoryBudget.reserve(size) == false))
+        {
+            if (m_allocator->logger->isEnabled(Level::WARN))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU Block Allocation of size %" PRIu64 " exceeds the memory budget\n", size);
+                m_allocator->logger->log(Level::WARN, buf);
+            }
+            return false;
+        }
+
         auto bufferInfo = vk::BufferCreateInfo()
             .setSize(size)
             .setUsage(usageFlags)
             .setSharingMode(vk::SharingMode::eExclusive);
 
-        m_buffer = m_allocator->device.createBuffer(bufferInfo, nullptr, VkBlock::getDispatchLoader());
+        // Blocks mix acceleration structures built and used on different queues, so ownership can't be
+        // transferred per acceleration structure and the buffers get shared instead
+        if (m_allocator->queueFamilyIndices.size() > 1)
+        {
+            bufferInfo.setSharingMode(vk::SharingMode::eConcurrent)
+                      .setQueueFamilyIndexCount(static_cast<uint32_t>(m_allocator->queueFamilyIndices.size()))
+                      .setPQueueFamilyIndices(m_allocator->queueFamilyIndices.data());
+        }
+
+        if (m_allocator->device.createBuffer(&bufferInfo, nullptr, &m_buffer, m_allocator->dispatchLoader) != vk::Result::eSuccess)
+        {
+            m_buffer = nullptr;
+            if (isBudgeted)
+            {
+                m_allocator->memoryBudget.release(size);
+            }
+            return false;
+        }
 
-        vk::MemoryRequirements memoryRequirements = m_allocator->device.getBufferMemoryRequirements(m_buffer, m_dispatchLoader);
-        uint32_t memoryTypeIndex = getMemoryIndex(m_allocator->physicalDevice, memoryRequirements.memoryTypeBits, propFlags, heapflags);
+        vk::MemoryRequirements memoryRequirements = m_allocator->device.getBufferMemoryRequirements(m_buffer, m_allocator->dispatchLoader);
+        uint32_t memoryTypeIndex = getMemoryIndex(memoryRequirements.memoryTypeBits, propFlags, heapflags);
 
         // Passed in alignment needs to be the same for alignment returned by getBufferMemoryRequirements
         if (memoryRequirements.alignment != alignment)
         {
-            if (Logger::isEnabled(Level::FATAL))
+            if (m_allocator->logger->isEnabled(Level::FATAL))
             {
-                Logger::log(Level::FATAL, "Alignment doesn't match for allocation\n");
+                m_allocator->logger->log(Level::FATAL, "Alignment doesn't match for allocation\n");
                 assert(0);
             }
         }
 
+        bool memoryAllocated = false;
+        if (isShared)
+        {
+            // Binding to a range of shared memory avoids an allocation per block
+            memoryAllocated = m_allocator->memoryAllocator->allocate(memoryRequirements.size,
+                                                                     memoryRequirements.alignment,
+                                                                     memoryTypeIndex,
+                                                                     m_memory,
+                                                                     m_memoryOffset,
+                                                                     m_memoryHandle);
+            if (memoryAllocated)
+            {
+                m_memoryAllocator = m_allocator->memoryAllocator;
+            }
+            else
+            {
+                m_memoryHandle = nullptr;
+                m_memoryOffset = 0;
+            }
+        }
+        else
+        {
+            auto memoryAllocateFlags = vk::MemoryAllocateFlagsInfo()
+                .setFlags(vk::MemoryAllocateFlagBits::eDeviceAddress);
+            if (m_allocator->deviceMask != 0)
+            {
+                memoryAllocateFlags.setFlags(vk::MemoryAllocateFlagBits::eDeviceAddress | vk::MemoryAllocateFlagBits::eDeviceMask)
+                                   .setDeviceMask(m_allocator->deviceMask);
+            }
+
+            auto memoryInfo = vk::MemoryAllocateInfo()
+                .setPNext(&memoryAllocateFlags)
+                .setAllocationSize(size)
+                .setMemoryTypeIndex(memoryTypeIndex);
+
+            // Running out of device memory is reported instead of thrown so the manager can fail gracefully
+            memoryAllocated = (m_allocator->device.allocateMemory(&memoryInfo, nullptr, &m_memory, m_allocator->dispatchLoader) == vk::Result::eSuccess);
+        }
+
+        if (memoryAllocated == false)
+        {
+            m_allocator->device.destroyBuffer(m_buffer, nullptr, m_allocator->dispatchLoader);
+            m_buffer = nullptr;
+            m_memory = nullptr;
+            if (isBudgeted)
+            {
+                m_allocator->memoryBudget.release(size);
+            }
+
+            if (m_allocator->logger->isEnabled(Level::ERR))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU vkAllocateMemory of size %" PRIu64 " failed\n", size);
+                m_allocator->logger->log(Level::ERR, buf);
+            }
+            return false;
+        }
+        m_allocator->device.bindBufferMemory(m_buffer, m_memory, m_memoryOffset, m_allocator->dispatchLoader);
+
+        // The address never changes for the lifetime of the buffer, so query it once instead of per lookup
+        if (usageFlags & vk::BufferUsageFlagBits::eShaderDeviceAddress)
+        {
+            m_deviceAddress = m_allocator->device.getBufferAddress(vk::BufferDeviceAddressInfo().setBuffer(m_buffer), m_allocator->dispatchLoader);
+        }
+
+        m_budgetedSize = isBudgeted ? size : 0;
+        return true;
+    }
+
+    void VkBlock::free()
+    {
+        m_allocator->device.destroyBuffer(m_buffer, nullptr, m_allocator->dispatchLoader);
+        if (m_memoryHandle != nullptr)
+        {
+            m_memoryAllocator->free(m_memoryHandle);
+            m_memoryHandle    = nullptr;
+            m_memoryAllocator = nullptr;
+            m_memoryOffset    = 0;
+        }
+        else
+        {
+            m_allocator->device.freeMemory(m_memory, nullptr, m_allocator->dispatchLoader);
+        }
+        m_allocator->memoryBudget.release(m_budgetedSize);
+        m_budgetedSize  = 0;
+        m_deviceAddress = 0;
+    }
+
+    // Blocks sharing memory are told apart by their offset
+    uint64_t VkBlock::getVMA() { return (uint64_t)(VkDeviceMemory)(m_memory) + m_memoryOffset; }
+
+    void VkMemoryHeap::setAllocator(Allocator* allocator)
+    {
+        m_allocator = allocator;
+    }
+
+    bool VkMemoryHeap::allocate(uint64_t size,
+                                uint32_t heapKind)
+    {
+        vk::PhysicalDeviceMemoryProperties memProperties;
+        m_allocator->physicalDevice.getMemoryProperties(&memProperties, m_allocator->dispatchLoader);
+
+        const bool isDeviceLocal = static_cast<bool>(memProperties.memoryTypes[heapKind].propertyFlags & vk::MemoryPropertyFlagBits::eDeviceLocal);
+        if (isDeviceLocal && (m_allocator->memoryBudget.reserve(size) == false))
+        {
+            if (m_allocator->logger->isEnabled(Level::WARN))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU Memory Arena allocation of size %" PRIu64 " exceeds the memory budget\n", size);
+                m_allocator->logger->log(Level::WARN, buf);
+            }
+            return false;
+        }
+
         auto memoryAllocateFlags = vk::MemoryAllocateFlagsInfo()
             .setFlags(vk::MemoryAllocateFlagBits::eDeviceAddress);
+        if (m_allocator->deviceMask != 0)
+        {
+            memoryAllocateFlags.setFlags(vk::MemoryAllocateFlagBits::eDeviceAddress | vk::MemoryAllocateFlagBits::eDeviceMask)
+                               .setDeviceMask(m_allocator->deviceMask);
+        }
 
         auto memoryInfo = vk::MemoryAllocateInfo()
             .setPNext(&memoryAllocateFlags)
             .setAllocationSize(size)
-            .setMemoryTypeIndex(memoryTypeIndex);
+            .setMemoryTypeIndex(heapKind);
+
+        if (m_allocator->device.allocateMemory(&memoryInfo, nullptr, &m_memory, m_allocator->dispatchLoader) != vk::Result::eSuccess)
+        {
+            m_memory = nullptr;
+            if (isDeviceLocal)
+            {
+                m_allocator->memoryBudget.release(size);
+            }
+
+            if (m_allocator->logger->isEnabled(Level::ERR))
+            {
+                char buf[128];
+                snprintf(buf, sizeof buf, "RTXMU vkAllocateMemory of size %" PRIu64 " for the memory arena failed\n", size);
+                m_allocator->logger->log(Level::ERR, buf);
+            }
+            return false;
+        }
+        m_budgetedSize = isDeviceLocal ? size : 0;
+        return true;
+    }
 
-        m_memory = m_allocator->device.allocateMemory(memoryInfo, nullptr, VkBlock::getDispatchLoader());
-        m_allocator->device.bindBufferMemory(m_buffer, m_memory, 0, VkBlock::getDispatchLoader());
+    void VkMemoryHeap::free()
+    {
+        m_allocator->device.freeMemory(m_memory, nullptr, m_allocator->dispatchLoader);
+        m_memory = nullptr;
+        m_allocator->memoryBudget.release(m_budgetedSize);
+        m_budgetedSize = 0;
     }
 
-    void VkBlock::free()
+    vk::DeviceMemory VkMemoryHeap::getMemory()
+    {
+        return m_memory;
+    }
+
+    VkMemoryArena::VkMemoryArena(Allocator* allocator,
+                                 uint64_t   heapSize) :
+        m_arena(heapSize, DefaultBlockAlignment, allocator)
+    {
+    }
+
+    bool VkMemoryArena::allocate(vk::DeviceSize    size,
+                                 vk::DeviceSize    alignment,
+                                 uint32_t          memoryTypeIndex,
+                                 vk::DeviceMemory& memory,
+                                 vk::DeviceSize&   memoryOffset,
+                                 void*&            handle)
+    {
+        auto placement = m_arena.allocate(size, alignment, memoryTypeIndex);
+        if (placement == nullptr)
+        {
+            return false;
+        }
+
+        memory       = placement->heap->getMemory();
+        memoryOffset = placement->offset;
+        handle       = placement;
+        return true;
+    }
+
+    void VkMemoryArena::free(void* handle)
     {
-        m_allocator->device.destroyBuffer(m_buffer, nullptr, VkBlock::getDispatchLoader());
-        m_allocator->device.freeMemory(m_memory, nullptr, VkBlock::getDispatchLoader());
+        m_arena.free(static_cast<HeapArena<Allocator, VkMemoryHeap>::Placement*>(handle));
     }
 
-    uint64_t VkBlock::getVMA() { return (uint64_t)(VkDeviceMemory)(m_memory); }
+    uint64_t VkMemoryArena::getSize()
+    {
+        return m_arena.getSize();
+    }
 }
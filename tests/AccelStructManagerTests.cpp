@@ -0,0 +1,402 @@
+/*
+* Copyright (c) 2024 NVIDIA CORPORATION. All rights reserved
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+// Checks the backend independent parts of the manager without a GPU. The test manager records builds the way
+// the backends do, including the failure path that hands ReservedId back, and ticks the fence tracked pipeline
+// with the id lists exactly as the builds returned them
+
+#include "rtxmu/AccelStructManager.h"
+#include "rtxmu/PrebuildInfoCache.h"
+#include <atomic>
+#include <map>
+#include <stdio.h>
+#include <thread>
+
+#define CHECK(condition)                                                             \
+    if ((condition) == false)                                                        \
+    {                                                                                \
+        fprintf(stderr, "%s:%d CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+        failedChecks++;                                                              \
+    }
+
+namespace
+{
+    using namespace rtxmu;
+
+    int failedChecks = 0;
+
+    class TestAccelStructManager : public AccelStructManager<AccelerationStructure>
+    {
+    public:
+
+        TestAccelStructManager() : AccelStructManager(Level::DISABLED)
+        {
+        }
+
+        // Mirrors PopulateBuildCommandList, builds at failIndex run out of memory and get ReservedId
+        void Build(const uint32_t         buildCount,
+                   const uint32_t         failIndex,
+                   std::vector<uint64_t>& accelStructIds)
+        {
+            for (uint32_t buildIndex = 0; buildIndex < buildCount; buildIndex++)
+            {
+                uint64_t asId = GetAccelStructId();
+                if (buildIndex == failIndex)
+                {
+                    ReleaseAccelStructId(asId);
+                    asId = ReservedId;
+                }
+                else
+                {
+                    m_asBufferBuildQueue[asId]->requestedCompaction = true;
+                    PublishAddress(asId, 0x10000 * asId);
+                }
+                accelStructIds.push_back(asId);
+            }
+        }
+
+        // Mirrors PopulateBuildCommandList with build deduplication, equal inputs share one id
+        void BuildDeduplicated(const std::vector<uint64_t>& inputs,
+                               std::vector<uint64_t>&       accelStructIds)
+        {
+            for (const uint64_t& input : inputs)
+            {
+                BuildInputKey key;
+                key.inputs.add(input);
+
+                uint64_t asId = AcquireDeduplicatedBuild(key);
+                if (asId == ReservedId)
+                {
+                    asId = GetAccelStructId();
+                    m_asBufferBuildQueue[asId]->requestedCompaction = true;
+                    RegisterDeduplicatedBuild(asId, key);
+                }
+                accelStructIds.push_back(asId);
+            }
+        }
+
+        // Mirrors Tick, the batched entry points filter the ids they are handed like the backends do
+        void Tick(const uint64_t completedFenceValue,
+                  const uint64_t submitFenceValue)
+        {
+            PipelineWork work;
+            BeginPipelineTick(completedFenceValue, work);
+
+            std::vector<uint64_t> liveIds;
+            GetLiveIds(work.sizeCopyIds, liveIds);
+            for (const uint64_t& accelStructId : liveIds)
+            {
+                m_asBufferBuildQueue[accelStructId]->compactionSizeCopied = true;
+            }
+
+            GetLiveIds(work.compactionIds, liveIds);
+            TakeDeferredCompactions(liveIds);
+            for (const uint64_t& accelStructId : liveIds)
+            {
+                m_asBufferBuildQueue[accelStructId]->isCompacted = true;
+            }
+
+            GetLiveIds(work.garbageCollectionIds, liveIds);
+            for (const uint64_t& accelStructId : liveIds)
+            {
+                m_asBufferBuildQueue[accelStructId]->readyToFree = true;
+                m_collectedCount++;
+            }
+
+            EndPipelineTick(submitFenceValue, work);
+        }
+
+        // Mirrors RemoveAccelerationStructures
+        void Remove(const std::vector<uint64_t>& accelStructIds)
+        {
+            for (const uint64_t& accelStructId : accelStructIds)
+            {
+                if (IsLiveId(accelStructId) && ReleaseReference(accelStructId))
+                {
+                    ReleaseAccelStructId(accelStructId);
+                }
+            }
+        }
+
+        bool IsValid(const uint64_t accelStructId)
+        {
+            return IsLiveId(accelStructId);
+        }
+
+        uint64_t AcquireId()
+        {
+            return GetAccelStructId();
+        }
+
+        void ReleaseId(const uint64_t accelStructId)
+        {
+            ReleaseAccelStructId(accelStructId);
+        }
+
+        uint64_t GetTableSize()
+        {
+            return m_asBufferBuildQueue.size();
+        }
+
+        uint64_t GetCollectedCount()
+        {
+            return m_collectedCount;
+        }
+
+    private:
+
+        uint64_t m_collectedCount = 0;
+    };
+
+    void TestFailedBuildPipeline()
+    {
+        TestAccelStructManager manager;
+
+        std::vector<uint64_t> accelStructIds;
+        manager.Build(4, 2, accelStructIds);
+
+        CHECK(accelStructIds.size() == 4);
+        CHECK(accelStructIds[2] == ReservedId);
+        CHECK(manager.IsValid(ReservedId) == false);
+        CHECK(manager.IsValid(accelStructIds[0]));
+        CHECK(manager.IsValid(1 << 20) == false);
+
+        // The list goes through every stage as the build returned it
+        manager.TrackBuilds(accelStructIds, 1);
+        CHECK(manager.GetPipelineDepth() == 3);
+
+        manager.RequestRebuild(accelStructIds);
+        CHECK(manager.GetRefitCount(ReservedId) == 0);
+        CHECK(manager.GetReferenceCount(ReservedId) == 0);
+        CHECK(manager.GetReferenceCount(accelStructIds[0]) == 1);
+
+        uint64_t addresses[5] = {};
+        const uint64_t queriedIds[5] = { accelStructIds[0], accelStructIds[1], accelStructIds[2], accelStructIds[3],
+                                         1 << 20 };
+        manager.GetAccelStructAddresses(queriedIds, 5, addresses);
+        CHECK(addresses[0] == 0x10000 * accelStructIds[0]);
+        CHECK(addresses[2] == 0);
+        CHECK(addresses[4] == 0);
+
+        for (uint64_t fenceValue = 1; (fenceValue < 8) && (manager.GetPipelineDepth() > 0); fenceValue++)
+        {
+            manager.Tick(fenceValue, fenceValue + 1);
+        }
+        CHECK(manager.GetPipelineDepth() == 0);
+        CHECK(manager.GetCollectedCount() == 3);
+
+        // Removing twice, or ids that never were, leaves the other acceleration structures alone
+        manager.Remove(accelStructIds);
+        manager.Remove(accelStructIds);
+        CHECK(manager.IsValid(accelStructIds[0]) == false);
+        CHECK(manager.GetReferenceCount(accelStructIds[3]) == 0);
+
+        // Stale ids of removed acceleration structures are skipped as well
+        manager.TrackBuilds(accelStructIds, 9);
+        CHECK(manager.GetPipelineDepth() == 0);
+    }
+
+    void TestDeduplicatedBuildPipeline()
+    {
+        TestAccelStructManager manager;
+        manager.SetBuildDeduplication(true);
+
+        std::vector<uint64_t> accelStructIds;
+        manager.BuildDeduplicated({ 7, 7, 9, 7 }, accelStructIds);
+        CHECK(accelStructIds[0] == accelStructIds[1]);
+        CHECK(accelStructIds[0] == accelStructIds[3]);
+        CHECK(manager.GetReferenceCount(accelStructIds[0]) == 3);
+
+        // Every stage sees the shared acceleration structure once
+        manager.TrackBuilds(accelStructIds, 1);
+        CHECK(manager.GetPipelineDepth() == 2);
+
+        for (uint64_t fenceValue = 1; (fenceValue < 8) && (manager.GetPipelineDepth() > 0); fenceValue++)
+        {
+            manager.Tick(fenceValue, fenceValue + 1);
+        }
+        CHECK(manager.GetCollectedCount() == 2);
+
+        // Removal drops one reference per id
+        manager.Remove({ accelStructIds[0], accelStructIds[2] });
+        CHECK(manager.GetReferenceCount(accelStructIds[0]) == 2);
+        CHECK(manager.IsValid(accelStructIds[2]) == false);
+        manager.Remove({ accelStructIds[0], accelStructIds[0] });
+        CHECK(manager.IsValid(accelStructIds[0]) == false);
+    }
+
+    void TestInputDigest()
+    {
+        BuildInputKey first;
+        BuildInputKey second;
+        BuildInputKey swapped;
+        for (uint64_t value = 0; value < 64; value++)
+        {
+            first.inputs.add(0x10000 * value);
+            second.inputs.add(0x10000 * value);
+            swapped.inputs.add(0x10000 * (value ^ 1));
+        }
+        CHECK(first == second);
+        CHECK(BuildInputKeyHash()(first) == BuildInputKeyHash()(second));
+        CHECK((first == swapped) == false);
+
+        // A prefix of the same values is a different key
+        BuildInputKey prefix;
+        for (uint64_t value = 0; value < 63; value++)
+        {
+            prefix.inputs.add(0x10000 * value);
+        }
+        CHECK((first == prefix) == false);
+    }
+
+    void TestNodePoolAllocator()
+    {
+        using Allocator = NodePoolAllocator<std::pair<const uint64_t, uint64_t>,
+                                            TreeNodeSize<std::pair<const uint64_t, uint64_t>>>;
+        Allocator::Pool pool;
+        {
+            std::map<uint64_t, uint64_t, std::less<uint64_t>, Allocator> freeRanges{ Allocator(&pool) };
+            for (uint64_t round = 0; round < 4; round++)
+            {
+                for (uint64_t offset = 0; offset < 512; offset++)
+                {
+                    freeRanges.emplace(offset * 256, 256);
+                }
+                CHECK(pool.getLiveNodeCount() >= 512);
+                freeRanges.clear();
+            }
+
+            // Every round reused the nodes of the first one
+            CHECK(pool.getCapacity() == 1024);
+        }
+        CHECK(pool.getLiveNodeCount() == 0);
+    }
+
+    void TestConcurrentIdAllocation()
+    {
+        TestAccelStructManager manager;
+
+        constexpr uint32_t ThreadCount    = 8;
+        constexpr uint32_t HeldIdCount    = 16;
+        constexpr uint64_t MaxIdCount     = 4096;
+        std::atomic<uint32_t> owners[MaxIdCount] = {};
+        std::atomic<uint32_t> duplicateIds{ 0 };
+
+        std::vector<std::thread> threads;
+        for (uint32_t threadIndex = 0; threadIndex < ThreadCount; threadIndex++)
+        {
+            threads.emplace_back([&, threadIndex]()
+            {
+                uint64_t heldIds[HeldIdCount] = {};
+                for (uint32_t iteration = 0; iteration < 20000; iteration++)
+                {
+                    uint64_t& heldId = heldIds[iteration % HeldIdCount];
+                    if (heldId != ReservedId)
+                    {
+                        owners[heldId].store(0);
+                        manager.ReleaseId(heldId);
+                    }
+
+                    heldId = manager.AcquireId();
+                    uint32_t owner = 0;
+                    if ((heldId >= MaxIdCount) || (manager.IsValid(heldId) == false) ||
+                        (owners[heldId].compare_exchange_strong(owner, threadIndex + 1) == false))
+                    {
+                        duplicateIds++;
+                        heldId = ReservedId;
+                    }
+                }
+                for (const uint64_t& heldId : heldIds)
+                {
+                    if (heldId != ReservedId)
+                    {
+                        owners[heldId].store(0);
+                        manager.ReleaseId(heldId);
+                    }
+                }
+            });
+        }
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+
+        // Released ids get recycled, the table only grows to the peak number of ids held at once plus a few
+        // ids sitting in the free lists of shards no thread looked at yet
+        CHECK(duplicateIds == 0);
+        CHECK(manager.GetTableSize() <= 2 * ThreadCount * HeldIdCount + 1);
+    }
+
+    void TestPrebuildInfoCacheBound()
+    {
+        PrebuildInfoCache<uint64_t, uint64_t, std::hash<uint64_t>> cache;
+        cache.setCapacity(64);
+
+        uint64_t info = 0;
+        for (uint64_t shape = 0; shape < 1000; shape++)
+        {
+            if (cache.find(shape % 200, info) == false)
+            {
+                cache.insert(shape % 200, 2 * (shape % 200));
+            }
+            CHECK(cache.size() <= 64);
+        }
+        CHECK(cache.getOverflowCount() > 0);
+
+        // Whatever survived the last overflow is still correct
+        CHECK(cache.find(999 % 200, info) && (info == 2 * (999 % 200)));
+
+        // Shapes already cached don't count as overflow
+        cache.clear();
+        for (uint64_t round = 0; round < 4; round++)
+        {
+            for (uint64_t shape = 0; shape < 64; shape++)
+            {
+                cache.insert(shape, shape);
+            }
+        }
+        CHECK(cache.size() == 64);
+
+        cache.setCapacity(0);
+        cache.insert(1, 1);
+        CHECK(cache.size() == 0);
+        CHECK(cache.find(1, info) == false);
+    }
+}
+
+int main()
+{
+    TestFailedBuildPipeline();
+    TestDeduplicatedBuildPipeline();
+    TestInputDigest();
+    TestNodePoolAllocator();
+    TestConcurrentIdAllocation();
+    TestPrebuildInfoCacheBound();
+
+    if (failedChecks > 0)
+    {
+        fprintf(stderr, "%d checks failed\n", failedChecks);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}